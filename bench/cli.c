@@ -0,0 +1,471 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+/* End-to-end latency of the frame program, which is mostly run as a
+ * short-lived process from prompts, completions and scripts. Runs each
+ * command against an existing framedb, such as one made by framegen,
+ * up to --iterations=N times (default 100) or as many as run in about
+ * two seconds, and reports the distribution of the wall time of each
+ * run. Also reports:
+ *    1. the startup cost of the process, as the time taken by 'frame
+ *       help', which does not open the framedb,
+ *    2. the cost of frm_init() and frm_close() in this process,
+ * and the share of each command's median that they account for.
+ *
+ * Usage: cli.elf <path-to-frame-program> <dbpath> [--iterations=N]
+ *                [--json=FILE] [--baseline=FILE] [--threshold=PERCENT]
+ *
+ * The results are written as JSON to FILE, or to the standard output,
+ * and as a table to the standard error. If a baseline (the JSON of an
+ * earlier run) is given, the median of each command is compared with
+ * it, and the program exits with 1 if any of them is slower by more
+ * than the threshold (default 10%).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "frm.h"
+
+#define DEFAULT_ITERATIONS    (100)
+#define MIN_ITERATIONS        (5)
+#define BUDGET_NS             (UINT64_C (2000000000))
+#define DEFAULT_THRESHOLD     (10.0)
+#define MAX_ARGS              (8)
+
+struct ctx_t {
+   const char *program;
+   const char *dbpath;
+   char **paths;
+   size_t npaths;
+   size_t counter;
+   char dbopt[4096];
+   char target[4096];      // A random frame, chosen before each run
+   char name[64];          // The name of the next frame to push
+};
+
+struct cmd_t {
+   const char *name;
+   const char *args[MAX_ARGS];   // "%t" is replaced by the target,
+                                 // "%n" by the name
+
+   // Untimed calls made before and after each run, if set.
+   bool (*before) (struct ctx_t *ctx);
+   bool (*after) (struct ctx_t *ctx);
+};
+
+struct result_t {
+   size_t nsamples;
+   double median, p90, p99, mean, min, max;     // In microseconds
+   double baseline;                             // Negative if none
+   char *error;
+};
+
+static uint64_t g_rng = 1;
+
+static uint64_t rng_next (void)
+{
+   g_rng ^= g_rng >> 12;
+   g_rng ^= g_rng << 25;
+   g_rng ^= g_rng >> 27;
+   return g_rng * UINT64_C (2685821657736338717);
+}
+
+static uint64_t now_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64 (const void *lhs, const void *rhs)
+{
+   uint64_t l = *(const uint64_t *)lhs;
+   uint64_t r = *(const uint64_t *)rhs;
+   return l < r ? -1 : l > r;
+}
+
+/* ********************************************************** */
+
+// The frames pushed by the benchmark are popped, and popped ones pushed
+// first, through the library, so that only the command itself is timed.
+static bool lib_push (struct ctx_t *ctx)
+{
+   frm_t *frm = frm_init (ctx->dbpath);
+   bool ret = frm && frm_push (frm, ctx->name, "Pushed by bench-cli");
+   frm_close (frm);
+   return ret;
+}
+
+static bool lib_pop (struct ctx_t *ctx)
+{
+   frm_t *frm = frm_init (ctx->dbpath);
+   bool ret = frm && frm_pop (frm, true);
+   frm_close (frm);
+   return ret;
+}
+
+// Each command starts from the root frame, so that 'list' and the like
+// do the same work in every run of the benchmark.
+static bool lib_top (struct ctx_t *ctx)
+{
+   frm_t *frm = frm_init (ctx->dbpath);
+   bool ret = frm && frm_top (frm);
+   frm_close (frm);
+   return ret;
+}
+
+static const struct cmd_t g_cmds[] = {
+   { "current",   { "current" },                            NULL,       NULL     },
+   { "status",    { "status" },                             NULL,       NULL     },
+   { "history",   { "history" },                            NULL,       NULL     },
+   { "list",      { "list" },                               NULL,       NULL     },
+   { "match",     { "match", "sprint" },                    NULL,       NULL     },
+   { "tree",      { "tree" },                               NULL,       NULL     },
+   { "push",      { "push", "%n", "--message=Pushed" },     NULL,       lib_pop  },
+   { "pop",       { "pop", "--force" },                     lib_push,   NULL     },
+   { "switch",    { "switch", "%t" },                       NULL,       NULL     },
+   { "back",      { "back" },                               NULL,       NULL     },
+};
+#define NCMDS     (sizeof g_cmds / sizeof g_cmds[0])
+
+// Runs the frame program with args; returns the wall time in ns, or 0
+// if the program did not exit with 0.
+static uint64_t run_frame (struct ctx_t *ctx, const char *const *args, bool check)
+{
+   const char *argv[MAX_ARGS + 4] = { ctx->program, "--quiet", ctx->dbopt };
+   size_t argc = 3;
+   for (size_t i=0; i<MAX_ARGS && args[i]; i++) {
+      argv[argc++] = (strcmp (args[i], "%t"))==0 ? ctx->target
+                   : (strcmp (args[i], "%n"))==0 ? ctx->name
+                   : args[i];
+   }
+   argv[argc] = NULL;
+
+   uint64_t start = now_ns ();
+   pid_t pid = fork ();
+   if (pid == 0) {
+      int fd = open ("/dev/null", O_WRONLY);
+      dup2 (fd, STDOUT_FILENO);
+      dup2 (fd, STDERR_FILENO);
+      execv (ctx->program, (char **)argv);
+      _exit (127);
+   }
+
+   int status = 0;
+   bool ok = pid > 0 && waitpid (pid, &status, 0) == pid && WIFEXITED (status)
+      && (!check || WEXITSTATUS (status) == 0);
+   uint64_t elapsed = now_ns () - start;
+   return ok ? elapsed : 0;
+}
+
+static void prepare (struct ctx_t *ctx)
+{
+   const char *target = ctx->paths[rng_next () % ctx->npaths];
+   snprintf (ctx->target, sizeof ctx->target, "%s", target);
+   snprintf (ctx->name, sizeof ctx->name, "bench-cli-%zu", ctx->counter++);
+}
+
+static double median_us (uint64_t *samples, size_t n)
+{
+   qsort (samples, n, sizeof *samples, cmp_u64);
+   return samples[n / 2] / 1e3;
+}
+
+/* ********************************************************** */
+
+static bool run_cmd (const struct cmd_t *cmd, struct ctx_t *ctx, size_t iterations,
+                     struct result_t *result)
+{
+   result->baseline = -1;
+
+   uint64_t *samples = malloc (iterations * sizeof *samples);
+   if (!samples) {
+      fprintf (stderr, "OOM error allocating samples\n");
+      return false;
+   }
+
+   uint64_t deadline = now_ns () + BUDGET_NS;
+   size_t n = 0;
+   while (n < iterations && lib_top (ctx)
+         && (n < MIN_ITERATIONS || now_ns () < deadline)) {
+      prepare (ctx);
+      if (cmd->before && !(cmd->before (ctx)))
+         break;
+      uint64_t elapsed = run_frame (ctx, cmd->args, true);
+      if (cmd->after && !(cmd->after (ctx)))
+         break;
+      if (!elapsed) {
+         char msg[128];
+         snprintf (msg, sizeof msg, "frame %s failed on run %zu", cmd->name, n);
+         result->error = strdup (msg);
+         break;
+      }
+      samples[n++] = elapsed;
+   }
+
+   if (n) {
+      qsort (samples, n, sizeof *samples, cmp_u64);
+      uint64_t total = 0;
+      for (size_t i=0; i<n; i++) {
+         total += samples[i];
+      }
+      result->nsamples = n;
+      result->median = samples[n / 2] / 1e3;
+      result->p90 = samples[(n * 90) / 100] / 1e3;
+      result->p99 = samples[(n * 99) / 100] / 1e3;
+      result->mean = total / 1e3 / n;
+      result->min = samples[0] / 1e3;
+      result->max = samples[n - 1] / 1e3;
+   } else if (!result->error) {
+      result->error = strdup ("Failed to prepare the framedb");
+   }
+   free (samples);
+   return true;
+}
+
+// The startup cost of the process, and of frm_init() and frm_close().
+static bool run_overheads (struct ctx_t *ctx, size_t iterations,
+                           double *startup, double *init)
+{
+   static const char *help[] = { "help", NULL };
+   uint64_t *samples = malloc (iterations * sizeof *samples);
+   if (!samples) {
+      fprintf (stderr, "OOM error allocating samples\n");
+      return false;
+   }
+
+   for (size_t i=0; i<iterations; i++) {
+      if (!(samples[i] = run_frame (ctx, help, false))) {
+         fprintf (stderr, "Failed to run [%s]\n", ctx->program);
+         free (samples);
+         return false;
+      }
+   }
+   *startup = median_us (samples, iterations);
+
+   for (size_t i=0; i<iterations; i++) {
+      uint64_t start = now_ns ();
+      frm_t *frm = frm_init (ctx->dbpath);
+      frm_close (frm);
+      samples[i] = now_ns () - start;
+   }
+   *init = median_us (samples, iterations);
+
+   free (samples);
+   return true;
+}
+
+/* ********************************************************** */
+
+// Reads the median of each command from the JSON written by an earlier
+// run; the JSON is written with one command per line.
+static bool baseline_read (const char *fname, struct result_t *results)
+{
+   FILE *inf = fopen (fname, "r");
+   if (!inf) {
+      fprintf (stderr, "Failed to open baseline [%s]: %m\n", fname);
+      return false;
+   }
+
+   char line[1024];
+   while (fgets (line, sizeof line, inf)) {
+      char name[64];
+      const char *median = strstr (line, "\"median_us\": ");
+      if (!median || (sscanf (line, " {\"name\": \"%63[^\"]\"", name))!=1)
+         continue;
+      for (size_t i=0; i<NCMDS; i++) {
+         if ((strcmp (name, g_cmds[i].name))==0) {
+            results[i].baseline = strtod (&median[13], NULL);
+         }
+      }
+   }
+   fclose (inf);
+   return true;
+}
+
+static double share (double part, double whole)
+{
+   return whole > 0 ? 100 * part / whole : 0;
+}
+
+static double change (const struct result_t *r)
+{
+   return r->baseline > 0 ? 100 * (r->median - r->baseline) / r->baseline : 0;
+}
+
+static void json_str (FILE *outf, const char *s)
+{
+   fputc ('"', outf);
+   for (; *s; s++) {
+      unsigned char c = *s;
+      if (c == '"' || c == '\\') {
+         fprintf (outf, "\\%c", c);
+      } else if (c < 0x20) {
+         fprintf (outf, "\\u%04x", c);
+      } else {
+         fputc (c, outf);
+      }
+   }
+   fputc ('"', outf);
+}
+
+static void json_write (FILE *outf, const struct ctx_t *ctx, size_t iterations,
+                        double startup, double init, double threshold,
+                        const struct result_t *results)
+{
+   fprintf (outf, "{\n  \"program\": ");
+   json_str (outf, ctx->program);
+   fprintf (outf, ",\n  \"dbpath\": ");
+   json_str (outf, ctx->dbpath);
+   fprintf (outf, ",\n  \"frames\": %zu,\n  \"iterations\": %zu,\n"
+            "  \"startup_us\": %.3f,\n  \"frm_init_us\": %.3f,\n"
+            "  \"threshold_pct\": %.1f,\n  \"commands\": [\n",
+            ctx->npaths, iterations, startup, init, threshold);
+   for (size_t i=0; i<NCMDS; i++) {
+      const struct result_t *r = &results[i];
+      fprintf (outf, "    {\"name\": \"%s\"", g_cmds[i].name);
+      if (r->error) {
+         fprintf (outf, ", \"error\": \"%s\"", r->error);
+      } else {
+         fprintf (outf, ", \"samples\": %zu, \"median_us\": %.3f, \"p90_us\": %.3f,"
+                  " \"p99_us\": %.3f, \"mean_us\": %.3f, \"min_us\": %.3f,"
+                  " \"max_us\": %.3f, \"startup_pct\": %.1f, \"frm_init_pct\": %.1f",
+                  r->nsamples, r->median, r->p90, r->p99, r->mean, r->min, r->max,
+                  share (startup, r->median), share (init, r->median));
+         if (r->baseline > 0) {
+            fprintf (outf, ", \"baseline_us\": %.3f, \"change_pct\": %.1f,"
+                     " \"regressed\": %s", r->baseline, change (r),
+                     change (r) > threshold ? "true" : "false");
+         }
+      }
+      fprintf (outf, "}%s\n", i + 1 < NCMDS ? "," : "");
+   }
+   fprintf (outf, "  ]\n}\n");
+}
+
+static void table_write (FILE *outf, double startup, double init, double threshold,
+                         const struct result_t *results)
+{
+   fprintf (outf, "Process startup: %.1fus, frm_init+frm_close: %.1fus\n",
+            startup, init);
+   fprintf (outf, "%-10s %6s %10s %10s %10s %10s %8s %8s %10s\n", "command", "n",
+            "p50(us)", "p90(us)", "p99(us)", "max(us)", "startup", "init",
+            "vs base");
+   for (size_t i=0; i<NCMDS; i++) {
+      const struct result_t *r = &results[i];
+      if (r->error) {
+         fprintf (outf, "%-10s error: %s\n", g_cmds[i].name, r->error);
+         continue;
+      }
+      fprintf (outf, "%-10s %6zu %10.1f %10.1f %10.1f %10.1f %7.1f%% %7.1f%%",
+               g_cmds[i].name, r->nsamples, r->median, r->p90, r->p99, r->max,
+               share (startup, r->median), share (init, r->median));
+      if (r->baseline > 0) {
+         fprintf (outf, " %+9.1f%%%s", change (r),
+                  change (r) > threshold ? " REGRESSED" : "");
+      }
+      fprintf (outf, "\n");
+   }
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   size_t iterations = DEFAULT_ITERATIONS;
+   double threshold = DEFAULT_THRESHOLD;
+   const char *json = NULL;
+   const char *baseline = NULL;
+   struct ctx_t ctx = { 0 };
+   struct result_t results[NCMDS] = { { 0 } };
+   FILE *outf = stdout;
+   frm_t *frm = NULL;
+
+   if (argc < 3 || argv[1][0] == '-' || argv[2][0] == '-') {
+      fprintf (stderr, "Usage: %s <path-to-frame-program> <dbpath> [--iterations=N]\n"
+                       "          [--json=FILE] [--baseline=FILE] [--threshold=PERCENT]\n",
+                       argv[0]);
+      return EXIT_FAILURE;
+   }
+   for (int i=3; i<argc; i++) {
+      if ((strncmp (argv[i], "--iterations=", 13))==0) {
+         iterations = strtoull (&argv[i][13], NULL, 10);
+      } else if ((strncmp (argv[i], "--json=", 7))==0) {
+         json = &argv[i][7];
+      } else if ((strncmp (argv[i], "--baseline=", 11))==0) {
+         baseline = &argv[i][11];
+      } else if ((strncmp (argv[i], "--threshold=", 12))==0) {
+         threshold = strtod (&argv[i][12], NULL);
+      } else {
+         fprintf (stderr, "Unknown option [%s]\n", argv[i]);
+         return EXIT_FAILURE;
+      }
+   }
+   if (iterations < MIN_ITERATIONS)
+      iterations = MIN_ITERATIONS;
+
+   ctx.program = argv[1];
+   ctx.dbpath = argv[2];
+   snprintf (ctx.dbopt, sizeof ctx.dbopt, "--dbpath=%s", ctx.dbpath);
+
+   if (!(frm = frm_init (ctx.dbpath))
+         || !(ctx.paths = frm_match_from_root (frm, "", 0)) || !ctx.paths[0]) {
+      fprintf (stderr, "No frames found in [%s]\n", ctx.dbpath);
+      goto cleanup;
+   }
+   while (ctx.paths[ctx.npaths])
+      ctx.npaths++;
+   frm_close (frm);
+   frm = NULL;
+
+   double startup = 0, init = 0;
+   if (!(run_overheads (&ctx, iterations, &startup, &init)))
+      goto cleanup;
+
+   for (size_t i=0; i<NCMDS; i++) {
+      fprintf (stderr, "Running frame %s ...\n", g_cmds[i].name);
+      if (!(run_cmd (&g_cmds[i], &ctx, iterations, &results[i])))
+         goto cleanup;
+   }
+
+   if (baseline && !(baseline_read (baseline, results)))
+      goto cleanup;
+
+   if (json && !(outf = fopen (json, "w"))) {
+      fprintf (stderr, "Failed to open [%s] for writing: %m\n", json);
+      goto cleanup;
+   }
+   json_write (outf, &ctx, iterations, startup, init, threshold, results);
+   table_write (stderr, startup, init, threshold, results);
+
+   ret = EXIT_SUCCESS;
+   for (size_t i=0; i<NCMDS; i++) {
+      if (results[i].error || change (&results[i]) > threshold) {
+         ret = EXIT_FAILURE;
+      }
+   }
+
+cleanup:
+   if (outf && outf != stdout) {
+      fclose (outf);
+   }
+   for (size_t i=0; i<NCMDS; i++) {
+      free (results[i].error);
+   }
+   frm_strarray_free (ctx.paths);
+   frm_close (frm);
+   return ret;
+}
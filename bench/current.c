@@ -0,0 +1,194 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+/* Latency of 'frame current', which shell prompts run on every command.
+ * Creates a framedb with a long history and then times:
+ *    1. frm_current_cached(), the prompt fast path,
+ *    2. frm_init(), frm_current(), frm_date_str() and frm_close(), the
+ *       path taken when there is no current record,
+ *    3. running 'frame current' itself,
+ *    4. running /bin/true, the cost of starting any process at all.
+ *
+ * Usage: current.elf <dbpath> <path-to-frame-program>
+ *
+ * The framedb at dbpath must not exist. Exits with 0 if the p99 latency
+ * of frm_current_cached() is under 1ms and 1 otherwise. The time taken
+ * to run 'frame current' is reported but not gated: most of it is the
+ * exec and dynamic startup that /bin/true pays as well, which depends on
+ * the machine rather than on the library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "frm.h"
+
+#define NHISTORY     (10000)
+#define NFAST        (10000)
+#define NSLOW        (1000)
+#define NPROCESS     (500)
+#define TRUE_PROGRAM "/bin/true"
+
+static uint64_t now_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64 (const void *lhs, const void *rhs)
+{
+   uint64_t l = *(const uint64_t *)lhs;
+   uint64_t r = *(const uint64_t *)rhs;
+   return l < r ? -1 : l > r;
+}
+
+// Sorts the samples and prints the percentiles; returns the p99.
+static uint64_t report (const char *name, uint64_t *samples, size_t nsamples)
+{
+   qsort (samples, nsamples, sizeof *samples, cmp_u64);
+   uint64_t p50 = samples[nsamples / 2];
+   uint64_t p99 = samples[(nsamples * 99) / 100];
+   uint64_t max = samples[nsamples - 1];
+   printf ("%-32s n=%-6zu p50=%8.3fms  p99=%8.3fms  max=%8.3fms\n",
+           name, nsamples, p50 / 1e6, p99 / 1e6, max / 1e6);
+   return p99;
+}
+
+static bool build_history (const char *dbpath)
+{
+   frm_t *frm = frm_create (dbpath);
+   if (!frm || !(frm_push (frm, "project", "A frame to switch to and from"))) {
+      fprintf (stderr, "Failed to create framedb [%s]\n", dbpath);
+      frm_close (frm);
+      return false;
+   }
+
+   for (size_t i=0; i<NHISTORY / 2; i++) {
+      if (!(frm_up (frm)) || !(frm_down (frm, "project"))) {
+         fprintf (stderr, "Failed to switch frames: %s\n", frm_lastmsg (frm));
+         frm_close (frm);
+         return false;
+      }
+   }
+
+   frm_close (frm);
+   return true;
+}
+
+// Runs 'program --quiet --dbpath=<dbpath> current', or just program if
+// dbpath is NULL.
+static bool run_frame (const char *program, const char *dbpath)
+{
+   char *dbopt = NULL;
+   if (dbpath) {
+      if (!(dbopt = malloc (strlen (dbpath) + 10)))
+         return false;
+      sprintf (dbopt, "--dbpath=%s", dbpath);
+   }
+
+   pid_t pid = fork ();
+   if (pid == 0) {
+      int fd = open ("/dev/null", O_WRONLY);
+      dup2 (fd, STDOUT_FILENO);
+      if (dbopt) {
+         execl (program, program, "--quiet", dbopt, "current", (char *)NULL);
+      } else {
+         execl (program, program, (char *)NULL);
+      }
+      _exit (127);
+   }
+   free (dbopt);
+
+   int status = 0;
+   return pid > 0 && waitpid (pid, &status, 0) == pid
+      && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+int main (int argc, char **argv)
+{
+   if (argc < 3) {
+      fprintf (stderr, "Usage: %s <dbpath> <path-to-frame-program>\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   const char *dbpath = argv[1];
+   uint64_t start = now_ns ();
+   if (!(build_history (dbpath)))
+      return EXIT_FAILURE;
+   printf ("Created framedb with %i history entries in %.3fs\n",
+           NHISTORY, (now_ns () - start) / 1e9);
+
+   uint64_t *samples = calloc (NFAST, sizeof *samples);
+   if (!samples) {
+      fprintf (stderr, "OOM error allocating samples\n");
+      return EXIT_FAILURE;
+   }
+
+   for (size_t i=0; i<NFAST; i++) {
+      uint64_t mtime;
+      start = now_ns ();
+      char *current = frm_current_cached (dbpath, &mtime);
+      samples[i] = now_ns () - start;
+      if (!current) {
+         fprintf (stderr, "No current record in [%s]\n", dbpath);
+         return EXIT_FAILURE;
+      }
+      frm_mem_free (current);
+   }
+   uint64_t cached_p99 = report ("frm_current_cached", samples, NFAST);
+
+   for (size_t i=0; i<NSLOW; i++) {
+      start = now_ns ();
+      frm_t *frm = frm_init (dbpath);
+      char *current = frm_current (frm);
+      char *date = frm_date_str_at (frm, NULL);
+      frm_close (frm);
+      samples[i] = now_ns () - start;
+      frm_mem_free (current);
+      frm_mem_free (date);
+   }
+   report ("frm_init+frm_current", samples, NSLOW);
+
+   for (size_t i=0; i<NPROCESS; i++) {
+      start = now_ns ();
+      if (!(run_frame (argv[2], dbpath))) {
+         fprintf (stderr, "Failed to run [%s]\n", argv[2]);
+         return EXIT_FAILURE;
+      }
+      samples[i] = now_ns () - start;
+   }
+   uint64_t process_p99 = report ("frame current (process)", samples, NPROCESS);
+
+   for (size_t i=0; i<NPROCESS; i++) {
+      start = now_ns ();
+      if (!(run_frame (TRUE_PROGRAM, NULL))) {
+         fprintf (stderr, "Failed to run [%s]\n", TRUE_PROGRAM);
+         return EXIT_FAILURE;
+      }
+      samples[i] = now_ns () - start;
+   }
+   uint64_t startup_p99 = report (TRUE_PROGRAM " (process)", samples, NPROCESS);
+
+   free (samples);
+
+   bool passed = cached_p99 < 1000000;
+   printf ("frm_current_cached p99 under 1ms: %s\n", passed ? "PASS" : "FAIL");
+   printf ("'frame current' p99 is %.3fms, of which starting a process takes"
+           " %.3fms\n", process_p99 / 1e6, startup_p99 / 1e6);
+   return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,293 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+/* Generates a framedb of a given shape for the benchmarks. The same
+ * options always generate the same framedb:
+ *    --frames=N     The number of frames under root, up to 1000000.
+ *    --depth=N      The depth of the tree below root.
+ *    --fanout=N     The number of children of each frame above the
+ *                   deepest level. The tree is filled one level at a
+ *                   time, so the last level that is reached may be
+ *                   partly filled.
+ *    --payload=N    The size of each payload in bytes.
+ *    --history=N    The number of frames visited after the tree is made,
+ *                   chosen at random, which are all in the history.
+ *    --seed=N       The seed for the names, payloads and history.
+ *    --mapped       Create a mapped framedb instead of a directory.
+ *
+ * Usage: framegen.elf <dbpath> [options]
+ *
+ * The framedb at dbpath must not exist. Frames are named after words and
+ * their position among their siblings, eg. "root/design-3/notes-0". The
+ * generated paths are printed to the standard output if --list is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "frm.h"
+
+#define MAX_FRAMES      (1000000)
+
+// Frames are created this many at a time.
+#define CHUNK           (4096)
+
+static const char *g_words[] = {
+   "project", "client", "sprint", "bugfix", "release", "meeting", "review",
+   "design", "backend", "frontend", "database", "deploy", "research",
+   "notes", "todo", "archive", "infra", "support", "billing", "search",
+   "GUI", "Parser", "Docs", "QA",
+};
+#define NWORDS       (sizeof g_words / sizeof g_words[0])
+
+struct shape_t {
+   uint64_t frames;
+   uint64_t depth;
+   uint64_t fanout;
+   uint64_t payload;
+   uint64_t history;
+   uint64_t seed;
+   bool mapped;
+   bool list;
+};
+
+// xorshift64*, so that the framedb is the same on every platform.
+static uint64_t g_rng;
+
+static uint64_t rng_next (void)
+{
+   g_rng ^= g_rng >> 12;
+   g_rng ^= g_rng << 25;
+   g_rng ^= g_rng >> 27;
+   return g_rng * UINT64_C (2685821657736338717);
+}
+
+static uint64_t now_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the value of --name=value in argv, or def if it is not given.
+static bool opt_u64 (int argc, char **argv, const char *name, uint64_t def,
+                     uint64_t *value)
+{
+   size_t nlen = strlen (name);
+   *value = def;
+   for (int i=2; i<argc; i++) {
+      if ((strncmp (argv[i], "--", 2))!=0
+            || (strncmp (&argv[i][2], name, nlen))!=0
+            || argv[i][2 + nlen] != '=')
+         continue;
+      char *endptr = NULL;
+      *value = strtoull (&argv[i][3 + nlen], &endptr, 10);
+      if (!argv[i][3 + nlen] || *endptr) {
+         fprintf (stderr, "Invalid value for --%s: [%s]\n", name, &argv[i][3 + nlen]);
+         return false;
+      }
+   }
+   return true;
+}
+
+static bool opt_bool (int argc, char **argv, const char *name)
+{
+   for (int i=2; i<argc; i++) {
+      if ((strncmp (argv[i], "--", 2))==0 && (strcmp (&argv[i][2], name))==0)
+         return true;
+   }
+   return false;
+}
+
+static char *make_payload (size_t len)
+{
+   char *ret = malloc (len + 1);
+   if (!ret)
+      return NULL;
+
+   size_t offset = 0;
+   while (offset < len) {
+      const char *word = g_words[rng_next () % NWORDS];
+      size_t wlen = strlen (word);
+      for (size_t i=0; i<wlen && offset < len; i++) {
+         ret[offset++] = word[i];
+      }
+      if (offset < len) {
+         ret[offset++] = rng_next () % 8 ? ' ' : '\n';
+      }
+   }
+   ret[len] = 0;
+   return ret;
+}
+
+// Creates the frames in names[0..count), which are relative to root.
+static bool create_chunk (frm_t *frm, const char **names, size_t count,
+                          const struct shape_t *shape)
+{
+   const char **messages = calloc (count + 1, sizeof *messages);
+   if (!messages) {
+      fprintf (stderr, "OOM error allocating payloads\n");
+      return false;
+   }
+
+   bool ret = true;
+   for (size_t i=0; i<count; i++) {
+      if (!(messages[i] = make_payload (shape->payload))) {
+         fprintf (stderr, "OOM error allocating payload\n");
+         ret = false;
+         break;
+      }
+   }
+
+   if (ret && !(frm_new_many (frm, "root", names, messages, count))) {
+      fprintf (stderr, "Failed to create frames: %s\n", frm_lastmsg (frm));
+      ret = false;
+   }
+
+   for (size_t i=0; i<count; i++) {
+      free ((char *)messages[i]);
+   }
+   free (messages);
+   return ret;
+}
+
+// Returns the paths of the frames, relative to root, in the order that
+// they are created: one level at a time, so that every parent comes
+// before its children.
+static char **make_names (const struct shape_t *shape, size_t *nnames)
+{
+   char **ret = calloc (shape->frames + 1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   size_t count = 0;
+   size_t level_start = 0, level_end = 0;
+   for (uint64_t level=0; level<shape->depth && count<shape->frames; level++) {
+      size_t nparents = level == 0 ? 1 : level_end - level_start;
+      for (size_t p=0; p<nparents && count<shape->frames; p++) {
+         const char *parent = level == 0 ? NULL : ret[level_start + p];
+         for (uint64_t c=0; c<shape->fanout && count<shape->frames; c++) {
+            char name[64];
+            snprintf (name, sizeof name, "%s-%" PRIu64,
+                      g_words[rng_next () % NWORDS], c);
+            size_t len = (parent ? strlen (parent) + 1 : 0) + strlen (name) + 1;
+            if (!(ret[count] = malloc (len))) {
+               *nnames = count;
+               return ret;
+            }
+            snprintf (ret[count], len, "%s%s%s", parent ? parent : "",
+                      parent ? "/" : "", name);
+            count++;
+         }
+      }
+      level_start = level == 0 ? 0 : level_end;
+      level_end = count;
+   }
+
+   *nnames = count;
+   return ret;
+}
+
+int main (int argc, char **argv)
+{
+   if (argc < 2 || argv[1][0] == '-') {
+      fprintf (stderr, "Usage: %s <dbpath> [--frames=N] [--depth=N] [--fanout=N]\n"
+                       "          [--payload=N] [--history=N] [--seed=N] [--mapped]\n"
+                       "          [--list]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   const char *dbpath = argv[1];
+   struct shape_t shape;
+   if (!(opt_u64 (argc, argv, "frames", 10000, &shape.frames))
+         || !(opt_u64 (argc, argv, "depth", 4, &shape.depth))
+         || !(opt_u64 (argc, argv, "fanout", 10, &shape.fanout))
+         || !(opt_u64 (argc, argv, "payload", 256, &shape.payload))
+         || !(opt_u64 (argc, argv, "history", 1000, &shape.history))
+         || !(opt_u64 (argc, argv, "seed", 1, &shape.seed)))
+      return EXIT_FAILURE;
+   shape.mapped = opt_bool (argc, argv, "mapped");
+   shape.list = opt_bool (argc, argv, "list");
+
+   if (shape.frames > MAX_FRAMES || shape.fanout == 0 || shape.depth == 0) {
+      fprintf (stderr, "Frames must be at most %i, depth and fanout at least 1\n",
+               MAX_FRAMES);
+      return EXIT_FAILURE;
+   }
+   g_rng = shape.seed ? shape.seed : 1;
+
+   size_t nnames = 0;
+   char **names = make_names (&shape, &nnames);
+   if (!names) {
+      fprintf (stderr, "OOM error allocating frame names\n");
+      return EXIT_FAILURE;
+   }
+   if (nnames < shape.frames) {
+      fprintf (stderr, "Note: a depth of %" PRIu64 " and fanout of %" PRIu64
+               " only allow %zu frames\n", shape.depth, shape.fanout, nnames);
+   }
+
+   if (shape.mapped) {
+      int fd = open (dbpath, O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd < 0) {
+         fprintf (stderr, "Failed to create [%s]: %m\n", dbpath);
+         return EXIT_FAILURE;
+      }
+      close (fd);
+   }
+
+   uint64_t start = now_ns ();
+   frm_t *frm = frm_create (dbpath);
+   if (!frm) {
+      fprintf (stderr, "Failed to create framedb [%s]\n", dbpath);
+      return EXIT_FAILURE;
+   }
+
+   bool ok = frm_batch_begin (frm);
+   for (size_t i=0; ok && i<nnames; i+=CHUNK) {
+      size_t count = nnames - i < CHUNK ? nnames - i : CHUNK;
+      ok = create_chunk (frm, (const char **)&names[i], count, &shape);
+   }
+   ok = frm_batch_end (frm) && ok;
+   uint64_t created = now_ns ();
+
+   for (uint64_t i=0; ok && nnames && i<shape.history; i++) {
+      char path[4096];
+      snprintf (path, sizeof path, "root/%s", names[rng_next () % nnames]);
+      if (!(frm_switch_direct (frm, path))) {
+         fprintf (stderr, "Failed to switch to [%s]: %s\n", path, frm_lastmsg (frm));
+         ok = false;
+      }
+   }
+   ok = ok && frm_top (frm);
+
+   frm_close (frm);
+   if (!ok)
+      return EXIT_FAILURE;
+
+   fprintf (stderr, "Created %zu frames in %.3fs and %" PRIu64 " history entries"
+            " in %.3fs at [%s]\n", nnames, (created - start) / 1e9,
+            shape.history, (now_ns () - created) / 1e9, dbpath);
+
+   for (size_t i=0; i<nnames; i++) {
+      if (shape.list) {
+         printf ("root/%s\n", names[i]);
+      }
+      free (names[i]);
+   }
+   free (names);
+   return EXIT_SUCCESS;
+}
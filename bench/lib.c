@@ -0,0 +1,593 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+/* Times each of the public frm_*() calls against an existing framedb,
+ * such as one made by framegen. For each call this reports:
+ *    1. the median, p99, mean, min and max latency, over up to
+ *       --iterations=N calls (default 200) or as many as run in about
+ *       two seconds, after one call to warm up,
+ *    2. the number of system calls that one call makes, counted by
+ *       tracing a child process with ptrace(),
+ *    3. the peak RSS of the process while the calls run.
+ *
+ * Usage: lib.elf <dbpath> [--iterations=N] [--json=FILE]
+ *
+ * The results are written as JSON to FILE, or to the standard output,
+ * and as a table to the standard error. The calls that modify the
+ * framedb (switching, pushing, appending to payloads) leave it
+ * modified. A call that the framedb does not support, such as
+ * frm_search() on a mapped framedb, is reported with its error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "frm.h"
+
+#define DEFAULT_ITERATIONS    (200)
+#define MIN_ITERATIONS        (5)
+#define BUDGET_NS             (UINT64_C (2000000000))
+
+// Each traced call is made this many times and the count averaged.
+#define TRACE_CALLS           (3)
+
+struct ctx_t {
+   frm_t *frm;
+   const char *dbpath;
+   char **paths;
+   size_t npaths;
+   const char *target;     // A random frame, chosen before each call
+   size_t counter;
+};
+
+struct op_t {
+   const char *name;
+   bool (*run) (struct ctx_t *ctx);
+
+   // Untimed calls made before and after each timed one, if set.
+   bool (*before) (struct ctx_t *ctx);
+   bool (*after) (struct ctx_t *ctx);
+};
+
+struct result_t {
+   size_t nsamples;
+   double median, p99, mean, min, max;    // In microseconds
+   double syscalls;                       // Negative if not counted
+   long peak_rss;                         // In KiB, negative if unknown
+   char *error;
+};
+
+static uint64_t g_rng = 1;
+
+static uint64_t rng_next (void)
+{
+   g_rng ^= g_rng >> 12;
+   g_rng ^= g_rng << 25;
+   g_rng ^= g_rng >> 27;
+   return g_rng * UINT64_C (2685821657736338717);
+}
+
+static uint64_t now_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64 (const void *lhs, const void *rhs)
+{
+   uint64_t l = *(const uint64_t *)lhs;
+   uint64_t r = *(const uint64_t *)rhs;
+   return l < r ? -1 : l > r;
+}
+
+/* ********************************************************** */
+
+// Each call frees what it is returned and fails if it gets nothing.
+static bool free_str (char *s)
+{
+   free (s);
+   return s != NULL;
+}
+
+static bool free_array (char **array)
+{
+   frm_strarray_free (array);
+   return array != NULL;
+}
+
+static bool op_init (struct ctx_t *ctx)
+{
+   frm_t *frm = frm_init (ctx->dbpath);
+   frm_close (frm);
+   return frm != NULL;
+}
+
+static bool op_current (struct ctx_t *ctx)
+{
+   return free_str (frm_current (ctx->frm));
+}
+
+static bool op_history (struct ctx_t *ctx)
+{
+   return free_str (frm_history (ctx->frm, 100));
+}
+
+static bool op_list (struct ctx_t *ctx)
+{
+   return free_array (frm_list (ctx->frm, "root"));
+}
+
+static bool op_match (struct ctx_t *ctx)
+{
+   return free_array (frm_match_from_root (ctx->frm, "sprint", 0));
+}
+
+static bool op_match_icase (struct ctx_t *ctx)
+{
+   return free_array (frm_match_from_root (ctx->frm, "SPRINT", FRM_MATCH_ICASE));
+}
+
+static bool op_match_glob (struct ctx_t *ctx)
+{
+   return free_array (frm_match_from_root (ctx->frm, "root/**/deploy-*",
+                                           FRM_MATCH_GLOB));
+}
+
+static bool op_switch (struct ctx_t *ctx)
+{
+   return frm_switch (ctx->frm, ctx->target);
+}
+
+static bool op_switch_direct (struct ctx_t *ctx)
+{
+   return frm_switch_direct (ctx->frm, ctx->target);
+}
+
+static bool op_back (struct ctx_t *ctx)
+{
+   return frm_back (ctx->frm, 1);
+}
+
+static bool op_payload_at (struct ctx_t *ctx)
+{
+   return free_str (frm_payload_at (ctx->frm, ctx->target));
+}
+
+static bool op_payload_append_at (struct ctx_t *ctx)
+{
+   return frm_payload_append_at (ctx->frm, ctx->target, "Appended by bench-lib");
+}
+
+static bool op_push (struct ctx_t *ctx)
+{
+   char name[64];
+   snprintf (name, sizeof name, "bench-push-%zu", ctx->counter++);
+   return frm_push (ctx->frm, name, "Pushed by bench-lib");
+}
+
+static bool op_pop (struct ctx_t *ctx)
+{
+   return frm_pop (ctx->frm, true);
+}
+
+static bool op_node_create (struct ctx_t *ctx)
+{
+   frm_node_t *root = frm_node_create (ctx->frm);
+   frm_node_free (root);
+   return root != NULL;
+}
+
+static bool op_node_create_lazy (struct ctx_t *ctx)
+{
+   frm_node_t *root = frm_node_create_lazy (ctx->frm, 1);
+   frm_node_free (root);
+   return root != NULL;
+}
+
+static bool op_fuzzy (struct ctx_t *ctx)
+{
+   return free_array (frm_fuzzy (ctx->frm, "dep sprint", 20));
+}
+
+static bool op_search (struct ctx_t *ctx)
+{
+   return free_array (frm_search (ctx->frm, "deploy sprint", 20));
+}
+
+static bool op_grep (struct ctx_t *ctx)
+{
+   return free_array (frm_grep (ctx->frm, "root", "deploy.*sprint"));
+}
+
+static const struct op_t g_ops[] = {
+   { "frm_init+frm_close",    op_init,                NULL,       NULL     },
+   { "frm_current",           op_current,             NULL,       NULL     },
+   { "frm_history",           op_history,             NULL,       NULL     },
+   { "frm_list",              op_list,                NULL,       NULL     },
+   { "frm_match",             op_match,               NULL,       NULL     },
+   { "frm_match/icase",       op_match_icase,         NULL,       NULL     },
+   { "frm_match/glob",        op_match_glob,          NULL,       NULL     },
+   { "frm_switch",            op_switch,              NULL,       NULL     },
+   { "frm_switch_direct",     op_switch_direct,       NULL,       NULL     },
+   { "frm_back",              op_back,                NULL,       NULL     },
+   { "frm_payload_at",        op_payload_at,          NULL,       NULL     },
+   { "frm_payload_append_at", op_payload_append_at,   NULL,       NULL     },
+   { "frm_push",              op_push,                NULL,       op_pop   },
+   { "frm_pop",               op_pop,                 op_push,    NULL     },
+   { "frm_node_create",       op_node_create,         NULL,       NULL     },
+   { "frm_node_create_lazy",  op_node_create_lazy,    NULL,       NULL     },
+   { "frm_fuzzy",             op_fuzzy,               NULL,       NULL     },
+   { "frm_search",            op_search,              NULL,       NULL     },
+   { "frm_grep",              op_grep,                NULL,       NULL     },
+};
+#define NOPS      (sizeof g_ops / sizeof g_ops[0])
+
+/* ********************************************************** */
+
+static void pick_target (struct ctx_t *ctx)
+{
+   ctx->target = ctx->paths[rng_next () % ctx->npaths];
+}
+
+// Makes one call; before() and after() are not timed.
+static bool call_op (const struct op_t *op, struct ctx_t *ctx, uint64_t *elapsed)
+{
+   pick_target (ctx);
+   if (op->before && !(op->before (ctx)))
+      return false;
+
+   uint64_t start = now_ns ();
+   bool ret = op->run (ctx);
+   if (elapsed) {
+      *elapsed = now_ns () - start;
+   }
+
+   if (op->after && !(op->after (ctx)))
+      return false;
+   return ret;
+}
+
+// Resets the peak RSS of the process, if the kernel allows it.
+static void rss_reset (void)
+{
+   int fd = open ("/proc/self/clear_refs", O_WRONLY);
+   if (fd >= 0) {
+      if (write (fd, "5", 1) != 1) {
+         // Then VmHWM is the peak since the process started.
+      }
+      close (fd);
+   }
+}
+
+// Returns the peak RSS in KiB.
+static long rss_peak (void)
+{
+   long ret = -1;
+   char line[256];
+   FILE *inf = fopen ("/proc/self/status", "r");
+   while (inf && fgets (line, sizeof line, inf)) {
+      if ((strncmp (line, "VmHWM:", 6))==0) {
+         ret = strtol (&line[6], NULL, 10);
+         break;
+      }
+   }
+   if (inf) {
+      fclose (inf);
+   }
+
+   struct rusage ru;
+   if (ret < 0 && (getrusage (RUSAGE_SELF, &ru))==0) {
+      ret = ru.ru_maxrss;
+   }
+   return ret;
+}
+
+/* ********************************************************** */
+
+/* System calls are counted in a child that the parent traces with
+ * PTRACE_SYSCALL, which stops the child on entry to and exit from each
+ * system call. The child raises SIGUSR1 before and after the calls to
+ * be counted, and the parent counts the stops in between. Raising a
+ * signal makes system calls of its own, which are counted in an empty
+ * segment first and subtracted.
+ */
+static void trace_child (const struct op_t *op, struct ctx_t *ctx)
+{
+   if ((ptrace (PTRACE_TRACEME, 0, NULL, NULL))!=0)
+      _exit (2);
+   raise (SIGSTOP);
+
+   // The child has its own handle, made before the segments.
+   if (!(ctx->frm = frm_init (ctx->dbpath)))
+      _exit (3);
+   call_op (op, ctx, NULL);
+
+   raise (SIGUSR1);
+   raise (SIGUSR1);
+   for (size_t i=0; i<TRACE_CALLS; i++) {
+      pick_target (ctx);
+      if (op->before) {
+         op->before (ctx);
+      }
+      raise (SIGUSR1);
+      op->run (ctx);
+      raise (SIGUSR1);
+      if (op->after) {
+         op->after (ctx);
+      }
+   }
+
+   frm_close (ctx->frm);
+   _exit (0);
+}
+
+// Returns the average number of system calls made by one call, or a
+// negative number if they could not be counted.
+static double trace_op (const struct op_t *op, struct ctx_t *ctx)
+{
+   fflush (stdout);
+   fflush (stderr);
+   pid_t pid = fork ();
+   if (pid < 0)
+      return -1;
+   if (pid == 0)
+      trace_child (op, ctx);
+
+   int status;
+   if (waitpid (pid, &status, 0) != pid || !WIFSTOPPED (status)) {
+      waitpid (pid, &status, 0);
+      return -1;
+   }
+   ptrace (PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+   size_t segment = 0, stops = 0;
+   size_t counts[TRACE_CALLS + 1];
+   bool inside = false;
+   int sig = 0;
+   while ((ptrace (PTRACE_SYSCALL, pid, NULL, (void *)(intptr_t)sig))==0) {
+      sig = 0;
+      if (waitpid (pid, &status, 0) != pid || !WIFSTOPPED (status))
+         break;
+      if (WSTOPSIG (status) == (SIGTRAP | 0x80)) {
+         stops += inside;
+         continue;
+      }
+      if (WSTOPSIG (status) != SIGUSR1) {
+         sig = WSTOPSIG (status);
+         continue;
+      }
+      if (inside && segment <= TRACE_CALLS) {
+         counts[segment++] = stops;
+      }
+      inside = !inside;
+      stops = 0;
+   }
+   if (!WIFEXITED (status) && !WIFSIGNALED (status)) {
+      kill (pid, SIGKILL);
+      waitpid (pid, &status, 0);
+   }
+   if (!WIFEXITED (status) || WEXITSTATUS (status) != 0 || segment != TRACE_CALLS + 1)
+      return -1;
+
+   double total = 0;
+   for (size_t i=1; i<=TRACE_CALLS; i++) {
+      total += counts[i] - (double)counts[0];
+   }
+   total = total / 2 / TRACE_CALLS;
+   return total < 0 ? 0 : total;
+}
+
+/* ********************************************************** */
+
+static bool run_op (const struct op_t *op, struct ctx_t *ctx, size_t iterations,
+                    struct result_t *result)
+{
+   memset (result, 0, sizeof *result);
+   result->syscalls = -1;
+   result->peak_rss = -1;
+
+   uint64_t *samples = malloc (iterations * sizeof *samples);
+   if (!samples) {
+      fprintf (stderr, "OOM error allocating samples\n");
+      return false;
+   }
+
+   rss_reset ();
+   if (!(call_op (op, ctx, NULL))) {
+      const char *msg = frm_lastmsg (ctx->frm);
+      result->error = strdup (msg && msg[0] ? msg : "Failed");
+      if (result->error) {
+         result->error[strcspn (result->error, "\n")] = 0;
+      }
+      free (samples);
+      return true;
+   }
+
+   uint64_t deadline = now_ns () + BUDGET_NS;
+   size_t n = 0;
+   while (n < iterations && (n < MIN_ITERATIONS || now_ns () < deadline)) {
+      if (!(call_op (op, ctx, &samples[n]))) {
+         fprintf (stderr, "%s failed on call %zu: %s\n", op->name, n,
+                  frm_lastmsg (ctx->frm));
+         break;
+      }
+      n++;
+   }
+   result->peak_rss = rss_peak ();
+
+   if (n) {
+      qsort (samples, n, sizeof *samples, cmp_u64);
+      uint64_t total = 0;
+      for (size_t i=0; i<n; i++) {
+         total += samples[i];
+      }
+      result->nsamples = n;
+      result->median = samples[n / 2] / 1e3;
+      result->p99 = samples[(n * 99) / 100] / 1e3;
+      result->mean = total / 1e3 / n;
+      result->min = samples[0] / 1e3;
+      result->max = samples[n - 1] / 1e3;
+   }
+   free (samples);
+
+   result->syscalls = trace_op (op, ctx);
+   return true;
+}
+
+static void json_str (FILE *outf, const char *s)
+{
+   fputc ('"', outf);
+   for (; *s; s++) {
+      unsigned char c = *s;
+      if (c == '"' || c == '\\') {
+         fprintf (outf, "\\%c", c);
+      } else if (c < 0x20) {
+         fprintf (outf, "\\u%04x", c);
+      } else {
+         fputc (c, outf);
+      }
+   }
+   fputc ('"', outf);
+}
+
+static void json_write (FILE *outf, const struct ctx_t *ctx, size_t iterations,
+                        const struct result_t *results)
+{
+   fprintf (outf, "{\n  \"dbpath\": ");
+   json_str (outf, ctx->dbpath);
+   fprintf (outf, ",\n  \"frames\": %zu,\n  \"iterations\": %zu,\n  \"ops\": [\n",
+            ctx->npaths, iterations);
+   for (size_t i=0; i<NOPS; i++) {
+      const struct result_t *r = &results[i];
+      fprintf (outf, "    {\"name\": ");
+      json_str (outf, g_ops[i].name);
+      if (r->error) {
+         fprintf (outf, ", \"error\": ");
+         json_str (outf, r->error);
+      } else {
+         fprintf (outf, ", \"samples\": %zu, \"median_us\": %.3f, \"p99_us\": %.3f,"
+                  " \"mean_us\": %.3f, \"min_us\": %.3f, \"max_us\": %.3f",
+                  r->nsamples, r->median, r->p99, r->mean, r->min, r->max);
+         if (r->syscalls < 0) {
+            fprintf (outf, ", \"syscalls\": null");
+         } else {
+            fprintf (outf, ", \"syscalls\": %.1f", r->syscalls);
+         }
+         if (r->peak_rss < 0) {
+            fprintf (outf, ", \"peak_rss_kib\": null");
+         } else {
+            fprintf (outf, ", \"peak_rss_kib\": %ld", r->peak_rss);
+         }
+      }
+      fprintf (outf, "}%s\n", i + 1 < NOPS ? "," : "");
+   }
+   fprintf (outf, "  ]\n}\n");
+}
+
+static void table_write (FILE *outf, const struct result_t *results)
+{
+   fprintf (outf, "%-24s %7s %10s %10s %10s %9s %9s\n", "call", "n",
+            "p50(us)", "p99(us)", "mean(us)", "syscalls", "rss(KiB)");
+   for (size_t i=0; i<NOPS; i++) {
+      const struct result_t *r = &results[i];
+      if (r->error) {
+         fprintf (outf, "%-24s error: %s\n", g_ops[i].name, r->error);
+         continue;
+      }
+      fprintf (outf, "%-24s %7zu %10.1f %10.1f %10.1f %9.1f %9ld\n", g_ops[i].name,
+               r->nsamples, r->median, r->p99, r->mean, r->syscalls, r->peak_rss);
+   }
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   size_t iterations = DEFAULT_ITERATIONS;
+   const char *json = NULL;
+   struct ctx_t ctx = { 0 };
+   struct result_t results[NOPS] = { { 0 } };
+   FILE *outf = stdout;
+
+   if (argc < 2 || argv[1][0] == '-') {
+      fprintf (stderr, "Usage: %s <dbpath> [--iterations=N] [--json=FILE]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+   for (int i=2; i<argc; i++) {
+      if ((strncmp (argv[i], "--iterations=", 13))==0) {
+         iterations = strtoull (&argv[i][13], NULL, 10);
+      } else if ((strncmp (argv[i], "--json=", 7))==0) {
+         json = &argv[i][7];
+      } else {
+         fprintf (stderr, "Unknown option [%s]\n", argv[i]);
+         return EXIT_FAILURE;
+      }
+   }
+   if (iterations < MIN_ITERATIONS)
+      iterations = MIN_ITERATIONS;
+
+   ctx.dbpath = argv[1];
+   if (!(ctx.frm = frm_init (ctx.dbpath))) {
+      fprintf (stderr, "Failed to open framedb [%s]\n", ctx.dbpath);
+      return EXIT_FAILURE;
+   }
+
+   if (!(ctx.paths = frm_match_from_root (ctx.frm, "", 0)) || !ctx.paths[0]) {
+      fprintf (stderr, "No frames found in [%s]\n", ctx.dbpath);
+      goto cleanup;
+   }
+   while (ctx.paths[ctx.npaths])
+      ctx.npaths++;
+
+   // The frames that are pushed are made under the same frame every
+   // time, rather than under whichever frame was switched to last.
+   char *start = frm_current (ctx.frm);
+   for (size_t i=0; i<NOPS; i++) {
+      if ((strcmp (g_ops[i].name, "frm_push"))==0 && start) {
+         frm_switch_direct (ctx.frm, start);
+      }
+      fprintf (stderr, "Running %s ...\n", g_ops[i].name);
+      if (!(run_op (&g_ops[i], &ctx, iterations, &results[i]))) {
+         free (start);
+         goto cleanup;
+      }
+   }
+   free (start);
+
+   if (json && !(outf = fopen (json, "w"))) {
+      fprintf (stderr, "Failed to open [%s] for writing: %m\n", json);
+      goto cleanup;
+   }
+   json_write (outf, &ctx, iterations, results);
+   table_write (stderr, results);
+   ret = EXIT_SUCCESS;
+
+cleanup:
+   if (outf && outf != stdout) {
+      fclose (outf);
+   }
+   for (size_t i=0; i<NOPS; i++) {
+      free (results[i].error);
+   }
+   frm_strarray_free (ctx.paths);
+   frm_close (ctx.frm);
+   return ret;
+}
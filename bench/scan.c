@@ -0,0 +1,204 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+/* Throughput of the substring kernels in frm_scan.h. Builds an index of
+ * generated frame paths and counts the paths that contain each of a few
+ * search terms:
+ *    1. with strstr() on each path, as match() did,
+ *    2. with memmem() over the whole index,
+ *    3. with each frm_scan kernel that this processor supports, over the
+ *       whole index.
+ * and then ignoring case, with strcasestr() on each path and with the
+ * case-insensitive kernels.
+ *
+ * Usage: scan.elf [npaths]
+ *
+ * Exits with 0 if every method finds the same paths and 1 otherwise.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "frm_scan.h"
+
+#define NPATHS       (200000)
+#define NREPEATS     (20)
+
+static const char *g_words[] = {
+   "project", "client", "sprint", "bugfix", "release", "meeting", "review",
+   "design", "backend", "frontend", "database", "deploy", "research",
+   "notes", "todo", "archive", "infra", "support", "billing", "search",
+};
+#define NWORDS       (sizeof g_words / sizeof g_words[0])
+
+static const char *g_terms[] = {
+   "a", "/n", "sprint", "deploy-1", "zzz", "support/billing-19",
+   "SPRINT", "Deploy-1",
+};
+#define NTERMS       (sizeof g_terms / sizeof g_terms[0])
+
+static double now_ns (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int strptr_cmp (const void *lhs, const void *rhs)
+{
+   return strcmp (*(char * const *)lhs, *(char * const *)rhs);
+}
+
+// Generates sorted paths such as "root/client-4/sprint-12/deploy-7".
+static char **make_paths (size_t npaths)
+{
+   char **ret = calloc (npaths + 1, sizeof *ret);
+   if (!ret)
+      return NULL;
+
+   srand (1);
+   for (size_t i=0; i<npaths; i++) {
+      char path[256] = "root";
+      size_t depth = 1 + rand () % 5;
+      for (size_t j=0; j<depth; j++) {
+         size_t len = strlen (path);
+         snprintf (&path[len], sizeof path - len, "/%s-%i",
+                   g_words[rand () % NWORDS], rand () % 40);
+      }
+      if (!(ret[i] = strdup (path)))
+         return NULL;
+   }
+   qsort (ret, npaths, sizeof *ret, strptr_cmp);
+   return ret;
+}
+
+static size_t count_strstr (char **paths, size_t npaths, const char *term,
+                            bool icase)
+{
+   size_t ret = 0;
+   for (size_t i=0; i<npaths; i++) {
+      ret += (icase ? strcasestr (paths[i], term) : strstr (paths[i], term)) != NULL;
+   }
+   return ret;
+}
+
+// Counts the lines of buf that contain term, as index_match() does.
+static size_t count_buffer (frm_scan_fn_t *fn, const char *buf, size_t len,
+                            const char *term)
+{
+   size_t ret = 0;
+   size_t tlen = strlen (term);
+   const char *end = buf + len;
+   while (buf < end) {
+      const char *hit = fn (buf, end - buf, term, tlen);
+      if (!hit)
+         break;
+      ret++;
+      const char *eol = memchr (hit, '\n', end - hit);
+      buf = eol ? eol + 1 : end;
+   }
+   return ret;
+}
+
+static const char *glibc_memmem (const char *hay, size_t hlen,
+                                 const char *needle, size_t nlen)
+{
+   return memmem (hay, hlen, needle, nlen);
+}
+
+int main (int argc, char **argv)
+{
+   size_t npaths = argc > 1 ? strtoull (argv[1], NULL, 10) : NPATHS;
+   char **paths = make_paths (npaths);
+   if (!paths) {
+      fprintf (stderr, "OOM error generating paths\n");
+      return EXIT_FAILURE;
+   }
+
+   size_t len = 0;
+   for (size_t i=0; i<npaths; i++) {
+      len += strlen (paths[i]) + 1;
+   }
+   char *buf = malloc (len + 1);
+   if (!buf) {
+      fprintf (stderr, "OOM error allocating index\n");
+      return EXIT_FAILURE;
+   }
+   for (size_t i=0, offset=0; i<npaths; i++) {
+      offset += sprintf (&buf[offset], "%s\n", paths[i]);
+   }
+
+   struct {
+      const char *name;
+      frm_scan_fn_t *fn;
+      frm_scan_fn_t *icase;
+   } methods[] = {
+      { "memmem", glibc_memmem, NULL },
+      { "portable", frm_scan_kernel ("portable"), frm_scan_kernel_icase ("portable") },
+      { "sse2", frm_scan_kernel ("sse2"), frm_scan_kernel_icase ("sse2") },
+      { "avx2", frm_scan_kernel ("avx2"), frm_scan_kernel_icase ("avx2") },
+   };
+   size_t nmethods = sizeof methods / sizeof methods[0];
+
+   printf ("%zu paths, %.1f MB, frm_scan_find() uses [%s]\n",
+           npaths, len / 1e6, frm_scan_kernel_name ());
+
+   bool ok = true;
+   for (int icase=0; icase<2; icase++) {
+      printf ("\n%-20s %10s %10s", icase ? "term (ignoring case)" : "term",
+              "matches", icase ? "strcasestr" : "strstr");
+      for (size_t m=0; m<nmethods; m++) {
+         printf (" %10s", methods[m].name);
+      }
+      printf ("   (ms per pass)\n");
+
+      for (size_t t=0; t<NTERMS; t++) {
+         const char *term = g_terms[t];
+
+         size_t expected = 0;
+         double start = now_ns ();
+         for (size_t r=0; r<NREPEATS; r++) {
+            expected = count_strstr (paths, npaths, term, icase);
+         }
+         printf ("%-20s %10zu %10.3f", term, expected,
+                 (now_ns () - start) / NREPEATS / 1e6);
+
+         for (size_t m=0; m<nmethods; m++) {
+            frm_scan_fn_t *fn = icase ? methods[m].icase : methods[m].fn;
+            if (!fn) {
+               printf (" %10s", "n/a");
+               continue;
+            }
+            size_t count = 0;
+            start = now_ns ();
+            for (size_t r=0; r<NREPEATS; r++) {
+               count = count_buffer (fn, buf, len, term);
+            }
+            printf (" %10.3f", (now_ns () - start) / NREPEATS / 1e6);
+            if (count != expected) {
+               printf (" [%s found %zu]", methods[m].name, count);
+               ok = false;
+            }
+         }
+         printf ("\n");
+      }
+   }
+
+   for (size_t i=0; i<npaths; i++) {
+      free (paths[i]);
+   }
+   free (paths);
+   free (buf);
+   return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
@@ -14,6 +14,7 @@ type
   frm_node_t = Pointer;
 
 var frame_var: frm_t;
+var frame_tree: frm_node_t = nil;
 
 
     function frm_create(dbpath: PAnsiChar): frm_t; cdecl; external 'frame';
@@ -56,6 +57,8 @@ var frame_var: frm_t;
     function frm_homepath: PAnsiChar; cdecl; external 'frame';
 
     function frm_node_create(frm: frm_t): frm_node_t; cdecl; external 'frame';
+    function frm_node_create_lazy(frm: frm_t; prefetch: csize_t): frm_node_t; cdecl; external 'frame';
+    function frm_node_prefetch(node: frm_node_t; levels: csize_t): LongBool; cdecl; external 'frame';
     procedure frm_node_free(rootnode: frm_node_t); cdecl; external 'frame';
 
 function frm_node_name(node: frm_node_t): PAnsiChar; cdecl; external 'frame';
@@ -71,6 +74,8 @@ function frm_node_find(node: frm_node_t; fpath: PChar): frm_node_t; cdecl; exter
 
 procedure frame_history_populate(searchTerm: String; tlView: TListView);
 procedure frame_frames_populate(tv: TTreeView);
+procedure frame_frames_expand(tv: TTreeView; node: TTreeNode);
+procedure frame_frames_free;
 procedure frame_current_populate(edt: TEdit);
 procedure frame_notes_populate(memo: TMemo);
 procedure frame_set_frames_selected(tv: TTreeView; edt: TEdit);
@@ -102,38 +107,57 @@ begin
 end;
 
 
-procedure addChild (tv: TTreeView; parent: TTreeNode; frmNode: frm_node_t);
+// Children of a frame are only added to the tree view (and read from the
+// framedb) when the frame is expanded, see frame_frames_expand(). Until
+// then every frame is shown as having children, as finding out would
+// read them.
+function addChild (tv: TTreeView; parent: TTreeNode; frmNode: frm_node_t): TTreeNode;
 var
   name: String;
-  nchildren: csize_t;
-  child: frm_node_t;
-  i: csize_t;
   current: TTreeNode;
 
 begin
   name := frm_node_name(frmNode);
   current := tv.Items.AddChild(parent, name);
-//  current.Data := frm_node_fpath(frmNode);
+  current.Data := frmNode;
+  current.HasChildren := True;
+  Exit(current);
+end;
+
+procedure frame_frames_expand(tv: TTreeView; node: TTreeNode);
+var
+  nchildren: csize_t;
+  i: csize_t;
 
-  nchildren := frm_node_nchildren(frmNode);
+begin
+  if (node = nil) or (node.Data = nil) or (node.Count > 0) then
+    Exit;
+
+  nchildren := frm_node_nchildren(node.Data);
+  node.HasChildren := nchildren > 0;
   i := 0;
 
   while i < nchildren do
   begin
-    child := frm_node_child(frmNode, i);
-    addChild (tv, current, child);
+    addChild (tv, node, frm_node_child(node.Data, i));
     Inc(i);
   end;
 end;
 
+procedure frame_frames_free;
+begin
+  frm_node_free(frame_tree);
+  frame_tree := nil;
+end;
+
 procedure frame_frames_populate(tv: TTreeView);
-var
-  root: pointer;
 begin
   tv.Items.Clear;
-  root := frm_node_create(frame_var);
-  addChild (tv, nil, root);
-  frm_node_free(root);
+  frame_frames_free;
+  frame_tree := frm_node_create_lazy(frame_var, 1);
+  if frame_tree = nil then
+    Exit;
+  frame_frames_expand (tv, addChild (tv, nil, frame_tree));
 end;
 
 procedure frame_current_populate(edt: TEdit);
@@ -148,8 +172,26 @@ begin
 end;
 
 procedure frame_set_frames_selected(tv: TTreeView; edt: TEdit);
+var
+  names: TStringDynArray;
+  current: TTreeNode;
+  i: Integer;
+
 begin
-  tv.Selected := tv.Items.FindNodeWithTextPath(edt.Caption);
+  // Only the frames along the path to the selected frame are loaded.
+  names := SplitString(edt.Caption, '/');
+  current := tv.Items.GetFirstNode;
+  if (current <> nil) and ((Length(names) = 0) or (current.Text <> names[0])) then
+    current := nil;
+
+  i := 1;
+  while (current <> nil) and (i < Length(names)) do
+  begin
+    frame_frames_expand(tv, current);
+    current := current.FindNode(names[i]);
+    Inc(i);
+  end;
+  tv.Selected := current;
 end;
 end.
 
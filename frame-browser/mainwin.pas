@@ -55,6 +55,8 @@ type
     procedure MenuItem4Click(Sender: TObject);
     procedure tvFramesEditingEnd(Sender: TObject; Node: TTreeNode;
       Cancel: Boolean);
+    procedure tvFramesExpanding(Sender: TObject; Node: TTreeNode;
+      var AllowExpansion: Boolean);
     procedure tvFramesKeyDown(Sender: TObject; var Key: Word; Shift: TShiftState
       );
     procedure tvFramesSelectionChanged(Sender: TObject);
@@ -99,6 +101,7 @@ end;
 
 function FrameInit (path: String): Boolean;
 begin
+  frame_frames_free;
   frm_close(frame_var);
   frame_var := frm_init(Pchar(path));
   if frame_var = nil then
@@ -248,6 +251,13 @@ begin
   end;
 end;
 
+procedure TfrmMain.tvFramesExpanding(Sender: TObject; Node: TTreeNode;
+  var AllowExpansion: Boolean);
+begin
+  frame_frames_expand(frmMain.tvFrames, Node);
+  AllowExpansion := true;
+end;
+
 procedure TfrmMain.tvFramesKeyDown(Sender: TObject; var Key: Word;
   Shift: TShiftState);
 begin
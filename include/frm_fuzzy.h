@@ -0,0 +1,63 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_FUZZY
+#define H_FRM_FUZZY
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Fuzzy matching of frame paths, as used by interactive finders. The
+ * query is split on whitespace into terms, and a path matches if every
+ * term is a subsequence of it, in any order. Case is ignored for ASCII
+ * letters unless the term has an uppercase letter; other bytes, including
+ * those of UTF-8 sequences, must be equal.
+ *
+ * Each term is scored on the shortest part of the path that contains it,
+ * with points for every matched character and bonuses for characters at
+ * the start of a path segment or of a word, for runs of consecutive
+ * characters and for matching within the last segment; gaps cost points.
+ */
+
+struct frm_fuzzy_hit_t {
+   size_t offset;          // Of the line in the buffer
+   size_t len;
+   int32_t score;
+};
+
+// Returns extra points for the matching line of len bytes at line, such
+// as for recently visited frames.
+typedef int32_t (frm_fuzzy_bonus_t) (void *arg, const char *line, size_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns the score of the len bytes at line against query, or -1 if
+   // it does not match. An empty query matches everything with a score
+   // of 0.
+   int32_t frm_fuzzy_score (const char *line, size_t len, const char *query);
+
+   // Scores every newline-terminated line of the len bytes at lines and
+   // returns the best limit of them (all of them if limit is 0), best
+   // first, storing the number returned in nhits. Lines with equal scores
+   // are ordered shortest first, then in the order of the buffer. bonus
+   // may be NULL. The caller must free the result.
+   struct frm_fuzzy_hit_t *frm_fuzzy_rank (const char *lines, size_t len,
+                                           const char *query, size_t limit,
+                                           frm_fuzzy_bonus_t *bonus, void *arg,
+                                           size_t *nhits);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,58 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_GLOB
+#define H_FRM_GLOB
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Glob patterns for frame paths. A pattern must match the whole path:
+ *    *        matches any characters other than '/'
+ *    **       matches any characters, including '/'. Between two
+ *             slashes it can also match nothing, along with one of the
+ *             slashes, so that "root/" ** "/GUI" matches "root/GUI"
+ *    ?        matches one character other than '/'
+ *    [abc]    matches one of the listed ASCII characters, which can
+ *             include ranges such as "a-z"; "[!abc]" and "[^abc]" match
+ *             one character, other than '/', that is not listed
+ *    \c       matches c
+ * Anything else matches itself. '?' and negated brackets match a whole
+ * UTF-8 character.
+ *
+ * The pattern is compiled into an NFA, and the DFA for it is built as it
+ * is run, one state for each set of NFA positions that a path reaches,
+ * so matching a path takes one table lookup per byte once the DFA is
+ * warm. Matching stops at the first byte after which no path can match.
+ */
+
+typedef struct frm_glob_t frm_glob_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Compiles pattern. If icase is set, letters match in either case,
+   // as folded by frm_scan_fold(). Returns NULL with errno set to EINVAL
+   // if the pattern is not valid.
+   frm_glob_t *frm_glob_new (const char *pattern, bool icase);
+   void frm_glob_del (frm_glob_t *glob);
+
+   // Returns true if the len bytes at text match the pattern. The DFA
+   // is built into glob, so a glob must not be used by two threads at
+   // once.
+   bool frm_glob_match (frm_glob_t *glob, const char *text, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,51 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_PERFLOG
+#define H_FRM_PERFLOG
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The performance log of a framedb (see frm_perflog_append() in frm.h),
+ * a file of fixed-size records in the byte order of the machine, one per
+ * run of a command. Each record is written with a single append, so
+ * processes running at the same time do not interleave them. When the
+ * log grows past FRM_PERFLOG_MAXSIZE it is renamed to <log>.1, replacing
+ * the one before it, and a new log is started.
+ */
+#define FRM_PERFLOG_MAXSIZE      (1024 * 1024)
+
+typedef struct frm_perflog_t {
+   uint64_t time;             // Start, in microseconds since the epoch
+   uint64_t dbsize;           // Bytes in the index, or the mapped file
+   uint32_t usecs;            // Duration
+   int32_t status;            // Exit status
+   char command[16];          // Truncated, NUL-padded if shorter
+} frm_perflog_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   bool frm_perflog_write (const char *fname, const frm_perflog_t *rec);
+
+   // Returns the records in fname.1 and fname that started at or after
+   // since, oldest first, with their number in *nrecs. A log that does
+   // not exist has no records. Returns NULL on error.
+   frm_perflog_t *frm_perflog_load (const char *fname, uint64_t since,
+                                    size_t *nrecs);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
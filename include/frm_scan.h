@@ -0,0 +1,73 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_SCAN
+#define H_FRM_SCAN
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Substring search over large buffers, such as the whole of the sorted
+ * index. The vector kernels compare the first and the last byte of the
+ * needle against 16 (SSE2) or 32 (AVX2) positions of the buffer at a
+ * time, and only compare the rest of the needle at the positions where
+ * both match. The fastest kernel that the processor supports is chosen
+ * the first time frm_scan_find() is called; other processors use a
+ * portable kernel built on memchr(). The case-insensitive kernels compare
+ * the first and the last byte in both cases.
+ *
+ * Case-insensitive search only folds ASCII letters, which is safe for
+ * UTF-8 text since no byte of a multi-byte sequence is an ASCII letter.
+ * To also ignore the case of other letters, fold both the text and the
+ * needle with frm_scan_fold() and search them with frm_scan_find().
+ */
+
+typedef const char *(frm_scan_fn_t) (const char *hay, size_t hlen,
+                                     const char *needle, size_t nlen);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns the first occurrence of needle in the hlen bytes at hay, or
+   // NULL if there is none, like memmem(). An empty needle is found at
+   // the start of hay.
+   const char *frm_scan_find (const char *hay, size_t hlen,
+                              const char *needle, size_t nlen);
+
+   // As frm_scan_find(), but ASCII letters match in either case.
+   const char *frm_scan_find_icase (const char *hay, size_t hlen,
+                                    const char *needle, size_t nlen);
+
+   // Returns the kernel with the given name, one of "avx2", "sse2" and
+   // "portable", or NULL if it is not supported by this processor. For
+   // tests and benchmarks.
+   frm_scan_fn_t *frm_scan_kernel (const char *name);
+   frm_scan_fn_t *frm_scan_kernel_icase (const char *name);
+
+   // Returns the name of the kernel used by frm_scan_find().
+   const char *frm_scan_kernel_name (void);
+
+   // Returns true if the len bytes at text are all ASCII.
+   bool frm_scan_ascii (const char *text, size_t len);
+
+   // Folds the len bytes of UTF-8 text at src to lowercase into dst,
+   // which may be src. Folds ASCII, Latin-1, Latin Extended-A, Greek and
+   // Cyrillic letters; everything else, including invalid sequences, is
+   // copied unchanged. The folded text is the same length as src, so
+   // offsets into one are offsets into the other.
+   void frm_scan_fold (char *dst, const char *src, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,81 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_SEARCH
+#define H_FRM_SEARCH
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A full-text index over the payloads of a directory framedb, keyed by
+ * frame ID (see frm_ids.h) so that renaming or moving frames does not
+ * change it. Text is split into words, which are runs of ASCII letters
+ * and digits and of non-ASCII bytes, and ASCII letters are folded to
+ * lowercase. Queries are ranked with BM25.
+ *
+ * The index is a snapshot, "search.index", and a log of the documents
+ * that changed since, "search.log". Each record in the log replaces the
+ * whole document. When the log grows too large it is merged into a new
+ * snapshot, which drops the documents of frames that no longer exist.
+ *
+ * The caller must hold the framedb lock, and must hold it exclusively to
+ * change the index.
+ */
+
+typedef struct frm_search_batch_t frm_search_batch_t;
+
+struct frm_search_hit_t {
+   uint64_t id;
+   double score;
+};
+
+// Returns true if the frame with the given ID still exists.
+typedef bool (frm_search_live_t) (void *arg, uint64_t id);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // A batch of documents to add to the index. Adding a document with
+   // the same ID as an earlier one replaces it.
+   frm_search_batch_t *frm_search_batch_new (void);
+   void frm_search_batch_del (frm_search_batch_t *batch);
+   bool frm_search_batch_add (frm_search_batch_t *batch, uint64_t id,
+                              const char *text);
+
+   // Returns true if there is a search index in dirfd.
+   bool frm_search_exists (int dirfd);
+
+   // Creates the search index in dirfd from the batch, which must hold
+   // every document, replacing any existing index.
+   bool frm_search_create (int dirfd, const frm_search_batch_t *batch);
+
+   // Adds the documents in the batch to the search index in dirfd, if
+   // there is one. Documents for which live() returns false are dropped
+   // when the log is merged into the snapshot.
+   bool frm_search_append (int dirfd, const frm_search_batch_t *batch,
+                           frm_search_live_t *live, void *arg);
+
+   // Returns up to limit documents that contain any of the words in
+   // query, best match first, and stores the number returned in nhits.
+   // Documents for which live() returns false are skipped. The caller
+   // must free the result. Returns NULL with errno set to ENOENT if there
+   // is no search index.
+   struct frm_search_hit_t *frm_search_query (int dirfd, const char *query,
+                                              size_t limit,
+                                              frm_search_live_t *live,
+                                              void *arg, size_t *nhits);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
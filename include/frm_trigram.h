@@ -0,0 +1,62 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_TRIGRAM
+#define H_FRM_TRIGRAM
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A trigram index over the paths in the sorted index of a directory
+ * framedb, for substring searches. For every sequence of three bytes that
+ * appears in any path it holds the list of paths that contain it, so that
+ * a search only has to check the paths that contain every trigram of the
+ * search term.
+ *
+ * The trigram index is a snapshot of the sorted index, and changes since
+ * the snapshot was taken are appended to a log. Both are kept next to
+ * the sorted index, in "index.trigram" and "index.trigram.log". The
+ * snapshot is rebuilt by the next search when the log grows too large, or
+ * when the sorted index was changed without the change being logged (for
+ * example, by an earlier version).
+ *
+ * The caller must hold the framedb lock, and must hold it exclusively to
+ * update the index.
+ */
+
+// Search terms shorter than this cannot use the trigram index.
+#define FRM_TRIGRAM_MIN    (3)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Record a change to the sorted index index_fname in dirfd, after the
+   // new index has been renamed into place. oldfd is an open descriptor
+   // to the index before the change. The change removed the path
+   // 'removed', if it is not NULL, and every path below it, and then
+   // added the paths in 'added'.
+   bool frm_trigram_update (int dirfd, int oldfd, const char *index_fname,
+                            const char *removed, char **added, size_t nadded);
+
+   // Returns all the paths in the sorted index index_fname in dirfd that
+   // start with prefix and contain sterm, in sorted order, as a NULL
+   // terminated array that the caller must free. sterm must be at least
+   // FRM_TRIGRAM_MIN bytes long. Returns NULL on error, in which case the
+   // caller can still search the sorted index itself.
+   char **frm_trigram_match (int dirfd, const char *index_fname,
+                             const char *prefix, const char *sterm);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
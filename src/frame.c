@@ -12,12 +12,16 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <time.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "ds_str.h"
 #include "frm.h"
+#include "frm_stats.h"
+#include "frm_perflog.h"
 
 /* **********************************************************
  * Command line handling:
@@ -105,14 +109,16 @@ static char *cline_command_get (size_t index)
       cmd = strchr (cmd, '\x1e');
       if (!cmd)
          break;
+      cmd++;
    }
    if (!cmd) {
       fprintf (stderr, "Request for command [%zu] failed\n", index);
       return NULL;
    }
 
-   if (*cmd == '\x1e')
-      cmd++;
+   // Past the last command
+   if (!cmd[0])
+      return ds_str_dup ("");
 
    char *end = strchr (cmd, '\x1e');
    if (!end) {
@@ -150,7 +156,7 @@ static char *run_editor (const char *default_file_contents)
          }
       }
    } else {
-      char fname[] = "frame-tmpfile-XXXXXX";
+      char fname[] = "/tmp/frame-tmpfile-XXXXXX";
       int fd = mkstemp (fname);
       if (fd < 0) {
          FRM_ERROR ("Failed to create temporary file: %m\n");
@@ -215,7 +221,8 @@ static void print_helpmsg (void)
 "options or subcommands will be decribed below.",
 "",
 "  Commands must be one of help, create, history, status, push, replace,",
-"append, up, down, switch, pop, delete, list or match.",
+"append, up, down, switch, pop, undo-pop, gc, delete, list, match, rename,",
+"move, id, search, grep, jump, batch, import-tree or perf-report.",
 "",
 "Options:",
 "",
@@ -252,9 +259,36 @@ static void print_helpmsg (void)
 "                       the match command to find all nodes that *DON'T* match",
 "                       the search term.",
 "",
+"  --icase              Ignore case when matching. ASCII letters and the letters",
+"                       of most European alphabets are matched in either case.",
+"",
+"  --glob               The search term of the match command is a glob pattern",
+"                       that must match the whole path, such as 'root/*/GUI*'.",
+"                       '*' and '?' do not match '/', '**' matches any number",
+"                       of frames and '[a-z]' matches one character of a set.",
+"",
+"  --mapped             When creating a database, store it in a single file that",
+"                       is memory-mapped instead of a directory tree.",
+"",
 "  --quiet              Suppress all non-functional stdout messages, such as",
 "                       the copyright notice.",
 "",
+"  --null               The commands read by 'batch' are terminated by a NUL",
+"                       character instead of by a newline.",
+"",
+"  --stats              Print to stderr, after the command, the number of calls",
+"                       made to each library function, the time they took and",
+"                       the files they opened, renamed and read and wrote.",
+"                       heap(B) is the change in the heap in use by the whole",
+"                       process over the calls, not the number of bytes that",
+"                       they allocated.",
+"",
+"  --perflog            Record how long the command took, its exit status and",
+"                       the size of the database in the database's perf.log",
+"                       (see 'perf-report'). Setting $FRAME_PERFLOG to anything",
+"                       but an empty string or '0' does the same for every",
+"                       command, eg. for those run by the shell prompt.",
+"",
 "Commands:",
 "",
 "help",
@@ -263,6 +297,9 @@ static void print_helpmsg (void)
 "create",
 "  Create a new frame database. If --dbpath is specified then it is used as the",
 "  location of the new database. If it is not then $HOME/.framdb is used instead.",
+"  If --mapped is specified the database is created as a single memory-mapped",
+"  file instead of a directory tree. A mapped database cannot be edited with",
+"  $EDITOR; use 'replace' and 'append' instead.",
 "",
 "history [count]",
 "  Display the history of all nodes visited, with a number that can be used",
@@ -311,11 +348,23 @@ static void print_helpmsg (void)
 "  Changes the current frame to the child frame named by 'name'.",
 "",
 "switch <path>",
-"  Changes the current frame to the non-child frame named by <path>.",
+"switch --id=<number>",
+"  Changes the current frame to the non-child frame named by <path>, or to the",
+"  frame with the ID <number> (see 'id' below).",
 "",
 "pop",
 "  Deletes the current frame and set the current frame to the parent of the",
-"  deleted frame.",
+"  deleted frame. The deleted frame is kept in the trash until 'gc' is run,",
+"  and can be restored with 'undo-pop' until then.",
+"",
+"undo-pop",
+"  Restores the most recently popped frame that is still in the trash, and",
+"  makes it the current frame.",
+"",
+"gc [seconds]",
+"  Permanently removes the popped frames in the trash. If [seconds] is given,",
+"  only frames that were popped at least that many seconds ago are removed.",
+"  A mapped database has no trash; 'gc' compacts its file instead.",
 "",
 "delete <path>",
 "  Deletes the frame named by <path>. The current frame is not changed.",
@@ -329,11 +378,71 @@ static void print_helpmsg (void)
 "rename <newname>",
 "  Rename the current node to <newname>.",
 "",
-"match <sterm> [--from-root] [--invert]",
+"move <path> <parent>",
+"  Move the frame at <path>, and all the frames under it, to be a child of the",
+"  frame at <parent>. Both paths can be relative to the current frame or",
+"  absolute from root. The moved frames keep their contents and dates.",
+"",
+"id [path]",
+"  Display the ID of the frame at [path], or of the current frame if [path] is",
+"  omitted. The ID of a frame does not change when it or its parents are",
+"  renamed, so it can be used with 'switch --id=<number>' to find it again.",
+"  Databases created with --mapped do not have frame IDs.",
+"",
+"match <sterm> [--from-root] [--invert] [--icase] [--glob]",
 "  Lists the nodes that match the search term <sterm>, starting at the current",
 "  frame. If '--from-root' is specified then the search is performed from the",
 "  root frame and not the current frame. If --invert is specified, then the search",
 "  is performed for all those nodes *NOT MATCHING* the search term <sterm>.",
+"  With --icase case is ignored, and with --glob <sterm> is a glob pattern for",
+"  the whole path rather than a part of it, eg. 'root/**/GUI*'.",
+"",
+"search <words...> [--limit=<number>]",
+"  Lists the frames whose contents contain any of the words, best match first.",
+"  Case is ignored. At most <number> frames are listed, 20 if --limit is not",
+"  specified and all of them if <number> is 0. Databases created with --mapped",
+"  cannot be searched.",
+"",
+"grep <regex> [--from=<path>]",
+"  Lists the frames whose contents match the extended regular expression",
+"  <regex>, starting at the current frame or at the frame at <path>. The",
+"  contents are read and matched in parallel, using every processor.",
+"",
+"jump <query...> [--list] [--limit=<number>]",
+"  Switches to the frame whose path best matches <query>. Each word of <query>",
+"  must appear in the path in order, but not necessarily next to each other, so",
+"  'jump prj gui' finds 'root/projects/frame/GUI'. Matches at the start of a",
+"  path segment or a word, and recently visited frames, are preferred. Case is",
+"  ignored unless a word has uppercase letters. With --list, the best matches",
+"  are listed instead: at most <number> of them, 20 if --limit is not specified",
+"  and all of them if <number> is 0.",
+"",
+"batch [file] [--null]",
+"  Runs the commands in [file], or on the standard input if [file] is omitted or",
+"  is '-', one per line, as if each was given on the command line but without",
+"  the leading 'frame'. Arguments containing spaces can be quoted. Blank lines",
+"  and lines starting with '#' are skipped. The framedb is only opened once,",
+"  and the index is updated once at the end, so this is much faster than",
+"  running the commands one at a time. Stops at the first command that fails.",
+"  Commands that need a message should be given '--message'.",
+"",
+"import-tree [file] [--message=<string>]",
+"  Creates a tree of new frames under the current frame in one step. Reads",
+"  [file], or the standard input if [file] is omitted or is '-', which lists",
+"  one frame per line as the path relative to the current frame, optionally",
+"  followed by a tab and the contents of the frame, eg. 'project/design'. A",
+"  frame must be listed after its parent. Frames without contents get the",
+"  message given with '--message', if any. Blank lines and lines starting with",
+"  '#' are skipped.",
+"",
+"perf-report [--since=<age>]",
+"  Lists the number of runs of each command recorded with --perflog, how many",
+"  failed, the 50th, 95th and 99th percentiles and the maximum of the time they",
+"  took, in milliseconds, and the smallest and largest database size they ran",
+"  on, which is the size of the index, or of the file of a mapped database.",
+"  With --since only the runs started within <age> are listed, which is a",
+"  number of seconds, or of minutes, hours or days if followed by 'm', 'h'",
+"  or 'd', eg. '--since=7d'.",
 "",
 NULL,
    };
@@ -362,6 +471,100 @@ static void status (frm_t *frm)
    free (payload);
 }
 
+static void print_stats (frm_t *frm)
+{
+   frm_stats_t *stats = frm_stats_get (frm);
+   if (!stats) {
+      fprintf (stderr, "Failed to get stats: %s\n", frm_lastmsg (frm));
+      return;
+   }
+
+   fprintf (stderr, "%-24s %6s %10s %6s %8s %7s %10s %10s %10s\n",
+            "function", "calls", "time(us)", "opens", "readdirs", "renames",
+            "read(B)", "written(B)", "heap(B)");
+   for (size_t i=0; stats[i].fname; i++) {
+      const frm_stats_t *s = &stats[i];
+      fprintf (stderr, "%-24s %6" PRIu64 " %10.1f %6" PRIu64 " %8" PRIu64
+               " %7" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIi64 "\n",
+               s->fname, s->calls, s->nsecs / 1e3, s->opens, s->readdirs,
+               s->renames, s->bytes_read, s->bytes_written, s->heap_bytes);
+   }
+   frm_mem_free (stats);
+}
+
+// Sorts by command, then by duration.
+static int perflog_cmp (const void *lhs, const void *rhs)
+{
+   const frm_perflog_t *l = lhs, *r = rhs;
+   int rc = strncmp (l->command, r->command, sizeof l->command);
+   if (rc)
+      return rc;
+   return l->usecs < r->usecs ? -1 : l->usecs > r->usecs;
+}
+
+// The nearest-rank percentile of the n durations, which are sorted.
+static double perflog_pct (const frm_perflog_t *recs, size_t n, size_t pct)
+{
+   size_t rank = (n * pct + 99) / 100;
+   return recs[rank ? rank - 1 : 0].usecs / 1e3;
+}
+
+static int perf_report (const char *dbpath, const char *since)
+{
+   uint64_t start = 0;
+   if (since && since[0]) {
+      char *end = NULL;
+      uint64_t age = strtoull (since, &end, 10);
+      switch (*end) {
+         case 'd':   age *= 24;  // Fallthrough
+         case 'h':   age *= 60;  // Fallthrough
+         case 'm':   age *= 60;  // Fallthrough
+         case 's':
+         case 0:     break;
+         default:
+            fprintf (stderr, "Invalid --since value [%s]\n", since);
+            return EXIT_FAILURE;
+      }
+      uint64_t now = (uint64_t)time (NULL);
+      start = age < now ? (now - age) * 1000000 : 0;
+   }
+
+   size_t nrecs = 0;
+   frm_perflog_t *recs = frm_perflog_get (dbpath, start, &nrecs);
+   if (!recs) {
+      fprintf (stderr, "Failed to read the perflog of [%s]\n", dbpath);
+      return EXIT_FAILURE;
+   }
+
+   qsort (recs, nrecs, sizeof *recs, perflog_cmp);
+   printf ("%-16s %7s %7s %9s %9s %9s %9s %12s %12s\n",
+           "command", "runs", "failed", "p50(ms)", "p95(ms)", "p99(ms)",
+           "max(ms)", "min-db(B)", "max-db(B)");
+   for (size_t i=0; i<nrecs; ) {
+      size_t n = 1;
+      while (i + n < nrecs && (strncmp (recs[i].command, recs[i + n].command,
+                                         sizeof recs[i].command))==0) {
+         n++;
+      }
+
+      size_t failed = 0;
+      uint64_t mindb = recs[i].dbsize, maxdb = recs[i].dbsize;
+      for (size_t j=i; j<i + n; j++) {
+         failed += recs[j].status != EXIT_SUCCESS;
+         mindb = recs[j].dbsize < mindb ? recs[j].dbsize : mindb;
+         maxdb = recs[j].dbsize > maxdb ? recs[j].dbsize : maxdb;
+      }
+      printf ("%-16.16s %7zu %7zu %9.2f %9.2f %9.2f %9.2f %12" PRIu64
+              " %12" PRIu64 "\n",
+              recs[i].command, n, failed, perflog_pct (&recs[i], n, 50),
+              perflog_pct (&recs[i], n, 95), perflog_pct (&recs[i], n, 99),
+              recs[i + n - 1].usecs / 1e3, mindb, maxdb);
+      i += n;
+   }
+   frm_mem_free (recs);
+   return EXIT_SUCCESS;
+}
+
 static void current (frm_t *frm)
 {
    char *current = frm_current (frm);
@@ -422,81 +625,98 @@ int print_tree (const frm_node_t *node, size_t level)
    return EXIT_SUCCESS;
 }
 
-int main (int argc, char **argv)
+// Creates the frames listed in a file (or stdin) under the current frame,
+// one per line: the path of the frame relative to the current frame,
+// optionally followed by a tab and the message.
+static int import_tree (frm_t *frm)
 {
-   int ret = EXIT_SUCCESS;
-   cline_parse_options (argc, argv);
-   cline_parse_commands (argc, argv);
-
-   // TODO: At some point maybe verify that the options specified are applicable
-   // to the command.
-   char *command = cline_command_get (0);
-   char *help = cline_option_get ("help");
-   char *force = cline_option_get ("force");
-   char *dbpath = cline_option_get ("dbpath");
+   int ret = EXIT_FAILURE;
+   char *fname = cline_command_get (1);
    char *message = cline_option_get ("message");
-   char *from_root = cline_option_get ("from-root");
-   char *invert = cline_option_get ("invert");
-   char *quiet = cline_option_get ("quiet");
-   char *frame = cline_option_get ("frame");
-   char *oldpath = NULL;
-
-   frm_t *frm = NULL;
-
-   if (!command || !command[0]) {
-      free (command);
-      command = ds_str_dup("status");
-      printf ("No command specified (try --help). Defaulting to 'status'\n");
-   }
-
-   if ((strcmp (command, "help")==0) || help) {
-      print_helpmsg ();
-      ret = EXIT_FAILURE;
+   char **names = NULL;
+   char **messages = NULL;
+   size_t nframes = 0;
+   size_t nalloced = 0;
+   char *line = NULL;
+   size_t line_len = 0;
+
+   FILE *inf = stdin;
+   if (fname && fname[0] && (strcmp (fname, "-"))!=0 && !(inf = fopen (fname, "r"))) {
+      fprintf (stderr, "Failed to open [%s]: %m\n", fname);
       goto cleanup;
    }
 
-
-   // TODO: have a more nuanced determination of when the copyright
-   // notice should be printed.
-   if (quiet==NULL) {
-      printf ("Frame %s, (© 2023 Lelanthran Manickum)\n", frame_version);
-   }
-
-   if (!dbpath) {
-
-      const char *home = frm_homepath ();
-      if (!home || !home[0]) {
-         fprintf (stderr, "No --dbpath specified and $HOME is not set\n");
-         ret = EXIT_FAILURE;
-         goto cleanup;
+   while ((getline (&line, &line_len, inf)) > 0) {
+      line[strcspn (line, "\r\n")] = 0;
+      if (!line[0] || line[0] == '#')
+         continue;
+
+      if (nframes == nalloced) {
+         size_t newlen = nalloced ? nalloced * 2 : 1024;
+         char **tmp_names = realloc (names, newlen * sizeof *names);
+         if (tmp_names)
+            names = tmp_names;
+         char **tmp_messages = realloc (messages, newlen * sizeof *messages);
+         if (tmp_messages)
+            messages = tmp_messages;
+         if (!tmp_names || !tmp_messages) {
+            fprintf (stderr, "OOM error reading frame %zu\n", nframes + 1);
+            goto cleanup;
+         }
+         nalloced = newlen;
       }
-      dbpath = ds_str_cat (home, FRM_DIR_SEPARATOR, ".framedb", NULL);
 
-      if (!dbpath) {
-         fprintf (stderr, "OOM error copying $HOME\n");
-         ret = EXIT_FAILURE;
+      char *tab = strchr (line, '\t');
+      if (tab) {
+         *tab++ = 0;
+      }
+      names[nframes] = ds_str_dup (line);
+      messages[nframes] = ds_str_dup (tab ? tab : message ? message : "");
+      if (!names[nframes++] || !messages[nframes - 1]) {
+         fprintf (stderr, "OOM error reading frame %zu\n", nframes);
          goto cleanup;
       }
    }
 
-   // Check for each command in turn. Could be done in an array, but I don't care
-   // enough to do it.
-   if ((strcmp (command, "create"))==0) {
-      if ((frm = frm_create (dbpath))) {
-         fprintf (stderr, "Created framedb at [%s]\n", dbpath);
-         ret = EXIT_SUCCESS;
-      } else {
-         fprintf (stderr, "Failed to create framedb at [%s]: %m\n", dbpath);
-         ret = EXIT_FAILURE;
-      }
+   if (!(frm_new_many (frm, NULL, (const char **)names, (const char **)messages,
+                       nframes))) {
+      fprintf (stderr, "Failed to import frames: %s\n", frm_lastmsg (frm));
       goto cleanup;
    }
 
-   if (!(frm = frm_init (dbpath))) {
-      fprintf (stderr, "Failed to load db from [%s]\n", dbpath);
-      ret = EXIT_FAILURE;
-      goto cleanup;
+   printf ("Created %zu new frames\n", nframes);
+   ret = EXIT_SUCCESS;
+
+cleanup:
+   for (size_t i=0; i<nframes; i++) {
+      free (names[i]);
+      free (messages[i]);
+   }
+   free (names);
+   free (messages);
+   if (inf && inf != stdin) {
+      fclose (inf);
    }
+   free (line);
+   free (message);
+   free (fname);
+   return ret;
+}
+
+// Runs a single command, as given by the options and commands parsed
+// from the command line, against an initialised framedb.
+static int run_command (frm_t *frm, const char *command)
+{
+   int ret = EXIT_SUCCESS;
+   char *force = cline_option_get ("force");
+   char *from_root = cline_option_get ("from-root");
+   char *invert = cline_option_get ("invert");
+   char *icase = cline_option_get ("icase");
+   char *glob = cline_option_get ("glob");
+   char *quiet = cline_option_get ("quiet");
+   char *frame = cline_option_get ("frame");
+   char *oldpath = NULL;
+   char *framepath = NULL;
 
    if (frame && frame[1]) {
       oldpath = frm_switch_path (frm, frame);
@@ -506,6 +726,7 @@ int main (int argc, char **argv)
          ret = EXIT_FAILURE;
          goto cleanup;
       }
+      framepath = frm_current (frm);
    }
 
    if ((strcmp (command, "history"))==0) {
@@ -530,6 +751,11 @@ int main (int argc, char **argv)
          count = (size_t)-1;
 
       char *history = frm_history (frm, count);
+      if (!history) {
+         fprintf (stderr, "Failed to read the frame history\n");
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
       char *sptr = NULL;
       char *tok = strtok_r (history, "\n", &sptr);
       size_t i=0;
@@ -685,6 +911,15 @@ int main (int argc, char **argv)
          ret = EXIT_FAILURE;
       }
 
+      // Write the edited payload back, so that the date and the search
+      // index are updated.
+      char *payload = ret == EXIT_SUCCESS ? frm_payload_at (frm, NULL) : NULL;
+      if (payload && !(frm_payload_replace_at (frm, NULL, payload))) {
+         fprintf (stderr, "Failed to update the current frame: %m\n");
+         ret = EXIT_FAILURE;
+      }
+      free (payload);
+
       free (fname);
       free (shcmd);
       current (frm);
@@ -753,6 +988,21 @@ int main (int argc, char **argv)
    }
 
    if ((strcmp (command, "switch"))==0) {
+      char *id = cline_option_get ("id");
+      if (id) {
+         char *endptr = NULL;
+         uint64_t idnum = strtoull (id, &endptr, 10);
+         if (!id[0] || *endptr || !(frm_switch_id (frm, idnum))) {
+            fprintf (stderr, "Failed to switch to frame with ID [%s]\n", id);
+            ret = EXIT_FAILURE;
+         }
+         free (id);
+         if (ret == EXIT_SUCCESS) {
+            status (frm);
+         }
+         goto cleanup;
+      }
+
       char *target = cline_command_get(1);
       if (!target || !target[0]) {
          fprintf (stderr, "Must specify an absolute path to switch to\n");
@@ -821,6 +1071,32 @@ int main (int argc, char **argv)
       goto cleanup;
    }
 
+   if ((strcmp (command, "undo-pop"))==0) {
+      if (!(frm_undo_pop (frm))) {
+         fprintf (stderr, "Failed to restore the last popped frame: %m\n");
+         ret = EXIT_FAILURE;
+      }
+      if (ret == EXIT_SUCCESS) {
+         status (frm);
+      }
+      goto cleanup;
+   }
+
+   if ((strcmp (command, "gc"))==0) {
+      char *age = cline_command_get (1);
+      char *endptr = NULL;
+      uint64_t min_age = age && age[0] ? strtoull (age, &endptr, 10) : 0;
+      if (endptr && *endptr) {
+         fprintf (stderr, "Invalid age [%s], must be a number of seconds\n", age);
+         ret = EXIT_FAILURE;
+      } else if (!(frm_gc (frm, min_age))) {
+         fprintf (stderr, "Failed to remove popped frames: %m\n");
+         ret = EXIT_FAILURE;
+      }
+      free (age);
+      goto cleanup;
+   }
+
    if ((strcmp (command, "delete"))==0) {
       char *target = cline_command_get (1);
       if (!target || !target[0]) {
@@ -865,7 +1141,7 @@ int main (int argc, char **argv)
             fprintf (stderr, "No search term specified, returning everything\n");
          }
          free (sterm);
-         if (!(sterm = ds_str_dup (""))) {
+         if (!(sterm = ds_str_dup (glob ? "**" : ""))) {
             fprintf (stderr, "OOM error allocating search term\n");
             ret = EXIT_FAILURE;
             goto cleanup;
@@ -877,6 +1153,12 @@ int main (int argc, char **argv)
       if (invert) {
          flags |= FRM_MATCH_INVERT;
       }
+      if (icase) {
+         flags |= FRM_MATCH_ICASE;
+      }
+      if (glob) {
+         flags |= FRM_MATCH_GLOB;
+      }
 
       if (!from_root) {
          results = frm_match (frm, sterm, flags);
@@ -899,6 +1181,143 @@ int main (int argc, char **argv)
       goto cleanup;
    }
 
+   if ((strcmp (command, "search"))==0) {
+      char *query = NULL;
+      for (size_t i=1; ; i++) {
+         char *word = cline_command_get (i);
+         if (!word || !word[0]) {
+            free (word);
+            break;
+         }
+         bool ok = ds_str_append (&query, query ? " " : "", word, NULL);
+         free (word);
+         if (!ok) {
+            fprintf (stderr, "OOM error allocating search query\n");
+            free (query);
+            ret = EXIT_FAILURE;
+            goto cleanup;
+         }
+      }
+      if (!query) {
+         fprintf (stderr, "No search words specified\n");
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+
+      char *limit = cline_option_get ("limit");
+      char *endptr = NULL;
+      size_t nlimit = limit ? strtoull (limit, &endptr, 10) : 20;
+      if (limit && (!limit[0] || *endptr)) {
+         fprintf (stderr, "Invalid limit [%s], must be a number\n", limit);
+         free (limit);
+         free (query);
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+      free (limit);
+
+      char **results = frm_search (frm, query, nlimit);
+      if (!results) {
+         fprintf (stderr, "Failed to search framedb: %m\n");
+         ret = EXIT_FAILURE;
+      } else {
+         for (size_t i=0; results[i]; i++) {
+            printf ("   %s\n", results[i]);
+         }
+         frm_strarray_free (results);
+      }
+
+      free (query);
+      goto cleanup;
+   }
+
+   if ((strcmp (command, "grep"))==0) {
+      char *regex = cline_command_get (1);
+      if (!regex || !regex[0]) {
+         fprintf (stderr, "No regular expression specified\n");
+         free (regex);
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+
+      char *from = cline_option_get ("from");
+      char **results = frm_grep (frm, from, regex);
+      if (!results) {
+         fprintf (stderr, "Failed to search framedb: %m\n");
+         ret = EXIT_FAILURE;
+      } else {
+         for (size_t i=0; results[i]; i++) {
+            printf ("   %s\n", results[i]);
+         }
+         frm_strarray_free (results);
+      }
+
+      free (from);
+      free (regex);
+      goto cleanup;
+   }
+
+   if ((strcmp (command, "jump"))==0) {
+      char *query = NULL;
+      for (size_t i=1; ; i++) {
+         char *word = cline_command_get (i);
+         if (!word || !word[0]) {
+            free (word);
+            break;
+         }
+         bool ok = ds_str_append (&query, query ? " " : "", word, NULL);
+         free (word);
+         if (!ok) {
+            fprintf (stderr, "OOM error allocating jump query\n");
+            free (query);
+            ret = EXIT_FAILURE;
+            goto cleanup;
+         }
+      }
+      if (!query) {
+         fprintf (stderr, "No frame to jump to specified\n");
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+
+      char *list = cline_option_get ("list");
+      char *limit = cline_option_get ("limit");
+      char *endptr = NULL;
+      size_t nlimit = limit ? strtoull (limit, &endptr, 10) : 20;
+      if (limit && (!limit[0] || *endptr)) {
+         fprintf (stderr, "Invalid limit [%s], must be a number\n", limit);
+         free (limit);
+         free (list);
+         free (query);
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+      free (limit);
+
+      char **results = frm_fuzzy (frm, query, list ? nlimit : 1);
+      if (!results) {
+         fprintf (stderr, "Failed to search framedb: %m\n");
+         ret = EXIT_FAILURE;
+      } else if (list) {
+         for (size_t i=0; results[i]; i++) {
+            printf ("   %s\n", results[i]);
+         }
+      } else if (!results[0]) {
+         fprintf (stderr, "No frame matches [%s]\n", query);
+         ret = EXIT_FAILURE;
+      } else if (!(frm_switch_direct (frm, results[0]))) {
+         fprintf (stderr, "Failed to switch to frame [%s]\n", results[0]);
+         ret = EXIT_FAILURE;
+      } else {
+         status (frm);
+      }
+
+      frm_strarray_free (results);
+      free (list);
+      free (query);
+      goto cleanup;
+   }
+
    if ((strcmp (command, "tree"))==0) {
       frm_node_t *root = frm_node_create (frm);
       if (!root) {
@@ -930,23 +1349,352 @@ int main (int argc, char **argv)
       }
       goto cleanup;
    }
+
+   if ((strcmp (command, "move"))==0) {
+      char *src = cline_command_get (1);
+      char *dst = cline_command_get (2);
+      if (!src || !src[0] || !dst || !dst[0]) {
+         fprintf (stderr, "Must specify a frame to move and its new parent\n");
+         ret = EXIT_FAILURE;
+      } else if (!(frm_move (frm, src, dst))) {
+         fprintf (stderr, "Failed to move [%s] to [%s]: %m\n", src, dst);
+         ret = EXIT_FAILURE;
+      }
+      free (src);
+      free (dst);
+      goto cleanup;
+   }
+
+   if ((strcmp (command, "import-tree"))==0) {
+      ret = import_tree (frm);
+      goto cleanup;
+   }
+
+   if ((strcmp (command, "id"))==0) {
+      char *target = cline_command_get (1);
+      uint64_t id = frm_id_at (frm, target && target[0] ? target : NULL);
+      if (id == 0) {
+         fprintf (stderr, "Failed to get the ID of frame [%s]: %m\n",
+                  target && target[0] ? target : "current");
+         ret = EXIT_FAILURE;
+      } else {
+         printf ("%" PRIu64 "\n", id);
+      }
+      free (target);
+      goto cleanup;
+   }
+
    // The default, with no arguments, is to print out the help message.
    // If we got to this point we have a command but it is unrecognised.
    fprintf (stderr, "Unrecognised command [%s]\n", command);
    ret = EXIT_FAILURE;
 
 cleanup:
+   // The --frame option only lasts for the one command, unless the command
+   // itself moved to another frame. This only matters in a batch.
+   if (oldpath && framepath) {
+      char *current = frm_current (frm);
+      if (current && (strcmp (current, framepath))==0) {
+         free (frm_switch_path (frm, oldpath));
+      }
+      free (current);
+   }
+   free (force);
+   free (from_root);
+   free (invert);
+   free (icase);
+   free (glob);
+   free (quiet);
+   free (frame);
+   free (oldpath);
+   free (framepath);
+   return ret;
+}
+
+// Splits a batch command line into arguments, in place. Arguments are
+// separated by whitespace, which can be quoted with single or double
+// quotes, or escaped with a backslash.
+static char **batch_split (char *line, int *argc)
+{
+   size_t nargs = 1;
+   char **ret = malloc ((strlen (line) / 2 + 3) * sizeof *ret);
+   if (!ret) {
+      fprintf (stderr, "OOM error splitting batch command\n");
+      return NULL;
+   }
+   ret[0] = "frame";
+
+   char *src = line;
+   char *dst = line;
+   while (*src) {
+      while (*src && strchr (" \t\r\n", *src))
+         src++;
+      if (!*src)
+         break;
+
+      ret[nargs++] = dst;
+      char quote = 0;
+      while (*src && (quote || !strchr (" \t\r\n", *src))) {
+         if (quote && *src == quote) {
+            quote = 0;
+            src++;
+         } else if (!quote && (*src == '\'' || *src == '"')) {
+            quote = *src++;
+         } else if (*src == '\\' && quote != '\'' && src[1]) {
+            *dst++ = src[1];
+            src += 2;
+         } else {
+            *dst++ = *src++;
+         }
+      }
+      if (*src) {
+         src++;
+      }
+      *dst++ = 0;
+   }
+
+   ret[nargs] = NULL;
+   *argc = nargs;
+   return ret;
+}
+
+// Runs the commands read from a file (or stdin), one per line (or per
+// NUL-terminated record with --null), against the one framedb handle.
+static int run_batch (frm_t *frm)
+{
+   int ret = EXIT_SUCCESS;
+   char *fname = cline_command_get (1);
+   char *nul = cline_option_get ("null");
+   char *line = NULL;
+   size_t line_len = 0;
+   size_t lineno = 0;
+
+   // Each command replaces the parsed command line, so keep the original
+   // to free at exit.
+   char *options = g_options;
+   char *commands = g_commands;
+   g_options = NULL;
+   g_commands = NULL;
+
+   FILE *inf = stdin;
+   if (fname && fname[0] && (strcmp (fname, "-"))!=0 && !(inf = fopen (fname, "r"))) {
+      fprintf (stderr, "Failed to open batch file [%s]: %m\n", fname);
+      ret = EXIT_FAILURE;
+      goto cleanup;
+   }
+
+   if (!(frm_batch_begin (frm))) {
+      fprintf (stderr, "Failed to start batch: %s\n", frm_lastmsg (frm));
+      ret = EXIT_FAILURE;
+      goto cleanup;
+   }
+
+   while ((getdelim (&line, &line_len, nul ? 0 : '\n', inf)) > 0) {
+      lineno++;
+      char *cmdline = ds_str_dup (line);
+      int argc = 0;
+      char **argv = cmdline ? batch_split (cmdline, &argc) : NULL;
+      if (!argv) {
+         fprintf (stderr, "OOM error reading batch command %zu\n", lineno);
+         free (cmdline);
+         ret = EXIT_FAILURE;
+         break;
+      }
+
+      // Blank lines and comments are skipped.
+      if (argc > 1 && argv[1][0] != '#') {
+         cline_parse_options (argc, argv);
+         cline_parse_commands (argc, argv);
+         char *command = cline_command_get (0);
+         if (!command || (strcmp (command, "batch"))==0
+               || (strcmp (command, "create"))==0) {
+            fprintf (stderr, "Command [%s] cannot be used in a batch\n", command);
+            ret = EXIT_FAILURE;
+         } else {
+            ret = run_command (frm, command);
+         }
+         free (command);
+         free (g_options);
+         free (g_commands);
+         g_options = NULL;
+         g_commands = NULL;
+      }
+      free (argv);
+      free (cmdline);
+
+      if (ret != EXIT_SUCCESS) {
+         fprintf (stderr, "Batch command %zu failed, stopping\n", lineno);
+         break;
+      }
+   }
+
+   if (!(frm_batch_end (frm))) {
+      fprintf (stderr, "Failed to complete batch: %s\n", frm_lastmsg (frm));
+      ret = EXIT_FAILURE;
+   }
+
+cleanup:
+   if (inf && inf != stdin) {
+      fclose (inf);
+   }
+   g_options = options;
+   g_commands = commands;
+   free (line);
+   free (fname);
+   free (nul);
+   return ret;
+}
+
+// The time on clock in microseconds, for --perflog.
+static uint64_t perflog_now (clockid_t clock)
+{
+   struct timespec ts;
+   clock_gettime (clock, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_SUCCESS;
+   uint64_t started = perflog_now (CLOCK_REALTIME);
+   uint64_t elapsed = perflog_now (CLOCK_MONOTONIC);
+   cline_parse_options (argc, argv);
+   cline_parse_commands (argc, argv);
+
+   // TODO: At some point maybe verify that the options specified are applicable
+   // to the command.
+   char *command = cline_command_get (0);
+   char *help = cline_option_get ("help");
+   char *dbpath = cline_option_get ("dbpath");
+   char *quiet = cline_option_get ("quiet");
+   char *frame = cline_option_get ("frame");
+   char *mapped = cline_option_get ("mapped");
+   char *stats = cline_option_get ("stats");
+   char *perflog = cline_option_get ("perflog");
+   char *since = cline_option_get ("since");
+   const char *perflog_env = getenv ("FRAME_PERFLOG");
+   bool logging = false;
+
+   frm_t *frm = NULL;
+
+   if (!command || !command[0]) {
+      free (command);
+      command = ds_str_dup("status");
+      printf ("No command specified (try --help). Defaulting to 'status'\n");
+   }
+
+   if ((strcmp (command, "help")==0) || help) {
+      print_helpmsg ();
+      ret = EXIT_FAILURE;
+      goto cleanup;
+   }
+
+
+   // TODO: have a more nuanced determination of when the copyright
+   // notice should be printed.
+   if (quiet==NULL) {
+      printf ("Frame %s, (© 2023 Lelanthran Manickum)\n", frame_version);
+   }
+
+   if (!dbpath) {
+
+      const char *home = frm_homepath ();
+      if (!home || !home[0]) {
+         fprintf (stderr, "No --dbpath specified and $HOME is not set\n");
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+      dbpath = ds_str_cat (home, FRM_DIR_SEPARATOR, ".framedb", NULL);
+
+      if (!dbpath) {
+         fprintf (stderr, "OOM error copying $HOME\n");
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+   }
+
+   logging = perflog
+      || (perflog_env && perflog_env[0] && (strcmp (perflog_env, "0"))!=0);
+
+   // Check for each command in turn. Could be done in an array, but I don't care
+   // enough to do it.
+   if ((strcmp (command, "create"))==0) {
+      // frm_create() uses the mapped backend when dbpath is a file.
+      int fd = -1;
+      if (mapped && (fd = open (dbpath, O_CREAT | O_EXCL | O_WRONLY, 0600)) < 0) {
+         fprintf (stderr, "Failed to create framedb file [%s]: %m\n", dbpath);
+         ret = EXIT_FAILURE;
+         goto cleanup;
+      }
+      if (fd >= 0)
+         close (fd);
+
+      if ((frm = frm_create (dbpath))) {
+         fprintf (stderr, "Created framedb at [%s]\n", dbpath);
+         ret = EXIT_SUCCESS;
+      } else {
+         fprintf (stderr, "Failed to create framedb at [%s]: %m\n", dbpath);
+         ret = EXIT_FAILURE;
+      }
+      goto cleanup;
+   }
+
+   if ((strcmp (command, "perf-report"))==0) {
+      ret = perf_report (dbpath, since);
+      goto cleanup;
+   }
+
+   // The shell prompt runs 'current' constantly, so answer it from the
+   // current record when possible instead of loading the framedb.
+   if ((strcmp (command, "current"))==0 && !(frame && frame[1]) && !stats) {
+      uint64_t mtime = 0;
+      char *path = frm_current_cached (dbpath, &mtime);
+      if (path) {
+         char strdate[30];
+         ctime_r ((time_t *)&mtime, strdate);
+         char *eol = strchr (strdate, '\n');
+         if (eol)
+            *eol = 0;
+         printf ("%s: %s\n", path, strdate);
+         free (path);
+         goto cleanup;
+      }
+   }
+
+   if (!(frm = frm_init (dbpath))) {
+      fprintf (stderr, "Failed to load db from [%s]\n", dbpath);
+      ret = EXIT_FAILURE;
+      goto cleanup;
+   }
+   if (stats && !(frm_stats_enable (frm, true))) {
+      fprintf (stderr, "Failed to enable stats, continuing without them\n");
+   }
+
+   if ((strcmp (command, "batch"))==0) {
+      ret = run_batch (frm);
+      goto cleanup;
+   }
+
+   ret = run_command (frm, command);
+
+cleanup:
+   if (stats && frm) {
+      print_stats (frm);
+   }
    frm_close (frm);
+   if (logging) {
+      elapsed = perflog_now (CLOCK_MONOTONIC) - elapsed;
+      frm_perflog_append (dbpath, command, started, elapsed, ret);
+   }
    free (command);
    free (help);
-   free (force);
    free (dbpath);
-   free (message);
-   free (from_root);
-   free (invert);
    free (quiet);
    free (frame);
-   free (oldpath); // No need to change back as we are exiting now.
+   free (mapped);
+   free (stats);
+   free (perflog);
+   free (since);
 
    free (g_options);
    free (g_commands);
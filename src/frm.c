@@ -16,21 +16,94 @@
 #include <inttypes.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
 
 #include "frm.h"
+#include "frm_map.h"
+#include "frm_ids.h"
+#include "frm_trigram.h"
+#include "frm_search.h"
+#include "frm_grep.h"
+#include "frm_scan.h"
+#include "frm_fuzzy.h"
+#include "frm_glob.h"
+#include "frm_stats.h"
+#include "frm_trace.h"
+#include "frm_perflog.h"
+#include "frm_io.h"
 #include "ds_str.h"
 #include "ds_array.h"
 
+/* Handles on the same framedb within a process share one of these, so
+ * that they can be used from different threads at the same time. Reads
+ * hold the lock shared and modifications hold it exclusively.
+ *
+ * Between processes the same is done with flock() on lockfd, which is
+ * the lockfile for a directory framedb and the file itself for a mapped
+ * framedb. The first reader in the process takes the shared flock() and
+ * the last one releases it.
+ *
+ * g_dbs_lock only guards the list of these and their refcounts; opening
+ * and closing a framedb can wait on another process, and is done
+ * without it.
+ */
+struct frm_db_t {
+   struct frm_db_t *next;
+   dev_t dev;
+   ino_t ino;
+   size_t refcount;
+   pthread_rwlock_t lock;
+
+   int lockfd;
+   pthread_mutex_t readers_lock;
+   size_t nreaders;
+   bool writing;
+
+   // Only used by the mapped backend. The first handle opens the map
+   // under init_lock, and the last one closes it.
+   pthread_mutex_t init_lock;
+   frm_map_t *map;
+};
+
 struct frm_t {
    char *dbpath;
-   char *olddir;
-   char *lastmsg;
+   struct frm_db_t *db;
+
+   // Directories of the dbpath and of the current frame. All file access
+   // is relative to these; the working directory of the process is never
+   // changed. 'current' is the path of the current frame relative to the
+   // dbpath, eg. "root/a/b".
+   int dbfd;
+   int curfd;
+   char *current;
+
+   // The stable frame IDs (see frm_ids.h).
+   frm_ids_t *ids;
+
+   // While a batch is open (see frm_batch_begin()) the paths of new
+   // frames are collected here and merged into the index in one pass.
+   bool batch;
+   ds_array_t *pending;
+
+   // Frames whose payload changed, for the search index (see
+   // frm_search.h). Written to it by search_flush().
+   frm_search_batch_t *search;
+
+   // Only used by the mapped backend
+   frm_map_t *map;
+   uint32_t node;
+
+   // The counters kept once frm_stats_enable() is called, else NULL.
+   frm_stats_table_t *stats;
 };
 
 #define ERR(x,...)     do {\
@@ -45,7 +118,7 @@ struct frm_t {
       free (prefix); free (msg); free (full);\
    } else {\
       fprintf (stderr, "%s\n", full);\
-      free (x->lastmsg); x->lastmsg = full;\
+      (void)(x); lastmsg_set (full);\
       free (prefix); free (msg);\
    }\
 } while (0)
@@ -54,1198 +127,5500 @@ struct frm_t {
 
 static const char *lockfile = "framedb.lock";
 
+// How long to wait for another process to release the framedb before
+// giving up, and the longest pause between attempts.
+#define LOCK_TIMEOUT_MS       (10000)
+#define LOCK_MAX_BACKOFF_MS   (64)
 
+// The most recently initialised handle, used by the functions that do not
+// take a frm_t.
+static frm_t *g_active = NULL;
 
-/* ********************************************************** */
-/* ********************************************************** */
-/* ********************************************************** */
-
-static bool wrapper_isdir (const struct dirent *de)
-{
-#ifdef PLATFORM_Windows
-
-   struct stat sb;
-   if ((stat (de->d_name, &sb)) != 0) {
-      FRM_ERROR ("Error: Failed to stat [%s]: %m\n", de->d_name);
-      return false;
-   }
-   return S_ISDIR(sb.st_mode);
-
-#else
+static pthread_mutex_t g_dbs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct frm_db_t *g_dbs = NULL;
 
-   return de->d_type == DT_DIR;
+// The last error message is kept per thread, not per handle, so that a
+// handle can be shared between threads.
+static pthread_key_t g_lastmsg_key;
+static pthread_once_t g_lastmsg_once = PTHREAD_ONCE_INIT;
 
-#endif
+static void lastmsg_init (void)
+{
+   pthread_key_create (&g_lastmsg_key, free);
 }
 
-static int wrapper_mkdir (const char *name)
+static void lastmsg_set (char *msg)
 {
-   int result = -1;
-#ifdef PLATFORM_Windows
-
-   result = mkdir (name);
-
-#else
-
-   result = mkdir (name, 0777);
-
-#endif
-
-   if (result!=0) {
-      FRM_ERROR ("Error: failed to create directory [%s]: %m\n", name);
-      return -1;
-   }
-   return 0;
+   pthread_once (&g_lastmsg_once, lastmsg_init);
+   free (pthread_getspecific (g_lastmsg_key));
+   pthread_setspecific (g_lastmsg_key, msg);
 }
 
-
-/* ********************************************************** */
-/* ********************************************************** */
-/* ********************************************************** */
-
-static const char *uint64_string (char dst[47], uint64_t value)
+static const char *lastmsg_get (void)
 {
-   snprintf (dst, 46, "%" PRIu64, value);
-   return dst;
+   pthread_once (&g_lastmsg_once, lastmsg_init);
+   const char *ret = pthread_getspecific (g_lastmsg_key);
+   return ret ? ret : "Success";
 }
 
-static char *pushdir (const char *newdir)
+// Returns the shared state for the framedb at dbpath, creating it if
+// this is the first handle on it. Must be called with g_dbs_lock held.
+static struct frm_db_t *db_acquire (const char *dbpath)
 {
-   char *ret = getcwd (NULL, 0);
-   if (!ret) {
-      FRM_ERROR ("Failed to get the current working directory\n");
+   struct stat sb;
+   if ((stat (dbpath, &sb))!=0) {
+      FRM_ERROR ("Failed to stat [%s]: %m\n", dbpath);
       return NULL;
    }
-   if ((chdir (newdir))!=0) {
-      FRM_ERROR ("Failed to switch to new dir [%s]\n", newdir);
-      free (ret);
-      return NULL;
+
+   struct frm_db_t *ret = g_dbs;
+   while (ret && (ret->dev != sb.st_dev || ret->ino != sb.st_ino))
+      ret = ret->next;
+
+   if (!ret) {
+      if (!(ret = calloc (1, sizeof *ret))) {
+         FRM_ERROR ("OOM error allocating framedb\n");
+         return NULL;
+      }
+      char *lockpath = S_ISDIR (sb.st_mode)
+         ? ds_str_cat (dbpath, FRM_DIR_SEPARATOR, lockfile, NULL)
+         : ds_str_dup (dbpath);
+      if (!lockpath) {
+         FRM_ERROR ("OOM error allocating lockfile name\n");
+         free (ret);
+         return NULL;
+      }
+      FRM_STATS_ADD (opens, 1);
+      ret->lockfd = open (lockpath, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+      if (ret->lockfd < 0) {
+         FRM_ERROR ("Error: Failed to open lockfile [%s]: %m\n", lockpath);
+         free (lockpath);
+         free (ret);
+         return NULL;
+      }
+      free (lockpath);
+      if ((errno = pthread_rwlock_init (&ret->lock, NULL))!=0) {
+         FRM_ERROR ("Failed to create framedb lock: %m\n");
+         close (ret->lockfd);
+         free (ret);
+         return NULL;
+      }
+      pthread_mutex_init (&ret->readers_lock, NULL);
+      pthread_mutex_init (&ret->init_lock, NULL);
+      ret->dev = sb.st_dev;
+      ret->ino = sb.st_ino;
+      ret->next = g_dbs;
+      g_dbs = ret;
    }
 
+   ret->refcount++;
    return ret;
 }
 
-static void popdir (char **olddir)
+// Returns true if this was the last handle on the framedb, which is then
+// no longer in g_dbs and must be closed with db_free(). Must be called
+// with g_dbs_lock held.
+static bool db_release (struct frm_db_t *db)
 {
-   if (!olddir || !*olddir)
-      return;
+   if (--db->refcount > 0)
+      return false;
 
-   if ((chdir (*olddir))!=0) {
-      FRM_ERROR ("Failed to switch back to [%s]\n", *olddir);
-      return;
+   struct frm_db_t **tmp = &g_dbs;
+   while (*tmp && *tmp != db)
+      tmp = &(*tmp)->next;
+   if (*tmp) {
+      *tmp = db->next;
    }
-
-   free (*olddir);
-   *olddir = NULL;
+   return true;
 }
 
-static char *get_path (frm_t *frm) {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = EINVAL;
-      return false;
-   }
-
-   char *pwd = getcwd (NULL, 0);
-   if (!pwd) {
-      ERR (frm, "Error: failed to retrieve path: %m\n");
-      return NULL;
-   }
+// The lockfile is left in place; a lock on it is released when the
+// descriptor is closed, even if the process dies.
+static void db_free (struct frm_db_t *db)
+{
+   frm_map_close (db->map);
+   close (db->lockfd);
+   pthread_mutex_destroy (&db->init_lock);
+   pthread_mutex_destroy (&db->readers_lock);
+   pthread_rwlock_destroy (&db->lock);
+   free (db);
+}
 
-   // Fixup the path, if it is an absolute path.
-   size_t nbytes = strlen (frm->dbpath);
-   if (nbytes > strlen (pwd)) {
-      ERR (frm, "Error: internal corruption detected\n");
-      free (pwd);
-      return NULL;
+// Takes the flock() on fd, backing off between attempts for as long as
+// another process holds it, up to LOCK_TIMEOUT_MS.
+static bool lock_wait (int fd, int operation)
+{
+   long waited = 0;
+   long backoff = 1;
+   while ((flock (fd, operation | LOCK_NB))!=0) {
+      if (errno != EWOULDBLOCK && errno != EINTR) {
+         FRM_ERROR ("Failed to lock framedb: %m\n");
+         return false;
+      }
+      if (waited >= LOCK_TIMEOUT_MS) {
+         FRM_ERROR ("Timed out after %lims waiting for framedb lock\n", waited);
+         errno = EWOULDBLOCK;
+         return false;
+      }
+      struct timespec ts = { 0, backoff * 1000000 };
+      nanosleep (&ts, NULL);
+      waited += backoff;
+      if (backoff < LOCK_MAX_BACKOFF_MS)
+         backoff *= 2;
    }
+   return true;
+}
 
-   char *path = ds_str_dup (&pwd[nbytes + 1]);
-   if (!path) {
-      ERR (frm, "OOM error: allocating path\n");
+// Another process may have grown a mapped framedb while it was unlocked.
+static bool db_refresh (struct frm_db_t *db)
+{
+   if (db->map && !(frm_map_refresh (db->map))) {
+      FRM_ERROR ("Failed to remap framedb: %m\n");
+      return false;
    }
-
-   free (pwd);
-   return path;
+   return true;
 }
 
-
-static char *history_read (const char *dbpath, size_t count)
+// The public functions take one of these locks around the internal
+// implementation, and fail if the lock cannot be had. A null handle is
+// left for the implementation to report. Use the db_rdlock(),
+// db_wrlock() and db_idxlock() macros below, which count the call for frm_stats_get()
+// and trace it for frm_trace_start().
+static bool db_take_rdlock (frm_t *frm)
 {
-   char *pwd = pushdir (dbpath);
-   if (!pwd) {
-      FRM_ERROR ("Failed to switch dir [%s]: %m\n", dbpath);
-      return NULL;
+   if (!frm)
+      return true;
+
+   struct frm_db_t *db = frm->db;
+   int rc;
+   if ((rc = pthread_rwlock_rdlock (&db->lock))!=0) {
+      ERR (frm, "Failed to lock framedb for reading: %s\n", strerror (rc));
+      errno = rc;
+      return false;
    }
 
-   char *history = frm_readfile ("history");
-   if (!history) {
-      // Ignoring empty history. History is allowed to be empty.
-      history = ds_str_dup ("");
-      if (!history) {
-         FRM_ERROR ("OOM error allocating empty history\n");
-         popdir (&pwd);
-         return NULL;
+   bool ret = true;
+   pthread_mutex_lock (&db->readers_lock);
+   if (db->nreaders == 0) {
+      ret = lock_wait (db->lockfd, LOCK_SH);
+      if (ret && !(ret = db_refresh (db))) {
+         flock (db->lockfd, LOCK_UN);
       }
    }
-
-   if (count == (size_t)-1) {
-      popdir (&pwd);
-      return history;
+   if (ret) {
+      db->nreaders++;
    }
+   pthread_mutex_unlock (&db->readers_lock);
 
-   char *tmp = history;
-   for (size_t i=0; i<count; i++) {
-      tmp = strchr (tmp, '\n');
-      if (!tmp)
-         break;
-      tmp++;
+   if (!ret) {
+      ERR (frm, "Failed to lock [%s] for reading: %m\n", frm->dbpath);
+      pthread_rwlock_unlock (&db->lock);
    }
-   if (tmp)
-      *tmp = 0;
-
-   popdir (&pwd);
-   return history;
+   return ret;
 }
 
-static bool history_append (const char *dbpath, const char *path)
+static bool db_take_wrlock (frm_t *frm)
 {
-   if (!dbpath || !path) {
-      FRM_ERROR ("Error: cannot append history with null paths\n");
-      return false;
-   }
-
-   char *pwd = pushdir (dbpath);
-   if (!pwd) {
-      FRM_ERROR ("Failed to push current working directory\n");
+   if (!frm)
+      return true;
+
+   struct frm_db_t *db = frm->db;
+   int rc;
+   if ((rc = pthread_rwlock_wrlock (&db->lock))!=0) {
+      ERR (frm, "Failed to lock framedb for writing: %s\n", strerror (rc));
+      errno = rc;
       return false;
    }
 
-   char *history = history_read (dbpath, (size_t)-1);
-   if (!history) {
-      popdir (&pwd);
+   if (!(lock_wait (db->lockfd, LOCK_EX))) {
+      ERR (frm, "Failed to lock [%s] for writing: %m\n", frm->dbpath);
+      pthread_rwlock_unlock (&db->lock);
       return false;
    }
-
-   if (!(frm_writefile ("history",
-               path, "\n",
-               history,
-               NULL))) {
-      FRM_ERROR ("Failed to write file [%s/history]: %m\n", dbpath);
-      free (history);
-      popdir (&pwd);
+   if (!(db_refresh (db))) {
+      ERR (frm, "Failed to lock [%s] for writing: %m\n", frm->dbpath);
+      flock (db->lockfd, LOCK_UN);
+      pthread_rwlock_unlock (&db->lock);
       return false;
    }
 
-   free (history);
-   popdir (&pwd);
+   db->writing = true;
    return true;
 }
 
-static char *history_find (const char *dbpath, const char *prefix)
+// Releases a lock taken by one of the db_take_*() functions.
+static void db_drop_lock (frm_t *frm)
 {
-   if (!dbpath || !prefix) {
-      FRM_ERROR ("Error: cannot search history with null paths\n");
-      return NULL;
-   }
-
-   char *pwd = pushdir (dbpath);
-   if (!pwd) {
-      FRM_ERROR ("Failed to push current working directory\n");
-      return NULL;
-   }
-
-   char *history = history_read (dbpath, (size_t)-1);
-   if (!history) {
-      popdir (&pwd);
-      return NULL;
-   }
-
-   char *sptr = NULL, *tok = NULL;
-   tok = strtok_r (history, "\n", &sptr);
-   do {
-      char *found = strstr (tok, prefix);
-      if (found == tok) {
-         // If we can switch to it, it exists and we return it,
-         // otherwise we just keep on trying.
-         char *olddir = pushdir (tok);
-         if (olddir) {
-            popdir (&olddir);
-            popdir (&pwd);
-            char *ret = ds_str_dup (tok);
-            free (history);
-            return ret;
-         }
+   struct frm_db_t *db = frm->db;
+   if (db->writing) {
+      db->writing = false;
+      flock (db->lockfd, LOCK_UN);
+   } else {
+      pthread_mutex_lock (&db->readers_lock);
+      if (--db->nreaders == 0) {
+         flock (db->lockfd, LOCK_UN);
       }
-   } while ((tok = strtok_r (NULL, "\n", &sptr)));
-
-   free (history);
-   popdir (&pwd);
-   return NULL;
+      pthread_mutex_unlock (&db->readers_lock);
+   }
+   pthread_rwlock_unlock (&db->lock);
 }
 
-static bool index_add (const char *dbpath, const char *entry)
+// Reads the index. Index entries deferred by an open batch on this
+// handle are merged into the index before it is read, which can only
+// be done under the write lock, so in that case the read lock is
+// traded for the write lock.
+static bool db_take_idxlock (frm_t *frm)
 {
-   if (!dbpath || !entry || !entry[0]) {
-      FRM_ERROR ("Error: null parameters passed to index_add: [%s:%s]\n",
-            dbpath, entry);
+   if (!(db_take_rdlock (frm)))
       return false;
-   }
-
-   char *olddir = pushdir (dbpath);
-   if (!olddir) {
-      FRM_ERROR ("Error: failed to switch directory [%s]: %m\n", dbpath);
-      return false;
-   }
+   if (!frm || (!ds_array_length (frm->pending) && !frm->search))
+      return true;
 
-   char *index = frm_readfile ("index");
-   if (!index) {
-      FRM_ERROR ("Error: failed to read index: %m\n");
-      popdir (&olddir);
-      return false;
-   }
+   db_drop_lock (frm);
+   return db_take_wrlock (frm);
+}
 
-   if (!(frm_writefile("index", entry, "\n", index, NULL))) {
-      FRM_ERROR ("Error: failed to write index: %m\n");
-      popdir (&olddir);
-      free (index);
-      return false;
-   }
+// Trades the read lock of a call for the write lock, for a call that
+// finds that it has to write after all. Anything read under the read
+// lock may have changed by the time this returns. On failure the call
+// is over, as if db_unlock() had been called.
+static bool db_upgrade (frm_t *frm)
+{
+   db_drop_lock (frm);
+   if (db_take_wrlock (frm))
+      return true;
 
-   free (index);
-   popdir (&olddir);
-   return true;
+   frm_stats_end ();
+   frm_trace_pop ();
+   return false;
 }
 
-static bool index_remove (const char *dbpath, const char *entry)
+static void db_unlock (frm_t *frm)
 {
-   bool error = true;
-   char *olddir = NULL;
-   FILE *infile = NULL, *outfile = NULL;
-   char *line = NULL;
-   static const size_t line_len = 1024 * 1024;
-   char fname[] = "frame-tmpfile-XXXXXX";
-   int fd = -1;
-   size_t nitems = 0;
-
-   if (!dbpath || !entry || !entry[0]) {
-      FRM_ERROR ("Error: null parameters passed to index_add: [%s:%s]\n",
-            dbpath, entry);
-      goto cleanup;
-   }
+   if (!frm)
+      return;
 
-   olddir = pushdir (dbpath);
-   if (!olddir) {
-      FRM_ERROR ("Error: failed to switch directory [%s]: %m\n", dbpath);
-      goto cleanup;
+   struct frm_db_t *db = frm->db;
+   // The space given up by the writes is reclaimed once there is
+   // enough of it, while nobody else can be using the file.
+   if (db->writing && db->map && !(frm_map_compact (db->map, false))) {
+      ERR (frm, "Warning: failed to compact [%s]\n", frm->dbpath);
    }
+   db_drop_lock (frm);
+   frm_stats_end ();
+   frm_trace_pop ();
+}
 
-   fd = mkstemp (fname);
-   if (fd < 0) {
-      FRM_ERROR ("Failed to create temporary file: %m\n");
-      return NULL;
+// The calls are counted from the point at which they ask for the lock,
+// so that the time spent waiting for it is counted too.
+static bool db_lock (frm_t *frm, const char *fname,
+                     bool (*take) (frm_t *))
+{
+   if (frm) {
+      frm_trace_push (fname);
+      frm_stats_begin (frm->stats, fname);
    }
-   close (fd);
-
-   if (!(infile = fopen ("index", "r"))) {
-      FRM_ERROR ("Error: failed to open index for reading: %m\n");
-      goto cleanup;
+   bool ret = take (frm);
+   if (!ret && frm) {
+      frm_stats_end ();
+      frm_trace_pop ();
    }
+   return ret;
+}
 
-   if (!(outfile = fopen (fname, "w"))) {
-      FRM_ERROR ("Error: failed to open [%s] for writing: %m\n", fname);
-      goto cleanup;
-   }
+#define db_rdlock(frm)     db_lock (frm, __func__, db_take_rdlock)
+#define db_wrlock(frm)     db_lock (frm, __func__, db_take_wrlock)
+#define db_idxlock(frm)    db_lock (frm, __func__, db_take_idxlock)
 
-   if (!(line = malloc (line_len))) {
-      FRM_ERROR ("OOM error allocating line for index\n");
-      goto cleanup;
-   }
 
-   while ((fgets (line, line_len - 1, infile))) {
-      char *tmp = strchr (line, '\n');
-      if (tmp)
-         *tmp = 0;
-      if ((strcmp (line, entry))==0) {
-         nitems++;
-         continue;
-      }
-      fprintf (outfile, "%s\n", line);
-   }
 
-   if (!nitems) {
-      FRM_ERROR ("Warning: [%s] not found in index\n", entry);
-   }
+/* ********************************************************** */
+/* ********************************************************** */
+/* ********************************************************** */
 
-   fclose (infile); infile = NULL;
-   fclose (outfile); outfile = NULL;
+static bool wrapper_isdir (int dirfd, const struct dirent *de)
+{
+   if (de->d_type != DT_UNKNOWN)
+      return de->d_type == DT_DIR;
 
-   if ((rename (fname, "index"))!=0) {
-      FRM_ERROR ("Error: failed to update index from [%s]: %m\n", fname);
-      goto cleanup;
+   // Not all filesystems fill in d_type.
+   struct stat sb;
+   if ((fstatat (dirfd, de->d_name, &sb, 0)) != 0) {
+      FRM_ERROR ("Error: Failed to stat [%s]: %m\n", de->d_name);
+      return false;
    }
+   return S_ISDIR(sb.st_mode);
+}
 
-   error = false;
+static int wrapper_mkdir (int dirfd, const char *name)
+{
+   int result = mkdirat (dirfd, name, 0777);
 
-cleanup:
-   if (fd >= 0) {
-      close (fd);
+   if (result!=0) {
+      FRM_ERROR ("Error: failed to create directory [%s]: %m\n", name);
+      return -1;
    }
+   return 0;
+}
 
-   remove (fname); // Don't care about the return value for this.
-
-   if (infile)
-      fclose (infile);
 
-   if (outfile)
-      fclose (outfile);
+/* ********************************************************** */
+/* ********************************************************** */
+/* ********************************************************** */
 
-   popdir (&olddir);
-   free (line);
+static const char *uint64_string (char dst[47], uint64_t value)
+{
+   snprintf (dst, 46, "%" PRIu64, value);
+   return dst;
+}
 
-   return !error;
+static int opendir_at (int dirfd, const char *path)
+{
+   FRM_STATS_ADD (opens, 1);
+   return openat (dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 }
 
-static bool isslash (int c)
+static bool isdir_at (int dirfd, const char *path)
 {
-   return c=='/' || c=='\\';
+   struct stat sb;
+   return (fstatat (dirfd, path, &sb, 0))==0 && S_ISDIR (sb.st_mode);
 }
 
-static char *strrslash (const char *s)
+static FILE *fopen_at (int dirfd, const char *name, const char *mode)
 {
-   char *ret = strrchr (s, '/');
-   if (ret)
-      return ret;
+   int flags = mode[0] == 'r' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+   FRM_STATS_ADD (opens, 1);
+   int fd = openat (dirfd, name, flags | O_CLOEXEC, 0644);
+   if (fd < 0)
+      return NULL;
 
-   return strrchr (s, '\\');
+   FILE *ret = fdopen (fd, mode);
+   if (!ret) {
+      close (fd);
+   }
+   return ret;
 }
 
-
-static bool removedir (const char *target)
+static char *readfile_at (int dirfd, const char *name)
 {
-   if (!target || !target[0] || isslash(target[0]) || target[0] == '.') {
-      FRM_ERROR ("Error: invalid directory removal name [%s]\n", target);
-      errno = EINVAL;
-      return false;
+   FRM_TRACE_SPAN ("readfile_at");
+
+   FILE *inf = fopen_at (dirfd, name, "r");
+   if (!inf) {
+      // Commenting this out - caller must print out the fname of the failing
+      // frm_readfile(fname) call.
+      // FRM_ERROR ("Failed to open [%s] for reading: %m\n", name);
+      return NULL;
    }
 
-   char *olddir = pushdir (target);
-   if (!olddir) {
-      FRM_ERROR ("Error: failed to switch to [%s]: %m\n", target);
-      return false;
+   if ((fseek (inf, 0, SEEK_END))!=0) {
+      FRM_ERROR ("Failed to seek EOF [%s]: %m\n", name);
+      fclose (inf);
+      return NULL;
    }
 
-   DIR *dirp = opendir (".");
-   if (!dirp) {
-      FRM_ERROR ("Error: failed to read directory [%s]: %m\n", target);
-      return false;
+   long len = ftell (inf);
+   if (len < 0) {
+      FRM_ERROR ("Failed to determine file length [%s]: %m\n", name);
+      fclose (inf);
+      return NULL;
    }
-   struct dirent *de;
-   while ((de = readdir (dirp))) {
-      if (de->d_name[0] == '.')
-         continue;
-      if (wrapper_isdir (de)) {
-         removedir (de->d_name);
-      } else {
-         if ((unlink (de->d_name)) != 0) {
-            FRM_ERROR ("Error: unlink [%s]: %m\n", de->d_name);
-            closedir (dirp);
-            popdir (&olddir);
-            return false;
-         }
-      }
+
+   if ((fseek (inf, 0, SEEK_SET))!=0) {
+      FRM_ERROR ("Failed to reset file position [%s]: %m\n", name);
+      fclose (inf);
+      return NULL;
    }
-   closedir (dirp);
-   popdir (&olddir);
 
-   if ((rmdir (target)) != 0) {
-      FRM_ERROR ("Error: Failed to rmdir() [%s]: %m\n", target);
-      return false;
+   char *ret = malloc (len + 2);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating file contents [%s]\n", name);
+      fclose (inf);
+      return NULL;
    }
 
-   return true;
-}
+   size_t nbytes = fread (ret, 1, len+1, inf);
+   FRM_STATS_ADD (bytes_read, nbytes);
+   if (!feof (inf) || ferror (inf)) {
+      FRM_ERROR ("Read [%zu of %li] bytes in [%s]: %m\n", nbytes, len, name);
+      fclose (inf);
+      free (ret);
+      return NULL;
+   }
+
+   fclose (inf);
+   ret[len] = 0;
+   return ret;
+}
+
+static bool vwritefile_at (int dirfd, const char *name, const char *data,
+                           va_list ap)
+{
+   FILE *outf = fopen_at (dirfd, name, "w");
+   if (!outf) {
+      FRM_ERROR ("Failed to open [%s] for writing: %m\n", name);
+      return false;
+   }
+
+   while (data) {
+      fprintf (outf, "%s", data);
+      FRM_STATS_ADD (bytes_written, strlen (data));
+      data = va_arg (ap, const char *);
+   }
+   fclose (outf);
+   return true;
+}
+
+static bool writefile_at (int dirfd, const char *name, const char *data, ...)
+{
+   va_list ap;
+
+   va_start (ap, data);
+   bool ret = vwritefile_at (dirfd, name, data, ap);
+   va_end (ap);
+
+   return ret;
+}
+
+// Joins the frame path rel onto the frame path base and removes any '.'
+// and '..' components, eg. ("root/a", "../b") gives "root/b". If base is
+// NULL then rel is an absolute frame path. Returns NULL with errno set to
+// EINVAL if the result is not root or a frame below root.
+static char *path_resolve (const char *base, const char *rel)
+{
+   char *joined = base ? ds_str_cat (base, "/", rel, NULL) : ds_str_dup (rel);
+   char *ret = joined ? malloc (strlen (joined) + 1) : NULL;
+   if (!ret) {
+      FRM_ERROR ("OOM error resolving path [%s]\n", rel);
+      free (joined);
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   size_t len = 0;
+   bool escaped = false;
+   char *sptr = NULL;
+   for (char *tok = strtok_r (joined, "/\\", &sptr); tok;
+         tok = strtok_r (NULL, "/\\", &sptr)) {
+      if ((strcmp (tok, "."))==0)
+         continue;
+      if ((strcmp (tok, ".."))==0) {
+         escaped = escaped || len == 0;
+         while (len && ret[len - 1] != '/')
+            len--;
+         if (len)
+            len--;
+         continue;
+      }
+      if (len)
+         ret[len++] = '/';
+      size_t toklen = strlen (tok);
+      memcpy (&ret[len], tok, toklen);
+      len += toklen;
+   }
+   ret[len] = 0;
+   free (joined);
+
+   if (escaped || (strncmp (ret, "root", 4))!=0 || (ret[4] && ret[4] != '/')) {
+      free (ret);
+      errno = EINVAL;
+      return NULL;
+   }
+
+   return ret;
+}
+
+static char *get_path (frm_t *frm) {
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
+   }
+
+   char *path = ds_str_dup (frm->current);
+   if (!path) {
+      ERR (frm, "OOM error: allocating path\n");
+   }
+
+   return path;
+}
+
+// Makes path, relative to the dbpath, the current frame without
+// recording it in the history.
+static bool set_current (frm_t *frm, const char *path)
+{
+   int fd = opendir_at (frm->dbfd, path);
+   char *tmp = ds_str_dup (path);
+   if (fd < 0 || !tmp) {
+      ERR (frm, "Failed to switch to frame [%s]: %m\n", path);
+      if (fd >= 0) {
+         close (fd);
+      }
+      free (tmp);
+      return false;
+   }
+
+   if (frm->curfd >= 0) {
+      close (frm->curfd);
+   }
+   free (frm->current);
+   frm->curfd = fd;
+   frm->current = tmp;
+   return true;
+}
+
+
+// Resolves 'from' as a frame path relative to the current frame and,
+// failing that, as an absolute frame path. Returns NULL if neither
+// exists.
+static char *resolve_frame (frm_t *frm, const char *from)
+{
+   if (!from || !from[0]) {
+      from = ".";
+   }
+
+   char *ret = path_resolve (frm->current, from);
+   if (ret && (isdir_at (frm->dbfd, ret)))
+      return ret;
+   free (ret);
+
+   ret = path_resolve (NULL, from);
+   if (ret && (isdir_at (frm->dbfd, ret)))
+      return ret;
+   free (ret);
+
+   ERR (frm, "Neither [%s] nor [%s/%s] could be used\n", from, frm->dbpath, from);
+   errno = ENOENT;
+   return NULL;
+}
+
+// Opens the directory of the frame at fpath, as resolved by
+// resolve_frame(), and optionally returns its path. A null or empty
+// fpath is the current frame.
+static int frame_open (frm_t *frm, const char *fpath, char **path)
+{
+   char *tmp = fpath && fpath[0]
+      ? resolve_frame (frm, fpath)
+      : ds_str_dup (frm->current);
+   int ret = tmp ? opendir_at (frm->dbfd, tmp) : -1;
+   if (ret < 0) {
+      ERR (frm, "Failed to open frame [%s]: %m\n", fpath ? fpath : "");
+      free (tmp);
+      return -1;
+   }
+
+   if (path) {
+      *path = tmp;
+   } else {
+      free (tmp);
+   }
+   return ret;
+}
+
+
+/* The history is an append-only log of records, oldest record first. Each
+ * record is a fixed header, the nul-terminated path, the ID of the frame
+ * (absent in records written by earlier versions) and then the total
+ * length of the record. The trailing length lets the log be walked
+ * backwards from EOF, so reading the most recent N entries only touches
+ * the last N records, and appending a record is a single write().
+ *
+ * Fields are stored in host byte order; a framedb is not portable between
+ * machines of differing endianness.
+ */
+#define HISTORY_FNAME         "history.log"
+#define CURRENT_FNAME         "current"
+#define HISTORY_LEGACY_FNAME  "history"
+#define HISTORY_MAGIC         (0x484d5246)
+#define HISTORY_CHUNK         (64 * 1024)
+
+struct history_rec_t {
+   uint32_t magic;
+   uint32_t pathlen;    // Includes the nul terminator
+   uint64_t seq;
+   uint64_t timestamp;
+};
+
+struct history_iter_t {
+   int fd;
+   size_t chunk;
+   off_t pos;           // Offset of the end of the next record to return
+   off_t buf_start;     // Offset in the file of buf[0]
+   char *buf;
+};
+
+static void history_iter_close (struct history_iter_t *it)
+{
+   if (it->fd >= 0) {
+      close (it->fd);
+   }
+   free (it->buf);
+   memset (it, 0, sizeof *it);
+   it->fd = -1;
+}
+
+static bool history_iter_open (struct history_iter_t *it, int dirfd, const char *fname,
+                               size_t chunk)
+{
+   memset (it, 0, sizeof *it);
+   it->chunk = chunk;
+   FRM_STATS_ADD (opens, 1);
+   if ((it->fd = openat (dirfd, fname, O_RDONLY | O_BINARY | O_CLOEXEC)) < 0) {
+      return false;
+   }
+
+   struct stat sb;
+   if ((fstat (it->fd, &sb))!=0) {
+      FRM_ERROR ("Failed to stat [%s]: %m\n", fname);
+      history_iter_close (it);
+      return false;
+   }
+
+   it->pos = sb.st_size;
+   it->buf_start = sb.st_size;
+   return true;
+}
+
+// Buffer at least 'want' bytes ending at the iterator position.
+static bool history_iter_fill (struct history_iter_t *it, size_t want)
+{
+   if (want < it->chunk)
+      want = it->chunk;
+   if ((off_t)want > it->pos)
+      want = it->pos;
+
+   char *tmp = realloc (it->buf, want);
+   if (!tmp) {
+      FRM_ERROR ("OOM error allocating history buffer\n");
+      return false;
+   }
+   it->buf = tmp;
+   it->buf_start = it->pos - want;
+
+   if (!(frm_io_read_full (it->fd, it->buf, want, it->buf_start))) {
+      FRM_ERROR ("Failed to read history: %m\n");
+      return false;
+   }
+   return true;
+}
+
+// Returns 1 when a record is returned, 0 when the start of the log is
+// reached and -1 on error. The returned path remains valid until the next
+// call. The id is FRM_ID_NONE if the record has none.
+static int history_iter_prev (struct history_iter_t *it,
+                              struct history_rec_t *hdr, const char **path,
+                              uint64_t *id)
+{
+   uint32_t reclen;
+   static const size_t minlen = sizeof *hdr + 1 + sizeof reclen;
+
+   if (it->pos == 0)
+      return 0;
+
+   if (it->pos < (off_t)minlen) {
+      FRM_ERROR ("Error: truncated history record at offset 0\n");
+      return -1;
+   }
+
+   if (it->pos - (off_t)sizeof reclen < it->buf_start) {
+      if (!(history_iter_fill (it, minlen)))
+         return -1;
+   }
+   memcpy (&reclen, &it->buf[it->pos - sizeof reclen - it->buf_start],
+           sizeof reclen);
+
+   if (reclen < minlen || (off_t)reclen > it->pos) {
+      FRM_ERROR ("Error: corrupt history record length %u at offset %lli\n",
+               reclen, (long long)it->pos);
+      return -1;
+   }
+
+   off_t start = it->pos - reclen;
+   if (start < it->buf_start) {
+      if (!(history_iter_fill (it, reclen)))
+         return -1;
+   }
+
+   const char *rec = &it->buf[start - it->buf_start];
+   memcpy (hdr, rec, sizeof *hdr);
+   size_t idlen = reclen - (sizeof *hdr + hdr->pathlen + sizeof reclen);
+   if (hdr->magic != HISTORY_MAGIC
+         || sizeof *hdr + hdr->pathlen + sizeof reclen > reclen
+         || (idlen != 0 && idlen != sizeof *id)
+         || rec[sizeof *hdr + hdr->pathlen - 1] != 0) {
+      FRM_ERROR ("Error: corrupt history record at offset %lli\n",
+               (long long)start);
+      return -1;
+   }
+
+   *id = FRM_ID_NONE;
+   if (idlen) {
+      memcpy (id, &rec[sizeof *hdr + hdr->pathlen], sizeof *id);
+   }
+   *path = &rec[sizeof *hdr];
+   it->pos = start;
+   return 1;
+}
+
+static char *history_record (size_t *reclen, uint64_t seq, uint64_t timestamp,
+                             const char *path, uint64_t id)
+{
+   struct history_rec_t hdr = {
+      HISTORY_MAGIC, strlen (path) + 1, seq, timestamp,
+   };
+   size_t idlen = id == FRM_ID_NONE ? 0 : sizeof id;
+   uint32_t len = sizeof hdr + hdr.pathlen + idlen + sizeof len;
+
+   char *ret = malloc (len);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating history record\n");
+      return NULL;
+   }
+
+   memcpy (ret, &hdr, sizeof hdr);
+   memcpy (&ret[sizeof hdr], path, hdr.pathlen);
+   memcpy (&ret[sizeof hdr + hdr.pathlen], &id, idlen);
+   memcpy (&ret[sizeof hdr + hdr.pathlen + idlen], &len, sizeof len);
+   *reclen = len;
+   return ret;
+}
+
+// Convert the newline-delimited history file used by earlier versions
+// into the record log.
+static bool history_migrate (int dbfd)
+{
+   bool error = true;
+   char *legacy = NULL;
+   int fd = -1;
+   static const char *tmpname = HISTORY_FNAME ".tmp";
+   struct stat sb;
+
+   if ((faccessat (dbfd, HISTORY_FNAME, F_OK, 0))==0)
+      return true;
+
+   if ((fstatat (dbfd, HISTORY_LEGACY_FNAME, &sb, 0))!=0)
+      return true;
+
+   if (!(legacy = readfile_at (dbfd, HISTORY_LEGACY_FNAME))) {
+      FRM_ERROR ("Failed to read [%s]: %m\n", HISTORY_LEGACY_FNAME);
+      goto cleanup;
+   }
+
+   FRM_STATS_ADD (opens, 1);
+   fd = openat (dbfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC,
+                0644);
+   if (fd < 0) {
+      FRM_ERROR ("Failed to create [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   // The legacy file has the most recent entry first, the log has it last.
+   size_t legacy_len = strlen (legacy);
+   size_t nlines = 0;
+   for (size_t i=0; i<legacy_len; i++) {
+      if (legacy[i] == '\n') {
+         legacy[i] = 0;
+         nlines++;
+      }
+   }
+   if (legacy_len && legacy[legacy_len - 1] != 0)
+      nlines++;
+
+   char **lines = calloc (nlines + 1, sizeof *lines);
+   if (!lines) {
+      FRM_ERROR ("OOM error allocating history lines\n");
+      goto cleanup;
+   }
+   char *line = legacy;
+   for (size_t i=0; i<nlines; i++) {
+      lines[i] = line;
+      line += strlen (line) + 1;
+   }
+
+   uint64_t seq = 0;
+   for (size_t i=nlines; i>0; i--) {
+      if (!lines[i-1][0])
+         continue;
+      size_t reclen = 0;
+      char *rec = history_record (&reclen, ++seq, sb.st_mtime, lines[i-1],
+                                  FRM_ID_NONE);
+      if (!rec || !(frm_io_write_full (fd, rec, reclen))) {
+         FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+         free (rec);
+         free (lines);
+         goto cleanup;
+      }
+      free (rec);
+   }
+   free (lines);
+
+   if ((close (fd))!=0) {
+      fd = -1;
+      FRM_ERROR ("Failed to close [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+   fd = -1;
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (dbfd, tmpname, dbfd, HISTORY_FNAME))!=0) {
+      FRM_ERROR ("Failed to rename [%s] to [%s]: %m\n", tmpname, HISTORY_FNAME);
+      goto cleanup;
+   }
+
+   if ((unlinkat (dbfd, HISTORY_LEGACY_FNAME, 0))!=0) {
+      FRM_ERROR ("Warning: failed to remove [%s]: %m\n", HISTORY_LEGACY_FNAME);
+   }
+
+   error = false;
+
+cleanup:
+   if (fd >= 0) {
+      close (fd);
+      unlinkat (dbfd, tmpname, 0);
+   }
+   free (legacy);
+   return !error;
+}
+
+// Returns the path at which the frame visited in a history record is
+// now, which is the recorded path unless the frame has since been renamed
+// or moved. Returns NULL if the frame no longer exists. The IDs are
+// resolved from the table in memory, which the caller must have read
+// with frm_ids_refresh(), so this does no I/O.
+static char *history_resolve (frm_ids_t *ids, const char *path, uint64_t id)
+{
+   if (id == FRM_ID_NONE || !ids)
+      return ds_str_dup (path);
+
+   return frm_ids_path_cached (ids, id);
+}
+
+static char *history_read (int dbfd, frm_ids_t *ids, size_t count)
+{
+   FRM_TRACE_SPAN ("history_read");
+
+   char *history = NULL;
+   size_t len = 0, cap = 0;
+   struct history_iter_t it;
+   struct history_rec_t hdr;
+   const char *recpath = NULL;
+   uint64_t id;
+   int rc = 0;
+
+   // Without the ID table the frames are listed under their recorded paths.
+   if (ids && !(frm_ids_refresh (ids))) {
+      FRM_ERROR ("Warning: failed to read the frame IDs, history may be stale\n");
+      ids = NULL;
+   }
+
+   // Ignoring missing history. History is allowed to be empty.
+   if ((history_iter_open (&it, dbfd, HISTORY_FNAME, HISTORY_CHUNK))) {
+      for (size_t i=0; i<count && (rc = history_iter_prev (&it, &hdr, &recpath, &id)) > 0; i++) {
+         // Frames that no longer exist are listed under their old path.
+         char *resolved = history_resolve (ids, recpath, id);
+         const char *path = resolved ? resolved : recpath;
+         size_t newlen = len + strlen (path) + 1;
+         if (newlen + 1 > cap) {
+            size_t newcap = (newlen + 1) * 2;
+            char *tmp = realloc (history, newcap);
+            if (!tmp) {
+               FRM_ERROR ("OOM error allocating history\n");
+               free (resolved);
+               rc = -1;
+               break;
+            }
+            history = tmp;
+            cap = newcap;
+         }
+         memcpy (&history[len], path, newlen - len - 1);
+         history[newlen - 1] = '\n';
+         history[newlen] = 0;
+         len = newlen;
+         free (resolved);
+      }
+      history_iter_close (&it);
+   }
+
+   if (rc < 0) {
+      free (history);
+      return NULL;
+   }
+
+   if (!history && !(history = ds_str_dup (""))) {
+      FRM_ERROR ("OOM error allocating empty history\n");
+   }
+
+   return history;
+}
+
+// The frame visited last, for frm_init(). Every command starts here, so
+// the ID table is only read if the frame is no longer at its recorded
+// path. Returns "" if there is no history.
+static char *history_last (int dbfd, frm_ids_t *ids)
+{
+   FRM_TRACE_SPAN ("history_last");
+
+   char *ret = NULL;
+   struct history_iter_t it;
+   struct history_rec_t hdr;
+   const char *path = NULL;
+   uint64_t id;
+
+   if ((history_iter_open (&it, dbfd, HISTORY_FNAME, 256))) {
+      if ((history_iter_prev (&it, &hdr, &path, &id)) > 0) {
+         if (id != FRM_ID_NONE && ids && !(isdir_at (dbfd, path))) {
+            ret = frm_ids_path (ids, id);
+         }
+         if (!ret) {
+            ret = ds_str_dup (path);
+         }
+      }
+      history_iter_close (&it);
+   }
+
+   if (!ret && !(ret = ds_str_dup (""))) {
+      FRM_ERROR ("OOM error allocating empty history\n");
+   }
+   return ret;
+}
+
+static bool current_record_write (int dbfd, const char *path);
+
+// Records the current frame of frm for frm_current_cached(). A batch
+// only records the frame that it ends on.
+static void current_record_update (frm_t *frm)
+{
+   if (!frm->batch && !(current_record_write (frm->dbfd, frm->current))) {
+      ERR (frm, "Warning: failed to update [%s]\n", CURRENT_FNAME);
+   }
+}
+
+static bool history_append (int dbfd, const char *path, uint64_t id)
+{
+   FRM_TRACE_SPAN ("history_append");
+
+   if (!path) {
+      FRM_ERROR ("Error: cannot append history with null paths\n");
+      return false;
+   }
+
+   uint64_t seq = 1;
+   struct history_iter_t it;
+   if ((history_iter_open (&it, dbfd, HISTORY_FNAME, 256))) {
+      struct history_rec_t hdr;
+      const char *last = NULL;
+      uint64_t last_id;
+      if ((history_iter_prev (&it, &hdr, &last, &last_id)) > 0) {
+         seq = hdr.seq + 1;
+      }
+      history_iter_close (&it);
+   }
+
+   size_t reclen = 0;
+   char *rec = history_record (&reclen, seq, (uint64_t)time (NULL), path, id);
+   if (!rec) {
+      return false;
+   }
+
+   bool ret = true;
+   FRM_STATS_ADD (opens, 1);
+   int fd = openat (dbfd, HISTORY_FNAME,
+                    O_WRONLY | O_APPEND | O_CREAT | O_BINARY | O_CLOEXEC, 0644);
+   if (fd < 0 || !(frm_io_write_full (fd, rec, reclen))) {
+      FRM_ERROR ("Failed to write file [%s]: %m\n", HISTORY_FNAME);
+      ret = false;
+   }
+
+   if (fd >= 0) {
+      close (fd);
+   }
+   free (rec);
+   return ret;
+}
+
+static char *history_find (int dbfd, frm_ids_t *ids, const char *prefix)
+{
+   FRM_TRACE_SPAN ("history_find");
+
+   if (!prefix) {
+      FRM_ERROR ("Error: cannot search history with null paths\n");
+      return NULL;
+   }
+
+   struct history_iter_t it;
+   if (!(history_iter_open (&it, dbfd, HISTORY_FNAME, HISTORY_CHUNK))) {
+      return NULL;
+   }
+
+   char *ret = NULL;
+   size_t prefix_len = strlen (prefix);
+   struct history_rec_t hdr;
+   const char *path = NULL;
+   uint64_t id;
+   bool have_ids = false;
+   while (!ret && (history_iter_prev (&it, &hdr, &path, &id)) > 0) {
+      // If it matches and still exists we return it, otherwise we just
+      // keep on trying.
+      if ((strncmp (path, prefix, prefix_len))==0 && isdir_at (dbfd, path)) {
+         ret = ds_str_dup (path);
+         break;
+      }
+
+      // A frame that is no longer at its recorded path may have been
+      // renamed or moved to a path that matches. The ID table is only
+      // read once, and only if it is needed.
+      if (id == FRM_ID_NONE || !ids)
+         continue;
+      if (!have_ids && !(have_ids = frm_ids_refresh (ids))) {
+         ids = NULL;
+         continue;
+      }
+      char *resolved = frm_ids_path_cached (ids, id);
+      if (resolved && (strcmp (resolved, path))!=0
+            && (strncmp (resolved, prefix, prefix_len))==0
+            && isdir_at (dbfd, resolved)) {
+         ret = resolved;
+         resolved = NULL;
+      }
+      free (resolved);
+   }
+
+   history_iter_close (&it);
+   return ret;
+}
+
+static uint64_t frame_id_at (int dbfd, const char *path);
+
+// Makes path the current frame and records it in the history.
+static bool visit (frm_t *frm, const char *path)
+{
+   if (!(set_current (frm, path))) {
+      return false;
+   }
+
+   if (!(history_append (frm->dbfd, frm->current,
+                         frame_id_at (frm->dbfd, frm->current)))) {
+      ERR (frm, "Failed to set the working frame to [%s]\n", frm->current);
+      return false;
+   }
+
+   current_record_update (frm);
+   return true;
+}
+
+/* The index holds the path of every frame below root, one per line, kept
+ * in strcmp() order. Readers map the file and binary search it, so that a
+ * prefix query only touches the pages holding the matching slice. Writers
+ * splice the change into a copy of the file and rename it over the
+ * original.
+ */
+#define INDEX_FNAME           "index.sorted"
+#define INDEX_LEGACY_FNAME    "index"
+
+struct index_map_t {
+   int fd;
+   const char *data;
+   size_t len;
+};
+
+static void index_map_close (struct index_map_t *im)
+{
+   if (im->data) {
+      munmap ((void *)im->data, im->len);
+   }
+   if (im->fd >= 0) {
+      close (im->fd);
+   }
+   im->fd = -1;
+   im->data = NULL;
+   im->len = 0;
+}
+
+static bool index_map_open (struct index_map_t *im, int dbfd)
+{
+   FRM_TRACE_SPAN ("index_map_open");
+
+   im->fd = -1;
+   im->data = NULL;
+   im->len = 0;
+
+   FRM_STATS_ADD (opens, 1);
+   if ((im->fd = openat (dbfd, INDEX_FNAME, O_RDONLY | O_BINARY | O_CLOEXEC)) < 0) {
+      FRM_ERROR ("Error: failed to open index for reading: %m\n");
+      return false;
+   }
+
+   struct stat sb;
+   if ((fstat (im->fd, &sb))!=0) {
+      FRM_ERROR ("Error: failed to stat index: %m\n");
+      index_map_close (im);
+      return false;
+   }
+
+   // An empty file cannot be mapped, but is a valid (empty) index.
+   if (sb.st_size == 0)
+      return true;
+
+   void *data = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, im->fd, 0);
+   if (data == MAP_FAILED) {
+      FRM_ERROR ("Error: failed to map index: %m\n");
+      index_map_close (im);
+      return false;
+   }
+
+   im->data = data;
+   im->len = sb.st_size;
+   return true;
+}
+
+static size_t index_eol (const struct index_map_t *im, size_t offset)
+{
+   const char *eol = memchr (&im->data[offset], '\n', im->len - offset);
+   return eol ? (size_t)(eol - im->data) : im->len;
+}
+
+// Compares the line starting at offset with key, as strcmp() would.
+static int index_linecmp (const struct index_map_t *im, size_t offset,
+                          const char *key)
+{
+   for (size_t i=offset; i<im->len && im->data[i]!='\n'; i++, key++) {
+      if (!*key)
+         return 1;
+      int diff = (unsigned char)im->data[i] - (unsigned char)*key;
+      if (diff)
+         return diff;
+   }
+   return *key ? -1 : 0;
+}
+
+static bool index_hasprefix (const struct index_map_t *im, size_t offset,
+                             const char *prefix, size_t prefix_len)
+{
+   return im->len - offset >= prefix_len
+      && (memcmp (&im->data[offset], prefix, prefix_len))==0
+      && !memchr (&im->data[offset], '\n', prefix_len);
+}
+
+// Returns the offset of the first line that is not less than key.
+static size_t index_lower_bound (const struct index_map_t *im, const char *key)
+{
+   size_t lo = 0, hi = im->len;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      while (mid > lo && im->data[mid - 1] != '\n')
+         mid--;
+      if ((index_linecmp (im, mid, key)) < 0) {
+         lo = index_eol (im, mid) + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo < im->len ? lo : im->len;
+}
+
+// Creates a new file with a unique name in dirfd, like mkstemp().
+static int tmpfile_at (int dirfd, char fname[64])
+{
+   static unsigned int counter = 0;
+   int fd = -1;
+   for (size_t i=0; i<100 && fd < 0; i++) {
+      snprintf (fname, 64, "frame-tmpfile-%li-%u",
+                (long)getpid (), __sync_fetch_and_add (&counter, 1));
+      FRM_STATS_ADD (opens, 1);
+      fd = openat (dirfd, fname,
+                   O_WRONLY | O_CREAT | O_EXCL | O_BINARY | O_CLOEXEC, 0644);
+      if (fd < 0 && errno != EEXIST)
+         break;
+   }
+   return fd;
+}
+
+// Atomically replaces the file fname in dirfd with data, so that readers
+// see either the old or the new contents, even after a crash.
+static bool replacefile_at (int dirfd, const char *fname, const char *data)
+{
+   char tmpname[64];
+   int fd = tmpfile_at (dirfd, tmpname);
+   bool ret = fd >= 0 && frm_io_write_full (fd, data, strlen (data));
+   if (fd >= 0 && (close (fd))!=0) {
+      ret = false;
+   }
+   FRM_STATS_ADD (renames, ret);
+   ret = ret && (renameat (dirfd, tmpname, dirfd, fname))==0;
+   if (!ret) {
+      FRM_ERROR ("Failed to write [%s]: %m\n", fname);
+      if (fd >= 0) {
+         unlinkat (dirfd, tmpname, 0);
+      }
+   }
+   return ret;
+}
+
+// Writes a new index consisting of the current index with the byte
+// ranges [cuts[0], cuts[1]), [cuts[2], cuts[3]) ... removed, in a single
+// pass. The ranges must be in order and not overlap. If insert is not
+// NULL it is written, followed by a newline, in place of the first range.
+static bool index_rewrite (const struct index_map_t *im, int dbfd,
+                           const size_t *cuts, size_t ncuts, const char *insert)
+{
+   char fname[64];
+   int fd = tmpfile_at (dbfd, fname);
+   if (fd < 0) {
+      FRM_ERROR ("Failed to create temporary file: %m\n");
+      return false;
+   }
+
+   bool error = true;
+   size_t offset = 0;
+   for (size_t i=0; i<ncuts; i+=2) {
+      if (!(frm_io_write_full (fd, &im->data[offset], cuts[i] - offset))) {
+         goto cleanup;
+      }
+      if (i == 0 && insert && (!(frm_io_write_full (fd, insert, strlen (insert)))
+                               || !(frm_io_write_full (fd, "\n", 1)))) {
+         goto cleanup;
+      }
+      offset = cuts[i + 1];
+   }
+   if (!(frm_io_write_full (fd, &im->data[offset], im->len - offset))) {
+      goto cleanup;
+   }
+
+   if ((close (fd))!=0) {
+      fd = -1;
+      goto cleanup;
+   }
+   fd = -1;
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (dbfd, fname, dbfd, INDEX_FNAME))!=0) {
+      FRM_ERROR ("Error: failed to update index from [%s]: %m\n", fname);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   if (error) {
+      FRM_ERROR ("Error: failed to write index [%s]: %m\n", fname);
+      unlinkat (dbfd, fname, 0);
+   }
+   if (fd >= 0) {
+      close (fd);
+   }
+   return !error;
+}
+
+// Writes a new index with the bytes [from, to) replaced by the string
+// 'insert' followed by a newline.
+static bool index_splice (const struct index_map_t *im, int dbfd,
+                          size_t from, size_t to, const char *insert)
+{
+   size_t cuts[] = { from, to };
+   return index_rewrite (im, dbfd, cuts, 2, insert);
+}
+
+static bool index_add (int dbfd, const char *entry)
+{
+   if (!entry || !entry[0]) {
+      FRM_ERROR ("Error: null parameters passed to index_add: [%s]\n", entry);
+      return false;
+   }
+
+   struct index_map_t im;
+   if (!(index_map_open (&im, dbfd))) {
+      FRM_ERROR ("Error: failed to read index: %m\n");
+      return false;
+   }
+
+   bool ret = true;
+   size_t offset = index_lower_bound (&im, entry);
+   if (offset == im.len || (index_linecmp (&im, offset, entry))!=0) {
+      char *added = (char *)entry;
+      ret = index_splice (&im, dbfd, offset, offset, entry)
+         && frm_trigram_update (dbfd, im.fd, INDEX_FNAME, NULL, &added, 1);
+   }
+
+   index_map_close (&im);
+   return ret;
+}
+
+// Removes entry and every entry below it from the index in a single
+// pass. Entries below 'a' all start with 'a/' and so are contiguous in
+// the sorted index, but need not follow 'a' directly (eg. 'a b' sorts
+// between them).
+static bool index_remove_tree (int dbfd, const char *entry)
+{
+   if (!entry || !entry[0]) {
+      FRM_ERROR ("Error: null parameters passed to index_remove_tree: [%s]\n",
+            entry);
+      return false;
+   }
+
+   char *prefix = ds_str_cat (entry, "/", NULL);
+   if (!prefix) {
+      FRM_ERROR ("OOM error allocating index prefix\n");
+      return false;
+   }
+
+   struct index_map_t im;
+   if (!(index_map_open (&im, dbfd))) {
+      free (prefix);
+      return false;
+   }
+
+   size_t cuts[4];
+   size_t ncuts = 0;
+   size_t offset = index_lower_bound (&im, entry);
+   if (offset < im.len && (index_linecmp (&im, offset, entry))==0) {
+      size_t end = index_eol (&im, offset);
+      cuts[ncuts++] = offset;
+      cuts[ncuts++] = end < im.len ? end + 1 : end;
+   }
+
+   size_t prefix_len = strlen (prefix);
+   size_t start = index_lower_bound (&im, prefix);
+   size_t end = start;
+   while (end < im.len && index_hasprefix (&im, end, prefix, prefix_len)) {
+      end = index_eol (&im, end);
+      end = end < im.len ? end + 1 : end;
+   }
+   if (end > start) {
+      cuts[ncuts++] = start;
+      cuts[ncuts++] = end;
+   }
+
+   bool ret = true;
+   if (ncuts == 0) {
+      FRM_ERROR ("Warning: [%s] not found in index\n", entry);
+   } else {
+      ret = index_rewrite (&im, dbfd, cuts, ncuts, NULL)
+         && frm_trigram_update (dbfd, im.fd, INDEX_FNAME, entry, NULL, 0);
+   }
+
+   index_map_close (&im);
+   free (prefix);
+   return ret;
+}
+
+static bool isslash (int c)
+{
+   return c=='/' || c=='\\';
+}
+
+static char *strrslash (const char *s)
+{
+   char *ret = strrchr (s, '/');
+   if (ret)
+      return ret;
+
+   return strrchr (s, '\\');
+}
+
+
+// Removes the directory target, in the directory pfd, and everything in
+// it. The tree is walked iteratively with a stack of open directories and
+// everything is removed with unlinkat(), so deep trees need neither
+// recursion nor a change of working directory.
+static bool removedir (int pfd, const char *target)
+{
+   if (!target || !target[0] || isslash(target[0]) || target[0] == '.') {
+      FRM_ERROR ("Error: invalid directory removal name [%s]\n", target);
+      errno = EINVAL;
+      return false;
+   }
+
+   struct removedir_t {
+      DIR *dirp;
+      char *name;
+   } *stack = NULL;
+   size_t depth = 0;
+   size_t nalloced = 0;
+   bool error = true;
+   const char *name = target;
+   int fd = pfd;
+
+   while (name || depth) {
+      if (name) {
+         if (depth == nalloced) {
+            size_t newlen = nalloced ? nalloced * 2 : 16;
+            struct removedir_t *tmp = realloc (stack, newlen * sizeof *stack);
+            if (!tmp) {
+               FRM_ERROR ("OOM error removing directory [%s]\n", name);
+               goto cleanup;
+            }
+            stack = tmp;
+            nalloced = newlen;
+         }
+
+         int dfd = opendir_at (fd, name);
+         stack[depth].dirp = dfd >= 0 ? fdopendir (dfd) : NULL;
+         stack[depth].name = ds_str_dup (name);
+         if (!stack[depth].dirp || !stack[depth].name) {
+            FRM_ERROR ("Error: failed to read directory [%s]: %m\n", name);
+            if (stack[depth].dirp) {
+               closedir (stack[depth].dirp);
+            } else if (dfd >= 0) {
+               close (dfd);
+            }
+            free (stack[depth].name);
+            goto cleanup;
+         }
+         fd = dirfd (stack[depth++].dirp);
+         name = NULL;
+      }
+
+      errno = 0;
+      FRM_STATS_ADD (readdirs, 1);
+      struct dirent *de = readdir (stack[depth - 1].dirp);
+      if (de) {
+         if ((strcmp (de->d_name, "."))==0 || (strcmp (de->d_name, ".."))==0)
+            continue;
+         if (wrapper_isdir (fd, de)) {
+            name = de->d_name;
+         } else if ((unlinkat (fd, de->d_name, 0)) != 0) {
+            FRM_ERROR ("Error: unlink [%s]: %m\n", de->d_name);
+            goto cleanup;
+         }
+         continue;
+      }
+
+      if (errno) {
+         FRM_ERROR ("Error: failed to read directory [%s]: %m\n",
+                    stack[depth - 1].name);
+         goto cleanup;
+      }
+
+      // Directory is now empty: remove it from its parent.
+      depth--;
+      closedir (stack[depth].dirp);
+      fd = depth ? dirfd (stack[depth - 1].dirp) : pfd;
+      if ((unlinkat (fd, stack[depth].name, AT_REMOVEDIR)) != 0) {
+         FRM_ERROR ("Error: Failed to rmdir() [%s]: %m\n", stack[depth].name);
+         free (stack[depth].name);
+         goto cleanup;
+      }
+      free (stack[depth].name);
+   }
+
+   error = false;
+
+cleanup:
+   while (depth--) {
+      closedir (stack[depth].dirp);
+      free (stack[depth].name);
+   }
+   free (stack);
+   return !error;
+}
+
+static int sort_entries (const void *lhs, const void *rhs)
+{
+   const char * const *lstr = lhs;
+   const char * const *rstr = rhs;
+
+   return strcmp (*lstr, *rstr);
+}
+
+// Convert the unsorted index used by earlier versions into the sorted
+// index.
+static bool index_migrate (int dbfd)
+{
+   if ((faccessat (dbfd, INDEX_FNAME, F_OK, 0))==0)
+      return true;
+
+   char *legacy = readfile_at (dbfd, INDEX_LEGACY_FNAME);
+   if (!legacy) {
+      // No index at all: start with an empty one.
+      return writefile_at (dbfd, INDEX_FNAME, "", NULL);
+   }
+
+   size_t nlines = 0;
+   for (char *tmp = legacy; *tmp; tmp++) {
+      if (*tmp == '\n')
+         nlines++;
+   }
+
+   char **lines = calloc (nlines + 2, sizeof *lines);
+   if (!lines) {
+      FRM_ERROR ("OOM error allocating index lines\n");
+      free (legacy);
+      return false;
+   }
+
+   nlines = 0;
+   char *sptr = NULL;
+   for (char *tok = strtok_r (legacy, "\n", &sptr); tok;
+         tok = strtok_r (NULL, "\n", &sptr)) {
+      lines[nlines++] = tok;
+   }
+   qsort (lines, nlines, sizeof *lines, sort_entries);
+
+   bool error = true;
+   FILE *outf = NULL;
+   static const char *tmpname = INDEX_FNAME ".tmp";
+   if (!(outf = fopen_at (dbfd, tmpname, "w"))) {
+      FRM_ERROR ("Error: failed to open [%s] for writing: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<nlines; i++) {
+      if (i && (strcmp (lines[i], lines[i-1]))==0)
+         continue;
+      if ((fprintf (outf, "%s\n", lines[i])) < 0) {
+         FRM_ERROR ("Error: failed to write [%s]: %m\n", tmpname);
+         goto cleanup;
+      }
+      FRM_STATS_ADD (bytes_written, strlen (lines[i]) + 1);
+   }
+
+   if ((fclose (outf))!=0) {
+      outf = NULL;
+      FRM_ERROR ("Error: failed to write [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+   outf = NULL;
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (dbfd, tmpname, dbfd, INDEX_FNAME))!=0) {
+      FRM_ERROR ("Error: failed to rename [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   if ((unlinkat (dbfd, INDEX_LEGACY_FNAME, 0))!=0) {
+      FRM_ERROR ("Warning: failed to remove [%s]: %m\n", INDEX_LEGACY_FNAME);
+   }
+
+   error = false;
+
+cleanup:
+   if (outf) {
+      fclose (outf);
+      unlinkat (dbfd, tmpname, 0);
+   }
+   free (lines);
+   free (legacy);
+   return !error;
+}
+
+// Adds all the entries to the index, and removes the entry 'remove' and
+// every entry below it if remove is not NULL, in a single pass. The
+// entries are sorted in place.
+static bool index_update (int dbfd, const char *remove, char **entries,
+                          size_t nentries)
+{
+   FRM_TRACE_SPAN ("index_update");
+
+   qsort (entries, nentries, sizeof *entries, sort_entries);
+
+   size_t remove_len = remove ? strlen (remove) : 0;
+
+   struct index_map_t im;
+   if (!(index_map_open (&im, dbfd))) {
+      FRM_ERROR ("Error: failed to read index: %m\n");
+      return false;
+   }
+
+   bool error = true;
+   char fname[64];
+   FILE *outf = NULL;
+   int fd = tmpfile_at (dbfd, fname);
+   if (fd < 0 || !(outf = fdopen (fd, "w"))) {
+      FRM_ERROR ("Failed to create temporary file: %m\n");
+      if (fd >= 0) {
+         close (fd);
+         unlinkat (dbfd, fname, 0);
+      }
+      index_map_close (&im);
+      return false;
+   }
+
+   size_t offset = 0;
+   size_t i = 0;
+   while (offset < im.len || i < nentries) {
+      if (i > 0 && i < nentries && (strcmp (entries[i], entries[i - 1]))==0) {
+         i++;
+         continue;
+      }
+
+      if (remove && offset < im.len
+            && index_hasprefix (&im, offset, remove, remove_len)
+            && (offset + remove_len == im.len
+                || im.data[offset + remove_len] == '\n'
+                || im.data[offset + remove_len] == '/')) {
+         size_t eol = index_eol (&im, offset);
+         offset = eol < im.len ? eol + 1 : eol;
+         continue;
+      }
+
+      int cmp = offset == im.len ? 1
+              : i == nentries ? -1
+              : index_linecmp (&im, offset, entries[i]);
+      if (cmp <= 0) {
+         size_t eol = index_eol (&im, offset);
+         if ((fwrite (&im.data[offset], 1, eol - offset, outf)) != eol - offset
+               || (fputc ('\n', outf)) == EOF) {
+            FRM_ERROR ("Error: failed to write index [%s]: %m\n", fname);
+            goto cleanup;
+         }
+         FRM_STATS_ADD (bytes_written, eol - offset + 1);
+         offset = eol < im.len ? eol + 1 : eol;
+         if (cmp == 0) {
+            i++;
+         }
+      } else {
+         if ((fprintf (outf, "%s\n", entries[i])) < 0) {
+            FRM_ERROR ("Error: failed to write index [%s]: %m\n", fname);
+            goto cleanup;
+         }
+         FRM_STATS_ADD (bytes_written, strlen (entries[i]) + 1);
+         i++;
+      }
+   }
+
+   if ((fclose (outf))!=0) {
+      outf = NULL;
+      FRM_ERROR ("Error: failed to write index [%s]: %m\n", fname);
+      goto cleanup;
+   }
+   outf = NULL;
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (dbfd, fname, dbfd, INDEX_FNAME))!=0) {
+      FRM_ERROR ("Error: failed to update index from [%s]: %m\n", fname);
+      goto cleanup;
+   }
+
+   error = !(frm_trigram_update (dbfd, im.fd, INDEX_FNAME, remove,
+                                 entries, nentries));
+
+cleanup:
+   if (outf) {
+      fclose (outf);
+   }
+   if (error) {
+      unlinkat (dbfd, fname, 0);
+   }
+   index_map_close (&im);
+   return !error;
+}
+
+// Adds all the entries to the index in a single pass, however many there
+// are. The entries are sorted in place.
+static bool index_merge (int dbfd, char **entries, size_t nentries)
+{
+   return index_update (dbfd, NULL, entries, nentries);
+}
+
+static bool index_match_add (ds_array_t *lines, const char *line, size_t len)
+{
+   char *tmp = malloc (len + 1);
+   if (!tmp || !(ds_array_ins_tail (lines, tmp))) {
+      FRM_ERROR ("OOM error allocating index entry\n");
+      free (tmp);
+      return false;
+   }
+   memcpy (tmp, line, len);
+   tmp[len] = 0;
+   return true;
+}
+
+// How a search term is matched against a path (see FRM_MATCH_ICASE and
+// FRM_MATCH_GLOB).
+struct matcher_t {
+   bool invert;
+   frm_glob_t *glob;
+
+   // A substring is searched for with find. Terms with letters outside
+   // ASCII are folded, and so is the text that they are searched for in.
+   frm_scan_fn_t *find;
+   const char *sterm;
+   size_t slen;
+   char *folded;
+   char *buf;
+   size_t bufcap;
+};
+
+static void matcher_fini (struct matcher_t *m)
+{
+   frm_glob_del (m->glob);
+   free (m->folded);
+   free (m->buf);
+   memset (m, 0, sizeof *m);
+}
+
+static bool matcher_init (struct matcher_t *m, const char *sterm, uint32_t flags)
+{
+   memset (m, 0, sizeof *m);
+   m->invert = flags & FRM_MATCH_INVERT;
+   m->find = frm_scan_find;
+   m->sterm = sterm;
+   m->slen = strlen (sterm);
+
+   if (flags & FRM_MATCH_GLOB)
+      return (m->glob = frm_glob_new (sterm, flags & FRM_MATCH_ICASE)) != NULL;
+
+   if (!(flags & FRM_MATCH_ICASE))
+      return true;
+
+   if ((frm_scan_ascii (sterm, m->slen))) {
+      m->find = frm_scan_find_icase;
+      return true;
+   }
+
+   if (!(m->folded = malloc (m->slen + 1))) {
+      FRM_ERROR ("OOM error allocating search term\n");
+      return false;
+   }
+   frm_scan_fold (m->folded, sterm, m->slen);
+   m->folded[m->slen] = 0;
+   m->sterm = m->folded;
+   return true;
+}
+
+// Sets found if the len bytes at line match, or if they do not and the
+// match is inverted.
+static bool matcher_test (struct matcher_t *m, const char *line, size_t len,
+                          bool *found)
+{
+   if (m->glob) {
+      *found = frm_glob_match (m->glob, line, len) != m->invert;
+      return true;
+   }
+
+   if (m->folded) {
+      if (len > m->bufcap) {
+         char *tmp = realloc (m->buf, len);
+         if (!tmp) {
+            FRM_ERROR ("OOM error allocating %zu bytes of folded text\n", len);
+            return false;
+         }
+         m->buf = tmp;
+         m->bufcap = len;
+      }
+      frm_scan_fold (m->buf, line, len);
+      line = m->buf;
+   }
+
+   *found = (m->find (line, len, m->sterm, m->slen) != NULL) != m->invert;
+   return true;
+}
+
+// Adds a copy of each of the lines in the len bytes at src that satisfy
+// m to lines, in order. A substring is searched for in one pass over all
+// the lines, rather than one line at a time; a glob is run on each line
+// in place.
+static bool matcher_lines (struct matcher_t *m, const char *src, size_t len,
+                           ds_array_t *lines)
+{
+   bool error = true;
+   char *folded = NULL;
+
+   if (m->glob) {
+      for (size_t line=0; line<len; ) {
+         const char *nl = memchr (&src[line], '\n', len - line);
+         size_t eol = nl ? (size_t)(nl - src) : len;
+         bool found;
+         if (!(matcher_test (m, &src[line], eol - line, &found))
+               || (found && !(index_match_add (lines, &src[line], eol - line))))
+            goto cleanup;
+         line = eol + 1;
+      }
+      error = false;
+      goto cleanup;
+   }
+
+   // Offsets in the folded copy are the same as in the source.
+   const char *hay = src;
+   if (m->folded && len) {
+      if (!(folded = malloc (len))) {
+         FRM_ERROR ("OOM error allocating %zu bytes of folded text\n", len);
+         goto cleanup;
+      }
+      frm_scan_fold (folded, src, len);
+      hay = folded;
+   }
+
+   // A line cannot contain a newline, so such a term matches nothing.
+   bool never = memchr (m->sterm, '\n', m->slen) != NULL;
+
+   for (size_t line=0; line<len; ) {
+      const char *hit = never ? NULL : m->find (&hay[line], len - line,
+                                                m->sterm, m->slen);
+      size_t hitline = hit ? (size_t)(hit - hay) : len;
+      while (hitline > line && src[hitline - 1] != '\n') {
+         hitline--;
+      }
+
+      // None of the lines before the one with the hit match.
+      while (m->invert && line < hitline) {
+         const char *nl = memchr (&src[line], '\n', len - line);
+         size_t eol = nl ? (size_t)(nl - src) : len;
+         if (!(index_match_add (lines, &src[line], eol - line)))
+            goto cleanup;
+         line = eol + 1;
+      }
+      if (!hit)
+         break;
+
+      const char *nl = memchr (&src[hitline], '\n', len - hitline);
+      size_t eol = nl ? (size_t)(nl - src) : len;
+      if (!m->invert && !(index_match_add (lines, &src[hitline], eol - hitline)))
+         goto cleanup;
+      line = eol + 1;
+   }
+
+   error = false;
+
+cleanup:
+   free (folded);
+   return !error;
+}
+
+// Returns every index entry that starts with prefix and satisfies m, in
+// sorted order.
+static char **index_match (int dbfd, const char *prefix, struct matcher_t *m)
+{
+   FRM_TRACE_SPAN ("index_match");
+
+   bool error = true;
+   char **ret = NULL;
+   ds_array_t *lines = ds_array_new ();
+   struct index_map_t im = { -1, NULL, 0 };
+
+   if (!lines) {
+      FRM_ERROR ("OOM error allocating storage for index\n");
+      goto cleanup;
+   }
+
+   if (!(index_map_open (&im, dbfd))) {
+      goto cleanup;
+   }
+
+   size_t prefix_len = strlen (prefix);
+   size_t start = index_lower_bound (&im, prefix);
+   size_t end = start;
+   while (end < im.len && index_hasprefix (&im, end, prefix, prefix_len)) {
+      end = index_eol (&im, end) + 1;
+   }
+   if (end > im.len) {
+      end = im.len;
+   }
+
+   if (!(matcher_lines (m, &im.data[start], end - start, lines))) {
+      goto cleanup;
+   }
+
+   size_t nlines = ds_array_length (lines);
+   if (!(ret = calloc (nlines + 1, sizeof *ret))) {
+      FRM_ERROR ("OOM error allocating storage for index\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<nlines; i++) {
+      ret[i] = ds_array_get (lines, i);
+   }
+   ds_array_del (lines);
+   lines = NULL;
+
+   error = false;
+
+cleanup:
+   index_map_close (&im);
+   for (size_t i=0; i<ds_array_length (lines); i++) {
+      free (ds_array_get (lines, i));
+   }
+   ds_array_del (lines);
+   if (error) {
+      free (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+// Returns every index entry that starts with prefix, in sorted order.
+static char **index_range (int dbfd, const char *prefix)
+{
+   FRM_TRACE_SPAN ("index_range");
+
+   bool error = true;
+
+   char **lines = NULL;
+   size_t nlines = 0;
+
+   struct index_map_t im = { -1, NULL, 0 };
+
+   if (!prefix) {
+      FRM_ERROR ("Error: prefix is null\n");
+      goto cleanup;
+   }
+
+   if (!(index_map_open (&im, dbfd))) {
+      goto cleanup;
+   }
+
+   size_t prefix_len = strlen (prefix);
+   size_t start = index_lower_bound (&im, prefix);
+   size_t end = start;
+   while (end < im.len && index_hasprefix (&im, end, prefix, prefix_len)) {
+      end = index_eol (&im, end) + 1;
+      nlines++;
+   }
+
+   if (!(lines = calloc (nlines + 1, sizeof *lines))) {
+      FRM_ERROR ("OOM error allocating storage for index\n");
+      goto cleanup;
+   }
+
+   size_t offset = start;
+   for (size_t i=0; i<nlines; i++) {
+      size_t eol = index_eol (&im, offset);
+      if (!(lines[i] = malloc (eol - offset + 1))) {
+         FRM_ERROR ("OOM error allocating index entry\n");
+         goto cleanup;
+      }
+      memcpy (lines[i], &im.data[offset], eol - offset);
+      lines[i][eol - offset] = 0;
+      offset = eol + 1;
+   }
+
+   error = false;
+
+cleanup:
+   index_map_close (&im);
+
+   if (error) {
+      frm_strarray_free (lines);
+      lines = NULL;
+   }
+
+   return lines;
+}
+
+// Returns true if at least one index entry starts with prefix.
+static bool index_exists (int dbfd, const char *prefix)
+{
+   struct index_map_t im;
+   bool ret = false;
+   if ((index_map_open (&im, dbfd))) {
+      size_t offset = index_lower_bound (&im, prefix);
+      ret = offset < im.len
+         && index_hasprefix (&im, offset, prefix, strlen (prefix));
+      index_map_close (&im);
+   }
+
+   return ret;
+}
+
+// Replaces the entry oldpath, and every entry below it, with the same
+// entries under newpath, in a single pass.
+static bool index_rename_tree (int dbfd, const char *oldpath, const char *newpath)
+{
+   char *prefix = ds_str_cat (oldpath, "/", NULL);
+   char **entries = prefix ? index_range (dbfd, prefix) : NULL;
+   free (prefix);
+   if (!entries) {
+      FRM_ERROR ("Error: failed to read index entries under [%s]\n", oldpath);
+      return false;
+   }
+
+   size_t nentries = 0;
+   while (entries[nentries])
+      nentries++;
+
+   char **renamed = calloc (nentries + 2, sizeof *renamed);
+   bool ret = renamed && (renamed[nentries] = ds_str_dup (newpath));
+   size_t oldlen = strlen (oldpath);
+   for (size_t i=0; ret && i<nentries; i++) {
+      ret = (renamed[i] = ds_str_cat (newpath, &entries[i][oldlen], NULL)) != NULL;
+   }
+   frm_strarray_free (entries);
+
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating renamed index entries\n");
+   } else {
+      ret = index_update (dbfd, oldpath, renamed, nentries + 1);
+   }
+
+   if (renamed) {
+      for (size_t i=0; i<nentries + 1; i++) {
+         free (renamed[i]);
+      }
+   }
+   free (renamed);
+   return ret;
+}
+
+static bool internal_frame_create (int dirfd, const char *name, const char *msg)
+{
+   if ((wrapper_mkdir (dirfd, name))!=0) {
+      FRM_ERROR ("Failed to create directory [%s]: %m\n", name);
+      return false;
+   }
+
+   int fd = opendir_at (dirfd, name);
+   if (fd < 0) {
+      FRM_ERROR ("Failed to open directory [%s]: %m\n", name);
+      return false;
+   }
+
+   char tstring[47];
+   if (!(writefile_at (fd, "info",
+               "mtime: ", uint64_string(tstring, (uint64_t)time(NULL)), "\n",
+               NULL))) {
+      FRM_ERROR ("Failed to create info file [%s/info]: %m\n", name);
+      close (fd);
+      return false;
+   }
+
+   if (!(writefile_at (fd, "payload", msg, "\n", NULL))) {
+      FRM_ERROR ("Failed to create payload file [%s/payload]: %m\n", name);
+      close (fd);
+      return false;
+   }
+
+   if (!(writefile_at (fd, "index", "", NULL))) {
+      FRM_ERROR ("Warning: failed to update index\n");
+   }
+
+   close (fd);
+   return true;
+}
+
+/* ********************************************************** */
+/* ********************************************************** */
+/* ********************************************************** */
+
+static void frm_free (frm_t *frm)
+{
+   if (!frm) {
+      errno = ENOENT;
+      return;
+   }
+
+   if (frm->curfd >= 0) {
+      close (frm->curfd);
+   }
+   if (frm->dbfd >= 0) {
+      close (frm->dbfd);
+   }
+   while (ds_array_length (frm->pending)) {
+      free (ds_array_rm_tail (frm->pending));
+   }
+   ds_array_del (frm->pending);
+   frm_search_batch_del (frm->search);
+   frm_ids_close (frm->ids);
+   frm_stats_table_del (frm->stats);
+   free (frm->dbpath);
+   free (frm->current);
+   free (frm);
+}
+
+static frm_t *frm_alloc (const char *dbpath)
+{
+   frm_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating frm_t");
+      return NULL;
+   }
+
+   ret->dbfd = -1;
+   ret->curfd = -1;
+   ret->dbpath = ds_str_dup (dbpath);
+
+   if (!ret->dbpath) {
+      FRM_ERROR ("Failed to allocate fields [dbpath:%p]\n", ret->dbpath);
+      frm_free (ret);
+      return NULL;
+   }
+
+   size_t dbpath_len = strlen (dbpath);
+   if (isslash (ret->dbpath[dbpath_len-1]))
+      ret->dbpath[dbpath_len-1] = 0;
+
+   return ret;
+}
+
+/* ********************************************************** */
+/* ********************************************************** */
+/* ********************************************************** */
+
+/* The mapped backend. When dbpath is a single file instead of a
+ * directory the public functions below dispatch to these, which
+ * implement the same semantics on top of frm_map.
+ */
+
+static bool map_visit (frm_t *frm, uint32_t node)
+{
+   if (!(frm_map_visit (frm->map, node))) {
+      ERR (frm, "Failed to record history for node %u: %m\n", node);
+      return false;
+   }
+   frm->node = node;
+   return true;
+}
+
+// Resolves path relative to the current frame, and failing that, as an
+// absolute path.
+static uint32_t map_resolve (frm_t *frm, const char *path)
+{
+   if (!path || !path[0])
+      return frm->node;
+
+   uint32_t ret = frm_map_lookup (frm->map, frm->node, path);
+   if (ret == FRM_MAP_NONE) {
+      ret = frm_map_lookup (frm->map, FRM_MAP_NONE, path);
+   }
+   return ret;
+}
+
+static char *map_history (frm_t *frm, size_t count)
+{
+   size_t max = count;
+   if (max > 4096)
+      max = 4096;
+
+   uint32_t *nodes = calloc (max + 1, sizeof *nodes);
+   if (!nodes) {
+      ERR (frm, "OOM error allocating history\n");
+      return NULL;
+   }
+
+   char *ret = ds_str_dup ("");
+   size_t nnodes = frm_map_history (frm->map, nodes, max);
+   for (size_t i=0; ret && i<nnodes; i++) {
+      char *path = frm_map_path (frm->map, nodes[i]);
+      if (!path || !(ds_str_append (&ret, path, "\n", NULL))) {
+         ERR (frm, "OOM error allocating history\n");
+         free (ret);
+         ret = NULL;
+      }
+      free (path);
+   }
+
+   free (nodes);
+   return ret;
+}
+
+// Returns the sorted paths of all the descendants of node, including node
+// itself if include_self is set, that match sterm (see matcher_init()).
+//
+// The paths are written one per line into a single buffer as the tree is
+// walked, each from the path of its parent, so that it can be searched in
+// one pass just as the index of a directory framedb is in index_match().
+static char **map_collect (frm_t *frm, uint32_t node, bool include_self,
+                           const char *sterm, uint32_t flags)
+{
+   struct collect_t {
+      uint32_t node;
+      size_t parent;             // Offset and length of the parent's path
+      size_t parent_len;
+   };
+
+   char **ret = NULL;
+   char *buf = NULL;
+   size_t len = 0, cap = 0;
+   struct collect_t *stack = NULL;
+   size_t depth = 0, stack_cap = 64;
+   ds_array_t *lines = ds_array_new ();
+   struct matcher_t m;
+
+   if (!(matcher_init (&m, sterm, flags))) {
+      ds_array_del (lines);
+      return NULL;
+   }
+
+   char *self = frm_map_path (frm->map, node);
+   if (!self || !lines || !(stack = malloc (stack_cap * sizeof *stack))) {
+      ERR (frm, "OOM error allocating node list\n");
+      goto cleanup;
+   }
+
+   // The path of node is the first line, and its children are the first
+   // nodes on the stack.
+   size_t self_len = strlen (self);
+   stack[depth++] = (struct collect_t) { node, 0, 0 };
+
+   while (depth) {
+      struct collect_t current = stack[--depth];
+      const char *name = current.node == node
+         ? self
+         : frm_map_name (frm->map, current.node);
+      size_t nlen = current.node == node ? self_len : strlen (name);
+      size_t needed = len + current.parent_len + 1 + nlen + 1;
+      if (needed > cap) {
+         size_t newcap = cap ? cap * 2 : 64 * 1024;
+         while (newcap < needed)
+            newcap *= 2;
+         char *tmp = realloc (buf, newcap);
+         if (!tmp) {
+            ERR (frm, "OOM error allocating %zu bytes of paths\n", newcap);
+            goto cleanup;
+         }
+         buf = tmp;
+         cap = newcap;
+      }
+
+      size_t offset = len;
+      if (current.parent_len) {
+         memcpy (&buf[len], &buf[current.parent], current.parent_len);
+         buf[len + current.parent_len] = '/';
+         len += current.parent_len + 1;
+      }
+      memcpy (&buf[len], name, nlen);
+      len += nlen;
+      buf[len++] = '\n';
+
+      uint32_t child = frm_map_child (frm->map, current.node);
+      for (; child != FRM_MAP_NONE; child = frm_map_sibling (frm->map, child)) {
+         if (depth == stack_cap) {
+            struct collect_t *tmp = realloc (stack, stack_cap * 2 * sizeof *tmp);
+            if (!tmp) {
+               ERR (frm, "OOM error allocating node list\n");
+               goto cleanup;
+            }
+            stack = tmp;
+            stack_cap *= 2;
+         }
+         stack[depth++] = (struct collect_t) { child, offset, len - offset - 1 };
+      }
+   }
+
+   size_t start = include_self ? 0 : self_len + 1;
+   if (!(matcher_lines (&m, &buf[start], len - start, lines))) {
+      goto cleanup;
+   }
+
+   size_t nlines = ds_array_length (lines);
+   if (!(ret = calloc (nlines + 1, sizeof *ret))) {
+      ERR (frm, "OOM error allocating results\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<nlines; i++) {
+      ret[i] = ds_array_get (lines, i);
+   }
+   qsort (ret, nlines, sizeof *ret, sort_entries);
+   ds_array_del (lines);
+   lines = NULL;
+
+cleanup:
+   for (size_t i=0; i<ds_array_length (lines); i++) {
+      free (ds_array_get (lines, i));
+   }
+   ds_array_del (lines);
+   matcher_fini (&m);
+   free (self);
+   free (buf);
+   free (stack);
+   return ret;
+}
+
+// The map is opened by the first handle on the framedb and shared by
+// the rest.
+static frm_t *map_init (const char *dbpath, struct frm_db_t *db)
+{
+   frm_t *ret = frm_alloc (dbpath);
+   if (!ret) {
+      return NULL;
+   }
+   ret->db = db;
+
+   if (!(db_rdlock (ret))) {
+      FRM_ERROR ("Failed to lock framedb [%s]: %m\n", dbpath);
+      frm_free (ret);
+      return NULL;
+   }
+
+   pthread_mutex_lock (&db->init_lock);
+   if (!db->map && !(db->map = frm_map_open (dbpath))) {
+      FRM_ERROR ("Failed to open framedb [%s]: %m\n", dbpath);
+      pthread_mutex_unlock (&db->init_lock);
+      db_unlock (ret);
+      frm_free (ret);
+      return NULL;
+   }
+   pthread_mutex_unlock (&db->init_lock);
+
+   ret->map = db->map;
+   ret->node = FRM_MAP_ROOT;
+   if ((frm_map_history (ret->map, &ret->node, 1)) != 1) {
+      FRM_ERROR ("Warning: no history found, defaulting to root frame\n");
+   }
+   db_unlock (ret);
+
+   return ret;
+}
+
+static bool map_push (frm_t *frm, const char *parent, const char *name,
+                      const char *message, bool dir_change)
+{
+   uint32_t pnode = map_resolve (frm, parent);
+   if (pnode == FRM_MAP_NONE) {
+      ERR (frm, "Error: no frame found at [%s]\n", parent);
+      errno = ENOENT;
+      return false;
+   }
+
+   char *payload = ds_str_cat (message, "\n", NULL);
+   if (!payload) {
+      ERR (frm, "OOM error allocating payload\n");
+      return false;
+   }
+
+   uint32_t node = frm_map_add (frm->map, pnode, name, payload);
+   free (payload);
+   if (node == FRM_MAP_NONE) {
+      ERR (frm, "Failed to create frame [%s]: %m\n", name);
+      return false;
+   }
+
+   return dir_change ? map_visit (frm, node) : true;
+}
+
+static bool map_switch (frm_t *frm, const char *target)
+{
+   char *suffixed = isslash (target[strlen(target)-1])
+      ? ds_str_dup (target)
+      : ds_str_cat (target, "/", NULL);
+   if (!suffixed) {
+      ERR (frm, "OOM error allocating suffixed string\n");
+      errno = ENOMEM;
+      return false;
+   }
+
+   // Prefer the most recently visited descendant of target.
+   uint32_t node = FRM_MAP_NONE;
+   uint32_t *history = calloc (4096, sizeof *history);
+   size_t nhistory = history ? frm_map_history (frm->map, history, 4096) : 0;
+   size_t slen = strlen (suffixed);
+   for (size_t i=0; i<nhistory && node == FRM_MAP_NONE; i++) {
+      char *path = frm_map_path (frm->map, history[i]);
+      if (path && (strncmp (path, suffixed, slen))==0) {
+         node = history[i];
+      }
+      free (path);
+   }
+   free (history);
+   free (suffixed);
+
+   if (node == FRM_MAP_NONE) {
+      node = frm_map_lookup (frm->map, FRM_MAP_NONE, target);
+   }
+
+   if (node == FRM_MAP_NONE) {
+      ERR (frm, "Failed to switch to target [%s]\n", target);
+      errno = ENOENT;
+      return false;
+   }
+
+   return map_visit (frm, node);
+}
+
+static bool map_delete (frm_t *frm, uint32_t node)
+{
+   if (node == FRM_MAP_NONE || node == FRM_MAP_ROOT) {
+      ERR (frm, "Error: invalid frame to delete\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   // Don't leave the current frame pointing into the removed subtree.
+   for (uint32_t i=frm->node; i!=FRM_MAP_NONE; i=frm_map_parent (frm->map, i)) {
+      if (i == node) {
+         if (!(map_visit (frm, frm_map_parent (frm->map, node))))
+            return false;
+         break;
+      }
+   }
+
+   if (!(frm_map_remove (frm->map, node))) {
+      ERR (frm, "Error: failed to remove frame: %m\n");
+      return false;
+   }
+
+   return true;
+}
+
+static bool search_live (void *arg, uint64_t id)
+{
+   frm_t *frm = arg;
+   char *path = frm_ids_path (frm->ids, id);
+   bool ret = path != NULL;
+   free (path);
+   return ret;
+}
+
+// Queues the new text of the payload of the frame with the given ID for
+// the search index.
+static void search_record (frm_t *frm, uint64_t id, const char *text)
+{
+   if (id == FRM_ID_NONE)
+      return;
+
+   if ((!frm->search && !(frm->search = frm_search_batch_new ()))
+         || !(frm_search_batch_add (frm->search, id, text))) {
+      ERR (frm, "Warning: failed to update the search index\n");
+   }
+}
+
+// Queues the payloads of the frames at paths for the search index.
+static void search_record_paths (frm_t *frm, char **paths)
+{
+   for (size_t i=0; paths[i]; i++) {
+      char *fname = ds_str_cat (paths[i], "/payload", NULL);
+      char *payload = fname ? readfile_at (frm->dbfd, fname) : NULL;
+      if (!payload) {
+         ERR (frm, "Warning: failed to read [%s/payload]: %m\n", paths[i]);
+      }
+      search_record (frm, frame_id_at (frm->dbfd, paths[i]), payload);
+      free (payload);
+      free (fname);
+   }
+}
+
+// Writes the queued payloads to the search index.
+static bool search_flush (frm_t *frm)
+{
+   if (!frm->search)
+      return true;
+
+   bool ret = frm_search_append (frm->dbfd, frm->search, search_live, frm);
+   if (!ret) {
+      ERR (frm, "Warning: failed to update the search index\n");
+   }
+   frm_search_batch_del (frm->search);
+   frm->search = NULL;
+   return ret;
+}
+
+// Merges the index updates deferred by an open batch into the index.
+// Anything that reads or changes the index calls this first. Only a
+// caller holding the write lock can merge; db_idxlock() makes sure
+// that readers do when this handle has anything to merge.
+static bool batch_flush (frm_t *frm)
+{
+   if (!frm->db->writing)
+      return true;
+
+   size_t npending = ds_array_length (frm->pending);
+   if (npending == 0)
+      return search_flush (frm);
+
+   char **entries = calloc (npending, sizeof *entries);
+   if (!entries) {
+      ERR (frm, "OOM error allocating index entries\n");
+      return false;
+   }
+   for (size_t i=0; i<npending; i++) {
+      entries[i] = ds_array_get (frm->pending, i);
+   }
+
+   bool ret = index_merge (frm->dbfd, entries, npending);
+   if (!ret) {
+      ERR (frm, "Error: failed to merge %zu new frames into the index\n", npending);
+   } else {
+      while (ds_array_length (frm->pending)) {
+         free (ds_array_rm_tail (frm->pending));
+      }
+   }
+
+   free (entries);
+   return search_flush (frm) && ret;
+}
+
+void frm_mem_free (void *ptr)
+{
+   free (ptr);
+}
+
+char *frm_readfile (const char *name)
+{
+   FRM_TRACE_SPAN ("frm_readfile");
+   return readfile_at (AT_FDCWD, name);
+}
+
+bool frm_vwritefile (const char *name, const char *data, va_list ap)
+{
+   return vwritefile_at (AT_FDCWD, name, data, ap);
+}
+
+bool frm_writefile (const char *fname, const char *data, ...)
+{
+   va_list ap;
+
+   va_start (ap, data);
+   bool ret = frm_vwritefile (fname, data, ap);
+   va_end (ap);
+
+   return ret;
+}
+
+const char *frm_homepath (void)
+{
+   static bool set = false;
+
+   if (set) {
+      return getenv ("HOME");
+   }
+
+
+#ifdef PLATFORM_Windows
+   const char *homedrive = getenv ("HOMEDRIVE");
+   const char *homepath = getenv ("HOMEPATH");
+   char *winhome = NULL;
+   if ((ds_str_printf (&winhome, "HOME=%s%s", homedrive, homepath)) == 0) {
+      FRM_ERROR ("OOM error allocating environment variable [%s=%s]\n",
+            homedrive, homepath);
+      return NULL;
+   }
+
+   if (!winhome) {
+      FRM_ERROR ("Failed to set $HOME variable: [%s][%s][%s]\n",
+            homedrive, homepath, winhome);
+      free (winhome);
+      return NULL;
+   }
+
+   if ((putenv (winhome)) != 0) {
+      FRM_ERROR ("Warning: failed to set environment [%s]: %m\n", winhome);
+   }
+
+   free (winhome);
+   homedrive = NULL;
+   homepath = NULL;
+   winhome = NULL;
+#endif
+
+   return getenv ("HOME");
+}
+
+char *frm_current_cached (const char *dbpath, uint64_t *mtime)
+{
+   frm_trace_from_env ();
+   FRM_TRACE_SPAN ("frm_current_cached");
+
+   // This is on the shell prompt path, so it is a single open() and
+   // read() with nothing allocated but the result.
+   char fname[PATH_MAX];
+   char data[PATH_MAX + 48];
+   if ((snprintf (fname, sizeof fname, "%s%s%s", dbpath, FRM_DIR_SEPARATOR,
+               CURRENT_FNAME)) >= (int)sizeof fname) {
+      errno = ENAMETOOLONG;
+      return NULL;
+   }
+
+   FRM_STATS_ADD (opens, 1);
+   int fd = open (fname, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return NULL;
+
+   ssize_t nbytes = read (fd, data, sizeof data - 1);
+   close (fd);
+   if (nbytes <= 0)
+      return NULL;
+   data[nbytes] = 0;
+
+   char *path = strchr (data, '\n');
+   char *eol = path ? strchr (&path[1], '\n') : NULL;
+   if (!eol) {
+      errno = EINVAL;
+      return NULL;
+   }
+   *eol = 0;
+
+   if (mtime) {
+      *mtime = strtoull (data, NULL, 10);
+   }
+   return ds_str_dup (&path[1]);
+}
+
+/* The perflog is kept in the framedb directory, or next to the file of a
+ * mapped framedb. The size of a framedb is taken from its index, which
+ * grows with the number of frames, as that only needs a stat().
+ */
+#define PERFLOG_FNAME         "perf.log"
+
+static char *perflog_fname (const char *dbpath, uint64_t *dbsize)
+{
+   struct stat sb;
+   if ((stat (dbpath, &sb))==0 && S_ISREG (sb.st_mode)) {
+      *dbsize = sb.st_size;
+      return ds_str_cat (dbpath, ".", PERFLOG_FNAME, NULL);
+   }
+
+   char *index = ds_str_cat (dbpath, FRM_DIR_SEPARATOR, INDEX_FNAME, NULL);
+   *dbsize = (index && (stat (index, &sb))==0) ? sb.st_size : 0;
+   free (index);
+   return ds_str_cat (dbpath, FRM_DIR_SEPARATOR, PERFLOG_FNAME, NULL);
+}
+
+bool frm_perflog_append (const char *dbpath, const char *command,
+                         uint64_t start, uint64_t usecs, int status)
+{
+   frm_perflog_t rec;
+   memset (&rec, 0, sizeof rec);
+   char *fname = perflog_fname (dbpath, &rec.dbsize);
+   if (!fname) {
+      FRM_ERROR ("OOM error creating perflog name for [%s]\n", dbpath);
+      return false;
+   }
+
+   rec.time = start;
+   rec.usecs = usecs > UINT32_MAX ? UINT32_MAX : usecs;
+   rec.status = status;
+   size_t len = strlen (command);
+   memcpy (rec.command, command, len < sizeof rec.command ? len : sizeof rec.command);
+
+   bool ret = frm_perflog_write (fname, &rec);
+   free (fname);
+   return ret;
+}
+
+struct frm_perflog_t *frm_perflog_get (const char *dbpath, uint64_t since,
+                                       size_t *nrecs)
+{
+   uint64_t dbsize;
+   char *fname = perflog_fname (dbpath, &dbsize);
+   if (!fname) {
+      FRM_ERROR ("OOM error creating perflog name for [%s]\n", dbpath);
+      *nrecs = 0;
+      return NULL;
+   }
+
+   frm_perflog_t *ret = frm_perflog_load (fname, since, nrecs);
+   free (fname);
+   return ret;
+}
+
+/* Every frame has a stable ID (see frm_ids.h), which is also kept in its
+ * info file.
+ */
+#define IDS_FNAME             "ids.log"
+
+static bool ids_migrate (int dbfd);
+
+/* A move is recorded in the move journal before the directory is renamed,
+ * and the journal is only removed once the index and the ID log agree
+ * with the new location. A journal left behind by a crash is completed
+ * the next time the framedb is opened.
+ */
+#define MOVE_FNAME            "move.journal"
+
+static bool move_recover (int dbfd);
+
+frm_t *frm_create (const char *dbpath)
+{
+   frm_trace_from_env ();
+   FRM_TRACE_SPAN ("frm_create");
+
+   // An existing regular file selects the mapped backend.
+   struct stat sb;
+   if ((stat (dbpath, &sb))==0 && S_ISREG (sb.st_mode)) {
+      frm_map_t *map = frm_map_create (dbpath, "ENTER YOUR NOTES HERE\n");
+      if (!map) {
+         FRM_ERROR ("Failed to create framedb [%s]: %m\n", dbpath);
+         return NULL;
+      }
+      frm_map_close (map);
+      return frm_init (dbpath);
+   }
+
+   if ((wrapper_mkdir (AT_FDCWD, dbpath))!=0) {
+      FRM_ERROR ("Failed to create directory [%s]: %m\n", dbpath);
+      return NULL;
+   }
+
+   int dbfd = opendir_at (AT_FDCWD, dbpath);
+   if (dbfd < 0) {
+      FRM_ERROR ("Failed to open directory [%s]: %m\n", dbpath);
+      return NULL;
+   }
+
+   if (!(internal_frame_create (dbfd, "root", "ENTER YOUR NOTES HERE"))) {
+      FRM_ERROR ("Failed to create frame [%s/root]: %m\n", dbpath);
+      close (dbfd);
+      return NULL;
+   }
+
+   if (!(ids_migrate (dbfd))) {
+      FRM_ERROR ("Failed to create [%s/%s]: %m\n", dbpath, IDS_FNAME);
+      close (dbfd);
+      return NULL;
+   }
+
+   if (!(history_append (dbfd, "root", FRM_ID_ROOT))
+         || !(current_record_write (dbfd, "root"))) {
+      FRM_ERROR ("Failed to set the working frame to [root]\n");
+      close (dbfd);
+      return NULL;
+   }
+
+   if (!(writefile_at (dbfd, INDEX_FNAME, "", NULL))) {
+      FRM_ERROR ("Error: failed to write index: %m\n");
+      close (dbfd);
+      return NULL;
+   }
+   close (dbfd);
+   return frm_init (dbpath);
+}
+
+// Migrating the files of earlier versions is the only time that opening
+// a framedb modifies it.
+static bool needs_migration (int dbfd)
+{
+   return (faccessat (dbfd, HISTORY_FNAME, F_OK, 0))!=0
+       || (faccessat (dbfd, INDEX_FNAME, F_OK, 0))!=0
+       || (faccessat (dbfd, IDS_FNAME, F_OK, 0))!=0
+       || (faccessat (dbfd, MOVE_FNAME, F_OK, 0))==0;
+}
+
+static frm_t *dir_init (const char *dbpath, struct frm_db_t *db)
+{
+   bool error = true;
+   frm_t *ret = NULL;
+   char *history = NULL;
+
+   if (!(ret = frm_alloc (dbpath))) {
+      FRM_ERROR ("OOM error allocating frm_t\n");
+      goto cleanup;
+   }
+   ret->db = db;
+
+   if ((ret->dbfd = opendir_at (AT_FDCWD, ret->dbpath)) < 0) {
+      FRM_ERROR ("Failed to open directory [%s]: %m\n", dbpath);
+      goto cleanup;
+   }
+
+   if ((needs_migration (ret->dbfd))) {
+      if (!(db_wrlock (ret))) {
+         FRM_ERROR ("Failed to lock framedb [%s]: %m\n", dbpath);
+         goto cleanup;
+      }
+
+      if (!(history_migrate (ret->dbfd))) {
+         FRM_ERROR ("Warning: failed to migrate [%s/%s] to [%s/%s]\n",
+                  dbpath, HISTORY_LEGACY_FNAME, dbpath, HISTORY_FNAME);
+      }
+
+      if (!(index_migrate (ret->dbfd))) {
+         FRM_ERROR ("Warning: failed to migrate [%s/%s] to [%s/%s]\n",
+                  dbpath, INDEX_LEGACY_FNAME, dbpath, INDEX_FNAME);
+      }
+
+      if (!(ids_migrate (ret->dbfd))) {
+         FRM_ERROR ("Warning: failed to assign IDs to the frames in [%s]\n",
+                  dbpath);
+      }
+
+      if (!(move_recover (ret->dbfd))) {
+         FRM_ERROR ("Warning: failed to complete the interrupted move in [%s]\n",
+                  dbpath);
+      }
+      db_unlock (ret);
+   }
+
+   if (!(ret->ids = frm_ids_open (ret->dbfd, IDS_FNAME))) {
+      FRM_ERROR ("Failed to open [%s/%s]: %m\n", dbpath, IDS_FNAME);
+      goto cleanup;
+   }
+
+   if (!(db_rdlock (ret))) {
+      FRM_ERROR ("Failed to lock framedb [%s]: %m\n", dbpath);
+      goto cleanup;
+   }
+   history = history_last (ret->dbfd, ret->ids);
+   db_unlock (ret);
+   if (!history || !history[0]) {
+      FRM_ERROR ("Warning: no history found, defaulting to root frame\n");
+      free (history);
+      if (!(history = ds_str_dup ("root"))) {
+         FRM_ERROR ("OOM error copying last working frame path\n");
+         goto cleanup;
+      }
+   }
+
+   char *eol = strchr (history, '\n');
+   if (eol) {
+      *eol = 0;
+   }
+
+   if (!(set_current (ret, history))) {
+      FRM_ERROR ("Failed to switch to frame [%s]: %m\n", history);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   free (history);
+   if (error) {
+      frm_free (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+frm_t *frm_init (const char *dbpath)
+{
+   frm_trace_from_env ();
+   FRM_TRACE_SPAN ("frm_init");
+
+   pthread_mutex_lock (&g_dbs_lock);
+   struct frm_db_t *db = db_acquire (dbpath);
+   pthread_mutex_unlock (&g_dbs_lock);
+   if (!db)
+      return NULL;
+
+   // Opening the framedb waits for its lock, so other handles must be
+   // able to come and go in the meantime.
+   frm_t *ret = (frm_map_isdb (dbpath)) ? map_init (dbpath, db) : dir_init (dbpath, db);
+
+   bool last = false;
+   pthread_mutex_lock (&g_dbs_lock);
+   if (ret) {
+      g_active = ret;
+   } else {
+      last = db_release (db);
+   }
+   pthread_mutex_unlock (&g_dbs_lock);
+
+   if (last) {
+      db_free (db);
+   }
+   return ret;
+}
+
+void frm_close (frm_t *frm)
+{
+   FRM_TRACE_SPAN ("frm_close");
+
+   if (!frm) {
+      errno = ENOENT;
+      return;
+   }
+
+   if (frm->batch && !(frm_batch_end (frm))) {
+      ERR (frm, "Error: failed to complete batch on [%s]\n", frm->dbpath);
+   }
+
+   // The last handle on the framedb closes it, which syncs a mapped
+   // framedb to disk, once nobody else can find it.
+   pthread_mutex_lock (&g_dbs_lock);
+   if (g_active == frm) {
+      g_active = NULL;
+   }
+   bool last = db_release (frm->db);
+   pthread_mutex_unlock (&g_dbs_lock);
+
+   if (last) {
+      db_free (frm->db);
+   }
+   frm_free (frm);
+}
+
+static char *internal_frm_history (frm_t *frm, size_t count)
+{
+   if (!frm) {
+      FRM_ERROR ("Found null object for frm_t\n");
+      errno = EINVAL;
+      return ds_str_dup ("");
+   }
+
+   if (frm->map) {
+      return map_history (frm, count);
+   }
+
+   return history_read (frm->dbfd, frm->ids, count);
+}
+
+static char *internal_frm_current (frm_t *frm)
+{
+   if (!frm) {
+      FRM_ERROR ("Error, null object passed for frm_t\n");
+      errno = EINVAL;
+      return ds_str_dup ("");
+   }
+
+   if (frm->map) {
+      char *ret = frm_map_path (frm->map, frm->node);
+      return ret ? ret : ds_str_dup ("");
+   }
+
+   char *ret = ds_str_dup (frm->current);
+   if (!ret) {
+      ERR (frm, "OOM error allocating current path\n");
+      ret = ds_str_dup ("");
+   }
+
+   return ret;
+}
+
+struct info_t {
+   uint64_t mtime;
+   uint64_t id;
+};
+
+static bool read_info (struct info_t *dst, int dirfd, const char *fname)
+{
+   char *data = readfile_at (dirfd, fname);
+   if (!data) {
+      FRM_ERROR ("Failed to read [%s]: %m\n", fname);
+      return false;
+   }
+
+   memset (dst, 0, sizeof *dst);
+
+   char *name = NULL;
+   char *sptr = NULL;
+   char *tok = strtok_r (data, "\n", &sptr);
+   do {
+      free (name);
+      if (!(name = ds_str_dup (tok))) {
+         FRM_ERROR ("OOM error allocating info fields\n");
+         free (data);
+         return false;
+      }
+      char *value = strchr (name, ':');
+      if (value) {
+         *value++ = 0;
+      }
+
+      if ((strcmp (name, "mtime"))==0) {
+         if ((sscanf (value, "%" PRIu64, &dst->mtime))!=1) {
+            FRM_ERROR ("Could not parse date value [%s]\n", value);
+         }
+      }
+      if ((strcmp (name, "id"))==0) {
+         if ((sscanf (value, "%" PRIu64, &dst->id))!=1) {
+            FRM_ERROR ("Could not parse id value [%s]\n", value);
+         }
+      }
+   } while ((tok = strtok_r (NULL, "\n", &sptr)));
+   free (name);
+   free (data);
+   return true;
+}
+
+static bool write_info (const struct info_t *info, int dirfd, const char *fname)
+{
+   char tstring[47];
+   char idstring[47];
+   if (!(writefile_at (dirfd, fname,
+               "mtime:", uint64_string (tstring, info->mtime), "\n",
+               info->id ? "id:" : "",
+               info->id ? uint64_string (idstring, info->id) : "",
+               info->id ? "\n" : "",
+               NULL))) {
+      FRM_ERROR ("Failed to write info: %m\n");
+      return false;
+   }
+
+   return true;
+}
+
+// Returns the ID of the frame at path, or FRM_ID_NONE if it has none.
+static uint64_t frame_id_at (int dbfd, const char *path)
+{
+   struct info_t info;
+   char *info_fname = ds_str_cat (path, "/info", NULL);
+   bool found = info_fname
+      && (faccessat (dbfd, info_fname, F_OK, 0))==0
+      && read_info (&info, dbfd, info_fname);
+   free (info_fname);
+   return found ? info.id : FRM_ID_NONE;
+}
+
+static bool info_set_id (int dbfd, const char *path, uint64_t id)
+{
+   struct info_t info;
+   char *info_fname = ds_str_cat (path, "/info", NULL);
+   bool ret = info_fname && read_info (&info, dbfd, info_fname);
+   if (ret) {
+      info.id = id;
+      ret = write_info (&info, dbfd, info_fname);
+   }
+   free (info_fname);
+   return ret;
+}
+
+// Assigns IDs to the frames of a framedb created by an earlier version,
+// or to the root of a new framedb. The log is built under a temporary
+// name, so that an interrupted migration starts again from scratch.
+// Parents are numbered before their children.
+static bool ids_migrate (int dbfd)
+{
+   if ((faccessat (dbfd, IDS_FNAME, F_OK, 0))==0)
+      return true;
+
+   bool error = true;
+   static const char *tmpname = IDS_FNAME ".tmp";
+   ds_array_t *queue = NULL;
+   frm_ids_t *ids = NULL;
+
+   unlinkat (dbfd, tmpname, 0);
+   if (!(ids = frm_ids_open (dbfd, tmpname))
+         || !(queue = ds_array_new ())
+         || !(ds_array_ins_tail (queue, ds_str_dup ("root")))
+         || !(frm_ids_set (ids, FRM_ID_ROOT, FRM_ID_NONE, "root"))
+         || !(info_set_id (dbfd, "root", FRM_ID_ROOT))) {
+      FRM_ERROR ("Failed to create [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   // The array is its own queue: each directory appends its children.
+   for (size_t i=0; i<ds_array_length (queue); i++) {
+      const char *parent = ds_array_get (queue, i);
+      if (!parent) {
+         FRM_ERROR ("OOM error numbering frames\n");
+         goto cleanup;
+      }
+
+      uint64_t pid = frame_id_at (dbfd, parent);
+      int fd = opendir_at (dbfd, parent);
+      DIR *dirp = fd >= 0 ? fdopendir (fd) : NULL;
+      if (!dirp) {
+         FRM_ERROR ("Error: failed to read directory [%s]: %m\n", parent);
+         if (fd >= 0) {
+            close (fd);
+         }
+         goto cleanup;
+      }
+
+      struct dirent *de;
+      while ((de = readdir (dirp))) {
+         FRM_STATS_ADD (readdirs, 1);
+         if (de->d_name[0] == '.' || !(wrapper_isdir (fd, de)))
+            continue;
+         char *path = ds_str_cat (parent, "/", de->d_name, NULL);
+         uint64_t id = path ? frm_ids_add (ids, pid, de->d_name) : FRM_ID_NONE;
+         if (id == FRM_ID_NONE || !(info_set_id (dbfd, path, id))
+               || !(ds_array_ins_tail (queue, path))) {
+            FRM_ERROR ("Failed to number frame [%s/%s]: %m\n", parent, de->d_name);
+            free (path);
+            closedir (dirp);
+            goto cleanup;
+         }
+      }
+      closedir (dirp);
+   }
+
+   frm_ids_close (ids);
+   ids = NULL;
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (dbfd, tmpname, dbfd, IDS_FNAME))!=0) {
+      FRM_ERROR ("Failed to rename [%s] to [%s]: %m\n", tmpname, IDS_FNAME);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   frm_ids_close (ids);
+   if (error) {
+      unlinkat (dbfd, tmpname, 0);
+   }
+   while (queue && ds_array_length (queue)) {
+      free (ds_array_rm_tail (queue));
+   }
+   ds_array_del (queue);
+   return !error;
+}
+
+/* The current record holds the most recent history entry and its mtime,
+ * as "<mtime>\n<path>\n". It is replaced atomically whenever either
+ * changes so that frm_current_cached() can read it without a lock.
+ */
+static bool current_record_write (int dbfd, const char *path)
+{
+   struct info_t info;
+   char *info_fname = ds_str_cat (path, "/info", NULL);
+   if (!info_fname || !(read_info (&info, dbfd, info_fname))) {
+      FRM_ERROR ("Failed to read info of [%s]: %m\n", path);
+      free (info_fname);
+      return false;
+   }
+   free (info_fname);
+
+   char tstring[47];
+   char *record = ds_str_cat (uint64_string (tstring, info.mtime), "\n",
+                              path, "\n", NULL);
+   if (!record) {
+      FRM_ERROR ("OOM error allocating current record\n");
+      return false;
+   }
+
+   bool ret = replacefile_at (dbfd, CURRENT_FNAME, record);
+   free (record);
+   return ret;
+}
+
+// Returns the path in the current record, or NULL if there is none.
+static char *current_record_read (int dbfd)
+{
+   char *data = readfile_at (dbfd, CURRENT_FNAME);
+   char *path = data ? strchr (data, '\n') : NULL;
+   char *ret = path ? ds_str_dup (&path[1]) : NULL;
+   char *eol = ret ? strchr (ret, '\n') : NULL;
+   if (eol) {
+      *eol = 0;
+   }
+   free (data);
+   return ret;
+}
+
+static bool update_info_mtime (int dirfd, const char *fname)
+{
+   struct info_t info;
+   if (!(read_info (&info, dirfd, fname))) {
+      FRM_ERROR ("Failed to read info file: %m\n");
+      return false;
+   }
+
+   info.mtime = time (NULL);
+   if (!(write_info (&info, dirfd, fname))) {
+      FRM_ERROR ("Failed to update info file: %m\n");
+      return false;
+   }
+
+   return true;
+}
+
+
+const char *frm_lastmsg (frm_t *frm)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return "";
+   }
+
+   return lastmsg_get ();
+}
+
+
+// Creates the frame 'name' in the directory pfd and returns the open
+// directory of the new frame, or -1 on error.
+static int frame_make (frm_t *frm, int pfd, const char *name, const char *message)
+{
+   struct info_t pinfo;
+   if (!(read_info (&pinfo, pfd, "info"))) {
+      ERR (frm, "Failed to read info of the parent of [%s]: %m\n", name);
+      return -1;
+   }
+
+   if ((wrapper_mkdir (pfd, name))!=0) {
+      ERR (frm, "Failed to create directory [%s]: %m\n", name);
+      return -1;
+   }
+
+   uint64_t id = frm_ids_add (frm->ids, pinfo.id, name);
+   if (id == FRM_ID_NONE) {
+      ERR (frm, "Warning: failed to allocate an ID for [%s]\n", name);
+   }
+
+   int fd = opendir_at (pfd, name);
+   if (fd < 0) {
+      ERR (frm, "Failed to open directory [%s]: %m\n", name);
+      return -1;
+   }
+
+   if (!(writefile_at (fd, "payload", message ? message : "", "\n", NULL))) {
+      ERR (frm, "Failed to write message to [%s/payload]: %m\n", name);
+      close (fd);
+      return -1;
+   }
+
+   struct info_t info = { (uint64_t)time (NULL), id };
+   if (!(write_info (&info, fd, "info"))) {
+      ERR (frm, "Failed to create info file [%s/info]: %m\n", name);
+      close (fd);
+      return -1;
+   }
+
+   search_record (frm, id, message);
+   return fd;
+}
+
+// Creates the frame 'name' under the frame at parent (the current frame
+// if parent is null) and optionally makes it the current frame.
+static bool internal_frm_push (frm_t *frm, const char *parent, const char *name,
+                               const char *message, bool dir_change)
+{
+   if (!frm) {
+      FRM_ERROR ("Error, null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      return map_push (frm, parent, name, message, dir_change);
+   }
+
+   bool error = true;
+   char *ppath = NULL;
+   char *path = NULL;
+   int pfd = -1;
+   int fd = -1;
+
+   if ((pfd = frame_open (frm, parent, &ppath)) < 0) {
+      ERR (frm, "Failed to open parent frame [%s]: %m\n", parent);
+      goto cleanup;
+   }
+
+   if ((fd = frame_make (frm, pfd, name, message)) < 0) {
+      goto cleanup;
+   }
+
+   if (!(path = path_resolve (ppath, name))) {
+      ERR (frm, "Failed to switch to [%s]: %m\n", name);
+      goto cleanup;
+   }
+
+   if (frm->batch) {
+      char *tmp = ds_str_dup (path);
+      if (!tmp || !(ds_array_ins_tail (frm->pending, tmp))) {
+         ERR (frm, "OOM error deferring index update for [%s]\n", path);
+         free (tmp);
+         goto cleanup;
+      }
+   } else if (!(index_add (frm->dbfd, path))) {
+      ERR (frm, "Warning: failed to update index\n");
+   }
+   if (!frm->batch) {
+      search_flush (frm);
+   }
+
+   if (dir_change) {
+      close (frm->curfd);
+      free (frm->current);
+      frm->curfd = fd;
+      frm->current = path;
+      fd = -1;
+      path = NULL;
+      if (!(history_append (frm->dbfd, frm->current,
+                            frame_id_at (frm->dbfd, frm->current)))) {
+         ERR (frm, "Failed to update history\n");
+         goto cleanup;
+      }
+      current_record_update (frm);
+   }
+
+   error = false;
+
+cleanup:
+   if (fd >= 0) {
+      close (fd);
+   }
+   if (pfd >= 0) {
+      close (pfd);
+   }
+   free (path);
+   free (ppath);
+   return !error;
+}
+
+// Resolves name relative to the frame at ppath, and returns the path if
+// it is strictly below ppath. The last slash is at *leaf.
+static char *new_many_path (frm_t *frm, const char *ppath, const char *name,
+                            char **leaf)
+{
+   size_t plen = strlen (ppath);
+   char *ret = name ? path_resolve (ppath, name) : NULL;
+   if (!ret || (strncmp (ret, ppath, plen))!=0 || ret[plen] != '/') {
+      ERR (frm, "Error: invalid frame name [%s]\n", name ? name : "");
+      free (ret);
+      errno = EINVAL;
+      return NULL;
+   }
+
+   *leaf = strrslash (ret);
+   return ret;
+}
+
+static bool map_new_many (frm_t *frm, const char *parent, const char **names,
+                          const char **messages, size_t count)
+{
+   uint32_t pnode = map_resolve (frm, parent);
+   char *ppath = pnode == FRM_MAP_NONE ? NULL : frm_map_path (frm->map, pnode);
+   if (!ppath) {
+      ERR (frm, "Error: no frame found at [%s]\n", parent ? parent : "");
+      errno = ENOENT;
+      return false;
+   }
+
+   bool error = true;
+   for (size_t i=0; i<count; i++) {
+      char *leaf = NULL;
+      char *path = new_many_path (frm, ppath, names[i], &leaf);
+      if (!path)
+         goto cleanup;
+
+      *leaf++ = 0;
+      uint32_t dnode = frm_map_lookup (frm->map, FRM_MAP_NONE, path);
+      char *payload = ds_str_cat (messages && messages[i] ? messages[i] : "",
+                                  "\n", NULL);
+      uint32_t node = dnode == FRM_MAP_NONE || !payload
+         ? FRM_MAP_NONE
+         : frm_map_add (frm->map, dnode, leaf, payload);
+      if (node == FRM_MAP_NONE) {
+         ERR (frm, "Failed to create frame [%s]: %m\n", names[i]);
+      }
+      free (payload);
+      free (path);
+      if (node == FRM_MAP_NONE)
+         goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   free (ppath);
+   return !error;
+}
+
+// Creates count frames under the frame at parent (the current frame if
+// parent is null). Each name is a path relative to parent, so a frame can
+// be created under a frame created earlier in the same call. The index is
+// updated once, with all the new frames, at the end; the frames created
+// before an error are kept.
+static bool internal_frm_new_many (frm_t *frm, const char *parent,
+                                   const char **names, const char **messages,
+                                   size_t count)
+{
+   if (!frm) {
+      FRM_ERROR ("Error, null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (!names && count) {
+      ERR (frm, "Error: null names passed for %zu new frames\n", count);
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      return map_new_many (frm, parent, names, messages, count);
+   }
+
+   bool error = true;
+   char *ppath = NULL;
+   char **entries = NULL;
+   size_t nentries = 0;
+
+   int pfd = frame_open (frm, parent, &ppath);
+   if (pfd < 0) {
+      ERR (frm, "Failed to open parent frame [%s]: %m\n", parent);
+      goto cleanup;
+   }
+   close (pfd);
+
+   if (!(entries = calloc (count + 1, sizeof *entries))) {
+      ERR (frm, "OOM error allocating %zu index entries\n", count);
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<count; i++) {
+      char *leaf = NULL;
+      char *path = new_many_path (frm, ppath, names[i], &leaf);
+      if (!path)
+         goto cleanup;
+
+      *leaf = 0;
+      int dfd = opendir_at (frm->dbfd, path);
+      *leaf = '/';
+      int fd = dfd < 0 ? -1 : frame_make (frm, dfd, &leaf[1],
+                                          messages ? messages[i] : NULL);
+      if (dfd < 0) {
+         ERR (frm, "Failed to open parent of [%s]: %m\n", path);
+      }
+      if (fd < 0) {
+         free (path);
+         if (dfd >= 0) {
+            close (dfd);
+         }
+         goto cleanup;
+      }
+      close (fd);
+      close (dfd);
+      entries[nentries++] = path;
+   }
+
+   error = false;
+
+cleanup:
+   if (frm->batch) {
+      for (size_t i=0; i<nentries; i++) {
+         if (!(ds_array_ins_tail (frm->pending, entries[i]))) {
+            ERR (frm, "OOM error deferring index update for [%s]\n", entries[i]);
+            free (entries[i]);
+            error = true;
+         }
+         entries[i] = NULL;
+      }
+   } else if (nentries && !(index_merge (frm->dbfd, entries, nentries))) {
+      ERR (frm, "Error: failed to merge %zu new frames into the index\n", nentries);
+      error = true;
+   }
+   if (!frm->batch) {
+      search_flush (frm);
+   }
+
+   frm_strarray_free (entries);
+   free (ppath);
+   return !error;
+}
+
+static char *internal_frm_payload_at (frm_t *frm, const char *fpath)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return ds_str_dup ("");
+   }
+
+   if (frm->map) {
+      uint32_t node = map_resolve (frm, fpath);
+      char *ret = node == FRM_MAP_NONE ? NULL : frm_map_payload (frm->map, node);
+      return ret ? ret : ds_str_dup ("");
+   }
+
+   int fd = frame_open (frm, fpath, NULL);
+   char *ret = fd < 0 ? NULL : readfile_at (fd, "payload");
+   if (fd >= 0) {
+      close (fd);
+   }
+   if (!ret) {
+      ERR (frm, "Failed to read [payload]: %m\n");
+      return ds_str_dup ("");
+   }
+
+   return ret;
+}
+
+static uint64_t internal_frm_date_epoch_at (frm_t *frm, const char *fpath)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return (uint64_t)-1;
+   }
+
+   if (frm->map) {
+      uint32_t node = map_resolve (frm, fpath);
+      return node == FRM_MAP_NONE ? (uint64_t)-1 : frm_map_mtime (frm->map, node);
+   }
+
+   struct info_t info;
+   int fd = frame_open (frm, fpath, NULL);
+   bool found = fd >= 0 && read_info (&info, fd, "info");
+   if (fd >= 0) {
+      close (fd);
+   }
+   if (!found) {
+      ERR (frm, "Failed to read [info]: %m\n");
+      return (uint64_t)-1;
+   }
+
+   return info.mtime;
+}
+
+static bool internal_frm_payload_write_at (frm_t *frm, const char *fpath,
+                                           const char *message, bool append)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      uint32_t node = map_resolve (frm, fpath);
+      char *tmp = append ? ds_str_cat ("\n", message, NULL) : ds_str_dup (message);
+      bool ret = node != FRM_MAP_NONE && tmp
+         && frm_map_set_payload (frm->map, node, tmp, append);
+      if (!ret) {
+         ERR (frm, "Error writing payload: %m\n");
+      }
+      free (tmp);
+      return ret;
+   }
+
+   char *path = NULL;
+   int fd = frame_open (frm, fpath, &path);
+   if (fd < 0) {
+      ERR (frm, "Error: no frame found at [%s]\n", fpath);
+      return false;
+   }
+
+   char *current = NULL;
+   if (append && !(current = readfile_at (fd, "payload"))) {
+      ERR (frm, "Warning: failed to read [payload]: %m\n");
+   }
+
+   bool ret = true;
+   if (!(writefile_at (fd, "payload", append ? current : message,
+               append ? "\n" : NULL, message, NULL))) {
+      ERR (frm, "Error writing [payload]: %m\n");
+      ret = false;
+   }
+
+   if (ret && !(update_info_mtime (fd, "info"))) {
+      ERR (frm, "Failed to update info file with mtime: %m\n");
+      ret = false;
+   }
+   close (fd);
+
+   if (ret) {
+      char *text = append ? ds_str_cat (current ? current : "", "\n", message, NULL)
+                          : NULL;
+      if (!append || text) {
+         search_record (frm, frame_id_at (frm->dbfd, path), append ? text : message);
+      }
+      if (!frm->batch) {
+         search_flush (frm);
+      }
+      free (text);
+   }
+   free (current);
+
+   // Keep the mtime in the current record up to date.
+   char *recorded = ret ? current_record_read (frm->dbfd) : NULL;
+   if (recorded && (strcmp (recorded, path))==0
+         && !(current_record_write (frm->dbfd, path))) {
+      ERR (frm, "Warning: failed to update [%s]\n", CURRENT_FNAME);
+   }
+   free (recorded);
+   free (path);
+
+   return ret;
+}
+
+static char *internal_frm_payload_fname_at (frm_t *frm, const char *fpath)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
+   }
+
+   // The mapped backend has no payload file that can be edited in place.
+   if (frm->map) {
+      ERR (frm, "Error: payload file not available for a mapped framedb\n");
+      errno = ENOTSUP;
+      return NULL;
+   }
+
+   char *path = NULL;
+   int fd = frame_open (frm, fpath, &path);
+   if (fd < 0) {
+      ERR (frm, "Error: no frame found at [%s]\n", fpath);
+      return NULL;
+   }
+   close (fd);
+
+   char *fname = ds_str_cat (frm->dbpath, "/", path, "/payload", NULL);
+   if (!fname) {
+      ERR (frm, "OOM error allocating filename of payload file\n");
+   }
+   free (path);
+
+   return fname;
+}
+
+static bool internal_frm_top (frm_t *frm)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = ENOENT;
+      return false;
+   }
+
+   if (frm->map) {
+      return map_visit (frm, FRM_MAP_ROOT);
+   }
+
+   return visit (frm, "root");
+}
+
+static bool internal_frm_up (frm_t *frm)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      if (frm->node == FRM_MAP_ROOT) {
+         ERR (frm, "Error: cannot go up a level beyond root frame\n");
+         return false;
+      }
+      return map_visit (frm, frm_map_parent (frm->map, frm->node));
+   }
+
+   if ((strcmp (frm->current, "root"))==0) {
+      ERR (frm, "Error: cannot go up a level beyond dbpath [%s]\n", frm->dbpath);
+      return false;
+   }
+
+   char *parent = path_resolve (frm->current, "..");
+   if (!parent) {
+      ERR (frm, "Failed to switch directory [..]: %m\n");
+      return false;
+   }
+
+   bool ret = visit (frm, parent);
+   free (parent);
+   return ret;
+}
+
+static bool internal_frm_down (frm_t *frm, const char *target)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      uint32_t node = frm_map_lookup (frm->map, frm->node, target);
+      if (node == FRM_MAP_NONE) {
+         ERR (frm, "Failed to switch to target [%s]\n", target);
+         errno = ENOENT;
+         return false;
+      }
+      return map_visit (frm, node);
+   }
+
+   char *path = path_resolve (frm->current, target);
+   if (!path || !(visit (frm, path))) {
+      ERR (frm, "Failed to switch to target [%s]\n", target);
+      free (path);
+      return false;
+   }
+
+   free (path);
+   return true;
+}
+
+static bool internal_frm_switch (frm_t *frm, const char *target)
+{
+   if (!frm || !target || !target[0]) {
+      ERR (frm, "Error: null objects passed for frm_switching\n");
+      return false;
+   }
+
+   if (frm->map) {
+      return map_switch (frm, target);
+   }
+
+   char *suffixed = isslash (target[strlen(target)-1])
+      ? ds_str_dup (target)
+      : ds_str_cat (target, "/", NULL);
+   if (!suffixed) {
+      ERR (frm, "OOM error allocating suffixed string\n");
+      errno = ENOMEM;
+      return false;
+   }
+
+   char *actual = history_find (frm->dbfd, frm->ids, suffixed);
+   free (suffixed);
+   char *path = path_resolve (NULL, actual ? actual : target);
+   if (!path || !(visit (frm, path))) {
+      ERR (frm, "Failed to switch to target [%s]\n", actual ? actual : target);
+      free (actual);
+      free (path);
+      return false;
+   }
+
+   free (actual);
+   free (path);
+   return true;
+}
+
+static bool internal_frm_switch_direct (frm_t *frm, const char *target)
+{
+   if (!frm || !target || !target[0]) {
+      ERR (frm, "Error: null objects passed for frm_switching\n");
+      return false;
+   }
+
+   if (frm->map) {
+      uint32_t node = frm_map_lookup (frm->map, FRM_MAP_NONE, target);
+      if (node == FRM_MAP_NONE) {
+         ERR (frm, "Failed to switch to target [%s]\n", target);
+         errno = ENOENT;
+         return false;
+      }
+      return map_visit (frm, node);
+   }
+
+   char *path = path_resolve (NULL, target);
+   if (!path || !(visit (frm, path))) {
+      ERR (frm, "Failed to switch to target [%s]\n", target);
+      free (path);
+      return false;
+   }
+
+   free (path);
+   return true;
+}
+
+static bool internal_frm_back (frm_t *frm, size_t index)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = ENOENT;
+      return false;
+   }
+
+   char *history = internal_frm_history (frm, index + 1);
+   if (!history) {
+      ERR (frm, "Failed to read history: %m\n");
+      return false;
+   }
+
+   if (!history[0]) {
+      ERR (frm, "History file appears to be empty, aborting switch.\n");
+      free (history);
+      return false;
+   }
+
+   // The entry at 'index' is the last line read; if the history is
+   // shorter than 'index' we switch to the oldest entry.
+   history[strlen (history) - 1] = 0;
+   char *line = strrchr (history, '\n');
+   line = line ? line + 1 : history;
+
+   internal_frm_switch (frm, line);
+
+   free (history);
+   return true;
+}
+
+static bool internal_frm_delete (frm_t *frm, const char *target);
+
+void frm_strarray_free (char **array)
+{
+   for (size_t i=0; array && array[i]; i++) {
+      free (array[i]);
+   }
+   free (array);
+}
+
+/* Popped frames are not removed straight away. The frame's directory is
+ * renamed into an entry in the trash directory, which is O(1) however
+ * large the subtree is, and the entry records where the frame came from
+ * so that it can be restored by frm_undo_pop(). frm_gc() removes the
+ * entries for good.
+ *
+ * Entries are named after the time of the pop, so that they sort in the
+ * order of popping. Entries claimed by frm_gc() are renamed with a prefix
+ * under the lock and then removed without it.
+ */
+#define TRASH_DNAME           ".trash"
+#define TRASH_ORIGIN_FNAME    "origin"
+#define TRASH_FRAME_DNAME     "frame"
+#define TRASH_GC_PREFIX       "gc-"
+
+static int trash_open (frm_t *frm, bool create)
+{
+   if (create && !(isdir_at (frm->dbfd, TRASH_DNAME))
+         && (wrapper_mkdir (frm->dbfd, TRASH_DNAME))!=0) {
+      ERR (frm, "Error: failed to create trash [%s]: %m\n", TRASH_DNAME);
+      return -1;
+   }
+
+   return opendir_at (frm->dbfd, TRASH_DNAME);
+}
+
+// Returns a name unique to this process, made of the current time in
+// nanoseconds and a counter, optionally prefixed.
+static void trash_entry_name (char dst[96], const char *prefix)
+{
+   static unsigned int counter = 0;
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME, &ts);
+   snprintf (dst, 96, "%s%020" PRIu64 "-%li-%u", prefix,
+             (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+             (long)getpid (), __sync_fetch_and_add (&counter, 1));
+}
+
+// Moves the frame at path, and everything under it, into the trash.
+static bool trash_frame (frm_t *frm, const char *path)
+{
+   bool error = true;
+   char name[96];
+   int tfd = -1;
+   int efd = -1;
+
+   if ((strcmp (path, "root"))==0) {
+      ERR (frm, "Error: cannot pop the root frame\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if ((tfd = trash_open (frm, true)) < 0) {
+      goto cleanup;
+   }
+
+   trash_entry_name (name, "");
+   if ((wrapper_mkdir (tfd, name))!=0 || (efd = opendir_at (tfd, name)) < 0) {
+      ERR (frm, "Error: failed to create trash entry [%s]: %m\n", name);
+      goto cleanup;
+   }
+
+   if (!(writefile_at (efd, TRASH_ORIGIN_FNAME, path, "\n", NULL))) {
+      ERR (frm, "Error: failed to write trash entry [%s]: %m\n", name);
+      goto cleanup;
+   }
+
+   uint64_t id = frame_id_at (frm->dbfd, path);
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (frm->dbfd, path, efd, TRASH_FRAME_DNAME))!=0) {
+      ERR (frm, "Error: failed to move [%s] to the trash: %m\n", path);
+      goto cleanup;
+   }
+
+   // Nothing under the frame has an ID until frm_undo_pop() restores it.
+   if (id != FRM_ID_NONE && !(frm_ids_remove_tree (frm->ids, id))) {
+      ERR (frm, "Warning: failed to record removal of [%s]\n", path);
+   }
+
+   if (!(index_remove_tree (frm->dbfd, path))) {
+      ERR (frm, "Warning: failed to remove [%s] from index\n", path);
+   }
+
+   error = false;
+
+cleanup:
+   if (error && efd >= 0) {
+      unlinkat (efd, TRASH_ORIGIN_FNAME, 0);
+      unlinkat (tfd, name, AT_REMOVEDIR);
+   }
+   if (efd >= 0) {
+      close (efd);
+   }
+   if (tfd >= 0) {
+      close (tfd);
+   }
+   return !error;
+}
+
+// Records the IDs of the frames at paths again after they were removed,
+// given the ID of the parent of the first. The paths are in the order
+// that tree_collect() returns them: the parent of each one comes before
+// it, and the parents of consecutive frames are in order.
+static bool ids_restore (frm_t *frm, char **paths, size_t npaths,
+                         uint64_t parent_id)
+{
+   bool error = true;
+   uint64_t *found = calloc (npaths + 1, sizeof *found);
+   uint64_t *ids = calloc (npaths + 1, sizeof *ids);
+   uint64_t *parents = calloc (npaths + 1, sizeof *parents);
+   const char **names = calloc (npaths + 1, sizeof *names);
+   size_t n = 0;
+
+   if (!found || !ids || !parents || !names) {
+      ERR (frm, "OOM error restoring IDs\n");
+      goto cleanup;
+   }
+
+   for (size_t i=0, p=0; i<npaths; i++) {
+      found[i] = frame_id_at (frm->dbfd, paths[i]);
+      const char *slash = strrslash (paths[i]);
+      if (!slash)
+         continue;
+      size_t plen = slash - paths[i];
+      while (i && p < i && (strlen (paths[p]) != plen
+               || (strncmp (paths[p], paths[i], plen))!=0))
+         p++;
+
+      // Frames made before IDs were added to the framedb have none.
+      if (found[i] == FRM_ID_NONE)
+         continue;
+      ids[n] = found[i];
+      parents[n] = i ? found[p] : parent_id;
+      names[n] = &slash[1];
+      n++;
+   }
+
+   error = n && !(frm_ids_set_many (frm->ids, n, ids, parents, names));
+
+cleanup:
+   free (found);
+   free (ids);
+   free (parents);
+   free (names);
+   return !error;
+}
+
+// Returns the paths of the frame at path and all the frames under it.
+static char **tree_collect (frm_t *frm, const char *path)
+{
+   bool error = true;
+   char **ret = NULL;
+   ds_array_t *paths = ds_array_new ();
+   char *tmp = ds_str_dup (path);
+   if (!paths || !tmp || !(ds_array_ins_tail (paths, tmp))) {
+      ERR (frm, "OOM error collecting frames under [%s]\n", path);
+      free (tmp);
+      goto cleanup;
+   }
+
+   // The array is its own queue: each directory appends its children.
+   for (size_t i=0; i<ds_array_length (paths); i++) {
+      const char *parent = ds_array_get (paths, i);
+      int fd = opendir_at (frm->dbfd, parent);
+      DIR *dirp = fd >= 0 ? fdopendir (fd) : NULL;
+      if (!dirp) {
+         ERR (frm, "Error: failed to read directory [%s]: %m\n", parent);
+         if (fd >= 0) {
+            close (fd);
+         }
+         goto cleanup;
+      }
+
+      struct dirent *de;
+      while ((de = readdir (dirp))) {
+         FRM_STATS_ADD (readdirs, 1);
+         if (de->d_name[0] == '.' || !(wrapper_isdir (fd, de)))
+            continue;
+         tmp = ds_str_cat (parent, "/", de->d_name, NULL);
+         if (!tmp || !(ds_array_ins_tail (paths, tmp))) {
+            ERR (frm, "OOM error collecting frames under [%s]\n", path);
+            free (tmp);
+            closedir (dirp);
+            goto cleanup;
+         }
+      }
+      closedir (dirp);
+   }
+
+   size_t npaths = ds_array_length (paths);
+   if (!(ret = calloc (npaths + 1, sizeof *ret))) {
+      ERR (frm, "OOM error collecting frames under [%s]\n", path);
+      goto cleanup;
+   }
+   for (size_t i=0; i<npaths; i++) {
+      ret[i] = ds_array_get (paths, i);
+   }
+
+   error = false;
+
+cleanup:
+   while (error && ds_array_length (paths)) {
+      free (ds_array_rm_tail (paths));
+   }
+   ds_array_del (paths);
+   return ret;
+}
+
+static bool internal_frm_undo_pop (frm_t *frm)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      ERR (frm, "Error: popped frames cannot be restored in a mapped framedb\n");
+      errno = ENOTSUP;
+      return false;
+   }
+
+   if (!(batch_flush (frm))) {
+      return false;
+   }
+
+   bool error = true;
+   char *name = NULL;
+   char *origin = NULL;
+   char **paths = NULL;
+   DIR *dirp = NULL;
+   int efd = -1;
+
+   int tfd = trash_open (frm, false);
+   if (tfd >= 0 && !(dirp = fdopendir (tfd))) {
+      close (tfd);
+   }
+   if (!dirp) {
+      ERR (frm, "Error: there are no popped frames to restore\n");
+      errno = ENOENT;
+      goto cleanup;
+   }
+
+   struct dirent *de;
+   while ((de = readdir (dirp))) {
+      FRM_STATS_ADD (readdirs, 1);
+      if (de->d_name[0] == '.'
+            || (strncmp (de->d_name, TRASH_GC_PREFIX, strlen (TRASH_GC_PREFIX)))==0)
+         continue;
+      if (!name || (strcmp (de->d_name, name)) > 0) {
+         free (name);
+         if (!(name = ds_str_dup (de->d_name))) {
+            ERR (frm, "OOM error reading trash\n");
+            goto cleanup;
+         }
+      }
+   }
+
+   if (!name) {
+      ERR (frm, "Error: there are no popped frames to restore\n");
+      errno = ENOENT;
+      goto cleanup;
+   }
+
+   if ((efd = opendir_at (tfd, name)) < 0
+         || !(origin = readfile_at (efd, TRASH_ORIGIN_FNAME))) {
+      ERR (frm, "Error: failed to read trash entry [%s]: %m\n", name);
+      goto cleanup;
+   }
+   origin[strcspn (origin, "\n")] = 0;
+
+   char *slash = strrslash (origin);
+   if (slash) {
+      *slash = 0;
+   }
+   bool parent_exists = slash && isdir_at (frm->dbfd, origin);
+   if (slash) {
+      *slash = '/';
+   }
+   if (!parent_exists) {
+      ERR (frm, "Error: the parent of popped frame [%s] no longer exists\n", origin);
+      errno = ENOENT;
+      goto cleanup;
+   }
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (efd, TRASH_FRAME_DNAME, frm->dbfd, origin))!=0) {
+      ERR (frm, "Error: failed to restore [%s]: %m\n", origin);
+      goto cleanup;
+   }
+   unlinkat (efd, TRASH_ORIGIN_FNAME, 0);
+   unlinkat (tfd, name, AT_REMOVEDIR);
+
+   size_t npaths = 0;
+   if (!(paths = tree_collect (frm, origin))) {
+      goto cleanup;
+   }
+   while (paths[npaths])
+      npaths++;
+
+   *slash = 0;
+   uint64_t parent_id = frame_id_at (frm->dbfd, origin);
+   *slash = '/';
+   if (!(ids_restore (frm, paths, npaths, parent_id))) {
+      ERR (frm, "Warning: failed to record restoring [%s]\n", origin);
+   }
+   if (!(index_merge (frm->dbfd, paths, npaths))) {
+      ERR (frm, "Warning: failed to add [%s] to index\n", origin);
+   }
+
+   // The search index may have dropped the frames while they were popped.
+   search_record_paths (frm, paths);
+   search_flush (frm);
+
+   if (!(visit (frm, origin))) {
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   if (efd >= 0) {
+      close (efd);
+   }
+   if (dirp) {
+      closedir (dirp);
+   }
+   frm_strarray_free (paths);
+   free (origin);
+   free (name);
+   return !error;
+}
+
+// Renames the trash entries that are at least min_age seconds old (and
+// any left behind by an interrupted frm_gc()) so that nothing else will
+// use them, and returns their new names.
+static char **internal_frm_gc_claim (frm_t *frm, uint64_t min_age)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
+   }
+
+   bool error = true;
+   ds_array_t *claimed = ds_array_new ();
+   char **ret = NULL;
+   DIR *dirp = NULL;
+
+   if (!claimed) {
+      ERR (frm, "OOM error allocating trash entries\n");
+      goto cleanup;
+   }
+
+   int tfd = frm->map ? -1 : trash_open (frm, false);
+   if (tfd >= 0 && !(dirp = fdopendir (tfd))) {
+      close (tfd);
+   }
+
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME, &ts);
+   uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+   struct dirent *de;
+   while (dirp && (de = readdir (dirp))) {
+      FRM_STATS_ADD (readdirs, 1);
+      if (de->d_name[0] == '.')
+         continue;
+
+      bool leftover = (strncmp (de->d_name, TRASH_GC_PREFIX,
+                                strlen (TRASH_GC_PREFIX)))==0;
+      uint64_t popped = strtoull (de->d_name, NULL, 10);
+      // Compared in whole seconds, so that no min_age can overflow.
+      if (!leftover && (popped > now || (now - popped) / 1000000000 < min_age))
+         continue;
+
+      char name[96];
+      trash_entry_name (name, TRASH_GC_PREFIX);
+      char *tmp = ds_str_dup (name);
+      if (!tmp || !(ds_array_ins_tail (claimed, tmp))) {
+         ERR (frm, "OOM error allocating trash entries\n");
+         free (tmp);
+         goto cleanup;
+      }
+      FRM_STATS_ADD (renames, 1);
+      if ((renameat (tfd, de->d_name, tfd, name))!=0) {
+         ERR (frm, "Error: failed to claim trash entry [%s]: %m\n", de->d_name);
+         free (ds_array_rm_tail (claimed));
+         goto cleanup;
+      }
+   }
+
+   // Drop the records of removed frames from the ID log while we hold
+   // the lock.
+   if (frm->ids && !(frm_ids_compact (frm->ids))) {
+      ERR (frm, "Warning: failed to compact the ID log: %m\n");
+   }
+
+   size_t nclaimed = ds_array_length (claimed);
+   if (!(ret = calloc (nclaimed + 1, sizeof *ret))) {
+      ERR (frm, "OOM error allocating trash entries\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<nclaimed; i++) {
+      ret[i] = ds_array_get (claimed, i);
+   }
+
+   error = false;
+
+cleanup:
+   // Entries already claimed are removed by a later frm_gc().
+   while (error && ds_array_length (claimed)) {
+      free (ds_array_rm_tail (claimed));
+   }
+   ds_array_del (claimed);
+   if (dirp) {
+      closedir (dirp);
+   }
+   return ret;
+}
+
+// Removes the claimed trash entries. No lock is needed, as nothing else
+// uses claimed entries.
+static bool trash_reclaim (frm_t *frm, char **claimed)
+{
+   if (!claimed || !claimed[0])
+      return claimed != NULL;
+
+   int tfd = trash_open (frm, false);
+   if (tfd < 0) {
+      ERR (frm, "Error: failed to open trash [%s]: %m\n", TRASH_DNAME);
+      return false;
+   }
+
+   bool ret = true;
+   for (size_t i=0; claimed[i]; i++) {
+      if (!(removedir (tfd, claimed[i]))) {
+         ERR (frm, "Error: failed to remove trash entry [%s]\n", claimed[i]);
+         ret = false;
+      }
+   }
+
+   close (tfd);
+   return ret;
+}
+
+static bool internal_frm_pop (frm_t *frm, bool force)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      if (!force && frm_map_child (frm->map, frm->node) != FRM_MAP_NONE) {
+         ERR (frm, "Error: cannot pop a frame that has children\n");
+         errno = ENOTEMPTY;
+         return false;
+      }
+      return map_delete (frm, frm->node);
+   }
 
-static int sort_entries (const void *lhs, const void *rhs)
+   if (!(batch_flush (frm))) {
+      return false;
+   }
+
+   if (!force) {
+      char *current = internal_frm_current (frm);
+      char *prefix = ds_str_cat (current, "/", NULL);
+      free (current);
+      if (!prefix) {
+         ERR (frm, "OOM error allocating prefix for current frame\n");
+         return false;
+      }
+
+      bool has_children = index_exists (frm->dbfd, prefix);
+      free (prefix);
+
+      if (has_children) {
+         ERR (frm, "Error: cannot pop a frame that has children\n");
+         errno = ENOTEMPTY;
+         return false;
+      }
+   }
+
+   char *oldpath = get_path (frm);
+   if (!oldpath) {
+      ERR (frm, "Error: failed to retrieve current working directory: %m\n");
+      return false;
+   }
+
+   if (!(internal_frm_up (frm))) {
+      ERR (frm, "Error: failed to switch to parent frame: %m\n");
+      free (oldpath);
+      return false;
+   }
+
+   if (!(trash_frame (frm, oldpath))) {
+      ERR (frm, "Error: failed to remove path [%s]: %m\n", oldpath);
+      free (oldpath);
+      return false;
+   }
+
+   free (oldpath);
+   return true;
+}
+
+static bool internal_frm_rename (frm_t *frm, const char *newname)
 {
-   const char * const *lstr = lhs;
-   const char * const *rstr = rhs;
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
+   }
 
-   return strcmp (*lstr, *rstr);
+   if (frm->map) {
+      if (!(frm_map_rename (frm->map, frm->node, newname))) {
+         ERR (frm, "Error: failed to rename to [%s]: %m\n", newname);
+         return false;
+      }
+      return true;
+   }
+
+   if (!(batch_flush (frm))) {
+      return false;
+   }
+
+   char *current_name = internal_frm_current (frm);
+   if (!current_name) {
+      ERR (frm, "OOM error retrieving current frame path\n");
+      return false;
+   }
+
+   const char *oldname = strrslash (current_name);
+   if (!oldname) {
+      ERR(frm, "Error: Internal corruption (current node has no slash): [%s]\n",
+               current_name);
+      free (current_name);
+      return false;
+   }
+   oldname++;
+
+   uint64_t id = frame_id_at (frm->dbfd, current_name);
+   if (!(internal_frm_up (frm))) {
+      ERR (frm, "Error: Failed to switch to parent directory [%s/..]: %m\n",
+            oldname);
+      free (current_name);
+      return false;
+   }
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (frm->curfd, oldname, frm->curfd, newname))!=0) {
+      ERR (frm, "Error: failed to rename [%s] to [%s]: %m\n", oldname, newname);
+      free (current_name);
+      return false;
+   }
+
+   // The frame keeps its ID, so only its own record changes.
+   if (id != FRM_ID_NONE
+         && !(frm_ids_set (frm->ids, id, frame_id_at (frm->dbfd, frm->current),
+                           newname))) {
+      ERR (frm, "Warning: failed to record new name of [%s]\n", current_name);
+   }
+
+   char *newpath = path_resolve (frm->current, newname);
+   if (!newpath || !(index_rename_tree (frm->dbfd, current_name, newpath))) {
+      ERR (frm, "Warning: failed to update index for [%s]\n", current_name);
+   }
+   free (newpath);
+   free (current_name);
+
+   if (!(internal_frm_down (frm, newname))) {
+      ERR (frm, "Warning: cannot switch to renamed frame [%s]: %m\n", newname);
+      return false;
+   }
+
+   return true;
 }
 
-static char **index_read (const char *dbpath)
+// Brings the ID log and the index up to date with a move of the frame at
+// src to dst. Each step can be repeated, so this is also used to complete
+// a move that was interrupted.
+static bool move_finish (int dbfd, frm_ids_t *ids, const char *src,
+                         const char *dst)
 {
-   bool error = true;
+   // Interrupted before the directory was renamed: nothing was changed.
+   if (!(isdir_at (dbfd, dst)))
+      return true;
+
+   char *parent = ds_str_dup (dst);
+   char *slash = parent ? strrslash (parent) : NULL;
+   if (!slash) {
+      FRM_ERROR ("Error: invalid move destination [%s]\n", dst);
+      free (parent);
+      return false;
+   }
+   *slash = 0;
 
-   char **lines = NULL;
-   size_t nlines = 0;
-   size_t nbytes = 0;
+   bool ret = true;
+   uint64_t id = frame_id_at (dbfd, dst);
+   if (id != FRM_ID_NONE
+         && !(frm_ids_set (ids, id, frame_id_at (dbfd, parent), &slash[1]))) {
+      FRM_ERROR ("Error: failed to record new location of [%s]\n", dst);
+      ret = false;
+   }
+   free (parent);
+
+   if (!(index_rename_tree (dbfd, src, dst))) {
+      FRM_ERROR ("Error: failed to update index for [%s]\n", src);
+      ret = false;
+   }
+
+   return ret;
+}
+
+static bool move_recover (int dbfd)
+{
+   if ((faccessat (dbfd, MOVE_FNAME, F_OK, 0))!=0)
+      return true;
+
+   char *journal = readfile_at (dbfd, MOVE_FNAME);
+   char *dst = journal ? strchr (journal, '\n') : NULL;
+   char *eol = dst ? strchr (&dst[1], '\n') : NULL;
+   if (!eol) {
+      FRM_ERROR ("Error: corrupt move journal [%s]\n", MOVE_FNAME);
+      free (journal);
+      return false;
+   }
+   *dst++ = 0;
+   *eol = 0;
+
+   frm_ids_t *ids = frm_ids_open (dbfd, IDS_FNAME);
+   bool ret = ids && move_finish (dbfd, ids, journal, dst);
+   if (ret) {
+      unlinkat (dbfd, MOVE_FNAME, 0);
+   }
+   frm_ids_close (ids);
+   free (journal);
+   return ret;
+}
+
+static bool map_move (frm_t *frm, const char *src, const char *dst_parent)
+{
+   uint32_t node = map_resolve (frm, src);
+   uint32_t parent = map_resolve (frm, dst_parent);
+   if (node == FRM_MAP_NONE || parent == FRM_MAP_NONE) {
+      ERR (frm, "Error: cannot find [%s]\n", node == FRM_MAP_NONE ? src : dst_parent);
+      errno = ENOENT;
+      return false;
+   }
+
+   if (!(frm_map_move (frm->map, node, parent))) {
+      ERR (frm, "Error: failed to move [%s] to [%s]: %m\n", src, dst_parent);
+      return false;
+   }
+
+   return true;
+}
+
+static bool internal_frm_move (frm_t *frm, const char *src, const char *dst_parent)
+{
+   if (!frm || !src || !src[0] || !dst_parent || !dst_parent[0]) {
+      ERR (frm, "Error: null objects passed for frm_move\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if (frm->map) {
+      return map_move (frm, src, dst_parent);
+   }
 
-   char *line = NULL;
-   static const size_t line_len = 1024 * 1024;
-   FILE *inf = NULL;
+   if (!(batch_flush (frm))) {
+      return false;
+   }
 
-   char *olddir = NULL;
+   bool error = true;
+   char *dst = NULL;
+   char *journal = NULL;
+   char *newcurrent = NULL;
+   char *srcpath = resolve_frame (frm, src);
+   char *parent = resolve_frame (frm, dst_parent);
+   if (!srcpath || !parent) {
+      goto cleanup;
+   }
 
-   if (!dbpath) {
-      FRM_ERROR ("Error: dbpath is null\n");
+   size_t srclen = strlen (srcpath);
+   if ((strcmp (srcpath, "root"))==0
+         || ((strncmp (parent, srcpath, srclen))==0
+            && (parent[srclen] == 0 || parent[srclen] == '/'))) {
+      ERR (frm, "Error: cannot move [%s] below itself\n", srcpath);
+      errno = EINVAL;
       goto cleanup;
    }
 
-   if (!(olddir = pushdir (dbpath))) {
-      FRM_ERROR ("Error: failed to switch directory: %m\n");
+   if (!(dst = ds_str_cat (parent, strrslash (srcpath), NULL))
+         || !(journal = ds_str_cat (srcpath, "\n", dst, "\n", NULL))) {
+      ERR (frm, "OOM error allocating move paths\n");
+      errno = ENOMEM;
       goto cleanup;
    }
 
-   if (!(inf = fopen ("index", "r"))) {
-      FRM_ERROR ("Error: failed to open index for reading: %m\n");
+   if ((strcmp (srcpath, dst))==0) {
+      error = false;
       goto cleanup;
    }
 
-   if (!(line = malloc (line_len))) {
-      FRM_ERROR ("OOM error allocating line for reading index\n");
+   if ((faccessat (frm->dbfd, dst, F_OK, 0))==0) {
+      ERR (frm, "Error: [%s] already exists\n", dst);
+      errno = EEXIST;
       goto cleanup;
    }
 
-   while ((fgets (line, line_len - 1, inf))) {
-      char *eol = strchr (line, '\n');
-      if (eol)
-         *eol = 0;
+   if (!(replacefile_at (frm->dbfd, MOVE_FNAME, journal))) {
+      ERR (frm, "Error: failed to write move journal: %m\n");
+      goto cleanup;
+   }
 
-      size_t newsize = nlines + 1;
-      char **tmp = realloc (lines, (sizeof *tmp) * (newsize + 1));
-      if (!tmp) {
-         FRM_ERROR ("OOM error allocating storage for index\n");
-         goto cleanup;
-      }
-      tmp[nlines+1] = NULL;
-      if (!(tmp[nlines] = ds_str_dup (line))) {
-         FRM_ERROR ("OOM error allocating index entry\n");
-         free (tmp);
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (frm->dbfd, srcpath, frm->dbfd, dst))!=0) {
+      ERR (frm, "Error: failed to move [%s] to [%s]: %m\n", srcpath, dst);
+      unlinkat (frm->dbfd, MOVE_FNAME, 0);
+      goto cleanup;
+   }
+
+   // The journal stays behind on failure, so that the next frm_init()
+   // can try again.
+   if (!(move_finish (frm->dbfd, frm->ids, srcpath, dst))) {
+      ERR (frm, "Warning: failed to update index for [%s]\n", dst);
+   } else {
+      unlinkat (frm->dbfd, MOVE_FNAME, 0);
+   }
+
+   // The directory is still open, but is now at a different path.
+   if ((strncmp (frm->current, srcpath, srclen))==0
+         && (frm->current[srclen] == 0 || frm->current[srclen] == '/')) {
+      if (!(newcurrent = ds_str_cat (dst, &frm->current[srclen], NULL))
+            || !(set_current (frm, newcurrent))) {
+         ERR (frm, "Error: failed to switch to moved frame [%s]\n", dst);
          goto cleanup;
       }
-      nbytes += strlen (line) + 2;
-      nlines = newsize;
-      lines = tmp;
+      current_record_update (frm);
    }
 
-   qsort (lines, nlines, sizeof *lines, sort_entries);
-
    error = false;
 
 cleanup:
-   popdir (&olddir);
+   free (srcpath);
+   free (parent);
+   free (dst);
+   free (journal);
+   free (newcurrent);
+   return !error;
+}
 
-   if (error) {
-      for (size_t i=0; i<nlines; i++) {
-         free (lines[i]);
-      }
-      free (lines);
-      lines = NULL;
+static bool internal_frm_delete (frm_t *frm, const char *target)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return false;
    }
 
-   if (inf) {
-      fclose (inf);
+   if (frm->map) {
+      return map_delete (frm, frm_map_lookup (frm->map, FRM_MAP_NONE, target));
    }
 
-   free (line);
-   return lines;
-}
-
-static bool internal_frame_create (const char *path,
-                                   const char *name, const char *msg)
-{
-   char *pwd = pushdir (path);
-   if (!pwd) {
-      FRM_ERROR ("Failed to store current working directory\n");
+   if (!(batch_flush (frm))) {
       return false;
    }
 
-   if ((wrapper_mkdir (name))!=0) {
-      FRM_ERROR ("Failed to create directory [%s/%s]: %m\n", path, name);
-      popdir (&pwd);
+   char *path = path_resolve (NULL, target);
+   if (!path) {
+      ERR (frm, "Error: invalid frame path [%s]\n", target);
       return false;
    }
 
-   char *newdir = pushdir (name);
-   if (!newdir) {
-      FRM_ERROR ("Failed to switch directory [%s]\n", name);
-      popdir (&pwd);
+   if ((strcmp (path, "root"))==0) {
+      ERR (frm, "Error: cannot delete the root frame\n");
+      free (path);
+      errno = EINVAL;
       return false;
    }
 
+   uint64_t id = frame_id_at (frm->dbfd, path);
+   bool removed = removedir (frm->dbfd, path);
+   if (!removed) {
+      ERR (frm, "Error: failed to remove directory[%s]: %m\n", path);
+   }
 
-   char tstring[47];
-   if (!(frm_writefile ("info",
-               "mtime: ", uint64_string(tstring, (uint64_t)time(NULL)), "\n",
-               NULL))) {
-      FRM_ERROR ("Failed to create info file [%s/%s/info]: %m\n", path, name);
-      return false;
+   if (id != FRM_ID_NONE && !(frm_ids_remove_tree (frm->ids, id))) {
+      ERR (frm, "Warning: failed to record removal of [%s]\n", path);
    }
 
-   if (!(frm_writefile ("payload", msg, "\n", NULL))) {
-      FRM_ERROR ("Failed to create payload file [%s/%s/payload]: %m\n", path, name);
-      popdir (&newdir);
-      popdir (&pwd);
-      return false;
+   // Even a partial removal invalidates the index entries.
+   if (!(index_remove_tree (frm->dbfd, path))) {
+      ERR (frm, "Warning: failed to remove [%s] from index\n", path);
    }
 
-   if (!(frm_writefile ("index", "", NULL))) {
-      FRM_ERROR ("Warning: failed to update index\n");
+   free (path);
+   if (!removed) {
+      return false;
    }
 
-   popdir (&newdir);
-   popdir (&pwd);
    return true;
 }
 
-/* ********************************************************** */
-/* ********************************************************** */
-/* ********************************************************** */
+static char **match (frm_t *frm, const char *sterm,
+      uint32_t flags, const char *from)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
+   }
 
-static void frm_free (frm_t *frm)
+   if (!(batch_flush (frm))) {
+      return NULL;
+   }
+
+   // The trigram index narrows a substring search down to the paths
+   // that might match. Without it, every path in the range is checked.
+   if (!(flags & (FRM_MATCH_INVERT | FRM_MATCH_ICASE | FRM_MATCH_GLOB))
+         && strlen (sterm) >= FRM_TRIGRAM_MIN) {
+      char **results = frm_trigram_match (frm->dbfd, INDEX_FNAME, from, sterm);
+      if (results)
+         return results;
+   }
+
+   struct matcher_t m;
+   if (!(matcher_init (&m, sterm, flags))) {
+      int err = errno;
+      ERR (frm, "Error: invalid search term [%s]\n", sterm);
+      errno = err;
+      return NULL;
+   }
+
+   char **results = index_match (frm->dbfd, from, &m);
+   matcher_fini (&m);
+   if (!results) {
+      ERR (frm, "Error: failed to read index\n");
+      return NULL;
+   }
+
+   return results;
+}
+
+static char **internal_frm_list (frm_t *frm, const char *from)
 {
    if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
       errno = ENOENT;
-      return;
+      return NULL;
+   }
+
+   if (frm->map) {
+      uint32_t node = map_resolve (frm, from);
+      if (node == FRM_MAP_NONE) {
+         ERR (frm, "Error: failed to switch path to [%s]\n", from);
+         errno = ENOENT;
+         return NULL;
+      }
+      return map_collect (frm, node, false, "", 0);
+   }
+
+   char *current = resolve_frame (frm, from);
+   if (!current) {
+      ERR (frm, "Error: failed to switch path to [%s]\n", from);
+      return NULL;
+   }
+
+   char *prefixed_current = ds_str_cat (current, "/", NULL);
+   if (!prefixed_current) {
+      ERR (frm, "OOM error allocating temporary string for current frame\n");
+      free (current);
+      return NULL;
+   }
+   free (current);
+
+   char **ret = match (frm, "", 0, prefixed_current);
+   free (prefixed_current);
+   return ret;
+}
+
+static char **internal_frm_match_at (frm_t *frm, const char *fpath,
+                                     const char *sterm, uint32_t flags)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
+   }
+
+   if (frm->map) {
+      uint32_t node = map_resolve (frm, fpath);
+      if (node == FRM_MAP_NONE) {
+         ERR (frm, "Error: no frame found at [%s]\n", fpath);
+         errno = ENOENT;
+         return NULL;
+      }
+      return map_collect (frm, node, node != FRM_MAP_ROOT, sterm, flags);
+   }
+
+   char *from = fpath && fpath[0]
+      ? resolve_frame (frm, fpath)
+      : internal_frm_current (frm);
+   if (!from) {
+      ERR (frm, "Failed to retrieve the frame [%s]\n", fpath ? fpath : "");
+      return NULL;
+   }
+
+   char **results = match (frm, sterm, flags, from);
+   free (from);
+   return results;
+}
+
+static char **internal_frm_match_from_root (frm_t *frm, const char *sterm, uint32_t flags)
+{
+   if (frm && frm->map) {
+      return map_collect (frm, FRM_MAP_ROOT, false, sterm, flags);
+   }
+
+   return match (frm, sterm, flags, "root");
+}
+
+// Drops, in place, the paths that did not match.
+static char **grep_filter (char **paths, const bool *matches)
+{
+   size_t npaths = 0;
+   for (size_t i=0; paths[i]; i++) {
+      if (matches[i]) {
+         paths[npaths++] = paths[i];
+      } else {
+         free (paths[i]);
+      }
    }
-
-   free (frm->dbpath);
-   free (frm->olddir);
-   free (frm->lastmsg);
-   free (frm);
+   paths[npaths] = NULL;
+   return paths;
 }
 
-static frm_t *frm_alloc (const char *dbpath, const char *olddir)
+static char **map_grep (frm_t *frm, const char *fpath, const char *regex)
 {
-   frm_t *ret = calloc (1, sizeof *ret);
-   if (!ret) {
-      FRM_ERROR ("OOM error allocating frm_t");
+   uint32_t node = map_resolve (frm, fpath);
+   if (node == FRM_MAP_NONE) {
+      ERR (frm, "Error: no frame found at [%s]\n", fpath);
+      errno = ENOENT;
       return NULL;
    }
 
-   ret->dbpath = ds_str_dup (dbpath);
-   ret->olddir = ds_str_dup (olddir);
-   ret->lastmsg = ds_str_dup ("Success");
+   char **paths = map_collect (frm, node, true, "", 0);
+   if (!paths)
+      return NULL;
 
-   if (!ret->dbpath || !ret->olddir || !ret->lastmsg) {
-      FRM_ERROR ("Failed to allocate fields [dbpath:%p], [olddir:%p]\n",
-               ret->dbpath, ret->olddir);
-      frm_free (ret);
-      ret = NULL;
-   }
+   size_t npaths = 0;
+   while (paths[npaths])
+      npaths++;
 
-   size_t dbpath_len = strlen (dbpath);
-   if (isslash (ret->dbpath[dbpath_len-1]))
-      ret->dbpath[dbpath_len-1] = 0;
+   bool *matches = NULL;
+   char **payloads = calloc (npaths + 1, sizeof *payloads);
+   for (size_t i=0; payloads && i<npaths; i++) {
+      uint32_t n = frm_map_lookup (frm->map, FRM_MAP_NONE, paths[i]);
+      payloads[i] = n == FRM_MAP_NONE ? NULL : frm_map_payload (frm->map, n);
+   }
+   if (!payloads) {
+      ERR (frm, "OOM error allocating payloads\n");
+   } else if (!(matches = frm_grep_texts (payloads, npaths, regex))) {
+      int err = errno;
+      ERR (frm, "Error: failed to search payloads for [%s]\n", regex);
+      errno = err;
+   }
 
-   return ret;
-}
+   for (size_t i=0; payloads && i<npaths; i++) {
+      free (payloads[i]);
+   }
+   free (payloads);
+   if (!matches) {
+      frm_strarray_free (paths);
+      return NULL;
+   }
 
-void frm_mem_free (void *ptr)
-{
-   free (ptr);
+   grep_filter (paths, matches);
+   free (matches);
+   return paths;
 }
 
-char *frm_readfile (const char *name)
+// Returns the frame at fpath, and every frame under it, whose payload
+// matches regex, in the order of the index.
+static char **internal_frm_grep (frm_t *frm, const char *fpath, const char *regex)
 {
-   FILE *inf = fopen (name, "r");
-   if (!inf) {
-      // Commenting this out - caller must print out the fname of the failing
-      // frm_readfile(fname) call.
-      // FRM_ERROR ("Failed to open [%s] for reading: %m\n", name);
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
       return NULL;
    }
 
-   if ((fseek (inf, 0, SEEK_END))!=0) {
-      FRM_ERROR ("Failed to seek EOF [%s]: %m\n", name);
-      fclose (inf);
+   if (!regex) {
+      ERR (frm, "Error: null regular expression\n");
+      errno = EINVAL;
       return NULL;
    }
 
-   long len = ftell (inf);
-   if (len < 0) {
-      FRM_ERROR ("Failed to determine file length [%s]: %m\n", name);
-      fclose (inf);
-      return NULL;
+   if (frm->map) {
+      return map_grep (frm, fpath, regex);
    }
 
-   if ((fseek (inf, 0, SEEK_SET))!=0) {
-      FRM_ERROR ("Failed to reset file position [%s]: %m\n", name);
-      fclose (inf);
+   if (!(batch_flush (frm))) {
       return NULL;
    }
 
-   char *ret = malloc (len + 2);
-   if (!ret) {
-      FRM_ERROR ("OOM error allocating file contents [%s]\n", name);
-      fclose (inf);
-      return NULL;
+   bool error = true;
+   char *prefix = NULL;
+   char **below = NULL;
+   char **paths = NULL;
+   bool *matches = NULL;
+
+   char *from = fpath && fpath[0]
+      ? resolve_frame (frm, fpath)
+      : internal_frm_current (frm);
+   if (!from) {
+      ERR (frm, "Failed to retrieve the frame [%s]\n", fpath ? fpath : "");
+      goto cleanup;
    }
 
-   size_t nbytes = fread (ret, 1, len+1, inf);
-   if (!feof (inf) || ferror (inf)) {
-      FRM_ERROR ("Read [%zu of %li] bytes in [%s]: %m\n", nbytes, len, name);
-      fclose (inf);
-      free (ret);
-      return NULL;
+   if (!(prefix = ds_str_cat (from, "/", NULL))
+         || !(below = index_range (frm->dbfd, prefix))) {
+      ERR (frm, "Error: failed to read index\n");
+      goto cleanup;
    }
 
-   fclose (inf);
-   ret[len] = 0;
-   return ret;
-}
+   size_t npaths = 1;
+   while (below[npaths - 1])
+      npaths++;
 
-bool frm_vwritefile (const char *name, const char *data, va_list ap)
-{
-   FILE *outf = fopen (name, "wt");
-   if (!outf) {
-      FRM_ERROR ("Failed to open [%s] for writing: %m\n", name);
-      return false;
+   if (!(paths = calloc (npaths + 1, sizeof *paths))) {
+      ERR (frm, "OOM error allocating %zu paths\n", npaths);
+      goto cleanup;
    }
+   paths[0] = from;
+   memcpy (&paths[1], below, (npaths - 1) * sizeof *paths);
+   from = NULL;
+   free (below);
+   below = NULL;
 
-   while (data) {
-      fprintf (outf, "%s", data);
-      data = va_arg (ap, const char *);
+   if (!(matches = frm_grep_scan (frm->dbfd, paths, npaths, regex))) {
+      int err = errno;
+      ERR (frm, "Error: failed to search payloads for [%s]\n", regex);
+      errno = err;
+      goto cleanup;
    }
-   fclose (outf);
-   return true;
+
+   grep_filter (paths, matches);
+   error = false;
+
+cleanup:
+   if (error) {
+      frm_strarray_free (paths);
+      paths = NULL;
+   }
+   frm_strarray_free (below);
+   free (matches);
+   free (prefix);
+   free (from);
+   return paths;
 }
 
-bool frm_writefile (const char *fname, const char *data, ...)
+// Creates the search index from the payload of every frame.
+static bool search_build (frm_t *frm)
 {
-   va_list ap;
+   char **paths = tree_collect (frm, "root");
+   if (!paths)
+      return false;
 
-   va_start (ap, data);
-   bool ret = frm_vwritefile (fname, data, ap);
-   va_end (ap);
+   search_record_paths (frm, paths);
+   frm_strarray_free (paths);
 
+   frm_search_batch_t *batch = frm->search ? frm->search : frm_search_batch_new ();
+   frm->search = NULL;
+   bool ret = batch && frm_search_create (frm->dbfd, batch);
+   if (!ret) {
+      ERR (frm, "Error: failed to create the search index\n");
+   }
+   frm_search_batch_del (batch);
    return ret;
 }
 
-const char *frm_homepath (void)
+// Only the write lock may build the search index. Under the read lock
+// a search that finds the index missing or damaged sets *stale instead,
+// for the caller to search again under the write lock.
+static char **internal_frm_search (frm_t *frm, const char *query, size_t limit,
+                                   bool *stale)
 {
-   static bool set = false;
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
+   }
 
-   if (set) {
-      return getenv ("HOME");
+   if (frm->map) {
+      ERR (frm, "Error: full-text search is not supported in a mapped framedb\n");
+      errno = ENOTSUP;
+      return NULL;
    }
 
+   if (!(batch_flush (frm))) {
+      return NULL;
+   }
 
-#ifdef PLATFORM_Windows
-   const char *homedrive = getenv ("HOMEDRIVE");
-   const char *homepath = getenv ("HOMEPATH");
-   char *winhome = NULL;
-   if ((ds_str_printf (&winhome, "HOME=%s%s", homedrive, homepath)) == 0) {
-      FRM_ERROR ("OOM error allocating environment variable [%s=%s]\n",
-            homedrive, homepath);
+   // The first search indexes every payload, and so does a search that
+   // finds the index damaged.
+   struct frm_search_hit_t *hits = NULL;
+   size_t nhits = 0;
+   for (int attempt=0; attempt<2 && !hits; attempt++) {
+      if (attempt > 0 || !(frm_search_exists (frm->dbfd))) {
+         if (!frm->db->writing) {
+            *stale = true;
+            return NULL;
+         }
+         if (!(search_build (frm)))
+            return NULL;
+      }
+      hits = frm_search_query (frm->dbfd, query, limit, search_live, frm, &nhits);
+   }
+   if (!hits) {
+      ERR (frm, "Error: failed to search for [%s]\n", query ? query : "");
       return NULL;
    }
 
-   if (!winhome) {
-      FRM_ERROR ("Failed to set $HOME variable: [%s][%s][%s]\n",
-            homedrive, homepath, winhome);
-      free (winhome);
+   char **ret = calloc (nhits + 1, sizeof *ret);
+   if (!ret) {
+      ERR (frm, "OOM error allocating search results\n");
+      free (hits);
       return NULL;
    }
 
-   if ((putenv (winhome)) != 0) {
-      FRM_ERROR ("Warning: failed to set environment [%s]: %m\n", winhome);
+   size_t nret = 0;
+   for (size_t i=0; i<nhits; i++) {
+      if ((ret[nret] = frm_ids_path (frm->ids, hits[i].id))) {
+         nret++;
+      }
    }
+   free (hits);
+   return ret;
+}
 
-   free (winhome);
-   homedrive = NULL;
-   homepath = NULL;
-   winhome = NULL;
-#endif
 
-   return getenv ("HOME");
+// The most recently visited frames, other than the current one, score up
+// to FUZZY_RECENT_BONUS extra points in frm_fuzzy(), the most recent one
+// the most.
+#define FUZZY_RECENT          (64)
+#define FUZZY_RECENT_BONUS    (32)
+
+struct fuzzy_recent_t {
+   const char *path;
+   size_t len;
+   int32_t bonus;
+};
+
+static int fuzzy_recent_cmp (const void *lhs, const void *rhs)
+{
+   const struct fuzzy_recent_t *l = lhs, *r = rhs;
+   size_t len = l->len < r->len ? l->len : r->len;
+   int ret = memcmp (l->path, r->path, len);
+   return ret ? ret : (l->len > r->len) - (l->len < r->len);
 }
 
-frm_t *frm_create (const char *dbpath)
+static int32_t fuzzy_recent_bonus (void *arg, const char *line, size_t len)
 {
-   if ((wrapper_mkdir (dbpath))!=0) {
-      FRM_ERROR ("Failed to create directory [%s]: %m\n", dbpath);
-      return NULL;
-   }
+   const struct fuzzy_recent_t *recent = arg;
+   size_t nrecent = 0;
+   while (recent[nrecent].path)
+      nrecent++;
+
+   struct fuzzy_recent_t key = { line, len, 0 };
+   const struct fuzzy_recent_t *found = nrecent
+      ? bsearch (&key, recent, nrecent, sizeof *recent, fuzzy_recent_cmp)
+      : NULL;
+   return found ? found->bonus : 0;
+}
 
-   if (!(internal_frame_create (dbpath, "root", "ENTER YOUR NOTES HERE"))) {
-      FRM_ERROR ("Failed to create frame [%s/root]: %m\n", dbpath);
+// Splits history, in place, into the distinct recently visited frames,
+// sorted by path. The last entry has a NULL path.
+static struct fuzzy_recent_t *fuzzy_recent (char *history, const char *current)
+{
+   struct fuzzy_recent_t *ret = calloc (FUZZY_RECENT + 1, sizeof *ret);
+   if (!ret)
       return NULL;
+
+   size_t nrecent = 0;
+   char *sptr = NULL;
+   for (char *path = strtok_r (history, "\n", &sptr); path;
+         path = strtok_r (NULL, "\n", &sptr)) {
+      if ((strcmp (path, current))==0)
+         continue;
+
+      bool seen = false;
+      for (size_t i=0; !seen && i<nrecent; i++) {
+         seen = (strcmp (ret[i].path, path))==0;
+      }
+      if (!seen) {
+         ret[nrecent].path = path;
+         ret[nrecent].len = strlen (path);
+         ret[nrecent].bonus = FUZZY_RECENT_BONUS * (FUZZY_RECENT - nrecent) / FUZZY_RECENT;
+         nrecent++;
+      }
    }
 
-   char *pwd = pushdir (dbpath);
-   if (!pwd) {
-      FRM_ERROR ("Failed to store current working directory\n");
-      return NULL;
+   if (nrecent) {
+      qsort (ret, nrecent, sizeof *ret, fuzzy_recent_cmp);
    }
+   return ret;
+}
 
-   if (!(history_append (dbpath, "root"))) {
-      FRM_ERROR ("Failed to set the working frame to [root]\n");
-      popdir (&pwd);
+// Returns the paths of every frame in a mapped framedb, one per line.
+static char *map_lines (frm_t *frm, size_t *len)
+{
+   char **paths = map_collect (frm, FRM_MAP_ROOT, false, "", 0);
+   if (!paths)
       return NULL;
+
+   *len = 0;
+   for (size_t i=0; paths[i]; i++) {
+      *len += strlen (paths[i]) + 1;
    }
 
-   if (!(frm_writefile("index", "", NULL))) {
-      FRM_ERROR ("Error: failed to write index: %m\n");
-      popdir (&pwd);
-      return NULL;
+   char *ret = malloc (*len + 1);
+   if (!ret) {
+      ERR (frm, "OOM error allocating %zu bytes of paths\n", *len);
    }
-   popdir (&pwd);
-   return frm_init (dbpath);
+   for (size_t i=0, offset=0; ret && paths[i]; i++) {
+      size_t plen = strlen (paths[i]);
+      memcpy (&ret[offset], paths[i], plen);
+      ret[offset + plen] = '\n';
+      offset += plen + 1;
+   }
+   frm_strarray_free (paths);
+   return ret;
 }
 
-frm_t *frm_init (const char *dbpath)
+static char **internal_frm_fuzzy (frm_t *frm, const char *query, size_t limit)
 {
-   bool error = true;
-   frm_t *ret = NULL;
-   char *history = NULL, *frame = NULL, *newpath = NULL;
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
+   }
 
-   char *pwd = pushdir (dbpath);
-   if (!pwd) {
-      FRM_ERROR ("Failed to switch directory to [%s]: %m\n", dbpath);
-      goto cleanup;
+   if (!frm->map && !(batch_flush (frm))) {
+      return NULL;
    }
 
-   int fd = -1;
-   if ((fd = open (lockfile, O_CREAT|O_EXCL, S_IRWXU))<0) {
-      FRM_ERROR ("Error: Failed to create lockfile [%s][%s]: %m\n",
-               dbpath, lockfile);
+   bool error = true;
+   char **ret = NULL;
+   char *current = internal_frm_current (frm);
+   char *history = internal_frm_history (frm, FUZZY_RECENT);
+   struct fuzzy_recent_t *recent = NULL;
+   struct index_map_t im = { -1, NULL, 0 };
+   char *mapped = NULL;
+   struct frm_fuzzy_hit_t *hits = NULL;
+   size_t nhits = 0;
+
+   if (!current || !history || !(recent = fuzzy_recent (history, current))) {
+      ERR (frm, "Error: failed to read the recently visited frames\n");
       goto cleanup;
    }
 
-   // TODO: replace this with frm_history
-   history = frm_readfile ("history");
-   frame = NULL;
-   if (!history) {
-      FRM_ERROR ("Warning: no history found, defaulting to root frame\n");
-      frame = ds_str_dup ("root");
+   const char *lines = NULL;
+   size_t len = 0;
+   if (frm->map) {
+      if (!(lines = mapped = map_lines (frm, &len)))
+         goto cleanup;
    } else {
-      char *eol = strchr (history, '\n');
-      if (!eol) {
-         eol = &history[strlen (history)];
-      }
-      *eol = 0;
-      frame = ds_str_dup (history);
-      if (!frame) {
-         FRM_ERROR ("OOM error copying last working frame path\n");
+      if (!(index_map_open (&im, frm->dbfd))) {
+         ERR (frm, "Error: failed to read index\n");
          goto cleanup;
       }
+      lines = im.data;
+      len = im.len;
    }
 
-   newpath = pushdir (frame);
-   if (!newpath) {
-      FRM_ERROR ("Failed to switch to frame [%s]: %m\n", frame);
+   hits = frm_fuzzy_rank (lines, len, query, limit, fuzzy_recent_bonus, recent,
+                          &nhits);
+   if (!hits) {
+      ERR (frm, "Error: failed to match [%s]\n", query ? query : "");
       goto cleanup;
    }
 
-   if (!(ret = frm_alloc (dbpath, pwd))) {
-      FRM_ERROR ("OOM error allocating frm_t\n");
+   if (!(ret = calloc (nhits + 1, sizeof *ret))) {
+      ERR (frm, "OOM error allocating %zu matches\n", nhits);
       goto cleanup;
    }
+   for (size_t i=0; i<nhits; i++) {
+      if (!(ret[i] = malloc (hits[i].len + 1))) {
+         ERR (frm, "OOM error allocating match\n");
+         goto cleanup;
+      }
+      memcpy (ret[i], &lines[hits[i].offset], hits[i].len);
+      ret[i][hits[i].len] = 0;
+   }
 
    error = false;
 
 cleanup:
-   if ((close (fd)) != 0) {
-      FRM_ERROR ("Error: unable to close lockfile descriptor %i: %m\n", fd);
-   }
-
-   free (pwd);
-   free (history);
-   free (frame);
-   free (newpath);
    if (error) {
-      frm_close (ret);
+      frm_strarray_free (ret);
+      ret = NULL;
    }
-
+   free (hits);
+   free (mapped);
+   index_map_close (&im);
+   free (recent);
+   free (history);
+   free (current);
    return ret;
 }
 
-void frm_close (frm_t *frm)
+
+/* ************************************************************ */
+
+
+struct frm_node_t {
+   const frm_node_t *parent;
+   ds_array_t *children;
+
+   char *name;
+   uint64_t date;
+
+   // The children are only read from the framedb the first time that
+   // they are asked for (see node_load()).
+   frm_t *frm;
+   uint32_t map_node;
+   bool loaded;
+
+   uint64_t id;
+};
+
+static void node_del (frm_node_t *node)
 {
-   if (!frm) {
-      errno = ENOENT;
+   if (!node)
       return;
-   }
 
-   popdir (&frm->olddir);
-   if ((chdir (frm->dbpath))!=0) {
-      ERR (frm, "Error: Failed to switch to dbpath [%s]: %m\n", frm->dbpath);
-      ERR (frm, "Warning: lockfile must be maually deleted [%s][%s]\n",
-               frm->dbpath, lockfile);
-   } else {
-      errno = 0;
-      if ((remove (lockfile))!=0) {
-         ERR (frm, "Error: Failed to remove [%s][%s]: %m\n", frm->dbpath, lockfile);
-         ERR (frm, "Warning: lockfile must be maually deleted [%s/%s]\n",
-               frm->dbpath, lockfile);
+   size_t nchildren = ds_array_length(node->children);
+   for (size_t i=0; i<nchildren; i++) {
+      frm_node_t *child = ds_array_get(node->children, i);
+      if (!child) {
+         FRM_ERROR ("Possible corruption, attempt to overflow array: %zu\n", i);
       }
+      node_del (child);
    }
-
-   free (frm->dbpath);
-   free (frm->lastmsg);
-   free (frm);
+   ds_array_del (node->children);
+   free (node->name);
+   free (node);
 }
 
-char *frm_history (frm_t *frm, size_t count)
+static frm_node_t *node_new (const frm_node_t *parent,
+                             const char *name, uint64_t date)
 {
-   if (!frm) {
-      FRM_ERROR ("Found null object for frm_t\n");
-      errno = EINVAL;
-      return ds_str_dup ("");
+   frm_node_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating node\n");
+      return NULL;
    }
 
-   return history_read(frm->dbpath, count);
-}
-
-char *frm_current (frm_t *frm)
-{
-   if (!frm) {
-      FRM_ERROR ("Error, null object passed for frm_t\n");
-      errno = EINVAL;
-      return ds_str_dup ("");
-   }
-   char *tmp = getcwd (NULL, 0);
-   if (!tmp) {
-      ERR (frm, "Failed to get the current working directory\n");
-      tmp = ds_str_dup ("");
+   if (!(ret->children = ds_array_new ())) {
+      FRM_ERROR ("OOM error allocating array object for children\n");
+      free (ret);
+      return NULL;
    }
 
-   char *pattern = ds_str_cat (frm->dbpath, FRM_DIR_SEPARATOR, NULL);
-   char *ret = ds_str_strsubst(tmp, pattern, "", NULL);
-   free (pattern);
-   if (!ret) {
-      ERR (frm, "OOM error allocating current path\n");
-      ret = ds_str_dup ("");
+   ret->parent = parent;
+   ret->date = date;
+   ret->frm = parent ? parent->frm : NULL;
+   ret->map_node = FRM_MAP_NONE;
+
+   if (!(ret->name = ds_str_dup (name))) {
+      FRM_ERROR ("OOM error allocating name field for node\n");
+      node_del (ret);
+      ret = NULL;
    }
 
-   free (tmp);
    return ret;
 }
 
-char *frm_payload (void)
+// Returns the path of the node relative to the dbpath, eg. "root/a/b".
+static char *node_path (const frm_node_t *node)
 {
-   char *ret = frm_readfile ("payload");
+   if (!node->parent)
+      return ds_str_dup (node->name);
+
+   char *parent_path = node_path (node->parent);
+   if (!parent_path) {
+      FRM_ERROR ("OOM error getting parent path of [%s]\n", node->name);
+      return NULL;
+   }
+
+   char *ret = ds_str_cat (parent_path, "/", node->name, NULL);
    if (!ret) {
-      FRM_ERROR ("Failed to read [payload]: %m\n");
-      return ds_str_dup ("");
+      FRM_ERROR ("OOM error joining name [%s] to parent path [%s]\n",
+               node->name, parent_path);
    }
+   free (parent_path);
 
    return ret;
 }
 
-struct info_t {
-   uint64_t mtime;
-};
+static bool node_load_map (frm_node_t *node)
+{
+   FRM_TRACE_SPAN ("node_load_map");
+
+   frm_map_t *map = node->frm->map;
+   uint32_t child = frm_map_child (map, node->map_node);
+   for (; child != FRM_MAP_NONE; child = frm_map_sibling (map, child)) {
+      frm_node_t *tmp = node_new (node, frm_map_name (map, child),
+                                  frm_map_mtime (map, child));
+      if (!tmp || !(ds_array_ins_tail (node->children, tmp))) {
+         FRM_ERROR ("OOM error adding child [%u] to [%s]\n", child, node->name);
+         node_del (tmp);
+         return false;
+      }
+      tmp->map_node = child;
+   }
+
+   return true;
+}
 
-static bool read_info (struct info_t *dst, const char *fname)
+static bool node_load_dir (frm_node_t *node)
 {
-   char *data = frm_readfile(fname);
-   if (!data) {
-      FRM_ERROR ("Failed to read [%s]: %m\n", fname);
-      return false;
+   FRM_TRACE_SPAN ("node_load_dir");
+
+   bool error = true;
+   DIR *dirp = NULL;
+   int fd = -1;
+   char *path = node_path (node);
+
+   if (!path) {
+      FRM_ERROR ("OOM error allocating directory name for [%s]\n", node->name);
+      goto cleanup;
    }
 
-   memset (dst, 0, sizeof *dst);
+   if ((fd = opendir_at (node->frm->dbfd, path)) < 0
+         || !(dirp = fdopendir (fd))) {
+      FRM_ERROR ("Error: failed to read directory [%s]: %m\n", path);
+      goto cleanup;
+   }
 
-   char *name = NULL;
-   char *sptr = NULL;
-   char *tok = strtok_r (data, "\n", &sptr);
-   do {
-      free (name);
-      if (!(name = ds_str_dup (tok))) {
-         FRM_ERROR ("OOM error allocating info fields\n");
-         free (data);
-         return false;
-      }
-      char *value = strchr (name, ':');
-      if (value) {
-         *value++ = 0;
+   struct dirent *de;
+   while ((de = readdir (dirp))) {
+      FRM_STATS_ADD (readdirs, 1);
+      if (de->d_name[0] == '.' || !(wrapper_isdir (fd, de)))
+         continue;
+
+      struct info_t info;
+      char *info_fname = ds_str_cat (de->d_name, "/info", NULL);
+      if (!info_fname || !(read_info (&info, fd, info_fname))) {
+         FRM_ERROR ("Error: failed to read child [%s] of [%s]: %m\n",
+                  de->d_name, path);
+         free (info_fname);
+         goto cleanup;
       }
+      free (info_fname);
 
-      if ((strcmp (name, "mtime"))==0) {
-         if ((sscanf (value, "%" PRIu64, &dst->mtime))!=1) {
-            FRM_ERROR ("Could not parse date value [%s]\n", value);
-         }
+      frm_node_t *child = node_new (node, de->d_name, info.mtime);
+      if (child) {
+         child->id = info.id;
       }
-   } while ((tok = strtok_r (NULL, "\n", &sptr)));
-   free (name);
-   free (data);
-   return true;
+      if (!child || !(ds_array_ins_tail (node->children, child))) {
+         FRM_ERROR ("OOM error adding child [%s] to [%s]\n", de->d_name, path);
+         node_del (child);
+         goto cleanup;
+      }
+   }
+
+   error = false;
+
+cleanup:
+   if (dirp) {
+      closedir (dirp);
+   } else if (fd >= 0) {
+      close (fd);
+   }
+   free (path);
+   return !error;
 }
 
-static bool write_info (const struct info_t *info, const char *fname)
+// Reads the immediate children of node, if they have not already been
+// read. Only the cached children change, so the node is still const as
+// far as the caller is concerned. Called with the framedb locked.
+static bool node_load (const frm_node_t *cnode)
 {
-   char tstring[47];
-   if (!(frm_writefile (fname,
-               "mtime:", uint64_string (tstring, info->mtime), "\n",
-               NULL))) {
-      FRM_ERROR ("Failed to write info: %m\n");
+   frm_node_t *node = (frm_node_t *)cnode;
+   if (node->loaded)
+      return true;
+
+   bool loaded = node->frm->map ? node_load_map (node) : node_load_dir (node);
+   if (!loaded) {
+      while (ds_array_length (node->children)) {
+         node_del (ds_array_rm_tail (node->children));
+      }
       return false;
    }
 
+   node->loaded = true;
    return true;
 }
 
-static bool update_info_mtime (const char *fname)
+// Called with the framedb locked, so that all the levels are read from
+// the same state of the framedb.
+static bool node_prefetch (const frm_node_t *node, size_t levels)
 {
-   struct info_t info;
-   if (!(read_info (&info, fname))) {
-      FRM_ERROR ("Failed to read info file: %m\n");
+   if (levels == 0)
+      return true;
+
+   if (!(node_load (node))) {
+      FRM_ERROR ("Error: failed to load children of [%s]\n", node->name);
       return false;
    }
 
-   info.mtime = time (NULL);
-   if (!(write_info (&info, fname))) {
-      FRM_ERROR ("Failed to update info file: %m\n");
-      return false;
+   size_t nchildren = ds_array_length (node->children);
+   for (size_t i=0; i<nchildren; i++) {
+      if (!(node_prefetch (ds_array_get (node->children, i), levels - 1)))
+         return false;
    }
 
    return true;
 }
 
-
-uint64_t frm_date_epoch (void)
+bool frm_node_prefetch (const frm_node_t *node, size_t levels)
 {
-   struct info_t info;
-   if (!(read_info (&info, "info"))) {
-      FRM_ERROR ("Failed to read [info]: %m\n");
-      return (uint64_t)-1;
+   if (!node) {
+      FRM_ERROR ("Error: null object passed for frm_node_t\n");
+      errno = EINVAL;
+      return false;
    }
 
-   return info.mtime;
-}
+   if (!(db_rdlock (node->frm)))
+      return false;
 
-char *frm_date_str (void)
-{
-   uint64_t epoch = frm_date_epoch ();
-   if (epoch == (uint64_t)-1) {
-      FRM_ERROR ("Failed to retrieve mtime\n");
-      return ds_str_dup ("");
-   }
-   char *tmp = ctime ((time_t *)&epoch);
-   char *eol = strchr (tmp, '\n');
-   if (eol)
-      *eol = 0;
-   return ds_str_dup (tmp);
+   bool ret = node_prefetch (node, levels);
+   db_unlock (node->frm);
+   return ret;
 }
 
-const char *frm_lastmsg (frm_t *frm)
+frm_node_t *frm_node_create_lazy (frm_t *frm, size_t prefetch)
 {
    if (!frm) {
       FRM_ERROR ("Error: null object passed for frm_t\n");
       errno = EINVAL;
-      return "";
+      return NULL;
    }
 
-   return frm->lastmsg;
-}
-
-
-static bool internal_frm_push (frm_t *frm, const char *name, const char *message,
-                               bool dir_change)
-{
-   if (!frm) {
-      FRM_ERROR ("Error, null object passed for frm_t\n");
-      errno = EINVAL;
-      return false;
-   }
+   if (!(db_rdlock (frm)))
+      return NULL;
 
-   if ((wrapper_mkdir (name))!=0) {
-      ERR (frm, "Failed to create directory [%s]: %m\n", name);
-      return false;
+   frm_node_t *ret = NULL;
+   uint64_t date = internal_frm_date_epoch_at (frm, "root");
+   if (date == (uint64_t)-1) {
+      ERR (frm, "Failed to read info file of root frame: %m\n");
+      goto cleanup;
    }
 
-   char *olddir = pushdir (name);
-   if (!olddir) {
-      ERR (frm, "Failed to switch to [%s]: %m\n", name);
-      return false;
+   if (!(ret = node_new (NULL, "root", date))) {
+      ERR (frm, "Error: failed to create root node\n");
+      goto cleanup;
    }
+   ret->frm = frm;
+   ret->map_node = FRM_MAP_ROOT;
+   ret->id = frm->map ? FRM_ID_NONE : FRM_ID_ROOT;
 
-   if (!(frm_writefile ("payload", message, "\n", NULL))) {
-      ERR (frm, "Failed to write message to [%s/payload]: %m\n", name);
-      popdir (&olddir);
-      return false;
+   if (!(node_prefetch (ret, prefetch))) {
+      ERR (frm, "Error: failed to read frames\n");
+      node_del (ret);
+      ret = NULL;
    }
 
-   char tstring[47];
-   if (!(frm_writefile ("info",
-               "mtime: ", uint64_string(tstring, (uint64_t)time(NULL)), "\n",
-               NULL))) {
-      ERR (frm, "Failed to create info file [%s/info]: %m\n", name);
-      popdir (&olddir);
-      return false;
-   }
+cleanup:
+   db_unlock (frm);
+   return ret;
+}
 
-   char *path = get_path (frm);
-   if (dir_change) {
-      if (!(history_append(frm->dbpath, path))) {
-         ERR (frm, "Failed to update history\n");
-         free (path);
-         popdir (&olddir);
-         return false;
-      }
-   }
+frm_node_t *frm_node_create (frm_t *frm)
+{
+   return frm_node_create_lazy (frm, (size_t)-1);
+}
 
-   if (!(index_add (frm->dbpath, path))) {
-      ERR (frm, "Warning: failed to update index\n");
-   }
+void frm_node_free (frm_node_t *rootnode)
+{
+   node_del (rootnode);
+}
 
-   if (dir_change) {
-      free (olddir);
-   } else {
-      popdir (&olddir);
-   }
 
-   free (path);
-   return true;
+const char *frm_node_name (const frm_node_t *node)
+{
+   return node ? node->name : "???";
 }
 
-bool frm_push (frm_t *frm, const char *name, const char *message)
+uint64_t frm_node_date (const frm_node_t *node)
 {
-   return internal_frm_push (frm, name, message, true);
+   return node ? node->date : (uint64_t)-1;
 }
 
-bool frm_new (frm_t *frm, const char *name, const char *message)
+uint64_t frm_node_id (const frm_node_t *node)
 {
-   return internal_frm_push (frm, name, message, false);
+   return node ? node->id : FRM_ID_NONE;
 }
 
-bool frm_payload_replace (const char *message)
+char *frm_node_fpath (const frm_node_t *node)
 {
-   if (!(frm_writefile ("payload", message, NULL))) {
-      FRM_ERROR ("Failed to write [payload]: %m\n");
-      return false;
-   }
-
-   if (!(update_info_mtime ("info"))) {
-      FRM_ERROR ("Failed to update info file with mtime: %m\n");
-      return false;
+   if (!node) {
+      return ds_str_dup ("");
    }
 
-   return true;
+   return node_path (node);
 }
 
-bool frm_payload_append (const char *message)
-{
-   char *current = frm_readfile ("payload");
-   if (!current) {
-      FRM_ERROR ("Warning: failed to read [payload]: %m\n");
-   }
 
-   bool ret = true;
-   if (!(frm_writefile ("payload", current, "\n", message, NULL))) {
-      FRM_ERROR ("Error writing [payload]: %m\n");
-      ret = false;
-   }
-   free (current);
+size_t frm_node_nchildren (const frm_node_t *node)
+{
+   if (!node)
+      return 0;
 
-   if (ret && !(update_info_mtime ("info"))) {
-      FRM_ERROR ("Failed to update info file with mtime: %m\n");
-      ret = false;
+   if (!node->loaded && !(frm_node_prefetch (node, 1))) {
+      FRM_ERROR ("Error: failed to load children of [%s]\n", node->name);
    }
 
-   return ret;
+   return ds_array_length (node->children);
 }
 
-char *frm_payload_fname (void)
+const frm_node_t *frm_node_child (const frm_node_t *node, size_t index)
 {
-   char *pwd = getcwd (NULL, 0);
-   if (!pwd) {
-      FRM_ERROR ("Error: failed to get current working directory: %m\n");
+   if (!node || index >= frm_node_nchildren (node)) {
+      FRM_ERROR ("Error: possible overflow detected\n");
       return NULL;
    }
 
-   char *fname = ds_str_cat (pwd, "/payload", NULL);
-   if (!fname) {
-      FRM_ERROR ("OOM error allocating filename of payload file\n");
-   }
-
-   free (pwd);
-   return fname;
+   return ds_array_get (node->children, index);
 }
 
-bool frm_top (frm_t *frm)
+const frm_node_t *frm_node_parent (const frm_node_t *node)
 {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = ENOENT;
-      return false;
-   }
-
-   char *target = ds_str_cat (frm->dbpath, "/root", NULL);
-   if (!target) {
-      ERR (frm, "OOM error allocating path for root frame\n");
-      return false;
-   }
+   return node ? node->parent : NULL;
+}
 
-   if ((chdir (target))!=0) {
-      ERR (frm, "Error: failed to switchdir to [%s/root]: %m\n", target);
-      free (target);
-      return false;
-   }
+const frm_node_t *frm_node_root (const frm_node_t *node)
+{
+   if (!node)
+      return NULL;
 
-   free (target);
-   if (!(history_append (frm->dbpath, "root"))) {
-      ERR (frm, "Error: failed to record history\n");
-      return false;
-   }
+   if (!node->parent)
+      return node;
 
-   return true;
+   return frm_node_root (node->parent);
 }
 
-bool frm_up (frm_t *frm)
+const frm_node_t *frm_node_find (const frm_node_t *node, const char *fpath)
 {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = EINVAL;
-      return false;
-   }
+   size_t slen = strlen (node->name);
+   if ((strncmp (node->name, fpath, slen))!=0)
+      return NULL;
 
-   char *pwd = getcwd (NULL, 0);
-   if (!pwd) {
-      ERR (frm, "Error: could not retrieve the current working directory: %m\n");
-      return false;
-   }
+   if (fpath[slen] == 0)
+      return node;
 
-   char *tmp = ds_str_cat (frm->dbpath, "/root", NULL);
-   if (!tmp) {
-      ERR (frm, "OOM error allocating temporary pattern\n");
-      return false;
-   }
+   if (!(isslash (fpath[slen])))
+      return NULL;
 
-   if ((strcmp (tmp, pwd))==0) {
-      ERR (frm, "Error: cannot go up a level beyond dbpath [%s]\n", frm->dbpath);
-      free (tmp);
-      free (pwd);
-      return false;
+   // Only the children along fpath get loaded.
+   size_t nchildren = frm_node_nchildren (node);
+   for (size_t i=0; i<nchildren; i++) {
+      frm_node_t *child = ds_array_get (node->children, i);
+      if (!child) {
+         FRM_ERROR ("Possible corruption, indexing [%zu] of [%s]\n",
+                  i, node->name);
+         return NULL;
+      }
+
+      const frm_node_t *target = frm_node_find (child, &fpath[slen+1]);
+      if (target)
+         return target;
    }
-   free (tmp);
+   return NULL;
+}
 
-   char *olddir = pushdir ("..");
-   if (!olddir) {
-      ERR (frm, "Failed to switch directory [..]: %m\n");
-      free (pwd);
-      return false;
+static char *internal_frm_switch_path (frm_t *frm, const char *from)
+{
+   // Attempt to switch to 'from' as a relative path. If that fails
+   // attempt to switch to 'from' as an absolute framename (absolute
+   // relative to frm->dbpath).
+   if (frm->map) {
+      uint32_t node = map_resolve (frm, from);
+      if (node == FRM_MAP_NONE) {
+         ERR (frm, "Error: no frame found at [%s]\n", from);
+         errno = ENOENT;
+         return NULL;
+      }
+      char *ret = frm_map_path (frm->map, frm->node);
+      frm->node = node;
+      return ret;
    }
 
-   char *path = get_path (frm);
-   if (!(history_append (frm->dbpath, path))) {
-      ERR (frm, "Failed to set the working frame to [root]\n");
-      free (olddir);
-      free (pwd);
-      return false;
+   char *path = resolve_frame (frm, from);
+   char *ret = get_path (frm);
+   if (!path || !ret || !(set_current (frm, path))) {
+      ERR (frm, "Error: failed to switch to [%s]\n", from);
+      free (ret);
+      ret = NULL;
    }
 
-   free (pwd);
    free (path);
-   free (olddir);
-   return true;
+   return ret;
 }
 
-bool frm_down (frm_t *frm, const char *target)
+
+static bool internal_frm_batch_begin (frm_t *frm)
 {
    if (!frm) {
       FRM_ERROR ("Error: null object passed for frm_t\n");
@@ -1253,702 +5628,583 @@ bool frm_down (frm_t *frm, const char *target)
       return false;
    }
 
-   if ((chdir (target))!=0) {
-      ERR (frm, "Failed to switch to target [%s]\n", target);
+   if (frm->batch) {
+      ERR (frm, "Error: a batch is already open\n");
+      errno = EBUSY;
       return false;
    }
 
-   char *pwd = get_path (frm);
-   if (!(history_append (frm->dbpath, pwd))) {
-      ERR (frm, "Failed to set the working frame to [root]\n");
-      free (pwd);
+   // The mapped backend has no index to defer.
+   if (!frm->map && !frm->pending && !(frm->pending = ds_array_new ())) {
+      ERR (frm, "OOM error allocating batch\n");
       return false;
    }
 
-   free (pwd);
+   frm->batch = true;
    return true;
 }
 
-bool frm_switch (frm_t *frm, const char *target)
+static bool internal_frm_batch_end (frm_t *frm)
 {
-   if (!frm || !target || !target[0]) {
-      ERR (frm, "Error: null objects passed for frm_switching\n");
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
       return false;
    }
 
-   char *suffixed = isslash (target[strlen(target)-1])
-      ? ds_str_dup (target)
-      : ds_str_cat (target, "/", NULL);
-   if (!suffixed) {
-      ERR (frm, "OOM error allocating suffixed string\n");
-      errno = ENOMEM;
+   if (!frm->batch) {
+      ERR (frm, "Error: no batch is open\n");
+      errno = EINVAL;
       return false;
    }
 
-   char *actual = history_find (frm->dbpath, suffixed);
-   free (suffixed);
-   if (!actual) {
-      if (!(actual = ds_str_dup (target))) {
-         ERR (frm, "OOM error allocating target to switch to [%s]\n", target);
-         return false;
-      }
-   }
+   frm->batch = false;
+   if (frm->map)
+      return true;
 
-   if ((chdir (frm->dbpath))!=0) {
-      ERR (frm, "Failed to switch to dbpath [%s]\n", frm->dbpath);
-      free (actual);
-      return false;
-   }
+   bool ret = batch_flush (frm);
+   current_record_update (frm);
+   return ret;
+}
 
-   if ((chdir (actual))!=0) {
-      ERR (frm, "Failed to switch to target [%s]\n", actual);
-      free (actual);
-      return false;
+static uint64_t internal_frm_id_at (frm_t *frm, const char *fpath)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return FRM_ID_NONE;
    }
 
-   char *pwd = get_path (frm);
-   if (!(history_append (frm->dbpath, pwd))) {
-      ERR (frm, "Failed to set the working frame to [root]\n");
-      free (actual);
-      free (pwd);
-      return false;
+   if (frm->map) {
+      ERR (frm, "Error: frame IDs are not supported by a mapped framedb\n");
+      errno = ENOTSUP;
+      return FRM_ID_NONE;
    }
 
-   free (actual);
-   free (pwd);
-   return true;
+   char *path = fpath && fpath[0] ? resolve_frame (frm, fpath) : get_path (frm);
+   uint64_t ret = path ? frame_id_at (frm->dbfd, path) : FRM_ID_NONE;
+   if (path && ret == FRM_ID_NONE) {
+      ERR (frm, "Error: frame [%s] has no ID\n", path);
+      errno = ENOENT;
+   }
+   free (path);
+   return ret;
 }
 
-bool frm_switch_direct (frm_t *frm, const char *target)
+static char *internal_frm_id_path (frm_t *frm, uint64_t id)
 {
-   if (!frm || !target || !target[0]) {
-      ERR (frm, "Error: null objects passed for frm_switching\n");
-      return false;
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
+      return NULL;
    }
 
-   char *suffixed = isslash (target[strlen(target)-1])
-      ? ds_str_dup (target)
-      : ds_str_cat (target, "/", NULL);
-   if (!suffixed) {
-      ERR (frm, "OOM error allocating suffixed string\n");
-      errno = ENOMEM;
-      return false;
+   if (frm->map) {
+      ERR (frm, "Error: frame IDs are not supported by a mapped framedb\n");
+      errno = ENOTSUP;
+      return NULL;
    }
 
-   if ((chdir (frm->dbpath))!=0) {
-      ERR (frm, "Failed to switch to dbpath [%s]\n", frm->dbpath);
-      free (suffixed);
-      return false;
+   char *ret = frm_ids_path (frm->ids, id);
+   if (!ret || !(isdir_at (frm->dbfd, ret))) {
+      ERR (frm, "Error: no frame with ID %" PRIu64 "\n", id);
+      free (ret);
+      errno = ENOENT;
+      return NULL;
    }
 
-   if ((chdir (suffixed))!=0) {
-      ERR (frm, "Failed to switch to target [%s]\n", suffixed);
-      free (suffixed);
-      return false;
-   }
+   return ret;
+}
 
-   char *pwd = get_path (frm);
-   if (!(history_append (frm->dbpath, pwd))) {
-      ERR (frm, "Failed to append history: [%s]\n", pwd);
-      free (suffixed);
-      free (pwd);
+static bool internal_frm_switch_id (frm_t *frm, uint64_t id)
+{
+   char *path = internal_frm_id_path (frm, id);
+   if (!path || !(visit (frm, path))) {
+      ERR (frm, "Failed to switch to frame %" PRIu64 "\n", id);
+      free (path);
       return false;
    }
 
-   free (suffixed);
-   free (pwd);
+   free (path);
    return true;
 }
 
-bool frm_back (frm_t *frm, size_t index)
-{
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = ENOENT;
-      return false;
-   }
+/* ************************************************************ */
 
-   bool error = true;
-   FILE *infile = NULL;
-   char *line = NULL;
-   char *olddir = NULL;
-   static const size_t line_len = 1024 * 1024 * 10;
+/* The public functions that take a frm_t hold the framedb lock for the
+ * duration of the call: a read lock if the framedb is not modified and a
+ * write lock otherwise. The lock is shared by all the handles on a
+ * framedb, and the write lock also covers the changes to the handle's
+ * current frame.
+ */
 
-   if (!(olddir = pushdir (frm->dbpath))) {
-      ERR (frm, "Failed to switch to dbpath directory [%s]: %m\n", frm->dbpath);
-      goto cleanup;
-   }
+char *frm_history (frm_t *frm, size_t count)
+{
+   if (!(db_rdlock (frm)))
+      return ds_str_dup ("");
 
-   if (!(infile = fopen ("history", "r"))) {
-      ERR (frm, "Failed to open [history] for reading: %m\n");
-      goto cleanup;
-   }
+   char *ret = internal_frm_history (frm, count);
+   db_unlock (frm);
+   return ret;
+}
 
-   if (!(line = malloc (line_len))) {
-      ERR (frm, "OOM error allocating line for reading history\n");
-   }
+char *frm_current (frm_t *frm)
+{
+   if (!(db_rdlock (frm)))
+      return ds_str_dup ("");
 
-   size_t nline = 0;
-   line[0] = 0;
-   while ((fgets (line, line_len - 1, infile))) {
-      char *tmp = strchr (line, '\n');
-      if (tmp)
-         *tmp = 0;
-      if (nline++ >= index)
-         break;
-   }
+   char *ret = internal_frm_current (frm);
+   db_unlock (frm);
+   return ret;
+}
 
-   if (!line[0]) {
-      ERR (frm, "History file appears to be empty, aborting switch.\n");
-      goto cleanup;
-   }
+char *frm_payload_at (frm_t *frm, const char *fpath)
+{
+   if (!(db_rdlock (frm)))
+      return ds_str_dup ("");
 
-   frm_switch (frm, line);
+   char *ret = internal_frm_payload_at (frm, fpath);
+   db_unlock (frm);
+   return ret;
+}
 
-   error = false;
-cleanup:
-   free (line);
-   free (olddir);
-   if (infile)
-      fclose (infile);
+uint64_t frm_date_epoch_at (frm_t *frm, const char *fpath)
+{
+   if (!(db_rdlock (frm)))
+      return (uint64_t)-1;
 
-   return !error;
+   uint64_t ret = internal_frm_date_epoch_at (frm, fpath);
+   db_unlock (frm);
+   return ret;
 }
 
-void frm_strarray_free (char **array)
+char *frm_date_str_at (frm_t *frm, const char *fpath)
 {
-   for (size_t i=0; array && array[i]; i++) {
-      free (array[i]);
+   time_t epoch = (time_t)frm_date_epoch_at (frm, fpath);
+   if (epoch == (time_t)-1) {
+      ERR (frm, "Failed to retrieve mtime\n");
+      return ds_str_dup ("");
    }
-   free (array);
+
+   char tmp[32];
+   if (!(ctime_r (&epoch, tmp))) {
+      ERR (frm, "Failed to format mtime\n");
+      return ds_str_dup ("");
+   }
+   char *eol = strchr (tmp, '\n');
+   if (eol)
+      *eol = 0;
+   return ds_str_dup (tmp);
 }
 
-bool frm_pop (frm_t *frm, bool force)
+bool frm_new_at (frm_t *frm, const char *fpath, const char *name,
+                 const char *message)
 {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = EINVAL;
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   if (!force) {
-      char **subframes = frm_list (frm, NULL);
-      size_t nsubframes = 0;
-      for (size_t i=0; subframes && subframes[i]; i++) {
-         nsubframes++;
-         free (subframes[i]);
-      }
-      free (subframes);
+   bool ret = internal_frm_push (frm, fpath && fpath[0] ? fpath : NULL, name,
+                                 message, false);
+   db_unlock (frm);
+   return ret;
+}
 
-      if (nsubframes!=0) {
-         ERR (frm, "Error: cannot pop a frame that has children\n");
-         errno = ENOTEMPTY;
-         return false;
-      }
-   }
+bool frm_new_many (frm_t *frm, const char *parent, const char **names,
+                   const char **messages, size_t count)
+{
+   if (!(db_wrlock (frm)))
+      return false;
 
-   char *oldpath = get_path (frm);
-   if (!oldpath) {
-      ERR (frm, "Error: failed to retrieve current working directory: %m\n");
+   bool ret = internal_frm_new_many (frm, parent && parent[0] ? parent : NULL,
+                                     names, messages, count);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_new (frm_t *frm, const char *name, const char *message)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   if (!(frm_up (frm))) {
-      ERR (frm, "Error: failed to switch to parent frame: %m\n");
-      free (oldpath);
+   bool ret = internal_frm_push (frm, NULL, name, message, false);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_push (frm_t *frm, const char *name, const char *message)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   if (!(frm_delete (frm, oldpath))) {
-      ERR (frm, "Error: failed to remove path [%s]: %m\n", oldpath);
-      free (oldpath);
+   bool ret = internal_frm_push (frm, NULL, name, message, true);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_payload_replace_at (frm_t *frm, const char *fpath, const char *message)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   free (oldpath);
-   return true;
+   bool ret = internal_frm_payload_write_at (frm, fpath, message, false);
+   db_unlock (frm);
+   return ret;
 }
 
-bool frm_rename (frm_t *frm, const char *newname)
+bool frm_payload_append_at (frm_t *frm, const char *fpath, const char *message)
 {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = EINVAL;
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   char *current_name = frm_current(frm);
-   if (!current_name) {
-      ERR (frm, "OOM error retrieving current frame path\n");
+   bool ret = internal_frm_payload_write_at (frm, fpath, message, true);
+   db_unlock (frm);
+   return ret;
+}
+
+char *frm_payload_fname_at (frm_t *frm, const char *fpath)
+{
+   if (!(db_rdlock (frm)))
+      return NULL;
+
+   char *ret = internal_frm_payload_fname_at (frm, fpath);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_top (frm_t *frm)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   const char *oldname = strrslash (current_name);
-   if (!oldname) {
-      ERR(frm, "Error: Internal corruption (current node has no slash): [%s]\n",
-               current_name);
-      free (current_name);
+   bool ret = internal_frm_top (frm);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_up (frm_t *frm)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
-   oldname++;
 
-   if (!(frm_up (frm))) {
-      ERR (frm, "Error: Failed to switch to parent directory [%s/..]: %m\n",
-            oldname);
-      free (current_name);
+   bool ret = internal_frm_up (frm);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_down (frm_t *frm, const char *target)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   if ((rename (oldname, newname))!=0) {
-      ERR (frm, "Error: failed to rename [%s] to [%s]: %m\n", oldname, newname);
-      free (current_name);
+   bool ret = internal_frm_down (frm, target);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_switch (frm_t *frm, const char *target)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   if (!(index_remove (frm->dbpath, current_name))) {
-      ERR (frm, "Warning: failed to remove [%s] from index\n", current_name);
-   }
-   free (current_name);
+   bool ret = internal_frm_switch (frm, target);
+   db_unlock (frm);
+   return ret;
+}
 
-   if (!(frm_down(frm, newname))) {
-      ERR (frm, "Warning: cannot switch to renamed frame [%s]: %m\n", newname);
+bool frm_switch_direct (frm_t *frm, const char *target)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   current_name = frm_current(frm);
-   if (!current_name) {
-      ERR (frm, "OOM error retrieving current frame path\n");
+   bool ret = internal_frm_switch_direct (frm, target);
+   db_unlock (frm);
+   return ret;
+}
+
+bool frm_back (frm_t *frm, size_t index)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   if (!(index_add(frm->dbpath, current_name))) {
-      ERR (frm, "Warning: failed to add [%s] to index\n", current_name);
-   }
-   free (current_name);
-   return true;
+   bool ret = internal_frm_back (frm, index);
+   db_unlock (frm);
+   return ret;
 }
 
 bool frm_delete (frm_t *frm, const char *target)
 {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = EINVAL;
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   char **subframes = frm_list (frm, target);
-   char *olddir = pushdir (frm->dbpath);
-   if (!olddir) {
-      ERR (frm, "Error: failed to switch directory: %m\n");
-      frm_strarray_free(subframes);
-      return false;
-   }
+   bool ret = internal_frm_delete (frm, target);
+   db_unlock (frm);
+   return ret;
+}
 
-   if (!(removedir (target))) {
-      ERR (frm, "Error: failed to remove directory[%s]: %m\n", target);
-      popdir (&olddir);
-      frm_strarray_free (subframes);
+bool frm_pop (frm_t *frm, bool force)
+{
+   if (!(db_wrlock (frm)))
       return false;
-   }
 
-   for (size_t i=0; subframes && subframes[i]; i++) {
-      if (!(index_remove (frm->dbpath, subframes[i]))) {
-         ERR (frm, "Warning: failed to remove [%s] from index\n", subframes[i]);
-      }
-   }
-   frm_strarray_free (subframes);
-   if (!(index_remove (frm->dbpath, target))) {
-      ERR (frm, "Warning: failed to remove [%s] from index\n", target);
-   }
+   bool ret = internal_frm_pop (frm, force);
+   db_unlock (frm);
+   return ret;
+}
+
+uint64_t frm_id_at (frm_t *frm, const char *fpath)
+{
+   if (!(db_rdlock (frm)))
+      return 0;
+
+   uint64_t ret = internal_frm_id_at (frm, fpath);
+   db_unlock (frm);
+   return ret;
+}
+
+char *frm_id_path (frm_t *frm, uint64_t id)
+{
+   if (!(db_rdlock (frm)))
+      return NULL;
 
-   popdir (&olddir);
-   return true;
+   char *ret = internal_frm_id_path (frm, id);
+   db_unlock (frm);
+   return ret;
 }
 
-static char **match (frm_t *frm, const char *sterm,
-      uint32_t flags, const char *from)
+bool frm_switch_id (frm_t *frm, uint64_t id)
 {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = EINVAL;
-      return NULL;
-   }
+   if (!(db_wrlock (frm)))
+      return false;
 
-   char **index = index_read(frm->dbpath);
-   if (!index) {
-      ERR (frm, "Error: failed to read index\n");
-      return NULL;
-   }
+   bool ret = internal_frm_switch_id (frm, id);
+   db_unlock (frm);
+   return ret;
+}
 
-   bool error = true;
-   char **results = NULL;
-   size_t results_len = 0;
+bool frm_move (frm_t *frm, const char *src, const char *dst_parent)
+{
+   if (!(db_wrlock (frm)))
+      return false;
 
-   for (size_t i=0; index[i]; i++) {
-      bool found = strstr (index[i], from)!=NULL;
-      if (!found) {
-         continue;
-      }
+   bool ret = internal_frm_move (frm, src, dst_parent);
+   db_unlock (frm);
+   return ret;
+}
 
-      found = strstr (index[i], sterm)!=NULL;
-      if (flags & FRM_MATCH_INVERT) {
-         found = !found;
-      }
+bool frm_undo_pop (frm_t *frm)
+{
+   if (!(db_wrlock (frm)))
+      return false;
 
-      if (found) {
-         size_t newsize = results_len + 1;
-         char **tmp = realloc (results, (sizeof *tmp) * (newsize + 1));
-         if (!tmp) {
-            ERR (frm, "OOM error allocating match results\n");
-            goto cleanup;
-         }
-         tmp[newsize] = NULL;
-         if (!(tmp[results_len] = ds_str_dup (index[i]))) {
-            ERR (frm, "OOM error allocating match item %zu\n", i);
-            goto cleanup;
-         }
+   bool ret = internal_frm_undo_pop (frm);
+   db_unlock (frm);
+   return ret;
+}
 
-         results = tmp;
-         results_len++;
-      }
-   }
+bool frm_gc (frm_t *frm, uint64_t min_age)
+{
+   if (!(db_wrlock (frm)))
+      return false;
 
-   // If we reached this point with NULL results then no errors occurred but
-   // no matches were found either. Must return an empty list.
-   if (!results && !(results = calloc (1, sizeof *results))) {
-      ERR (frm, "OOM error allocating empty list\n");
-      goto cleanup;
+   char **claimed = internal_frm_gc_claim (frm, min_age);
+   if (claimed && frm->map && !(frm_map_compact (frm->map, true))) {
+      ERR (frm, "Error: failed to compact [%s]\n", frm->dbpath);
+      frm_strarray_free (claimed);
+      claimed = NULL;
    }
+   db_unlock (frm);
 
-   error = false;
-cleanup:
-   for (size_t i=0; index && index[i]; i++) {
-      free (index[i]);
-   }
-   free (index);
+   // The slow part, removing the popped subtrees, is done without the lock.
+   bool ret = trash_reclaim (frm, claimed);
+   frm_strarray_free (claimed);
+   return ret;
+}
 
-   if (error) {
-      for (size_t i=0; results && results[i]; i++) {
-         free (results[i]);
-      }
-      free (results);
-      results = 0;
-   }
+bool frm_rename (frm_t *frm, const char *newname)
+{
+   if (!(db_wrlock (frm)))
+      return false;
 
-   return results;
+   bool ret = internal_frm_rename (frm, newname);
+   db_unlock (frm);
+   return ret;
 }
 
 char **frm_list (frm_t *frm, const char *from)
 {
-   if (!frm) {
-      FRM_ERROR ("Error: null object passed for frm_t\n");
-      errno = ENOENT;
-      return NULL;
-   }
-
-   char *olddir = frm_switch_path (frm, from);
-   if (!olddir) {
-      ERR (frm, "Error: failed to switch path to [%s]\n", from);
+   if (!(db_idxlock (frm)))
       return NULL;
-   }
 
-   char *current = frm_current (frm);
-   if (!current) {
-      ERR (frm, "Error: unable to determine current frame: %m\n");
-      popdir (&olddir);
-      return NULL;
-   }
+   char **ret = internal_frm_list (frm, from);
+   db_unlock (frm);
+   return ret;
+}
 
-   char *prefixed_current = ds_str_cat (current, "/", NULL);
-   if (!prefixed_current) {
-      ERR (frm, "OOM error allocating temporary string for current frame\n");
-      free (current);
-      popdir (&olddir);
+char **frm_match_at (frm_t *frm, const char *fpath, const char *sterm,
+                     uint32_t flags)
+{
+   if (!(db_idxlock (frm)))
       return NULL;
-   }
-   free (current);
 
-   char **ret = match (frm, "", 0, prefixed_current);
-   free (prefixed_current);
-   popdir (&olddir);
+   char **ret = internal_frm_match_at (frm, fpath, sterm, flags);
+   db_unlock (frm);
    return ret;
 }
 
 char **frm_match (frm_t *frm, const char *sterm, uint32_t flags)
 {
-   char *current = frm_current (frm);
-   if (!current) {
-      ERR (frm, "Failed to retrieve the current frame\n");
+   if (!(db_idxlock (frm)))
       return NULL;
-   }
 
-   char **results = match (frm, sterm, flags, current);
-   free (current);
-   return results;
+   char **ret = internal_frm_match_at (frm, NULL, sterm, flags);
+   db_unlock (frm);
+   return ret;
 }
 
 char **frm_match_from_root (frm_t *frm, const char *sterm, uint32_t flags)
 {
-   return match (frm, sterm, flags, "root");
-}
-
-
-/* ************************************************************ */
-
-
-struct frm_node_t {
-   const frm_node_t *parent;
-   ds_array_t *children;
+   if (!(db_idxlock (frm)))
+      return NULL;
 
-   char *name;
-   uint64_t date;
-};
+   char **ret = internal_frm_match_from_root (frm, sterm, flags);
+   db_unlock (frm);
+   return ret;
+}
 
-static void node_del (frm_node_t *node)
+char **frm_grep (frm_t *frm, const char *fpath, const char *regex)
 {
-   if (!node)
-      return;
+   if (!(db_idxlock (frm)))
+      return NULL;
 
-   size_t nchildren = ds_array_length(node->children);
-   for (size_t i=0; i<nchildren; i++) {
-      frm_node_t *child = ds_array_get(node->children, i);
-      if (!child) {
-         FRM_ERROR ("Possible corruption, attempt to overflow array: %zu\n", i);
-      }
-      node_del (child);
-   }
-   ds_array_del (node->children);
-   free (node->name);
-   free (node);
+   char **ret = internal_frm_grep (frm, fpath, regex);
+   db_unlock (frm);
+   return ret;
 }
 
-static frm_node_t *node_new (const frm_node_t *parent,
-                             const char *name, uint64_t date)
+char **frm_search (frm_t *frm, const char *query, size_t limit)
 {
-   frm_node_t *ret = calloc (1, sizeof *ret);
-   if (!ret) {
-      FRM_ERROR ("OOM error allocating node\n");
-   }
-
-   if (!(ret->children = ds_array_new ())) {
-      FRM_ERROR ("OOM error allocating array object for children\n");
-      free (ret);
+   if (!(db_idxlock (frm)))
       return NULL;
-   }
-
-   ret->parent = parent;
-   ret->date = date;
 
-   if (!(ret->name = ds_str_dup (name))) {
-      FRM_ERROR ("OOM error allocating name field for node\n");
-      node_del (ret);
-      ret = NULL;
+   bool stale = false;
+   char **ret = internal_frm_search (frm, query, limit, &stale);
+   if (stale) {
+      if (!(db_upgrade (frm)))
+         return NULL;
+      ret = internal_frm_search (frm, query, limit, &stale);
    }
-
+   db_unlock (frm);
    return ret;
 }
 
-static frm_node_t *node_open (const frm_node_t *parent, const char *dirname)
+char **frm_fuzzy (frm_t *frm, const char *query, size_t limit)
 {
-   bool error = true;
-   DIR *dirp = NULL;
-   char *pwd = pushdir (dirname);
-   frm_node_t *ret = NULL;
-   struct info_t info;
-
-   if (!pwd) {
-      FRM_ERROR ("Error: failed to switch to directory [%s]: %m\n", dirname);
-      goto cleanup;
-   }
+   if (!(db_idxlock (frm)))
+      return NULL;
 
-   if (!(dirp = opendir ("."))) {
-      FRM_ERROR ("Error: failed to read directory [%s]: %m\n", dirname);
-      goto cleanup;
-   }
+   char **ret = internal_frm_fuzzy (frm, query, limit);
+   db_unlock (frm);
+   return ret;
+}
 
-   if (!(read_info (&info, "info"))) {
-      FRM_ERROR ("Failed to read info file: %m\n");
+bool frm_stats_enable (frm_t *frm, bool enable)
+{
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
       return false;
    }
 
-   if (!(ret = node_new (parent, dirname, info.mtime))) {
-      FRM_ERROR ("Error: failed to create new node [%s]\n", dirname);
-      goto cleanup;
-   }
-
-   struct dirent *de;
-   while ((de = readdir (dirp))) {
-      if (de->d_name[0] == '.')
-         continue;
-      if (wrapper_isdir (de)) {
-         frm_node_t *child = node_open (ret, de->d_name);
-         if (!child) {
-            FRM_ERROR ("Error: failed to read child [%s] of [%s]: %m\n",
-                     de->d_name, dirname);
-         }
-         if (!(ds_array_ins_tail(ret->children, child))) {
-            FRM_ERROR ("OOM error adding child [%s] to [%s]\n",
-                     de->d_name, dirname);
-            node_del (child);
-            goto cleanup;
-         }
-      }
-   }
-
-   error = false;
-
-cleanup:
-   if (error) {
-      node_del (ret);
-      ret = NULL;
+   // The table is made once and kept until the handle is closed, so
+   // that the calls in other threads never see it go away.
+   bool ret = true;
+   pthread_mutex_lock (&g_dbs_lock);
+   if (!frm->stats && enable && !(frm->stats = frm_stats_table_new ())) {
+      ERR (frm, "OOM error allocating stats\n");
+      ret = false;
    }
-
-   closedir (dirp);
-   popdir (&pwd);
+   frm_stats_table_enable (frm->stats, enable);
+   pthread_mutex_unlock (&g_dbs_lock);
    return ret;
 }
 
-frm_node_t *frm_node_create (frm_t *frm)
+struct frm_stats_t *frm_stats_get (frm_t *frm)
 {
-   char *pwd = pushdir (frm->dbpath);
-   if (!pwd) {
-      ERR (frm, "Error: failed to switch to [%s]: %m\n", frm->dbpath);
+   if (!frm) {
+      FRM_ERROR ("Error: null object passed for frm_t\n");
+      errno = EINVAL;
       return NULL;
    }
-
-   // TODO: Must switch to basedir first.
-   frm_node_t *ret = node_open (NULL, "root");
-   popdir (&pwd);
-   return ret;
+   return frm_stats_table_get (frm->stats);
 }
 
-void frm_node_free (frm_node_t *rootnode)
+void frm_stats_reset (frm_t *frm)
 {
-   node_del (rootnode);
+   if (frm) {
+      frm_stats_table_reset (frm->stats);
+   }
 }
 
-
-const char *frm_node_name (const frm_node_t *node)
+bool frm_batch_begin (frm_t *frm)
 {
-   return node ? node->name : "???";
+   if (!(db_wrlock (frm)))
+      return false;
+
+   bool ret = internal_frm_batch_begin (frm);
+   db_unlock (frm);
+   return ret;
 }
 
-uint64_t frm_node_date (const frm_node_t *node)
+bool frm_batch_end (frm_t *frm)
 {
-   return node ? node->date : (uint64_t)-1;
+   if (!(db_wrlock (frm)))
+      return false;
+
+   bool ret = internal_frm_batch_end (frm);
+   db_unlock (frm);
+   return ret;
 }
 
-char *frm_node_fpath (const frm_node_t *node)
+char *frm_switch_path (frm_t *frm, const char *from)
 {
-   if (!node) {
-      return "";
-   }
-
-   char *parent_fpath = frm_node_fpath (node->parent);
-   if (!parent_fpath) {
-      FRM_ERROR ("OOM error getting parent name [%s]\n", node->name);
+   if (!(db_wrlock (frm)))
       return NULL;
-   }
-
-   char *ret = ds_str_cat (parent_fpath, "/", node->name, NULL);
-
-   if (!ret) {
-      FRM_ERROR ("OOM error joining name [%s] to parent fpath [%s]\n",
-               node->name, parent_fpath);
-   }
-   free (parent_fpath);
 
+   char *ret = internal_frm_switch_path (frm, from);
+   db_unlock (frm);
    return ret;
 }
 
+/* The functions that do not take a frm_t operate on the current frame of
+ * the most recently initialised handle.
+ */
 
-size_t frm_node_nchildren (const frm_node_t *node)
+char *frm_payload (void)
 {
-   return node ? ds_array_length (node->children) :  0;
+   return frm_payload_at (g_active, NULL);
 }
 
-const frm_node_t *frm_node_child (const frm_node_t *node, size_t index)
+uint64_t frm_date_epoch (void)
 {
-   if (!node || index > (ds_array_length(node->children) + 1)) {
-      FRM_ERROR ("Error: possible overflow detected\n");
-      return NULL;
-   }
-
-   return ds_array_get (node->children, index);
+   return frm_date_epoch_at (g_active, NULL);
 }
 
-const frm_node_t *frm_node_parent (const frm_node_t *node)
+char *frm_date_str (void)
 {
-   return node ? node->parent : NULL;
+   return frm_date_str_at (g_active, NULL);
 }
 
-const frm_node_t *frm_node_root (const frm_node_t *node)
+bool frm_payload_replace (const char *message)
 {
-   if (!node)
-      return NULL;
-
-   if (!node->parent)
-      return node;
-
-   return frm_node_root (node->parent);
+   return frm_payload_replace_at (g_active, NULL, message);
 }
 
-const frm_node_t *frm_node_find (const frm_node_t *node, const char *fpath)
+bool frm_payload_append (const char *message)
 {
-   size_t slen = strlen (node->name);
-   if ((memcmp (node->name, fpath, slen))!=0)
-      return NULL;
-
-   size_t nchildren = ds_array_length (node->children);
-   for (size_t i=0; i<nchildren; i++) {
-      frm_node_t *child = ds_array_get (node->children, i);
-      if (!child) {
-         FRM_ERROR ("Possible corruption, indexing [%zu] of [%s]\n",
-                  i, node->name);
-         return NULL;
-      }
-
-      const frm_node_t *target = frm_node_find (child, &fpath[slen+1]);
-      if (target)
-         return target;
-   }
-   return NULL;
+   return frm_payload_append_at (g_active, NULL, message);
 }
 
-char *frm_switch_path (frm_t *frm, const char *from)
+char *frm_payload_fname (void)
 {
-   // Attempt to switch to 'from' as a relative path. If that fails
-   // attempt to switch to 'from' as an absolute framename (absolute
-   // relative to frm->dbpath).
-   if (!from || !from[0]) {
-      from = "./";
-   }
-   char *olddir = pushdir (from);
-   if (!olddir) {
-      ERR (frm, "Warning: using relative path [%s] failed, trying absolute path\n",
-            from);
-      char *tmp = ds_str_cat (frm->dbpath, "/", from, NULL);
-      if (!tmp) {
-         ERR (frm, "OOM error allocating absolute path for framename [%s/%s]\n",
-               frm->dbpath, from);
-         return NULL;
-      }
-      char *first_errmsg = ds_str_dup (strerror (errno));
-      if (!first_errmsg) {
-         ERR (frm, "OOM error allocating error message string: %i\n", errno);
-         return NULL;
-      }
-
-      olddir = pushdir (tmp);
-      free (tmp);
-      if (!olddir) {
-         ERR (frm, "Neither [%s] nor [%s/%s] could be used: [%s][%m]\n",
-               from, frm->dbpath, from, first_errmsg);
-         free (first_errmsg);
-         return NULL;
-      }
-      free (first_errmsg);
-   }
-
-   return olddir;
+   return frm_payload_fname_at (g_active, NULL);
 }
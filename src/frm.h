@@ -17,6 +17,8 @@
 } while (0)
 
 #define FRM_MATCH_INVERT        (0x01 << 0)
+#define FRM_MATCH_ICASE         (0x01 << 1)
+#define FRM_MATCH_GLOB          (0x01 << 2)
 
 typedef struct frm_t frm_t;
 typedef struct frm_node_t frm_node_t;
@@ -47,14 +49,47 @@ extern "C" {
    const char *frm_homepath (void);
 
    /* Create a new framedb, initialise an existing one and close the
-    * handle to the framedb.
+    * handle to the framedb. If dbpath is an existing (empty) file instead
+    * of a directory the framedb is stored in that single memory-mapped
+    * file; frm_payload_fname() is not supported for such a framedb.
+    *
+    * A mapped framedb reclaims the space of removed frames and replaced
+    * payloads and names by compacting the file. This happens while the
+    * call that modified it still holds the exclusive lock, once that
+    * space is more than half of the file in use. That call then also
+    * pays for copying every live frame and payload, which on a large
+    * framedb can take much longer than the modification itself; the
+    * cost is amortised over the writes that made the garbage. Programs
+    * that must bound the latency of each modification can call frm_gc()
+    * at a convenient time, which compacts the file whatever the amount
+    * of garbage.
     */
    frm_t *frm_create (const char *dbpath);
    frm_t *frm_init (const char *dbpath);
    void frm_close (frm_t *frm);
 
+   /* Thread safety. The functions that take a frm_t may be called from
+    * any thread. A framedb may be opened more than once, from the same
+    * or different threads, and a single handle may be shared between
+    * threads; all the handles on a framedb share a single reader/writer
+    * lock that is held for the duration of each call. The message
+    * returned by frm_lastmsg() is kept per thread.
+    *
+    * Other processes are excluded with an advisory lock on the framedb,
+    * shared for reads and exclusive for modifications. A call waits for
+    * up to ten seconds for another process to release the framedb before
+    * failing, and a lock held by a process that dies is released with it.
+    *
+    * The functions that do not take a frm_t use the most recently
+    * initialised handle and are not thread-safe; use the _at() versions
+    * instead. A node tree (see frm_node_create()) must not be shared
+    * between threads.
+    */
+
    /* Retrieve information: history, current frame name, current
-    * frame payload, current frame date (in two formats).
+    * frame payload, current frame date (in two formats). The functions
+    * that do not take a frm_t operate on the current frame of the most
+    * recently initialised framedb.
     */
    char *frm_history (frm_t *frm, size_t count);
    char *frm_current (frm_t *frm);
@@ -63,6 +98,41 @@ extern "C" {
    char *frm_date_str (void);
    const char *frm_lastmsg (frm_t *frm);
 
+   /* A fast path for shell prompts. Returns the current frame of the
+    * framedb at dbpath, and its date in *mtime if mtime is not NULL,
+    * from a small record kept up to date by the other functions. The
+    * framedb is neither initialised nor locked. Returns NULL if there is
+    * no record, eg. for a mapped framedb or one that has not changed
+    * frame since it was last upgraded; use frm_init() and frm_current()
+    * in that case. The caller must free the result.
+    */
+   char *frm_current_cached (const char *dbpath, uint64_t *mtime);
+
+   /* A log of how long each command took on the framedb at dbpath (see
+    * frm_perflog.h), kept across runs and rotated as it grows. Neither
+    * function initialises or locks the framedb.
+    *
+    * frm_perflog_append() records that command started at start, in
+    * microseconds since the epoch, and took usecs with the exit status
+    * status. Only the first 16 characters of command are kept.
+    *
+    * frm_perflog_get() returns the records that started at or after
+    * since, oldest first, with their number in *nrecs, which must be
+    * freed with frm_mem_free(). Returns NULL on error.
+    */
+   bool frm_perflog_append (const char *dbpath, const char *command,
+                            uint64_t start, uint64_t usecs, int status);
+   struct frm_perflog_t *frm_perflog_get (const char *dbpath, uint64_t since,
+                                          size_t *nrecs);
+
+   /* As above, but for the frame at fpath, which is resolved relative to
+    * the handle's current frame and, failing that, as an absolute frame
+    * path. A null or empty fpath is the handle's current frame.
+    */
+   char *frm_payload_at (frm_t *frm, const char *fpath);
+   uint64_t frm_date_epoch_at (frm_t *frm, const char *fpath);
+   char *frm_date_str_at (frm_t *frm, const char *fpath);
+
    /* Add/create information: new frame (new creates a new one and then
     * returns, push creates a new one and switches to it), replace the
     * payload, append to payload and return the payload filename.
@@ -73,6 +143,37 @@ extern "C" {
    bool frm_payload_append (const char *message);
    char *frm_payload_fname (void);
 
+   /* As above, for the frame at fpath (see frm_payload_at()).
+    * frm_new_at() creates the new frame under the frame at fpath.
+    */
+   bool frm_new_at (frm_t *frm, const char *fpath, const char *name,
+                    const char *message);
+   bool frm_payload_replace_at (frm_t *frm, const char *fpath, const char *message);
+   bool frm_payload_append_at (frm_t *frm, const char *fpath, const char *message);
+   char *frm_payload_fname_at (frm_t *frm, const char *fpath);
+
+   /* Create count frames under the frame at parent (see frm_payload_at())
+    * in one call. names[i] is the path of a new frame relative to parent,
+    * eg. "a/b", and its parent must exist or be created earlier in the
+    * list. messages[i] is its payload; messages may be NULL for empty
+    * payloads. All the new frames are added to the index in a single
+    * pass. Stops at the first frame that cannot be created, keeping the
+    * frames created so far.
+    */
+   bool frm_new_many (frm_t *frm, const char *parent, const char **names,
+                      const char **messages, size_t count);
+
+   /* Batches. Between frm_batch_begin() and frm_batch_end() the index
+    * entries of new frames are kept in memory, and merged into the index
+    * in a single pass when the batch ends (or when anything needs to read
+    * the index). The current frame record (see frm_current_cached()) is
+    * also only written when the batch ends. Until then other handles may
+    * not see the new frames in frm_list() and frm_match(). frm_close()
+    * ends an open batch.
+    */
+   bool frm_batch_begin (frm_t *frm);
+   bool frm_batch_end (frm_t *frm);
+
    /* Navigational functions, including deletion when popping.
     */
    bool frm_top (frm_t *frm);
@@ -85,11 +186,114 @@ extern "C" {
    bool frm_pop (frm_t *frm, bool force);
    bool frm_rename (frm_t *frm, const char *newname);
 
-   /* Search/listing functions.
+   /* Moves the frame at src, with all its descendants, to be a child of
+    * the frame at dst_parent. Both paths are resolved as for
+    * frm_payload_at(). The frames keep their IDs, content and dates, and
+    * the current frame follows the move if it was one of them. A move that
+    * is interrupted by a crash is completed by the next frm_init().
+    */
+   bool frm_move (frm_t *frm, const char *src, const char *dst_parent);
+
+   /* Stable frame IDs. Every frame in a directory framedb has a 64-bit ID
+    * that does not change when the frame is renamed or moved and is never
+    * given to another frame; 0 is not a valid ID. frm_id_at() returns the
+    * ID of the frame at fpath (see frm_payload_at()), frm_id_path() the
+    * current path of the frame with the given ID and frm_switch_id() makes
+    * it the current frame. The history follows frames by their ID, so
+    * renamed and moved frames are listed under their new path. Not
+    * supported by a mapped framedb.
+    */
+   uint64_t frm_id_at (frm_t *frm, const char *fpath);
+   char *frm_id_path (frm_t *frm, uint64_t id);
+   bool frm_switch_id (frm_t *frm, uint64_t id);
+
+   /* Popping a frame moves it, and all the frames under it, into a trash
+    * area in the framedb instead of removing them, so that frm_pop()
+    * takes the same time however large the subtree is.
+    * frm_undo_pop() restores the most recently popped frame that is
+    * still in the trash and makes it the current frame. frm_gc()
+    * permanently removes the frames that were popped at least min_age
+    * seconds ago (all of them if min_age is 0). It holds the framedb lock
+    * only while it selects the frames to remove, so it can be called
+    * periodically from a background thread of a long-running program.
+    * A mapped framedb has no trash: frames are removed when popped, and
+    * frm_gc() compacts the file instead (see frm_create()).
+    */
+   bool frm_undo_pop (frm_t *frm);
+   bool frm_gc (frm_t *frm, uint64_t min_age);
+
+   /* Search/listing functions. By default the match functions return
+    * the paths that contain sterm. The flags are:
+    *    FRM_MATCH_INVERT  Return the paths that do not match instead.
+    *    FRM_MATCH_ICASE   Ignore case. ASCII letters are compared
+    *                      without copying the paths; a term with other
+    *                      letters is compared with both it and the
+    *                      paths folded by frm_scan_fold().
+    *    FRM_MATCH_GLOB    sterm is a glob pattern that must match the
+    *                      whole path, such as "root/work/GUI*"; see
+    *                      frm_glob.h. Sets errno to EINVAL if the pattern
+    *                      is not valid.
     */
    char **frm_list (frm_t *frm, const char *from);
    char **frm_match (frm_t *frm, const char *sterm, uint32_t flags);
    char **frm_match_from_root (frm_t *frm, const char *sterm, uint32_t flags);
+   char **frm_match_at (frm_t *frm, const char *fpath, const char *sterm,
+                        uint32_t flags);
+
+   /* Full-text search of the payloads. Returns the paths of up to limit
+    * frames (all of them if limit is 0) whose payload contains any of the
+    * words in query, best match first, as ranked by BM25. Words are runs
+    * of letters and digits, and case is ignored for ASCII letters. The
+    * index is kept up to date by the functions that write payloads; the
+    * first search builds it from every payload. A payload edited in
+    * place through frm_payload_fname() is not seen until it is written
+    * again with frm_payload_replace_at() or frm_payload_append_at(). Not
+    * supported by a mapped framedb.
+    */
+   char **frm_search (frm_t *frm, const char *query, size_t limit);
+
+   /* Returns the paths of the frame at fpath (see frm_payload_at()) and
+    * of every frame under it whose payload matches the POSIX extended
+    * regular expression regex, in the same order as frm_list(). '^' and
+    * '$' match at the start and end of each line. The payloads are read
+    * and matched by one thread per processor. Sets errno to EINVAL if
+    * regex is not valid.
+    */
+   char **frm_grep (frm_t *frm, const char *fpath, const char *regex);
+
+   /* Fuzzy search of the paths of every frame, for interactive finders.
+    * Returns the paths of up to limit frames (all of them if limit is 0)
+    * that contain each whitespace-separated term of query as a
+    * subsequence, best match first. Matches at the start of path segments
+    * and words, and runs of consecutive characters, score higher, as do
+    * the frames visited most recently. Case is ignored for ASCII letters
+    * unless the term has an uppercase letter. Pass the first result to
+    * frm_switch_direct() to switch to it.
+    */
+   char **frm_fuzzy (frm_t *frm, const char *query, size_t limit);
+
+   /* Counters of the work done by each public function called on frm,
+    * such as the files opened and the bytes read, and the time it took;
+    * see frm_stats.h. Counting starts when it is enabled, and costs a
+    * test of a thread-local pointer at each counter when it is not.
+    * frm_stats_get() returns the counters, ending with an entry whose
+    * fname is NULL, which must be freed with frm_mem_free().
+    */
+   bool frm_stats_enable (frm_t *frm, bool enable);
+   struct frm_stats_t *frm_stats_get (frm_t *frm);
+   void frm_stats_reset (frm_t *frm);
+
+   /* Writes a trace of every public function called, and of the reads
+    * of payloads, history and the index inside them, to the file fname
+    * as trace events in JSON that chrome://tracing and Perfetto can
+    * load. The trace covers every framedb in the process. The events are
+    * buffered, and the rest are written by frm_trace_stop(), which is
+    * also called at exit. Tracing also starts at the first frm_init() or
+    * frm_create() when the environment variable FRM_TRACE names a file.
+    * When tracing is off each span costs a test of a global flag.
+    */
+   bool frm_trace_start (const char *fname);
+   void frm_trace_stop (void);
 
    /* Tree functions. All the other frame functions are designed to
     * return one of the following:
@@ -105,15 +309,26 @@ extern "C" {
    /* Create and destroy the tree of nodes. Creation always returns
     * the tree starting at the root node. Freeing anything but the root
     * node is gauranteed to leak memory.
+    *
+    * frm_node_create() reads the entire tree up front. The lazy version
+    * only reads the first 'prefetch' levels below the root; the children
+    * of any other node are read the first time frm_node_nchildren() or
+    * frm_node_child() is called on it. frm_node_prefetch() reads the
+    * next 'levels' levels below node in advance. A lazy tree must be freed
+    * before the frm_t it was created from is closed.
     */
    frm_node_t *frm_node_create (frm_t *frm);
+   frm_node_t *frm_node_create_lazy (frm_t *frm, size_t prefetch);
+   bool frm_node_prefetch (const frm_node_t *node, size_t levels);
    void frm_node_free (frm_node_t *rootnode);
 
-   /* Get the tree name, date and full path. Full path is useful to
-    * directly navigate to a particular node.
+   /* Get the tree name, date, ID and full path. Full path is useful to
+    * directly navigate to a particular node. The full path must be freed
+    * by the caller.
     */
    const char *frm_node_name (const frm_node_t *node);
    uint64_t frm_node_date (const frm_node_t *node);
+   uint64_t frm_node_id (const frm_node_t *node);
    char *frm_node_fpath (const frm_node_t *node);
 
    /* Functions necessary for recursing. Count the number of children,
@@ -0,0 +1,307 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frm.h"
+#include "frm_fuzzy.h"
+
+// The points for each matched character, and the bonuses for matching
+// the first character of a path segment, of a word (after ' ', '-', '_'
+// or '.') or of a camelCase or numeric part. The bonus for the first
+// character of a term is doubled.
+#define FUZZY_MATCH           (16)
+#define FUZZY_SEGMENT         (10)
+#define FUZZY_WORD            (8)
+#define FUZZY_CAMEL           (6)
+#define FUZZY_CONSECUTIVE     (6)
+#define FUZZY_LAST_SEGMENT    (12)
+
+// The cost of the first character of a gap and of each one after that.
+#define FUZZY_GAP_START       (3)
+#define FUZZY_GAP_EXTEND      (1)
+
+struct fuzzy_term_t {
+   char *str;
+   size_t len;
+   bool exact;             // The term has an uppercase letter
+
+   // Maps each byte of a path to the byte it is compared as: itself in
+   // an exact term, and folded to lowercase otherwise.
+   unsigned char fold[256];
+};
+
+/* ********************************************************** */
+
+static int fuzzy_lower (int c)
+{
+   return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static bool fuzzy_eq (const struct fuzzy_term_t *term, char c, char tc)
+{
+   return term->fold[(unsigned char)c] == (unsigned char)tc;
+}
+
+static void fuzzy_terms_free (struct fuzzy_term_t *terms)
+{
+   for (size_t i=0; terms && terms[i].str; i++) {
+      free (terms[i].str);
+   }
+   free (terms);
+}
+
+// Splits the query into terms; the last one has a NULL str.
+static struct fuzzy_term_t *fuzzy_terms (const char *query)
+{
+   size_t qlen = strlen (query);
+   struct fuzzy_term_t *ret = calloc (qlen / 2 + 2, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating fuzzy query\n");
+      return NULL;
+   }
+
+   size_t nterms = 0;
+   for (size_t i=0; i<qlen; ) {
+      while (i < qlen && strchr (" \t\r\n", query[i]))
+         i++;
+      size_t start = i;
+      while (i < qlen && !strchr (" \t\r\n", query[i]))
+         i++;
+      if (i == start)
+         break;
+
+      struct fuzzy_term_t *term = &ret[nterms];
+      if (!(term->str = malloc (i - start + 1))) {
+         FRM_ERROR ("OOM error allocating fuzzy query\n");
+         fuzzy_terms_free (ret);
+         return NULL;
+      }
+      term->len = i - start;
+      for (size_t j=0; j<term->len; j++) {
+         char c = query[start + j];
+         term->exact = term->exact || (c >= 'A' && c <= 'Z');
+         term->str[j] = c;
+      }
+      for (size_t j=0; !term->exact && j<term->len; j++) {
+         term->str[j] = fuzzy_lower ((unsigned char)term->str[j]);
+      }
+      term->str[term->len] = 0;
+      for (int c=0; c<256; c++) {
+         term->fold[c] = term->exact ? c : fuzzy_lower (c);
+      }
+      nterms++;
+   }
+   return ret;
+}
+
+static int32_t fuzzy_boundary (const char *line, size_t i)
+{
+   if (i == 0 || line[i - 1] == '/')
+      return FUZZY_SEGMENT;
+
+   char prev = line[i - 1], c = line[i];
+   if (strchr (" -_.", prev))
+      return FUZZY_WORD;
+   if ((prev >= 'a' && prev <= 'z' && c >= 'A' && c <= 'Z')
+         || (!(prev >= '0' && prev <= '9') && c >= '0' && c <= '9'))
+      return FUZZY_CAMEL;
+   return 0;
+}
+
+// Scores one term on the shortest part of the line that ends where the
+// first occurrence of the term ends.
+static int32_t fuzzy_term_score (const char *line, size_t len,
+                                 const struct fuzzy_term_t *term)
+{
+   size_t j = 0, end = 0;
+   for (size_t i=0; i<len; i++) {
+      if (fuzzy_eq (term, line[i], term->str[j]) && ++j == term->len) {
+         end = i + 1;
+         break;
+      }
+   }
+   if (j < term->len)
+      return -1;
+
+   size_t start = end;
+   while (j) {
+      start--;
+      if (fuzzy_eq (term, line[start], term->str[j - 1]))
+         j--;
+   }
+
+   int32_t ret = 0;
+   bool consecutive = false;
+   for (size_t i=start; i<end && j<term->len; i++) {
+      if (!(fuzzy_eq (term, line[i], term->str[j]))) {
+         ret -= consecutive ? FUZZY_GAP_START : FUZZY_GAP_EXTEND;
+         consecutive = false;
+         continue;
+      }
+      int32_t bonus = fuzzy_boundary (line, i);
+      ret += FUZZY_MATCH + (j == 0 ? 2 * bonus : bonus);
+      if (consecutive)
+         ret += FUZZY_CONSECUTIVE;
+      consecutive = true;
+      j++;
+   }
+
+   size_t segment = len;
+   while (segment > 0 && line[segment - 1] != '/')
+      segment--;
+   if (start >= segment)
+      ret += FUZZY_LAST_SEGMENT;
+
+   return ret;
+}
+
+static int32_t fuzzy_score (const char *line, size_t len,
+                            const struct fuzzy_term_t *terms)
+{
+   int32_t ret = 0;
+   for (size_t i=0; terms[i].str; i++) {
+      int32_t score = fuzzy_term_score (line, len, &terms[i]);
+      if (score < 0)
+         return -1;
+      ret += score;
+   }
+   return ret;
+}
+
+/* ********************************************************** */
+
+// The hits are kept in a heap with the worst one at the top.
+static bool fuzzy_hit_worse (const struct frm_fuzzy_hit_t *lhs,
+                             const struct frm_fuzzy_hit_t *rhs)
+{
+   if (lhs->score != rhs->score)
+      return lhs->score < rhs->score;
+   if (lhs->len != rhs->len)
+      return lhs->len > rhs->len;
+   return lhs->offset > rhs->offset;
+}
+
+static int fuzzy_hit_cmp (const void *lhs, const void *rhs)
+{
+   return fuzzy_hit_worse (rhs, lhs) ? -1 : fuzzy_hit_worse (lhs, rhs);
+}
+
+static void fuzzy_heap_push (struct frm_fuzzy_hit_t *heap, size_t *nheap,
+                             size_t limit, struct frm_fuzzy_hit_t hit)
+{
+   size_t i;
+   if (*nheap < limit) {
+      // Sift up from the new leaf.
+      for (i=(*nheap)++; i > 0 && fuzzy_hit_worse (&hit, &heap[(i - 1) / 2]);
+           i=(i - 1) / 2) {
+         heap[i] = heap[(i - 1) / 2];
+      }
+   } else {
+      // Replace the top and sift down.
+      for (i=0; 2 * i + 1 < *nheap; ) {
+         size_t child = 2 * i + 1;
+         if (child + 1 < *nheap && fuzzy_hit_worse (&heap[child + 1], &heap[child]))
+            child++;
+         if (!(fuzzy_hit_worse (&heap[child], &hit)))
+            break;
+         heap[i] = heap[child];
+         i = child;
+      }
+   }
+   heap[i] = hit;
+}
+
+/* ********************************************************** */
+
+int32_t frm_fuzzy_score (const char *line, size_t len, const char *query)
+{
+   struct fuzzy_term_t *terms = fuzzy_terms (query ? query : "");
+   if (!terms)
+      return -1;
+
+   int32_t ret = fuzzy_score (line, len, terms);
+   fuzzy_terms_free (terms);
+   return ret;
+}
+
+struct frm_fuzzy_hit_t *frm_fuzzy_rank (const char *lines, size_t len,
+                                        const char *query, size_t limit,
+                                        frm_fuzzy_bonus_t *bonus, void *arg,
+                                        size_t *nhits)
+{
+   bool error = true;
+   struct frm_fuzzy_hit_t *heap = NULL;
+   size_t nheap = 0, cap = 0;
+
+   *nhits = 0;
+   if (limit == 0)
+      limit = (size_t)-1;
+
+   struct fuzzy_term_t *terms = fuzzy_terms (query ? query : "");
+   if (!terms)
+      return NULL;
+
+   for (size_t offset=0; offset<len; ) {
+      const char *line = &lines[offset];
+      const char *eol = memchr (line, '\n', len - offset);
+      size_t linelen = eol ? (size_t)(eol - line) : len - offset;
+      size_t next = offset + linelen + 1;
+
+      int32_t score = linelen ? fuzzy_score (line, linelen, terms) : -1;
+      if (score < 0) {
+         offset = next;
+         continue;
+      }
+      if (bonus) {
+         score += bonus (arg, line, linelen);
+      }
+
+      struct frm_fuzzy_hit_t hit = { offset, linelen, score };
+      offset = next;
+      if (nheap == limit && !(fuzzy_hit_worse (&heap[0], &hit)))
+         continue;
+
+      // The heap only grows as far as it is filled.
+      if (nheap == cap) {
+         size_t newcap = cap ? cap * 2 : 64;
+         if (newcap > limit)
+            newcap = limit;
+         struct frm_fuzzy_hit_t *tmp = realloc (heap, newcap * sizeof *tmp);
+         if (!tmp) {
+            FRM_ERROR ("OOM error allocating fuzzy matches\n");
+            goto cleanup;
+         }
+         heap = tmp;
+         cap = newcap;
+      }
+      fuzzy_heap_push (heap, &nheap, limit, hit);
+   }
+
+   if (!heap && !(heap = malloc (sizeof *heap))) {
+      FRM_ERROR ("OOM error allocating fuzzy matches\n");
+      goto cleanup;
+   }
+   if (nheap) {
+      qsort (heap, nheap, sizeof *heap, fuzzy_hit_cmp);
+   }
+   *nhits = nheap;
+   error = false;
+
+cleanup:
+   fuzzy_terms_free (terms);
+   if (error) {
+      free (heap);
+      heap = NULL;
+   }
+   return heap;
+}
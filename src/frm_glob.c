@@ -0,0 +1,422 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "frm.h"
+#include "frm_glob.h"
+#include "frm_scan.h"
+
+// The DFA states that are kept. When there are more, the DFA is thrown
+// away and built again from the state that it was in.
+#define GLOB_MAX_STATES    (256)
+
+#define GLOB_UNKNOWN       (-1)
+#define GLOB_DEAD          (0)      // No path can match from here
+#define GLOB_START         (1)
+
+// Text is folded this many bytes at a time.
+#define GLOB_CHUNK         (256)
+
+// A position of the NFA, which matches a byte in set.
+struct glob_token_t {
+   uint64_t set[4];
+   bool repeat;            // Zero or more bytes, otherwise exactly one
+   size_t skip;            // If not 0, position i + skip follows without a byte
+};
+
+struct frm_glob_t {
+   // Position ntokens is the accepting position.
+   struct glob_token_t *tokens;
+   size_t ntokens;
+   size_t cap;
+   size_t nwords;          // In a set of positions
+
+   // The text is folded with frm_scan_fold() before it is matched.
+   bool fold;
+
+   // State i of the DFA is the set of positions at sets[i * nwords], and
+   // moves to state next[i * 256 + c] on byte c.
+   uint64_t *sets;
+   int32_t *next;
+   bool *accept;
+   size_t nstates;
+};
+
+/* ********************************************************** */
+
+static void glob_set_add (uint64_t *set, size_t bit)
+{
+   set[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static void glob_set_del (uint64_t *set, size_t bit)
+{
+   set[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+static bool glob_set_has (const uint64_t *set, size_t bit)
+{
+   return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void glob_set_range (uint64_t *set, int lo, int hi)
+{
+   for (int c=lo; c<=hi; c++) {
+      glob_set_add (set, c);
+   }
+}
+
+static struct glob_token_t *glob_token (frm_glob_t *glob)
+{
+   if (glob->ntokens == glob->cap) {
+      size_t newcap = glob->cap ? glob->cap * 2 : 16;
+      struct glob_token_t *tmp = realloc (glob->tokens, newcap * sizeof *tmp);
+      if (!tmp) {
+         FRM_ERROR ("OOM error allocating glob pattern\n");
+         return NULL;
+      }
+      glob->tokens = tmp;
+      glob->cap = newcap;
+   }
+   struct glob_token_t *ret = &glob->tokens[glob->ntokens++];
+   memset (ret, 0, sizeof *ret);
+   return ret;
+}
+
+// Adds a token for one character: the byte that starts it, in set, and
+// any continuation bytes of a UTF-8 sequence.
+static bool glob_char (frm_glob_t *glob, const uint64_t set[4])
+{
+   struct glob_token_t *token = glob_token (glob);
+   if (!token)
+      return false;
+   memcpy (token->set, set, sizeof token->set);
+
+   if (!(token = glob_token (glob)))
+      return false;
+   glob_set_range (token->set, 0x80, 0xBF);
+   token->repeat = true;
+   return true;
+}
+
+static bool glob_literal (frm_glob_t *glob, int c, bool icase)
+{
+   struct glob_token_t *token = glob_token (glob);
+   if (!token)
+      return false;
+   glob_set_add (token->set, c);
+   if (icase && c >= 'a' && c <= 'z')
+      glob_set_add (token->set, c - ('a' - 'A'));
+   if (icase && c >= 'A' && c <= 'Z')
+      glob_set_add (token->set, c + ('a' - 'A'));
+   return true;
+}
+
+// Parses the bracket expression at pattern[*i], which is '['.
+static bool glob_bracket (frm_glob_t *glob, const char *pattern, size_t *i,
+                          bool icase)
+{
+   uint64_t set[4] = { 0, 0, 0, 0 };
+   size_t j = *i + 1;
+   bool negate = pattern[j] == '!' || pattern[j] == '^';
+   if (negate)
+      j++;
+
+   for (bool first=true; pattern[j] && (first || pattern[j] != ']'); first=false) {
+      if (pattern[j] == '\\' && pattern[j + 1])
+         j++;
+      unsigned char lo = pattern[j++], hi = lo;
+      if (pattern[j] == '-' && pattern[j + 1] && pattern[j + 1] != ']') {
+         j++;
+         if (pattern[j] == '\\' && pattern[j + 1])
+            j++;
+         hi = pattern[j++];
+      }
+      if (lo >= 0x80 || hi >= 0x80) {
+         FRM_ERROR ("Error: only ASCII characters can be listed in [%s]\n", pattern);
+         return false;
+      }
+      for (int c=lo; c<=hi; c++) {
+         glob_set_add (set, c);
+         if (icase && c >= 'a' && c <= 'z')
+            glob_set_add (set, c - ('a' - 'A'));
+         if (icase && c >= 'A' && c <= 'Z')
+            glob_set_add (set, c + ('a' - 'A'));
+      }
+   }
+   if (pattern[j] != ']') {
+      FRM_ERROR ("Error: unterminated '[' in [%s]\n", pattern);
+      return false;
+   }
+   *i = j + 1;
+
+   // Like '*' and '?', a bracket never matches '/'.
+   if (!negate) {
+      glob_set_del (set, '/');
+      struct glob_token_t *token = glob_token (glob);
+      if (token)
+         memcpy (token->set, set, sizeof set);
+      return token != NULL;
+   }
+
+   for (size_t w=0; w<4; w++) {
+      set[w] = ~set[w];
+   }
+   glob_set_del (set, '/');
+   for (int c=0x80; c<=0xBF; c++) {
+      glob_set_del (set, c);
+   }
+   return glob_char (glob, set);
+}
+
+static bool glob_compile (frm_glob_t *glob, const char *pattern, bool icase)
+{
+   for (size_t i=0; pattern[i]; ) {
+      struct glob_token_t *token = NULL;
+      switch (pattern[i]) {
+         case '*':
+            if (pattern[i + 1] != '*') {
+               if (!(token = glob_token (glob)))
+                  return false;
+               glob_set_range (token->set, 0, 255);
+               glob_set_del (token->set, '/');
+               token->repeat = true;
+               i++;
+               break;
+            }
+
+            size_t end = i;
+            while (pattern[end] == '*')
+               end++;
+
+            // "/**/" also matches "/". The skip is from a position that
+            // matches no byte, so that it is only taken before the '**'
+            // has matched anything.
+            bool slashes = (i == 0 || pattern[i - 1] == '/') && pattern[end] == '/';
+            if (slashes) {
+               if (!(token = glob_token (glob)))
+                  return false;
+               token->repeat = true;
+               token->skip = 3;
+            }
+
+            if (!(token = glob_token (glob)))
+               return false;
+            glob_set_range (token->set, 0, 255);
+            token->repeat = true;
+
+            if (slashes) {
+               if (!(glob_literal (glob, '/', false)))
+                  return false;
+               end++;
+            }
+            i = end;
+            break;
+
+         case '?': {
+            uint64_t set[4] = { 0, 0, 0, 0 };
+            glob_set_range (set, 0, 0x7F);
+            glob_set_range (set, 0xC0, 0xFF);
+            glob_set_del (set, '/');
+            if (!(glob_char (glob, set)))
+               return false;
+            i++;
+            break;
+         }
+
+         case '[':
+            if (!(glob_bracket (glob, pattern, &i, icase)))
+               return false;
+            break;
+
+         case '\\':
+            if (pattern[i + 1])
+               i++;
+            // Fallthrough
+
+         default:
+            if (!(glob_literal (glob, (unsigned char)pattern[i], icase)))
+               return false;
+            i++;
+            break;
+      }
+   }
+   return true;
+}
+
+/* ********************************************************** */
+
+// Adds the positions that can be reached from set without a byte.
+static void glob_closure (const frm_glob_t *glob, uint64_t *set)
+{
+   // Positions only lead forward, so one pass finds them all.
+   for (size_t i=0; i<glob->ntokens; i++) {
+      if (!(glob_set_has (set, i)))
+         continue;
+      if (glob->tokens[i].repeat)
+         glob_set_add (set, i + 1);
+      if (glob->tokens[i].skip)
+         glob_set_add (set, i + glob->tokens[i].skip);
+   }
+}
+
+static void glob_reset (frm_glob_t *glob)
+{
+   memset (glob->next, 0, 256 * sizeof *glob->next);
+   memset (&glob->next[256], 0xFF, 256 * sizeof *glob->next);
+   glob->nstates = 2;
+}
+
+// Returns the state for the set of positions, adding it if it is new.
+static int32_t glob_state (frm_glob_t *glob, const uint64_t *set)
+{
+   size_t nbytes = glob->nwords * sizeof *set;
+   for (size_t i=0; i<glob->nstates; i++) {
+      if ((memcmp (&glob->sets[i * glob->nwords], set, nbytes))==0)
+         return i;
+   }
+
+   if (glob->nstates == GLOB_MAX_STATES) {
+      glob_reset (glob);
+   }
+   size_t ret = glob->nstates++;
+   memcpy (&glob->sets[ret * glob->nwords], set, nbytes);
+   memset (&glob->next[ret * 256], 0xFF, 256 * sizeof *glob->next);
+   glob->accept[ret] = glob_set_has (set, glob->ntokens);
+   return ret;
+}
+
+static int32_t glob_transition (frm_glob_t *glob, int32_t state, unsigned char c)
+{
+   uint64_t *set = &glob->sets[GLOB_MAX_STATES * glob->nwords];
+   const uint64_t *from = &glob->sets[state * glob->nwords];
+   memset (set, 0, glob->nwords * sizeof *set);
+
+   for (size_t i=0; i<glob->ntokens; i++) {
+      if (glob_set_has (from, i) && glob_set_has (glob->tokens[i].set, c))
+         glob_set_add (set, glob->tokens[i].repeat ? i : i + 1);
+   }
+   glob_closure (glob, set);
+
+   // A reset forgets the state that the transition is from.
+   size_t nstates = glob->nstates;
+   int32_t ret = glob_state (glob, set);
+   if (glob->nstates >= nstates) {
+      glob->next[state * 256 + c] = ret;
+   }
+   return ret;
+}
+
+/* ********************************************************** */
+
+frm_glob_t *frm_glob_new (const char *pattern, bool icase)
+{
+   bool error = true;
+   char *folded = NULL;
+   frm_glob_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating glob\n");
+      return NULL;
+   }
+
+   // Letters outside ASCII only match in either case if both the
+   // pattern and the text are folded.
+   size_t len = strlen (pattern);
+   if (icase && !(frm_scan_ascii (pattern, len))) {
+      if (!(folded = malloc (len + 1))) {
+         FRM_ERROR ("OOM error allocating glob\n");
+         goto cleanup;
+      }
+      frm_scan_fold (folded, pattern, len);
+      folded[len] = 0;
+      pattern = folded;
+      ret->fold = true;
+   }
+
+   if (!(glob_compile (ret, pattern, icase))) {
+      errno = EINVAL;
+      goto cleanup;
+   }
+
+   // The last set is scratch space for glob_transition().
+   ret->nwords = (ret->ntokens + 1 + 63) / 64;
+   if (!(ret->sets = calloc ((GLOB_MAX_STATES + 1) * ret->nwords, sizeof *ret->sets))
+         || !(ret->next = malloc (GLOB_MAX_STATES * 256 * sizeof *ret->next))
+         || !(ret->accept = calloc (GLOB_MAX_STATES, sizeof *ret->accept))) {
+      FRM_ERROR ("OOM error allocating glob automaton\n");
+      goto cleanup;
+   }
+
+   // The dead state has the empty set and leads nowhere.
+   glob_reset (ret);
+   uint64_t *start = &ret->sets[GLOB_START * ret->nwords];
+   glob_set_add (start, 0);
+   glob_closure (ret, start);
+   ret->accept[GLOB_START] = glob_set_has (start, ret->ntokens);
+
+   error = false;
+
+cleanup:
+   free (folded);
+   if (error) {
+      frm_glob_del (ret);
+      ret = NULL;
+   }
+   return ret;
+}
+
+void frm_glob_del (frm_glob_t *glob)
+{
+   if (!glob)
+      return;
+
+   free (glob->tokens);
+   free (glob->sets);
+   free (glob->next);
+   free (glob->accept);
+   free (glob);
+}
+
+bool frm_glob_match (frm_glob_t *glob, const char *text, size_t len)
+{
+   char chunk[GLOB_CHUNK];
+   int32_t state = GLOB_START;
+
+   for (size_t offset=0; offset<len; ) {
+      const char *bytes = &text[offset];
+      size_t nbytes = len - offset;
+      if (glob->fold) {
+         // A chunk does not end in the middle of a two-byte sequence.
+         if (nbytes > sizeof chunk) {
+            nbytes = sizeof chunk;
+            if ((unsigned char)bytes[nbytes - 1] >= 0xC0)
+               nbytes--;
+         }
+         frm_scan_fold (chunk, bytes, nbytes);
+         bytes = chunk;
+      }
+      offset += nbytes;
+
+      for (size_t i=0; i<nbytes; i++) {
+         unsigned char c = bytes[i];
+         int32_t next = glob->next[state * 256 + c];
+         if (next == GLOB_UNKNOWN)
+            next = glob_transition (glob, state, c);
+         if (next == GLOB_DEAD)
+            return false;
+         state = next;
+      }
+   }
+   return glob->accept[state];
+}
@@ -0,0 +1,249 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+
+#include "frm.h"
+#include "frm_grep.h"
+#include "frm_io.h"
+
+#define GREP_FLAGS         (REG_EXTENDED | REG_NOSUB | REG_NEWLINE)
+
+// Frames are handed out to the threads this many at a time.
+#define GREP_CHUNK         (16)
+
+// There is one thread for about this many frames, up to one per processor.
+#define GREP_PER_THREAD    (256)
+#define GREP_MAX_THREADS   (64)
+
+// Payloads larger than this are mapped rather than read, where regexec()
+// can match text that is not NUL-terminated.
+#define GREP_MMAP_MIN      (64 * 1024)
+
+struct grep_job_t {
+   int dirfd;
+   char **paths;
+   size_t npaths;
+   size_t next;            // The next frame to hand out
+   bool *matches;
+   bool failed;
+};
+
+struct grep_worker_t {
+   struct grep_job_t *job;
+   regex_t re;
+   bool compiled;
+   pthread_t thread;
+   bool started;
+   char *buf;
+   size_t cap;
+};
+
+/* ********************************************************** */
+
+static bool grep_compile (regex_t *re, const char *regex)
+{
+   int rc = regcomp (re, regex, GREP_FLAGS);
+   if (rc != 0) {
+      char msg[256];
+      regerror (rc, re, msg, sizeof msg);
+      FRM_ERROR ("Error: invalid regular expression [%s]: %s\n", regex, msg);
+      errno = EINVAL;
+      return false;
+   }
+   return true;
+}
+
+// Matches the payload of the frame at path. A frame without a payload
+// does not match.
+static bool grep_payload (struct grep_worker_t *worker, const char *path,
+                          bool *matched)
+{
+   *matched = false;
+
+   size_t plen = strlen (path);
+   if (!(worker->buf) || worker->cap < plen + sizeof "/payload") {
+      size_t cap = plen + sizeof "/payload" + 4096;
+      char *tmp = realloc (worker->buf, cap);
+      if (!tmp) {
+         FRM_ERROR ("OOM error allocating payload buffer\n");
+         return false;
+      }
+      worker->buf = tmp;
+      worker->cap = cap;
+   }
+   memcpy (worker->buf, path, plen);
+   strcpy (&worker->buf[plen], "/payload");
+
+   int fd = openat (worker->job->dirfd, worker->buf, O_RDONLY | O_BINARY | O_CLOEXEC);
+   if (fd < 0)
+      return errno == ENOENT;
+
+   struct stat sb;
+   if ((fstat (fd, &sb))!=0) {
+      FRM_ERROR ("Failed to read [%s]: %m\n", worker->buf);
+      close (fd);
+      return false;
+   }
+   size_t len = sb.st_size;
+
+#ifdef REG_STARTEND
+   if (len >= GREP_MMAP_MIN) {
+      char *text = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+      close (fd);
+      if (text == MAP_FAILED) {
+         FRM_ERROR ("Failed to map [%s/payload]: %m\n", path);
+         return false;
+      }
+      regmatch_t range = { 0, len };
+      *matched = (regexec (&worker->re, text, 1, &range, REG_STARTEND))==0;
+      munmap (text, len);
+      return true;
+   }
+#endif
+
+   if (worker->cap < len + 1) {
+      char *tmp = realloc (worker->buf, len + 1);
+      if (!tmp) {
+         FRM_ERROR ("OOM error allocating payload buffer\n");
+         close (fd);
+         return false;
+      }
+      worker->buf = tmp;
+      worker->cap = len + 1;
+   }
+
+   bool ret = frm_io_read_full (fd, worker->buf, len, 0);
+   close (fd);
+   if (!ret) {
+      FRM_ERROR ("Failed to read [%s/payload]: %m\n", path);
+      return false;
+   }
+   worker->buf[len] = 0;
+   *matched = (regexec (&worker->re, worker->buf, 0, NULL, 0))==0;
+   return true;
+}
+
+static void *grep_worker (void *arg)
+{
+   struct grep_worker_t *worker = arg;
+   struct grep_job_t *job = worker->job;
+
+   for (;;) {
+      size_t start = __sync_fetch_and_add (&job->next, GREP_CHUNK);
+      if (start >= job->npaths || __atomic_load_n (&job->failed, __ATOMIC_RELAXED))
+         break;
+
+      size_t end = start + GREP_CHUNK < job->npaths ? start + GREP_CHUNK : job->npaths;
+      for (size_t i=start; i<end; i++) {
+         if (!(grep_payload (worker, job->paths[i], &job->matches[i]))) {
+            __atomic_store_n (&job->failed, true, __ATOMIC_RELAXED);
+            break;
+         }
+      }
+   }
+   return NULL;
+}
+
+/* ********************************************************** */
+
+bool *frm_grep_scan (int dirfd, char **paths, size_t npaths,
+                     const char *regex)
+{
+   bool error = true;
+   struct grep_job_t job = { dirfd, paths, npaths, 0, NULL, false };
+   struct grep_worker_t *workers = NULL;
+   size_t nworkers = 0;
+
+   long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+   size_t nthreads = npaths / GREP_PER_THREAD + 1;
+   if (ncpus > 0 && nthreads > (size_t)ncpus) {
+      nthreads = ncpus;
+   }
+   if (nthreads > GREP_MAX_THREADS) {
+      nthreads = GREP_MAX_THREADS;
+   }
+
+   if (!(job.matches = calloc (npaths + 1, sizeof *job.matches))
+         || !(workers = calloc (nthreads, sizeof *workers))) {
+      FRM_ERROR ("OOM error allocating grep workers\n");
+      goto cleanup;
+   }
+
+   for (nworkers=0; nworkers<nthreads; nworkers++) {
+      struct grep_worker_t *worker = &workers[nworkers];
+      worker->job = &job;
+      if (!(worker->compiled = grep_compile (&worker->re, regex)))
+         goto cleanup;
+   }
+
+   // The calling thread is the first worker.
+   for (size_t i=1; i<nworkers; i++) {
+      int rc = pthread_create (&workers[i].thread, NULL, grep_worker, &workers[i]);
+      if (rc != 0) {
+         // The threads that did start do the work between them.
+         FRM_ERROR ("Warning: failed to start grep thread: %s\n", strerror (rc));
+         break;
+      }
+      workers[i].started = true;
+   }
+   grep_worker (&workers[0]);
+
+   for (size_t i=1; i<nworkers; i++) {
+      if (workers[i].started) {
+         pthread_join (workers[i].thread, NULL);
+         workers[i].started = false;
+      }
+   }
+
+   error = job.failed;
+
+cleanup:
+   for (size_t i=0; workers && i<nthreads; i++) {
+      if (workers[i].compiled) {
+         regfree (&workers[i].re);
+      }
+      free (workers[i].buf);
+   }
+   free (workers);
+   if (error) {
+      free (job.matches);
+      job.matches = NULL;
+   }
+   return job.matches;
+}
+
+bool *frm_grep_texts (char **texts, size_t ntexts, const char *regex)
+{
+   regex_t re;
+   if (!(grep_compile (&re, regex)))
+      return NULL;
+
+   bool *ret = calloc (ntexts + 1, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating grep results\n");
+   }
+   for (size_t i=0; ret && i<ntexts; i++) {
+      ret[i] = (regexec (&re, texts[i] ? texts[i] : "", 0, NULL, 0))==0;
+   }
+   regfree (&re);
+   return ret;
+}
@@ -0,0 +1,47 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_GREP
+#define H_FRM_GREP
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A parallel scan of the payloads of a directory framedb for a POSIX
+ * extended regular expression. The frames are shared out, a few at a
+ * time, between one thread per processor; each thread has its own copy
+ * of the compiled expression, as regexec() may serialise callers that
+ * share one. The expression is matched against each line of a payload,
+ * so '^' and '$' match at the start and end of lines.
+ *
+ * The caller must hold the framedb lock.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns an array of npaths flags that are true for the frames at
+   // paths, relative to dirfd, whose payload matches regex. The caller
+   // must free the result. Returns NULL on error, with errno set to
+   // EINVAL if regex is not valid.
+   bool *frm_grep_scan (int dirfd, char **paths, size_t npaths,
+                        const char *regex);
+
+   // As above, for payloads that are not files: matches the ntexts texts
+   // in the calling thread.
+   bool *frm_grep_texts (char **texts, size_t ntexts, const char *regex);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,746 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "frm.h"
+#include "frm_stats.h"
+#include "frm_ids.h"
+#include "frm_io.h"
+#include "ds_str.h"
+
+/* The log is a sequence of records, each of which is a fixed header, the
+ * nul-terminated name (absent for a removal) and then the total length
+ * of the record, so that the last record can be read from EOF. Every
+ * record holds the next ID to allocate at the time it was written.
+ *
+ * Fields are stored in host byte order.
+ */
+
+#define IDS_MAGIC          (0x44494d46)
+#define IDS_CHUNK          (64 * 1024)
+#define IDS_INITIAL_SLOTS  (1024)
+
+struct ids_rec_t {
+   uint32_t magic;
+   uint32_t namelen;    // Includes the nul terminator, 0 for a removal
+   uint64_t id;
+   uint64_t parent;
+   uint64_t next;
+};
+
+struct ids_entry_t {
+   uint64_t id;         // FRM_ID_NONE for an empty slot
+   uint64_t parent;
+   char *name;          // NULL if the frame has been removed
+};
+
+struct frm_ids_t {
+   pthread_mutex_t lock;
+   int dirfd;
+   char *fname;
+   int fd;
+   ino_t ino;
+
+   // The last record, as at the file size tail_size.
+   off_t tail_size;
+   uint64_t next;
+
+   // The table, an open-addressed hash of ID to entry, as at the file
+   // offset 'loaded'.
+   bool have_table;
+   off_t loaded;
+   struct ids_entry_t *slots;
+   size_t nslots;
+   size_t nused;
+};
+
+static void ids_table_clear (frm_ids_t *ids)
+{
+   for (size_t i=0; i<ids->nslots; i++) {
+      free (ids->slots[i].name);
+   }
+   free (ids->slots);
+   ids->slots = NULL;
+   ids->nslots = 0;
+   ids->nused = 0;
+   ids->loaded = 0;
+   ids->have_table = false;
+}
+
+static struct ids_entry_t *ids_table_find (frm_ids_t *ids, uint64_t id)
+{
+   if (!ids->nslots)
+      return NULL;
+
+   size_t mask = ids->nslots - 1;
+   for (size_t i=(id * 0x9e3779b97f4a7c15ULL) & mask; ; i=(i + 1) & mask) {
+      if (ids->slots[i].id == id)
+         return &ids->slots[i];
+      if (ids->slots[i].id == FRM_ID_NONE)
+         return NULL;
+   }
+}
+
+static bool ids_table_grow (frm_ids_t *ids)
+{
+   size_t nslots = ids->nslots ? ids->nslots * 2 : IDS_INITIAL_SLOTS;
+   struct ids_entry_t *slots = calloc (nslots, sizeof *slots);
+   if (!slots) {
+      FRM_ERROR ("OOM error allocating ID table\n");
+      return false;
+   }
+
+   struct ids_entry_t *old = ids->slots;
+   size_t nold = ids->nslots;
+   ids->slots = slots;
+   ids->nslots = nslots;
+   for (size_t i=0; i<nold; i++) {
+      if (old[i].id == FRM_ID_NONE)
+         continue;
+      size_t mask = nslots - 1;
+      size_t j = (old[i].id * 0x9e3779b97f4a7c15ULL) & mask;
+      while (slots[j].id != FRM_ID_NONE)
+         j = (j + 1) & mask;
+      slots[j] = old[i];
+   }
+   free (old);
+   return true;
+}
+
+// Applies a record to the table. Name is NULL for a removal.
+static bool ids_table_apply (frm_ids_t *ids, uint64_t id, uint64_t parent,
+                             const char *name)
+{
+   struct ids_entry_t *entry = ids_table_find (ids, id);
+   if (!entry) {
+      if ((ids->nused + 1) * 2 > ids->nslots && !(ids_table_grow (ids)))
+         return false;
+      size_t mask = ids->nslots - 1;
+      size_t i = (id * 0x9e3779b97f4a7c15ULL) & mask;
+      while (ids->slots[i].id != FRM_ID_NONE)
+         i = (i + 1) & mask;
+      entry = &ids->slots[i];
+      entry->id = id;
+      ids->nused++;
+   }
+
+   char *tmp = NULL;
+   if (name && !(tmp = ds_str_dup (name))) {
+      FRM_ERROR ("OOM error allocating ID table entry\n");
+      return false;
+   }
+   free (entry->name);
+   entry->name = tmp;
+   entry->parent = parent;
+   return true;
+}
+
+// Opens the log again if it has been replaced (by frm_ids_compact() in
+// another process) since it was opened.
+static bool ids_reopen (frm_ids_t *ids)
+{
+   struct stat sb;
+   if (ids->fd >= 0 && (fstatat (ids->dirfd, ids->fname, &sb, 0))==0
+         && sb.st_ino == ids->ino) {
+      return true;
+   }
+
+   FRM_STATS_ADD (opens, 1);
+   int fd = openat (ids->dirfd, ids->fname,
+                    O_RDWR | O_APPEND | O_CREAT | O_BINARY | O_CLOEXEC, 0644);
+   if (fd < 0 || (fstat (fd, &sb))!=0) {
+      FRM_ERROR ("Failed to open ID log [%s]: %m\n", ids->fname);
+      if (fd >= 0) {
+         close (fd);
+      }
+      return false;
+   }
+
+   if (ids->fd >= 0) {
+      close (ids->fd);
+   }
+   ids->fd = fd;
+   ids->ino = sb.st_ino;
+   ids->tail_size = -1;
+   ids->next = FRM_ID_ROOT;
+   ids_table_clear (ids);
+   return true;
+}
+
+// Reads the next ID to allocate from the last record.
+static bool ids_read_tail (frm_ids_t *ids)
+{
+   struct stat sb;
+   if ((fstat (ids->fd, &sb))!=0) {
+      FRM_ERROR ("Failed to stat ID log [%s]: %m\n", ids->fname);
+      return false;
+   }
+
+   if (sb.st_size == ids->tail_size)
+      return true;
+
+   struct ids_rec_t hdr;
+   uint32_t reclen = 0;
+   if (sb.st_size == 0) {
+      ids->next = FRM_ID_ROOT;
+   } else if (sb.st_size < (off_t)(sizeof hdr + sizeof reclen)
+         || !(frm_io_read_full (ids->fd, &reclen, sizeof reclen,
+                             sb.st_size - sizeof reclen))
+         || reclen > sb.st_size || reclen < sizeof hdr + sizeof reclen
+         || !(frm_io_read_full (ids->fd, &hdr, sizeof hdr, sb.st_size - reclen))
+         || hdr.magic != IDS_MAGIC) {
+      FRM_ERROR ("Error: corrupt last record in ID log [%s]\n", ids->fname);
+      errno = EINVAL;
+      return false;
+   } else {
+      ids->next = hdr.next;
+   }
+
+   ids->tail_size = sb.st_size;
+   return true;
+}
+
+// Reads the records appended since the table was last read.
+static bool ids_load (frm_ids_t *ids)
+{
+   struct stat sb;
+   if ((fstat (ids->fd, &sb))!=0) {
+      FRM_ERROR ("Failed to stat ID log [%s]: %m\n", ids->fname);
+      return false;
+   }
+
+   if (ids->have_table && sb.st_size == ids->loaded)
+      return true;
+
+   size_t len = sb.st_size - ids->loaded;
+   char *buf = malloc (len + 1);
+   if (!buf) {
+      FRM_ERROR ("OOM error reading ID log [%s]\n", ids->fname);
+      return false;
+   }
+   if (!(frm_io_read_full (ids->fd, buf, len, ids->loaded))) {
+      FRM_ERROR ("Failed to read ID log [%s]: %m\n", ids->fname);
+      free (buf);
+      return false;
+   }
+
+   size_t offset = 0;
+   bool ret = true;
+   struct ids_rec_t hdr;
+   uint32_t reclen;
+   while (ret && offset + sizeof hdr + sizeof reclen <= len) {
+      memcpy (&hdr, &buf[offset], sizeof hdr);
+      reclen = sizeof hdr + hdr.namelen + sizeof reclen;
+      if (hdr.magic != IDS_MAGIC || offset + reclen > len
+            || (hdr.namelen && buf[offset + sizeof hdr + hdr.namelen - 1] != 0)) {
+         FRM_ERROR ("Error: corrupt record in ID log [%s] at offset %lli\n",
+                    ids->fname, (long long)(ids->loaded + offset));
+         errno = EINVAL;
+         ret = false;
+         break;
+      }
+
+      const char *name = hdr.namelen ? &buf[offset + sizeof hdr] : NULL;
+      ret = ids_table_apply (ids, hdr.id, hdr.parent, name);
+      ids->next = hdr.next;
+      offset += reclen;
+   }
+
+   free (buf);
+   if (ret) {
+      ids->loaded += offset;
+      ids->tail_size = ids->loaded;
+      ids->have_table = true;
+   } else {
+      ids_table_clear (ids);
+      ids->tail_size = -1;
+   }
+   return ret;
+}
+
+// Appends a record for each of the n frames in a single write. A NULL
+// name records a removal.
+static bool ids_append_many (frm_ids_t *ids, size_t n, const uint64_t *id,
+                             const uint64_t *parent, const char **name)
+{
+   size_t len = 0;
+   for (size_t i=0; i<n; i++) {
+      len += sizeof (struct ids_rec_t) + (name[i] ? strlen (name[i]) + 1 : 0)
+           + sizeof (uint32_t);
+   }
+
+   char *buf = malloc (len ? len : 1);
+   if (!buf) {
+      FRM_ERROR ("OOM error allocating ID records\n");
+      return false;
+   }
+
+   uint64_t next = ids->next;
+   size_t offset = 0;
+   for (size_t i=0; i<n; i++) {
+      if (id[i] >= next)
+         next = id[i] + 1;
+      struct ids_rec_t hdr = {
+         IDS_MAGIC, name[i] ? strlen (name[i]) + 1 : 0, id[i], parent[i], next,
+      };
+      uint32_t reclen = sizeof hdr + hdr.namelen + sizeof reclen;
+      memcpy (&buf[offset], &hdr, sizeof hdr);
+      if (name[i]) {
+         memcpy (&buf[offset + sizeof hdr], name[i], hdr.namelen);
+      }
+      memcpy (&buf[offset + sizeof hdr + hdr.namelen], &reclen, sizeof reclen);
+      offset += reclen;
+   }
+
+   bool ret = frm_io_write_full (ids->fd, buf, len);
+   free (buf);
+   if (!ret) {
+      FRM_ERROR ("Failed to write ID log [%s]: %m\n", ids->fname);
+      ids->tail_size = -1;
+      return false;
+   }
+
+   // Keep the table and the tail up to date with our own write, unless
+   // someone else has written since.
+   if (ids->tail_size >= 0) {
+      ids->tail_size += len;
+   }
+   ids->next = next;
+   if (ids->have_table && ids->loaded + (off_t)len == ids->tail_size) {
+      for (size_t i=0; ret && i<n; i++) {
+         ret = ids_table_apply (ids, id[i], parent[i], name[i]);
+      }
+      if (ret) {
+         ids->loaded = ids->tail_size;
+      } else {
+         ids_table_clear (ids);
+      }
+   }
+   return true;
+}
+
+static bool ids_append (frm_ids_t *ids, uint64_t id, uint64_t parent,
+                        const char *name)
+{
+   return ids_append_many (ids, 1, &id, &parent, &name);
+}
+
+// Sets below[i] for each slot i that holds a frame at or below the frame
+// top, as far as the table shows, and clears it for the rest. Called with
+// ids->lock held.
+static bool ids_below (frm_ids_t *ids, uint64_t top, bool *below)
+{
+   // Each slot is one of these once it has been walked through.
+   enum { UNKNOWN, BELOW, ELSEWHERE };
+   uint8_t *state = calloc (ids->nslots ? ids->nslots : 1, sizeof *state);
+   size_t *chain = malloc ((ids->nused + 1) * sizeof *chain);
+   if (!state || !chain) {
+      FRM_ERROR ("OOM error walking ID table\n");
+      free (state);
+      free (chain);
+      return false;
+   }
+
+   // Walk up from each frame until a frame that has already been walked
+   // through, top, the root or a removed frame, and mark every frame on
+   // the way the same. A loop in the parents (a corrupt log) is ended by
+   // the length of the chain.
+   for (size_t i=0; i<ids->nslots; i++) {
+      size_t nchain = 0;
+      uint8_t result = ELSEWHERE;
+      struct ids_entry_t *entry = &ids->slots[i];
+      while (entry && entry->id != FRM_ID_NONE && entry->name && nchain <= ids->nused) {
+         size_t slot = entry - ids->slots;
+         if (state[slot] != UNKNOWN) {
+            result = state[slot];
+            break;
+         }
+         chain[nchain++] = slot;
+         if (entry->id == top) {
+            result = BELOW;
+            break;
+         }
+         if (entry->id == FRM_ID_ROOT)
+            break;
+         entry = ids_table_find (ids, entry->parent);
+      }
+      while (nchain) {
+         state[chain[--nchain]] = result;
+      }
+      below[i] = state[i] == BELOW;
+   }
+
+   free (state);
+   free (chain);
+   return true;
+}
+
+// The path of id from the table, or NULL if it is not in the table or
+// does not lead to the root. Called with ids->lock held.
+static char *ids_path (frm_ids_t *ids, uint64_t id)
+{
+   // Collect the names from the frame up to the root, then join them in
+   // reverse. A loop in the parents (a corrupt log) ends the walk.
+   size_t len = 0;
+   size_t depth = 0;
+   struct ids_entry_t *entry = ids_table_find (ids, id);
+   while (entry && entry->name && entry->id != FRM_ID_ROOT && depth <= ids->nused) {
+      len += strlen (entry->name) + 1;
+      depth++;
+      entry = ids_table_find (ids, entry->parent);
+   }
+   if (!entry || !entry->name || entry->id != FRM_ID_ROOT) {
+      errno = ENOENT;
+      return NULL;
+   }
+   len += strlen (entry->name);
+
+   char *ret = malloc (len + 1);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating path of ID %" PRIu64 "\n", id);
+      return NULL;
+   }
+   ret[len] = 0;
+   for (entry = ids_table_find (ids, id); ; entry = ids_table_find (ids, entry->parent)) {
+      size_t namelen = strlen (entry->name);
+      len -= namelen;
+      memcpy (&ret[len], entry->name, namelen);
+      if (entry->id == FRM_ID_ROOT)
+         break;
+      ret[--len] = '/';
+   }
+   return ret;
+}
+
+/* ********************************************************** */
+
+frm_ids_t *frm_ids_open (int dirfd, const char *fname)
+{
+   frm_ids_t *ret = calloc (1, sizeof *ret);
+   if (!ret || !(ret->fname = ds_str_dup (fname))) {
+      FRM_ERROR ("OOM error allocating ID log\n");
+      free (ret);
+      return NULL;
+   }
+
+   pthread_mutex_init (&ret->lock, NULL);
+   ret->dirfd = dirfd;
+   ret->fd = -1;
+   ret->tail_size = -1;
+   if (!(ids_reopen (ret))) {
+      frm_ids_close (ret);
+      return NULL;
+   }
+
+   return ret;
+}
+
+void frm_ids_close (frm_ids_t *ids)
+{
+   if (!ids)
+      return;
+
+   ids_table_clear (ids);
+   if (ids->fd >= 0) {
+      close (ids->fd);
+   }
+   pthread_mutex_destroy (&ids->lock);
+   free (ids->fname);
+   free (ids);
+}
+
+uint64_t frm_ids_add (frm_ids_t *ids, uint64_t parent, const char *name)
+{
+   if (!ids || !name || !name[0]) {
+      FRM_ERROR ("Error: invalid parameters for new ID [%s]\n", name);
+      errno = EINVAL;
+      return FRM_ID_NONE;
+   }
+
+   uint64_t ret = FRM_ID_NONE;
+   pthread_mutex_lock (&ids->lock);
+   if ((ids_reopen (ids)) && (ids_read_tail (ids))) {
+      uint64_t id = ids->next;
+      if ((ids_append (ids, id, parent, name))) {
+         ret = id;
+      }
+   }
+   pthread_mutex_unlock (&ids->lock);
+   return ret;
+}
+
+bool frm_ids_set (frm_ids_t *ids, uint64_t id, uint64_t parent, const char *name)
+{
+   if (!ids || id == FRM_ID_NONE || !name || !name[0]) {
+      FRM_ERROR ("Error: invalid parameters for ID %" PRIu64 " [%s]\n", id, name);
+      errno = EINVAL;
+      return false;
+   }
+
+   pthread_mutex_lock (&ids->lock);
+   bool ret = ids_reopen (ids) && ids_read_tail (ids)
+           && ids_append (ids, id, parent, name);
+   pthread_mutex_unlock (&ids->lock);
+   return ret;
+}
+
+bool frm_ids_remove (frm_ids_t *ids, uint64_t id)
+{
+   if (!ids || id == FRM_ID_NONE) {
+      FRM_ERROR ("Error: invalid ID %" PRIu64 " to remove\n", id);
+      errno = EINVAL;
+      return false;
+   }
+
+   pthread_mutex_lock (&ids->lock);
+   bool ret = ids_reopen (ids) && ids_read_tail (ids)
+           && ids_append (ids, id, FRM_ID_NONE, NULL);
+   pthread_mutex_unlock (&ids->lock);
+   return ret;
+}
+
+bool frm_ids_set_many (frm_ids_t *ids, size_t n, const uint64_t *id,
+                       const uint64_t *parent, const char **name)
+{
+   for (size_t i=0; ids && i<n; i++) {
+      if (id[i] == FRM_ID_NONE || !name[i] || !name[i][0]) {
+         FRM_ERROR ("Error: invalid parameters for ID %" PRIu64 " [%s]\n",
+                    id[i], name[i]);
+         errno = EINVAL;
+         return false;
+      }
+   }
+   if (!ids) {
+      errno = EINVAL;
+      return false;
+   }
+
+   pthread_mutex_lock (&ids->lock);
+   bool ret = ids_reopen (ids) && ids_read_tail (ids)
+           && ids_append_many (ids, n, id, parent, name);
+   pthread_mutex_unlock (&ids->lock);
+   return ret;
+}
+
+bool frm_ids_remove_tree (frm_ids_t *ids, uint64_t id)
+{
+   if (!ids || id == FRM_ID_NONE) {
+      FRM_ERROR ("Error: invalid ID %" PRIu64 " to remove\n", id);
+      errno = EINVAL;
+      return false;
+   }
+
+   bool error = true;
+   bool *below = NULL;
+   uint64_t *removed = NULL;
+   uint64_t *parents = NULL;
+   const char **names = NULL;
+
+   pthread_mutex_lock (&ids->lock);
+   if (!(ids_reopen (ids)) || !(ids_load (ids))) {
+      goto cleanup;
+   }
+
+   below = calloc (ids->nslots + 1, sizeof *below);
+   removed = malloc ((ids->nused + 1) * sizeof *removed);
+   parents = calloc (ids->nused + 1, sizeof *parents);
+   names = calloc (ids->nused + 1, sizeof *names);
+   if (!below || !removed || !parents || !names) {
+      FRM_ERROR ("OOM error removing ID %" PRIu64 "\n", id);
+      goto cleanup;
+   }
+   if (!(ids_below (ids, id, below))) {
+      goto cleanup;
+   }
+
+   // The frame itself is removed even if the table does not know it.
+   size_t n = 0;
+   removed[n++] = id;
+   for (size_t i=0; i<ids->nslots; i++) {
+      if (below[i] && ids->slots[i].id != id) {
+         removed[n++] = ids->slots[i].id;
+      }
+   }
+
+   error = !(ids_append_many (ids, n, removed, parents, names));
+
+cleanup:
+   pthread_mutex_unlock (&ids->lock);
+   free (below);
+   free (removed);
+   free (parents);
+   free (names);
+   return !error;
+}
+
+char *frm_ids_path (frm_ids_t *ids, uint64_t id)
+{
+   if (!ids || id == FRM_ID_NONE) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   char *ret = NULL;
+   pthread_mutex_lock (&ids->lock);
+   if ((ids_reopen (ids)) && (ids_load (ids))) {
+      ret = ids_path (ids, id);
+   }
+   pthread_mutex_unlock (&ids->lock);
+   return ret;
+}
+
+bool frm_ids_refresh (frm_ids_t *ids)
+{
+   if (!ids) {
+      errno = EINVAL;
+      return false;
+   }
+
+   pthread_mutex_lock (&ids->lock);
+   bool ret = ids_reopen (ids) && ids_load (ids);
+   pthread_mutex_unlock (&ids->lock);
+   return ret;
+}
+
+char *frm_ids_path_cached (frm_ids_t *ids, uint64_t id)
+{
+   if (!ids || id == FRM_ID_NONE) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   pthread_mutex_lock (&ids->lock);
+   char *ret = ids->have_table ? ids_path (ids, id) : NULL;
+   pthread_mutex_unlock (&ids->lock);
+   return ret;
+}
+
+bool frm_ids_compact (frm_ids_t *ids)
+{
+   if (!ids) {
+      errno = EINVAL;
+      return false;
+   }
+
+   bool error = true;
+   char *tmpname = NULL;
+   int fd = -1;
+   char *buf = NULL;
+   size_t buflen = 0;
+   bool *live = NULL;
+
+   pthread_mutex_lock (&ids->lock);
+   if (!(ids_reopen (ids)) || !(ids_load (ids))) {
+      goto cleanup;
+   }
+
+   // Frames below a removed frame are dropped as well, so that nothing
+   // that cannot be reached from the root survives.
+   if (!(live = calloc (ids->nslots + 1, sizeof *live))) {
+      FRM_ERROR ("OOM error compacting ID log\n");
+      goto cleanup;
+   }
+   if (!(ids_below (ids, FRM_ID_ROOT, live))) {
+      goto cleanup;
+   }
+
+   if (!(tmpname = ds_str_cat (ids->fname, ".tmp", NULL))) {
+      FRM_ERROR ("OOM error allocating temporary ID log name\n");
+      goto cleanup;
+   }
+
+   FRM_STATS_ADD (opens, 1);
+   fd = openat (ids->dirfd, tmpname,
+                O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      FRM_ERROR ("Failed to create [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   for (size_t i=0; i<ids->nslots; i++) {
+      struct ids_entry_t *entry = &ids->slots[i];
+      if (!live[i])
+         continue;
+
+      struct ids_rec_t hdr = {
+         IDS_MAGIC, strlen (entry->name) + 1, entry->id, entry->parent, ids->next,
+      };
+      uint32_t reclen = sizeof hdr + hdr.namelen + sizeof reclen;
+      if (buflen + reclen > IDS_CHUNK) {
+         if (!(frm_io_write_full (fd, buf, buflen))) {
+            FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+            goto cleanup;
+         }
+         buflen = 0;
+      }
+      if (!buf && !(buf = malloc (IDS_CHUNK + sizeof hdr + 4096 + sizeof reclen))) {
+         FRM_ERROR ("OOM error compacting ID log\n");
+         goto cleanup;
+      }
+      if (reclen > IDS_CHUNK) {
+         FRM_ERROR ("Error: name too long in ID log [%s]\n", entry->name);
+         errno = ENAMETOOLONG;
+         goto cleanup;
+      }
+      memcpy (&buf[buflen], &hdr, sizeof hdr);
+      memcpy (&buf[buflen + sizeof hdr], entry->name, hdr.namelen);
+      memcpy (&buf[buflen + sizeof hdr + hdr.namelen], &reclen, sizeof reclen);
+      buflen += reclen;
+   }
+
+   if (buflen && !(frm_io_write_full (fd, buf, buflen))) {
+      FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   if ((close (fd))!=0) {
+      fd = -1;
+      FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+   fd = -1;
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (ids->dirfd, tmpname, ids->dirfd, ids->fname))!=0) {
+      FRM_ERROR ("Failed to rename [%s] to [%s]: %m\n", tmpname, ids->fname);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   if (fd >= 0) {
+      close (fd);
+   }
+   if (error && tmpname) {
+      unlinkat (ids->dirfd, tmpname, 0);
+   }
+   // Picks up the new log.
+   if (!error) {
+      ids_reopen (ids);
+   }
+   pthread_mutex_unlock (&ids->lock);
+   free (live);
+   free (buf);
+   free (tmpname);
+   return !error;
+}
+
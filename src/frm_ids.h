@@ -0,0 +1,81 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_IDS
+#define H_FRM_IDS
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Stable frame IDs for a directory framedb. Every frame has a 64-bit ID
+ * that never changes and is never reused. The ID log records the parent
+ * and the name of each ID, and the last record for an ID replaces the
+ * earlier ones, so renaming or moving a frame appends a single record
+ * however many frames are below it. The path of a frame is found from its
+ * ID by following the parents up to the root.
+ *
+ * The log is only read in full the first time an ID has to be resolved;
+ * after that only the records appended since are read. Allocating an ID
+ * only reads the last record. The caller must hold the framedb lock, and
+ * must hold it exclusively to modify the log.
+ */
+
+#define FRM_ID_NONE        ((uint64_t)0)
+#define FRM_ID_ROOT        ((uint64_t)1)
+
+typedef struct frm_ids_t frm_ids_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Open the ID log fname in the directory dirfd, creating an empty one
+   // if it does not exist, and close it.
+   frm_ids_t *frm_ids_open (int dirfd, const char *fname);
+   void frm_ids_close (frm_ids_t *ids);
+
+   // Allocate a new ID for the frame 'name' under the frame parent, and
+   // return it or FRM_ID_NONE on error.
+   uint64_t frm_ids_add (frm_ids_t *ids, uint64_t parent, const char *name);
+
+   // Record a new parent and name for an existing ID, or that the frame
+   // with that ID has been removed.
+   bool frm_ids_set (frm_ids_t *ids, uint64_t id, uint64_t parent, const char *name);
+   bool frm_ids_remove (frm_ids_t *ids, uint64_t id);
+
+   // frm_ids_set() for n frames at once, with a single write.
+   bool frm_ids_set_many (frm_ids_t *ids, size_t n, const uint64_t *id,
+                          const uint64_t *parent, const char **name);
+
+   // Record that the frame with that ID, and every frame below it, has
+   // been removed. Reads the whole log if it has not been read yet.
+   bool frm_ids_remove_tree (frm_ids_t *ids, uint64_t id);
+
+   // Returns the path of the frame with the given ID, eg. "root/a/b", or
+   // NULL if there is no such frame. The caller must free the result.
+   char *frm_ids_path (frm_ids_t *ids, uint64_t id);
+
+   // For resolving many IDs at once: frm_ids_refresh() reads the records
+   // appended to the log since it was last read, and frm_ids_path_cached()
+   // is frm_ids_path() from the records read so far, without touching the
+   // log. frm_ids_path_cached() returns NULL until the log has been read.
+   bool frm_ids_refresh (frm_ids_t *ids);
+   char *frm_ids_path_cached (frm_ids_t *ids, uint64_t id);
+
+   // Rewrite the log with only the latest record of each frame that can
+   // be reached from the root.
+   bool frm_ids_compact (frm_ids_t *ids);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,55 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "frm_stats.h"
+#include "frm_io.h"
+
+/* ********************************************************** */
+
+bool frm_io_read_full (int fd, void *dst, size_t len, off_t offset)
+{
+   char *tmp = dst;
+   while (len) {
+      ssize_t nbytes = pread (fd, tmp, len, offset);
+      if (nbytes <= 0) {
+         if (nbytes < 0 && errno == EINTR)
+            continue;
+         return false;
+      }
+      FRM_STATS_ADD (bytes_read, nbytes);
+      tmp += nbytes;
+      offset += nbytes;
+      len -= nbytes;
+   }
+   return true;
+}
+
+bool frm_io_write_full (int fd, const void *src, size_t len)
+{
+   const char *tmp = src;
+   while (len) {
+      ssize_t nbytes = write (fd, tmp, len);
+      if (nbytes < 0) {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      FRM_STATS_ADD (bytes_written, nbytes);
+      tmp += nbytes;
+      len -= nbytes;
+   }
+   return true;
+}
+
@@ -0,0 +1,49 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_IO
+#define H_FRM_IO
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+
+/* File I/O helpers shared by the library's on-disk formats. The bytes
+ * read and written are counted in the calling thread's frm_stats.
+ */
+
+#ifndef O_BINARY
+#define O_BINARY     0
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC    0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Read exactly len bytes at offset, retrying after short reads and
+   // EINTR. Returns false on error or if the file ends first.
+   bool frm_io_read_full (int fd, void *dst, size_t len, off_t offset);
+
+   // Write all len bytes at the current offset of fd, retrying after
+   // short writes and EINTR. Returns false on error.
+   bool frm_io_write_full (int fd, const void *src, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
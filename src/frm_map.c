@@ -0,0 +1,1100 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+
+#include "frm.h"
+#include "frm_map.h"
+#include "ds_str.h"
+
+/* File layout: a header at offset zero, followed by an arena from which
+ * all other storage is bump-allocated. The node table, the string heap,
+ * the child index and the history ring are regions in the arena; when
+ * the table, heap or index fills up a larger region is allocated and the
+ * old one is abandoned. Payloads are individually allocated blocks that
+ * are reused in place when the new payload fits. The abandoned storage,
+ * and that of removed nodes and replaced names, is counted in the header
+ * and reclaimed by frm_map_compact() once it is more than
+ * 1/MAP_GARBAGE_RATIO of the arena.
+ *
+ * Each node keeps its children in a doubly linked list, in creation
+ * order, with the last child in the parent so that appending is O(1).
+ * Children are found by name through the child index, an open-addressed
+ * hash table of node numbers keyed on the parent and the name.
+ *
+ * All offsets are from the start of the file, except for node names
+ * which are offsets into the string heap. Fields are stored in host byte
+ * order.
+ */
+
+#define MAP_MAGIC          "FRMMAP1"
+#define MAP_VERSION        (2)
+#define MAP_ALIGN          (8)
+#define MAP_INITIAL_SIZE   (128 * 1024)
+#define MAP_INITIAL_NODES  (64)
+#define MAP_INITIAL_HEAP   (4 * 1024)
+#define MAP_INITIAL_INDEX  (128)
+#define MAP_HISTORY_CAP    (4096)
+#define MAP_GARBAGE_RATIO  (2)      // Compact when garbage > used / this
+
+#define MAP_NODE_USED      (0x01 << 0)
+
+#define MAP_INDEX_EMPTY    FRM_MAP_NONE
+#define MAP_INDEX_REMOVED  ((uint32_t)-2)
+
+struct map_header_t {
+   char magic[8];
+   uint32_t version;
+   uint32_t reserved;
+
+   uint64_t size;          // Size of the file
+   uint64_t used;          // End of the arena allocations
+   uint64_t garbage;       // Bytes in abandoned allocations
+
+   uint64_t nodes;         // Offset of the node table
+   uint32_t node_cap;
+   uint32_t node_count;    // High water mark of the table
+   uint32_t node_free;     // Head of the free list, linked via next_sibling
+   uint32_t node_used;     // Number of live nodes
+
+   uint64_t heap;          // Offset of the string heap
+   uint64_t heap_cap;
+   uint64_t heap_used;
+
+   uint64_t history;       // Offset of the history ring
+   uint32_t history_head;  // Index of the next slot to write
+   uint32_t history_count;
+
+   uint64_t index;         // Offset of the child index
+   uint32_t index_cap;     // A power of two
+   uint32_t index_used;    // Slots that are not empty, including removed
+};
+
+struct map_node_t {
+   uint32_t parent;
+   uint32_t first_child;
+   uint32_t last_child;
+   uint32_t next_sibling;
+   uint32_t prev_sibling;
+   uint32_t generation;    // Incremented when the node is freed
+   uint64_t name;          // Offset in the string heap
+   uint64_t payload;
+   uint64_t payload_len;
+   uint64_t payload_cap;
+   uint64_t mtime;
+   uint32_t flags;
+   uint32_t reserved;
+};
+
+struct map_visit_t {
+   uint32_t node;
+   uint32_t generation;
+};
+
+struct frm_map_t {
+   int fd;
+   char *base;
+   size_t size;
+   bool dirty;
+};
+
+/* ********************************************************** */
+
+static struct map_header_t *map_header (const frm_map_t *map)
+{
+   return (struct map_header_t *)map->base;
+}
+
+static struct map_node_t *map_node (const frm_map_t *map, uint32_t node)
+{
+   struct map_header_t *hdr = map_header (map);
+   if (node >= hdr->node_count)
+      return NULL;
+
+   struct map_node_t *ret = (struct map_node_t *)(map->base + hdr->nodes) + node;
+   return (ret->flags & MAP_NODE_USED) ? ret : NULL;
+}
+
+static uint64_t map_align (uint64_t value)
+{
+   return (value + MAP_ALIGN - 1) & ~(uint64_t)(MAP_ALIGN - 1);
+}
+
+// The old mapping is only replaced once the new one has been made, so
+// that the map is still usable at its old size if this fails.
+static bool map_remap (frm_map_t *map, size_t newsize)
+{
+   void *base = mmap (NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      map->fd, 0);
+   if (base == MAP_FAILED) {
+      FRM_ERROR ("Error: failed to map %zu bytes: %m\n", newsize);
+      return false;
+   }
+
+   if (map->base) {
+      munmap (map->base, map->size);
+   }
+   map->base = base;
+   map->size = newsize;
+   return true;
+}
+
+// Returns the offset of nbytes of newly allocated storage, or zero on
+// error. May move the mapping, so all pointers into the map must be
+// re-read after calling this.
+static uint64_t map_alloc (frm_map_t *map, uint64_t nbytes)
+{
+   struct map_header_t *hdr = map_header (map);
+   uint64_t offset = map_align (hdr->used);
+   uint64_t needed = offset + map_align (nbytes);
+
+   if (needed > hdr->size) {
+      uint64_t newsize = hdr->size * 2;
+      while (newsize < needed)
+         newsize *= 2;
+
+      if ((ftruncate (map->fd, newsize))!=0) {
+         FRM_ERROR ("Error: failed to grow framedb to %" PRIu64 " bytes: %m\n",
+                  newsize);
+         return 0;
+      }
+      // Other processes check the size of the file against the header,
+      // so put it back if it cannot be used.
+      if (!(map_remap (map, newsize))) {
+         if ((ftruncate (map->fd, hdr->size))!=0) {
+            FRM_ERROR ("Error: failed to restore framedb to %" PRIu64 " bytes: %m\n",
+                     hdr->size);
+         }
+         return 0;
+      }
+
+      hdr = map_header (map);
+      hdr->size = newsize;
+   }
+
+   hdr->used = needed;
+   map->dirty = true;
+   return offset;
+}
+
+static uint64_t map_heap_add (frm_map_t *map, const char *s)
+{
+   size_t len = strlen (s) + 1;
+   struct map_header_t *hdr = map_header (map);
+
+   if (hdr->heap_used + len > hdr->heap_cap) {
+      uint64_t newcap = hdr->heap_cap * 2;
+      while (newcap < hdr->heap_used + len)
+         newcap *= 2;
+
+      uint64_t heap = map_alloc (map, newcap);
+      if (!heap)
+         return (uint64_t)-1;
+
+      hdr = map_header (map);
+      memcpy (map->base + heap, map->base + hdr->heap, hdr->heap_used);
+      hdr->garbage += hdr->heap_cap;
+      hdr->heap = heap;
+      hdr->heap_cap = newcap;
+   }
+
+   uint64_t ret = hdr->heap_used;
+   memcpy (map->base + hdr->heap + ret, s, len);
+   hdr->heap_used += len;
+   map->dirty = true;
+   return ret;
+}
+
+static uint32_t map_node_alloc (frm_map_t *map)
+{
+   struct map_header_t *hdr = map_header (map);
+   struct map_node_t *table = (struct map_node_t *)(map->base + hdr->nodes);
+
+   if (hdr->node_free != FRM_MAP_NONE) {
+      uint32_t ret = hdr->node_free;
+      hdr->node_free = table[ret].next_sibling;
+      return ret;
+   }
+
+   if (hdr->node_count == hdr->node_cap) {
+      uint32_t newcap = hdr->node_cap * 2;
+      uint64_t nodes = map_alloc (map, (uint64_t)newcap * sizeof *table);
+      if (!nodes)
+         return FRM_MAP_NONE;
+
+      hdr = map_header (map);
+      memcpy (map->base + nodes, map->base + hdr->nodes,
+              (uint64_t)hdr->node_count * sizeof *table);
+      hdr->garbage += (uint64_t)hdr->node_cap * sizeof *table;
+      hdr->nodes = nodes;
+      hdr->node_cap = newcap;
+   }
+
+   return hdr->node_count++;
+}
+
+// FNV-1a over the parent and the name.
+static uint32_t map_index_hash (uint32_t parent, const char *name, size_t len)
+{
+   uint32_t ret = 2166136261u;
+   for (size_t i=0; i<sizeof parent; i++) {
+      ret = (ret ^ ((parent >> (i * 8)) & 0xff)) * 16777619u;
+   }
+   for (size_t i=0; i<len; i++) {
+      ret = (ret ^ (unsigned char)name[i]) * 16777619u;
+   }
+   return ret;
+}
+
+static uint32_t map_index_find (const frm_map_t *map, uint32_t parent,
+                                const char *name, size_t len)
+{
+   struct map_header_t *hdr = map_header (map);
+   const uint32_t *slots = (uint32_t *)(map->base + hdr->index);
+   const struct map_node_t *table = (struct map_node_t *)(map->base + hdr->nodes);
+   uint32_t mask = hdr->index_cap - 1;
+
+   uint32_t i = map_index_hash (parent, name, len) & mask;
+   for (; slots[i] != MAP_INDEX_EMPTY; i = (i + 1) & mask) {
+      if (slots[i] == MAP_INDEX_REMOVED)
+         continue;
+      const struct map_node_t *n = &table[slots[i]];
+      const char *cname = map->base + hdr->heap + n->name;
+      if (n->parent == parent && (strncmp (cname, name, len))==0 && cname[len] == 0)
+         return slots[i];
+   }
+   return FRM_MAP_NONE;
+}
+
+// Called with room for the node in the index, see map_index_reserve().
+static void map_index_insert (frm_map_t *map, uint32_t node)
+{
+   struct map_header_t *hdr = map_header (map);
+   uint32_t *slots = (uint32_t *)(map->base + hdr->index);
+   const struct map_node_t *n = (struct map_node_t *)(map->base + hdr->nodes) + node;
+   const char *name = map->base + hdr->heap + n->name;
+   uint32_t mask = hdr->index_cap - 1;
+
+   uint32_t i = map_index_hash (n->parent, name, strlen (name)) & mask;
+   while (slots[i] != MAP_INDEX_EMPTY && slots[i] != MAP_INDEX_REMOVED)
+      i = (i + 1) & mask;
+
+   if (slots[i] == MAP_INDEX_EMPTY)
+      hdr->index_used++;
+   slots[i] = node;
+}
+
+// Must be called while the parent and name of node are still the ones
+// that it was inserted with.
+static void map_index_remove (frm_map_t *map, uint32_t node)
+{
+   struct map_header_t *hdr = map_header (map);
+   uint32_t *slots = (uint32_t *)(map->base + hdr->index);
+   const struct map_node_t *n = (struct map_node_t *)(map->base + hdr->nodes) + node;
+   const char *name = map->base + hdr->heap + n->name;
+   uint32_t mask = hdr->index_cap - 1;
+
+   uint32_t i = map_index_hash (n->parent, name, strlen (name)) & mask;
+   for (; slots[i] != MAP_INDEX_EMPTY; i = (i + 1) & mask) {
+      if (slots[i] == node) {
+         slots[i] = MAP_INDEX_REMOVED;
+         return;
+      }
+   }
+}
+
+// Fills an index of cap slots at slots with every node that has a parent.
+static void map_index_build (const frm_map_t *map, uint32_t *slots, uint32_t cap)
+{
+   struct map_header_t *hdr = map_header (map);
+   const struct map_node_t *table = (struct map_node_t *)(map->base + hdr->nodes);
+   uint32_t mask = cap - 1;
+
+   for (uint32_t i=0; i<cap; i++) {
+      slots[i] = MAP_INDEX_EMPTY;
+   }
+   for (uint32_t node=0; node<hdr->node_count; node++) {
+      if (!(table[node].flags & MAP_NODE_USED) || table[node].parent == FRM_MAP_NONE)
+         continue;
+      const char *name = map->base + hdr->heap + table[node].name;
+      uint32_t i = map_index_hash (table[node].parent, name, strlen (name)) & mask;
+      while (slots[i] != MAP_INDEX_EMPTY)
+         i = (i + 1) & mask;
+      slots[i] = node;
+   }
+}
+
+// Makes sure that one more node can be inserted in the index, keeping
+// it at most 3/4 full including removed slots. The index is rebuilt, at
+// double the size if the live nodes alone would fill more than half.
+static bool map_index_reserve (frm_map_t *map)
+{
+   struct map_header_t *hdr = map_header (map);
+   if ((uint64_t)(hdr->index_used + 1) * 4 <= (uint64_t)hdr->index_cap * 3)
+      return true;
+
+   uint32_t newcap = hdr->index_cap;
+   while ((uint64_t)(hdr->node_used + 1) * 2 > newcap)
+      newcap *= 2;
+
+   uint64_t index = map_alloc (map, (uint64_t)newcap * sizeof (uint32_t));
+   if (!index)
+      return false;
+
+   hdr = map_header (map);
+   hdr->garbage += (uint64_t)hdr->index_cap * sizeof (uint32_t);
+   hdr->index = index;
+   hdr->index_cap = newcap;
+   map_index_build (map, (uint32_t *)(map->base + index), newcap);
+   hdr->index_used = hdr->node_used - 1;
+   return true;
+}
+
+static bool map_valid_name (const char *name)
+{
+   if (!name || !name[0] || (strcmp (name, "."))==0 || (strcmp (name, ".."))==0)
+      return false;
+
+   return strpbrk (name, "/\\") == NULL;
+}
+
+/* ********************************************************** */
+
+bool frm_map_isdb (const char *fname)
+{
+   struct stat sb;
+   if ((stat (fname, &sb))!=0 || !S_ISREG (sb.st_mode))
+      return false;
+
+   if (sb.st_size == 0)
+      return true;
+
+   char magic[sizeof MAP_MAGIC];
+   FILE *inf = fopen (fname, "rb");
+   if (!inf)
+      return false;
+
+   bool ret = fread (magic, 1, sizeof magic, inf) == sizeof magic
+      && (memcmp (magic, MAP_MAGIC, sizeof magic))==0;
+   fclose (inf);
+   return ret;
+}
+
+static frm_map_t *map_open_fd (const char *fname)
+{
+   frm_map_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating frm_map_t\n");
+      return NULL;
+   }
+
+   if ((ret->fd = open (fname, O_RDWR | O_CLOEXEC))<0) {
+      FRM_ERROR ("Error: failed to open [%s]: %m\n", fname);
+      free (ret);
+      return NULL;
+   }
+
+   return ret;
+}
+
+frm_map_t *frm_map_create (const char *fname, const char *root_payload)
+{
+   frm_map_t *ret = map_open_fd (fname);
+   if (!ret)
+      return NULL;
+
+   // Nobody else can have a new framedb open, so don't wait for the lock.
+   if ((flock (ret->fd, LOCK_EX | LOCK_NB))!=0) {
+      FRM_ERROR ("Error: failed to lock [%s]: %m\n", fname);
+      goto errorexit;
+   }
+
+   struct stat sb;
+   if ((fstat (ret->fd, &sb))!=0 || sb.st_size != 0) {
+      FRM_ERROR ("Error: [%s] is not an empty file\n", fname);
+      errno = EEXIST;
+      goto errorexit;
+   }
+
+   if ((ftruncate (ret->fd, MAP_INITIAL_SIZE))!=0) {
+      FRM_ERROR ("Error: failed to size [%s]: %m\n", fname);
+      goto errorexit;
+   }
+
+   if (!(map_remap (ret, MAP_INITIAL_SIZE)))
+      goto errorexit;
+
+   struct map_header_t *hdr = map_header (ret);
+   memcpy (hdr->magic, MAP_MAGIC, sizeof MAP_MAGIC);
+   hdr->version = MAP_VERSION;
+   hdr->size = MAP_INITIAL_SIZE;
+   hdr->used = map_align (sizeof *hdr);
+   hdr->node_free = FRM_MAP_NONE;
+
+   uint64_t nodes = map_alloc (ret, MAP_INITIAL_NODES * sizeof (struct map_node_t));
+   uint64_t heap = map_alloc (ret, MAP_INITIAL_HEAP);
+   uint64_t history = map_alloc (ret, MAP_HISTORY_CAP * sizeof (struct map_visit_t));
+   uint64_t index = map_alloc (ret, MAP_INITIAL_INDEX * sizeof (uint32_t));
+   if (!nodes || !heap || !history || !index) {
+      goto errorexit;
+   }
+
+   hdr = map_header (ret);
+   hdr->nodes = nodes;
+   hdr->node_cap = MAP_INITIAL_NODES;
+   hdr->heap = heap;
+   hdr->heap_cap = MAP_INITIAL_HEAP;
+   hdr->history = history;
+   hdr->index = index;
+   hdr->index_cap = MAP_INITIAL_INDEX;
+
+   struct map_node_t *root = (struct map_node_t *)(ret->base + hdr->nodes);
+   memset (root, 0, sizeof *root);
+   root->parent = FRM_MAP_NONE;
+   root->first_child = FRM_MAP_NONE;
+   root->last_child = FRM_MAP_NONE;
+   root->next_sibling = FRM_MAP_NONE;
+   root->prev_sibling = FRM_MAP_NONE;
+   root->flags = MAP_NODE_USED;
+   hdr->node_count = 1;
+   hdr->node_used = 1;
+   map_index_build (ret, (uint32_t *)(ret->base + hdr->index), hdr->index_cap);
+
+   uint64_t name = map_heap_add (ret, "root");
+   if (name == (uint64_t)-1) {
+      goto errorexit;
+   }
+   map_node (ret, FRM_MAP_ROOT)->name = name;
+
+   if (!(frm_map_set_payload (ret, FRM_MAP_ROOT, root_payload, false))
+         || !(frm_map_visit (ret, FRM_MAP_ROOT))) {
+      goto errorexit;
+   }
+
+   return ret;
+
+errorexit:
+   frm_map_close (ret);
+   return NULL;
+}
+
+frm_map_t *frm_map_open (const char *fname)
+{
+   frm_map_t *ret = map_open_fd (fname);
+   if (!ret)
+      return NULL;
+
+   struct stat sb;
+   if ((fstat (ret->fd, &sb))!=0) {
+      FRM_ERROR ("Error: failed to stat [%s]: %m\n", fname);
+      goto errorexit;
+   }
+
+   if ((size_t)sb.st_size < sizeof (struct map_header_t)
+         || !(map_remap (ret, sb.st_size))) {
+      FRM_ERROR ("Error: [%s] is not a framedb\n", fname);
+      goto errorexit;
+   }
+
+   struct map_header_t *hdr = map_header (ret);
+   if ((memcmp (hdr->magic, MAP_MAGIC, sizeof MAP_MAGIC))!=0
+         || hdr->version != MAP_VERSION
+         || hdr->size != (uint64_t)sb.st_size
+         || hdr->used > hdr->size) {
+      FRM_ERROR ("Error: [%s] is not a valid framedb\n", fname);
+      errno = EINVAL;
+      goto errorexit;
+   }
+
+   return ret;
+
+errorexit:
+   frm_map_close (ret);
+   return NULL;
+}
+
+void frm_map_close (frm_map_t *map)
+{
+   if (!map)
+      return;
+
+   if (map->base) {
+      if (map->dirty && (msync (map->base, map->size, MS_SYNC))!=0) {
+         FRM_ERROR ("Warning: failed to sync framedb: %m\n");
+      }
+      munmap (map->base, map->size);
+   }
+
+   // Closing the descriptor releases the lock, if any.
+   if (map->fd >= 0) {
+      close (map->fd);
+   }
+   free (map);
+}
+
+bool frm_map_refresh (frm_map_t *map)
+{
+   uint64_t size = map_header (map)->size;
+   if (size == map->size)
+      return true;
+
+   struct stat sb;
+   if ((fstat (map->fd, &sb))!=0 || (uint64_t)sb.st_size < size) {
+      FRM_ERROR ("Error: framedb is smaller than its header states\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   return map_remap (map, size);
+}
+
+/* ********************************************************** */
+
+uint32_t frm_map_lookup (const frm_map_t *map, uint32_t from, const char *path)
+{
+   if (!path)
+      return FRM_MAP_NONE;
+
+   uint32_t ret = from;
+   const char *name = path;
+   while (*name) {
+      size_t len = strcspn (name, "/\\");
+      const char *next = name[len] ? &name[len + 1] : &name[len];
+
+      if (len == 0 || (len == 1 && name[0] == '.')) {
+         name = next;
+         continue;
+      }
+
+      if (ret == FRM_MAP_NONE) {
+         // Absolute paths must start at the root frame.
+         if (len != 4 || (memcmp (name, "root", 4))!=0)
+            return FRM_MAP_NONE;
+         ret = FRM_MAP_ROOT;
+         name = next;
+         continue;
+      }
+
+      if (len == 2 && name[0] == '.' && name[1] == '.') {
+         ret = frm_map_parent (map, ret);
+         if (ret == FRM_MAP_NONE)
+            return FRM_MAP_NONE;
+         name = next;
+         continue;
+      }
+
+      uint32_t child = map_index_find (map, ret, name, len);
+      if (child == FRM_MAP_NONE)
+         return FRM_MAP_NONE;
+
+      ret = child;
+      name = next;
+   }
+
+   return ret;
+}
+
+uint32_t frm_map_parent (const frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   return n ? n->parent : FRM_MAP_NONE;
+}
+
+uint32_t frm_map_child (const frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   return n ? n->first_child : FRM_MAP_NONE;
+}
+
+uint32_t frm_map_sibling (const frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   return n ? n->next_sibling : FRM_MAP_NONE;
+}
+
+uint32_t frm_map_find_child (const frm_map_t *map, uint32_t node,
+                             const char *name)
+{
+   if (!map_node (map, node) || !name)
+      return FRM_MAP_NONE;
+
+   return map_index_find (map, node, name, strlen (name));
+}
+
+const char *frm_map_name (const frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   return n ? map->base + map_header (map)->heap + n->name : NULL;
+}
+
+uint64_t frm_map_mtime (const frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   return n ? n->mtime : (uint64_t)-1;
+}
+
+char *frm_map_path (const frm_map_t *map, uint32_t node)
+{
+   size_t len = 0;
+   for (uint32_t i=node; i!=FRM_MAP_NONE; i=frm_map_parent (map, i)) {
+      const char *name = frm_map_name (map, i);
+      if (!name) {
+         FRM_ERROR ("Error: invalid node %u\n", i);
+         return NULL;
+      }
+      len += strlen (name) + 1;
+   }
+
+   char *ret = malloc (len ? len : 1);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating path\n");
+      return NULL;
+   }
+
+   // Fill in from the end, leaf first.
+   ret[len ? len - 1 : 0] = 0;
+   size_t end = len ? len - 1 : 0;
+   for (uint32_t i=node; i!=FRM_MAP_NONE; i=frm_map_parent (map, i)) {
+      const char *name = frm_map_name (map, i);
+      size_t nlen = strlen (name);
+      end -= nlen;
+      memcpy (&ret[end], name, nlen);
+      if (end) {
+         ret[--end] = '/';
+      }
+   }
+
+   return ret;
+}
+
+char *frm_map_payload (const frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   if (!n) {
+      errno = ENOENT;
+      return NULL;
+   }
+
+   char *ret = malloc (n->payload_len + 1);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating payload\n");
+      return NULL;
+   }
+
+   memcpy (ret, map->base + n->payload, n->payload_len);
+   ret[n->payload_len] = 0;
+   return ret;
+}
+
+/* ********************************************************** */
+
+// Appends node to the children of parent, so that children are
+// traversed in creation order, and adds it to the child index. The
+// caller must have reserved room in the index.
+static void map_link (frm_map_t *map, uint32_t parent, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   struct map_node_t *p = map_node (map, parent);
+   n->parent = parent;
+   n->next_sibling = FRM_MAP_NONE;
+   n->prev_sibling = p->last_child;
+   if (p->last_child == FRM_MAP_NONE) {
+      p->first_child = node;
+   } else {
+      map_node (map, p->last_child)->next_sibling = node;
+   }
+   p->last_child = node;
+   map_index_insert (map, node);
+}
+
+// Removes node from the children of its parent and from the child index.
+static void map_unlink (frm_map_t *map, uint32_t node)
+{
+   map_index_remove (map, node);
+
+   struct map_node_t *n = map_node (map, node);
+   struct map_node_t *p = map_node (map, n->parent);
+   if (n->prev_sibling == FRM_MAP_NONE) {
+      p->first_child = n->next_sibling;
+   } else {
+      map_node (map, n->prev_sibling)->next_sibling = n->next_sibling;
+   }
+   if (n->next_sibling == FRM_MAP_NONE) {
+      p->last_child = n->prev_sibling;
+   } else {
+      map_node (map, n->next_sibling)->prev_sibling = n->prev_sibling;
+   }
+   n->next_sibling = FRM_MAP_NONE;
+   n->prev_sibling = FRM_MAP_NONE;
+}
+
+uint32_t frm_map_add (frm_map_t *map, uint32_t parent,
+                      const char *name, const char *payload)
+{
+   if (!map_valid_name (name)) {
+      FRM_ERROR ("Error: invalid frame name [%s]\n", name);
+      errno = EINVAL;
+      return FRM_MAP_NONE;
+   }
+
+   if (!map_node (map, parent)) {
+      FRM_ERROR ("Error: invalid parent node %u\n", parent);
+      errno = ENOENT;
+      return FRM_MAP_NONE;
+   }
+
+   if ((frm_map_find_child (map, parent, name)) != FRM_MAP_NONE) {
+      FRM_ERROR ("Error: frame [%s] already exists\n", name);
+      errno = EEXIST;
+      return FRM_MAP_NONE;
+   }
+
+   if (!(map_index_reserve (map)))
+      return FRM_MAP_NONE;
+
+   uint64_t name_offset = map_heap_add (map, name);
+   if (name_offset == (uint64_t)-1)
+      return FRM_MAP_NONE;
+
+   uint32_t ret = map_node_alloc (map);
+   if (ret == FRM_MAP_NONE)
+      return FRM_MAP_NONE;
+
+   struct map_header_t *hdr = map_header (map);
+   struct map_node_t *n = (struct map_node_t *)(map->base + hdr->nodes) + ret;
+   uint32_t generation = n->generation;
+   memset (n, 0, sizeof *n);
+   n->generation = generation;
+   n->first_child = FRM_MAP_NONE;
+   n->last_child = FRM_MAP_NONE;
+   n->name = name_offset;
+   n->flags = MAP_NODE_USED;
+   map_link (map, parent, ret);
+   hdr->node_used++;
+
+   if (!(frm_map_set_payload (map, ret, payload, false))) {
+      frm_map_remove (map, ret);
+      return FRM_MAP_NONE;
+   }
+
+   return ret;
+}
+
+bool frm_map_set_payload (frm_map_t *map, uint32_t node,
+                          const char *data, bool append)
+{
+   struct map_node_t *n = map_node (map, node);
+   if (!n) {
+      errno = ENOENT;
+      return false;
+   }
+
+   size_t len = data ? strlen (data) : 0;
+   uint64_t start = append ? n->payload_len : 0;
+   uint64_t newlen = start + len;
+
+   if (newlen > n->payload_cap) {
+      uint64_t newcap = map_align (newlen + newlen / 2);
+      uint64_t block = map_alloc (map, newcap);
+      if (!block)
+         return false;
+
+      n = map_node (map, node);
+      memcpy (map->base + block, map->base + n->payload, start);
+      map_header (map)->garbage += n->payload_cap;
+      n->payload = block;
+      n->payload_cap = newcap;
+   }
+
+   memcpy (map->base + n->payload + start, data, len);
+   n->payload_len = newlen;
+   n->mtime = (uint64_t)time (NULL);
+   map->dirty = true;
+   return true;
+}
+
+bool frm_map_rename (frm_map_t *map, uint32_t node, const char *newname)
+{
+   if (!map_valid_name (newname)) {
+      FRM_ERROR ("Error: invalid frame name [%s]\n", newname);
+      errno = EINVAL;
+      return false;
+   }
+
+   uint32_t parent = frm_map_parent (map, node);
+   if (parent == FRM_MAP_NONE) {
+      FRM_ERROR ("Error: cannot rename the root frame\n");
+      errno = EINVAL;
+      return false;
+   }
+
+   if ((frm_map_find_child (map, parent, newname)) != FRM_MAP_NONE) {
+      FRM_ERROR ("Error: frame [%s] already exists\n", newname);
+      errno = EEXIST;
+      return false;
+   }
+
+   if (!(map_index_reserve (map)))
+      return false;
+
+   uint64_t oldlen = strlen (frm_map_name (map, node)) + 1;
+   uint64_t name = map_heap_add (map, newname);
+   if (name == (uint64_t)-1)
+      return false;
+
+   map_index_remove (map, node);
+   map_header (map)->garbage += oldlen;
+   map_node (map, node)->name = name;
+   map_index_insert (map, node);
+   return true;
+}
+
+bool frm_map_move (frm_map_t *map, uint32_t node, uint32_t parent)
+{
+   if (!map_node (map, node) || node == FRM_MAP_ROOT || !map_node (map, parent)) {
+      FRM_ERROR ("Error: cannot move node %u to node %u\n", node, parent);
+      errno = EINVAL;
+      return false;
+   }
+
+   for (uint32_t i=parent; i!=FRM_MAP_NONE; i=frm_map_parent (map, i)) {
+      if (i == node) {
+         FRM_ERROR ("Error: cannot move node %u below itself\n", node);
+         errno = EINVAL;
+         return false;
+      }
+   }
+
+   if (frm_map_parent (map, node) == parent)
+      return true;
+
+   if ((frm_map_find_child (map, parent, frm_map_name (map, node))) != FRM_MAP_NONE) {
+      FRM_ERROR ("Error: frame [%s] already exists\n", frm_map_name (map, node));
+      errno = EEXIST;
+      return false;
+   }
+
+   if (!(map_index_reserve (map)))
+      return false;
+
+   map_unlink (map, node);
+   map_link (map, parent, node);
+   map->dirty = true;
+   return true;
+}
+
+static void map_node_free (frm_map_t *map, uint32_t node)
+{
+   struct map_header_t *hdr = map_header (map);
+   struct map_node_t *n = map_node (map, node);
+
+   hdr->garbage += n->payload_cap + strlen (frm_map_name (map, node)) + 1;
+   n->flags = 0;
+   n->generation++;
+   n->next_sibling = hdr->node_free;
+   hdr->node_free = node;
+   hdr->node_used--;
+}
+
+bool frm_map_remove (frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   if (!n || node == FRM_MAP_ROOT) {
+      FRM_ERROR ("Error: cannot remove node %u\n", node);
+      errno = EINVAL;
+      return false;
+   }
+
+   // Unlink from the parent first, then free the subtree.
+   map_unlink (map, node);
+
+   // Iterative post-order walk: descend to a leaf, free it, resume at its
+   // parent, which now has one less child.
+   uint32_t current = node;
+   while (current != FRM_MAP_NONE) {
+      struct map_node_t *c = map_node (map, current);
+      if (c->first_child != FRM_MAP_NONE) {
+         current = c->first_child;
+         map_unlink (map, current);
+         continue;
+      }
+      uint32_t parent = current == node ? FRM_MAP_NONE : c->parent;
+      map_node_free (map, current);
+      current = parent;
+   }
+
+   map->dirty = true;
+   return true;
+}
+
+bool frm_map_compact (frm_map_t *map, bool force)
+{
+   struct map_header_t *hdr = map_header (map);
+   if (!hdr->garbage || (!force && hdr->garbage <= hdr->used / MAP_GARBAGE_RATIO))
+      return true;
+
+   // The new layout is built in memory and then copied over the start of
+   // the file: the header, the node table at its current capacity, a
+   // string heap with only the names of live nodes, the history ring, the
+   // child index at its current capacity without the removed slots and
+   // then the payloads of the live nodes with no room to spare. Node
+   // numbers do not change, so neither does the history.
+   const struct map_node_t *table = (struct map_node_t *)(map->base + hdr->nodes);
+   uint64_t heap_live = 0;
+   uint64_t payload_live = 0;
+   for (uint32_t i=0; i<hdr->node_count; i++) {
+      if (table[i].flags & MAP_NODE_USED) {
+         heap_live += strlen (map->base + hdr->heap + table[i].name) + 1;
+         payload_live += map_align (table[i].payload_len);
+      }
+   }
+
+   uint64_t heap_cap = MAP_INITIAL_HEAP;
+   while (heap_cap < heap_live)
+      heap_cap *= 2;
+
+   uint64_t nodes = map_align (sizeof *hdr);
+   uint64_t heap = nodes + map_align ((uint64_t)hdr->node_cap * sizeof *table);
+   uint64_t history = heap + map_align (heap_cap);
+   uint64_t index = history + map_align (MAP_HISTORY_CAP * sizeof (struct map_visit_t));
+   uint64_t payloads = index + map_align ((uint64_t)hdr->index_cap * sizeof (uint32_t));
+   uint64_t used = payloads + payload_live;
+
+   uint64_t newsize = MAP_INITIAL_SIZE;
+   while (newsize < used)
+      newsize *= 2;
+
+   // Everything in the new layout is no larger than in the old one.
+   if (used > hdr->used || newsize > hdr->size) {
+      FRM_ERROR ("Error: framedb cannot be compacted, [%" PRIu64 "] bytes in use\n",
+                 used);
+      errno = EINVAL;
+      return false;
+   }
+
+   char *buf = calloc (1, used);
+   if (!buf) {
+      FRM_ERROR ("OOM error compacting framedb of %" PRIu64 " bytes\n", used);
+      return false;
+   }
+
+   struct map_header_t *nhdr = (struct map_header_t *)buf;
+   struct map_node_t *ntable = (struct map_node_t *)(buf + nodes);
+   memcpy (nhdr, hdr, sizeof *hdr);
+   memcpy (ntable, table, (uint64_t)hdr->node_count * sizeof *table);
+   memcpy (buf + history, map->base + hdr->history,
+           MAP_HISTORY_CAP * sizeof (struct map_visit_t));
+
+   uint64_t heap_used = 0;
+   uint64_t payload = payloads;
+   for (uint32_t i=0; i<hdr->node_count; i++) {
+      if (!(table[i].flags & MAP_NODE_USED))
+         continue;
+
+      const char *name = map->base + hdr->heap + table[i].name;
+      size_t len = strlen (name) + 1;
+      memcpy (buf + heap + heap_used, name, len);
+      ntable[i].name = heap_used;
+      heap_used += len;
+
+      memcpy (buf + payload, map->base + table[i].payload, table[i].payload_len);
+      ntable[i].payload = payload;
+      ntable[i].payload_cap = map_align (table[i].payload_len);
+      payload += ntable[i].payload_cap;
+   }
+
+   uint64_t oldsize = hdr->size;
+   nhdr->size = newsize;
+   nhdr->used = used;
+   nhdr->garbage = 0;
+   nhdr->nodes = nodes;
+   nhdr->heap = heap;
+   nhdr->heap_cap = heap_cap;
+   nhdr->heap_used = heap_used;
+   nhdr->history = history;
+   nhdr->index = index;
+   nhdr->index_used = hdr->node_used - 1;
+
+   memcpy (map->base, buf, used);
+   // The names are hashed from the new heap, so the index can only be
+   // built once the new layout is in place.
+   map_index_build (map, (uint32_t *)(map->base + index), hdr->index_cap);
+   free (buf);
+   map->dirty = true;
+
+   if (newsize == oldsize)
+      return true;
+
+   // Other processes check the size of the file against the header, so
+   // the header keeps the old size if the file cannot be shrunk. If it
+   // cannot be mapped again the old, larger, mapping is still usable.
+   if ((ftruncate (map->fd, newsize))!=0) {
+      FRM_ERROR ("Warning: failed to shrink framedb to %" PRIu64 " bytes: %m\n",
+                 newsize);
+      map_header (map)->size = oldsize;
+      return true;
+   }
+   if (!(map_remap (map, newsize))) {
+      FRM_ERROR ("Warning: failed to remap framedb after compacting\n");
+   }
+   return true;
+}
+
+/* ********************************************************** */
+
+bool frm_map_visit (frm_map_t *map, uint32_t node)
+{
+   struct map_node_t *n = map_node (map, node);
+   if (!n) {
+      errno = ENOENT;
+      return false;
+   }
+
+   struct map_header_t *hdr = map_header (map);
+   struct map_visit_t *ring = (struct map_visit_t *)(map->base + hdr->history);
+   ring[hdr->history_head].node = node;
+   ring[hdr->history_head].generation = n->generation;
+   hdr->history_head = (hdr->history_head + 1) % MAP_HISTORY_CAP;
+   if (hdr->history_count < MAP_HISTORY_CAP)
+      hdr->history_count++;
+
+   map->dirty = true;
+   return true;
+}
+
+size_t frm_map_history (const frm_map_t *map, uint32_t *dst, size_t count)
+{
+   struct map_header_t *hdr = map_header (map);
+   struct map_visit_t *ring = (struct map_visit_t *)(map->base + hdr->history);
+
+   size_t ret = 0;
+   uint32_t slot = hdr->history_head;
+   for (uint32_t i=0; i<hdr->history_count && ret<count; i++) {
+      slot = (slot + MAP_HISTORY_CAP - 1) % MAP_HISTORY_CAP;
+      struct map_node_t *n = map_node (map, ring[slot].node);
+      if (!n || n->generation != ring[slot].generation)
+         continue;
+      dst[ret++] = ring[slot].node;
+   }
+   return ret;
+}
+
@@ -0,0 +1,104 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_MAP
+#define H_FRM_MAP
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* A framedb stored in a single memory-mapped file. The file holds a
+ * node table, a string heap for the frame names and a payload area,
+ * so that loading and searching the tree costs page faults instead of
+ * syscalls. This is the storage layer only; the frm_*() functions in
+ * frm.c implement the frame semantics on top of it.
+ *
+ * Nodes are identified by their index in the node table. The root frame
+ * is always node 0. Pointers returned into the map (such as names) are
+ * only valid until the next function that modifies the map.
+ */
+
+#define FRM_MAP_NONE       ((uint32_t)-1)
+#define FRM_MAP_ROOT       ((uint32_t)0)
+
+typedef struct frm_map_t frm_map_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns true if the file at fname is a mapped framedb, or is an
+   // empty file that frm_map_create() can initialise.
+   bool frm_map_isdb (const char *fname);
+
+   // Create a new mapped framedb in the (existing, empty) file fname,
+   // open an existing one and close it. Apart from during creation the
+   // file is not locked; the caller must hold a lock on it around each
+   // access if it may be shared with other processes.
+   frm_map_t *frm_map_create (const char *fname, const char *root_payload);
+   frm_map_t *frm_map_open (const char *fname);
+   void frm_map_close (frm_map_t *map);
+
+   // Pick up any growth of the file by another process. Must be called
+   // each time the lock on the file is acquired, before any other access.
+   bool frm_map_refresh (frm_map_t *map);
+
+   // Resolve a path of names separated by slashes. If 'from' is a node,
+   // the path is relative to that node and may contain '.' and '..'. If
+   // 'from' is FRM_MAP_NONE the path is absolute and starts with 'root'.
+   // FRM_MAP_NONE is returned if no such node exists.
+   uint32_t frm_map_lookup (const frm_map_t *map, uint32_t from, const char *path);
+
+   // Tree navigation. Children are traversed using frm_map_child() for
+   // the first child and frm_map_sibling() for the rest.
+   uint32_t frm_map_parent (const frm_map_t *map, uint32_t node);
+   uint32_t frm_map_child (const frm_map_t *map, uint32_t node);
+   uint32_t frm_map_sibling (const frm_map_t *map, uint32_t node);
+   uint32_t frm_map_find_child (const frm_map_t *map, uint32_t node,
+                                const char *name);
+
+   // Node fields. The path and payload are allocated and must be freed by
+   // the caller, the name points into the map.
+   const char *frm_map_name (const frm_map_t *map, uint32_t node);
+   uint64_t frm_map_mtime (const frm_map_t *map, uint32_t node);
+   char *frm_map_path (const frm_map_t *map, uint32_t node);
+   char *frm_map_payload (const frm_map_t *map, uint32_t node);
+
+   // Modification. frm_map_add() returns the new node or FRM_MAP_NONE on
+   // error, frm_map_move() makes node and all its descendants a child of
+   // parent and frm_map_remove() removes the node and all its descendants.
+   uint32_t frm_map_add (frm_map_t *map, uint32_t parent,
+                         const char *name, const char *payload);
+   bool frm_map_set_payload (frm_map_t *map, uint32_t node,
+                             const char *data, bool append);
+   bool frm_map_rename (frm_map_t *map, uint32_t node, const char *newname);
+   bool frm_map_move (frm_map_t *map, uint32_t node, uint32_t parent);
+   bool frm_map_remove (frm_map_t *map, uint32_t node);
+
+   // Reclaim the space of replaced payloads and names, outgrown tables
+   // and removed nodes by rewriting the file in place, and shrink the
+   // file to fit. Does nothing unless force is set or that space is more
+   // than half of the file in use. Node numbers do not change. The
+   // caller must hold the lock on the file exclusively.
+   bool frm_map_compact (frm_map_t *map, bool force);
+
+   // History. Visiting a node records it in a fixed-size ring of recent
+   // nodes. frm_map_history() fills dst with up to count of the most
+   // recently visited nodes that still exist, newest first, and returns
+   // the number of nodes stored.
+   bool frm_map_visit (frm_map_t *map, uint32_t node);
+   size_t frm_map_history (const frm_map_t *map, uint32_t *dst, size_t count);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,160 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <fcntl.h>
+
+#include "frm.h"
+#include "frm_stats.h"
+#include "frm_perflog.h"
+#include "frm_io.h"
+#include "ds_str.h"
+
+/* ********************************************************** */
+
+// Appends the records in fname that started at or after since to
+// *recs, which holds *nrecs of *cap.
+static bool perflog_read (const char *fname, uint64_t since,
+                          frm_perflog_t **recs, size_t *nrecs, size_t *cap)
+{
+   bool error = true;
+   FRM_STATS_ADD (opens, 1);
+   int fd = open (fname, O_RDONLY | O_BINARY | O_CLOEXEC);
+   if (fd < 0) {
+      if (errno == ENOENT)
+         return true;
+      FRM_ERROR ("Failed to open perflog [%s]: %m\n", fname);
+      return false;
+   }
+
+   frm_perflog_t buf[256];
+   ssize_t nbytes;
+   size_t partial = 0;
+   while ((nbytes = read (fd, (char *)buf + partial, sizeof buf - partial)) > 0) {
+      FRM_STATS_ADD (bytes_read, nbytes);
+      size_t len = partial + nbytes;
+      size_t n = len / sizeof *buf;
+      for (size_t i=0; i<n; i++) {
+         if (buf[i].time < since)
+            continue;
+         if (*nrecs == *cap) {
+            size_t newcap = *cap ? *cap * 2 : 1024;
+            frm_perflog_t *tmp = realloc (*recs, newcap * sizeof *tmp);
+            if (!tmp) {
+               FRM_ERROR ("OOM error reading perflog [%s]\n", fname);
+               goto cleanup;
+            }
+            *recs = tmp;
+            *cap = newcap;
+         }
+         (*recs)[(*nrecs)++] = buf[i];
+      }
+      // A short read can end part of the way into a record.
+      partial = len - n * sizeof *buf;
+      memmove (buf, &buf[n], partial);
+   }
+   if (nbytes < 0) {
+      FRM_ERROR ("Failed to read perflog [%s]: %m\n", fname);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   close (fd);
+   return !error;
+}
+
+/* ********************************************************** */
+
+bool frm_perflog_write (const char *fname, const frm_perflog_t *rec)
+{
+   FRM_STATS_ADD (opens, 1);
+   int fd = open (fname, O_WRONLY | O_APPEND | O_CREAT | O_BINARY | O_CLOEXEC,
+                  0644);
+   if (fd < 0) {
+      FRM_ERROR ("Failed to open perflog [%s]: %m\n", fname);
+      return false;
+   }
+
+   bool ret = true;
+   ssize_t nbytes = write (fd, rec, sizeof *rec);
+   if (nbytes != (ssize_t)sizeof *rec) {
+      FRM_ERROR ("Failed to write perflog [%s]: %m\n", fname);
+      ret = false;
+   } else {
+      FRM_STATS_ADD (bytes_written, nbytes);
+   }
+
+   // Only the process that finds the log still in place rotates it; any
+   // others that have it open append their record to the rotated log.
+   struct stat fsb, sb;
+   if (ret && (fstat (fd, &fsb))==0 && fsb.st_size >= FRM_PERFLOG_MAXSIZE
+         && (flock (fd, LOCK_EX))==0) {
+      if ((stat (fname, &sb))==0 && sb.st_ino == fsb.st_ino
+            && sb.st_dev == fsb.st_dev) {
+         char *old = ds_str_cat (fname, ".1", NULL);
+         FRM_STATS_ADD (renames, 1);
+         if (!old || (rename (fname, old))!=0) {
+            FRM_ERROR ("Failed to rotate perflog [%s]: %m\n", fname);
+         }
+         free (old);
+      }
+      flock (fd, LOCK_UN);
+   }
+
+   close (fd);
+   return ret;
+}
+
+frm_perflog_t *frm_perflog_load (const char *fname, uint64_t since,
+                                 size_t *nrecs)
+{
+   bool error = true;
+   frm_perflog_t *ret = NULL;
+   size_t cap = 0;
+   char *old = ds_str_cat (fname, ".1", NULL);
+
+   *nrecs = 0;
+   if (!old) {
+      FRM_ERROR ("OOM error reading perflog [%s]\n", fname);
+      goto cleanup;
+   }
+
+   if (!(perflog_read (old, since, &ret, nrecs, &cap))
+         || !(perflog_read (fname, since, &ret, nrecs, &cap)))
+      goto cleanup;
+
+   // Never NULL on success, even when there are no records.
+   if (!ret && !(ret = malloc (sizeof *ret))) {
+      FRM_ERROR ("OOM error reading perflog [%s]\n", fname);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   free (old);
+   if (error) {
+      free (ret);
+      ret = NULL;
+      *nrecs = 0;
+   }
+   return ret;
+}
+
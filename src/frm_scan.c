@@ -0,0 +1,356 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined (__x86_64__) && defined (__GNUC__)
+#define SCAN_X86     1
+#include <immintrin.h>
+#endif
+
+#include "frm_scan.h"
+
+/* ********************************************************** */
+
+static const char *scan_portable (const char *hay, size_t hlen,
+                                  const char *needle, size_t nlen)
+{
+   if (nlen == 0)
+      return hay;
+
+   const char *end = hay + hlen;
+   while ((size_t)(end - hay) >= nlen) {
+      const char *tmp = memchr (hay, needle[0], end - hay - nlen + 1);
+      if (!tmp)
+         return NULL;
+      if (tmp[nlen - 1] == needle[nlen - 1]
+            && (memcmp (tmp, needle, nlen))==0)
+         return tmp;
+      hay = tmp + 1;
+   }
+   return NULL;
+}
+
+static int scan_lower (int c)
+{
+   return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static int scan_upper (int c)
+{
+   return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
+
+static bool scan_eq_icase (const char *lhs, const char *rhs, size_t len)
+{
+   for (size_t i=0; i<len; i++) {
+      if (scan_lower ((unsigned char)lhs[i]) != scan_lower ((unsigned char)rhs[i]))
+         return false;
+   }
+   return true;
+}
+
+static const char *scan_portable_icase (const char *hay, size_t hlen,
+                                        const char *needle, size_t nlen)
+{
+   if (nlen == 0)
+      return hay;
+
+   int first = scan_lower ((unsigned char)needle[0]);
+   int last = scan_lower ((unsigned char)needle[nlen - 1]);
+   for (size_t i=0; i + nlen <= hlen; i++) {
+      if (scan_lower ((unsigned char)hay[i]) == first
+            && scan_lower ((unsigned char)hay[i + nlen - 1]) == last
+            && scan_eq_icase (&hay[i], needle, nlen))
+         return &hay[i];
+   }
+   return NULL;
+}
+
+#ifdef SCAN_X86
+
+// Checks the candidate positions in mask, lowest first, starting at hay.
+static const char *scan_candidates (const char *hay, uint32_t mask,
+                                    const char *needle, size_t nlen)
+{
+   while (mask) {
+      int bit = __builtin_ctz (mask);
+      if ((memcmp (&hay[bit + 1], &needle[1], nlen - 2))==0)
+         return &hay[bit];
+      mask &= mask - 1;
+   }
+   return NULL;
+}
+
+static const char *scan_candidates_icase (const char *hay, uint32_t mask,
+                                          const char *needle, size_t nlen)
+{
+   while (mask) {
+      int bit = __builtin_ctz (mask);
+      if (scan_eq_icase (&hay[bit], needle, nlen))
+         return &hay[bit];
+      mask &= mask - 1;
+   }
+   return NULL;
+}
+
+static const char *scan_sse2 (const char *hay, size_t hlen,
+                              const char *needle, size_t nlen)
+{
+   if (nlen < 2 || hlen < nlen)
+      return nlen == 1 ? memchr (hay, needle[0], hlen) : nlen ? NULL : hay;
+
+   const __m128i first = _mm_set1_epi8 (needle[0]);
+   const __m128i last = _mm_set1_epi8 (needle[nlen - 1]);
+
+   // Each block tests the 16 positions starting at i, which needs the
+   // bytes up to i + 16 + nlen - 1.
+   size_t i = 0;
+   for (; i + 16 + nlen - 1 <= hlen; i += 16) {
+      __m128i bf = _mm_loadu_si128 ((const __m128i *)&hay[i]);
+      __m128i bl = _mm_loadu_si128 ((const __m128i *)&hay[i + nlen - 1]);
+      __m128i eq = _mm_and_si128 (_mm_cmpeq_epi8 (bf, first),
+                                  _mm_cmpeq_epi8 (bl, last));
+      uint32_t mask = _mm_movemask_epi8 (eq);
+      if (mask) {
+         const char *ret = scan_candidates (&hay[i], mask, needle, nlen);
+         if (ret)
+            return ret;
+      }
+   }
+   return scan_portable (&hay[i], hlen - i, needle, nlen);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *scan_avx2 (const char *hay, size_t hlen,
+                              const char *needle, size_t nlen)
+{
+   if (nlen < 2 || hlen < nlen)
+      return nlen == 1 ? memchr (hay, needle[0], hlen) : nlen ? NULL : hay;
+
+   const __m256i first = _mm256_set1_epi8 (needle[0]);
+   const __m256i last = _mm256_set1_epi8 (needle[nlen - 1]);
+
+   size_t i = 0;
+   for (; i + 32 + nlen - 1 <= hlen; i += 32) {
+      __m256i bf = _mm256_loadu_si256 ((const __m256i *)&hay[i]);
+      __m256i bl = _mm256_loadu_si256 ((const __m256i *)&hay[i + nlen - 1]);
+      __m256i eq = _mm256_and_si256 (_mm256_cmpeq_epi8 (bf, first),
+                                     _mm256_cmpeq_epi8 (bl, last));
+      uint32_t mask = _mm256_movemask_epi8 (eq);
+      if (mask) {
+         const char *ret = scan_candidates (&hay[i], mask, needle, nlen);
+         if (ret)
+            return ret;
+      }
+   }
+   return scan_sse2 (&hay[i], hlen - i, needle, nlen);
+}
+
+// The case-insensitive kernels compare the first and the last byte of
+// the needle in both cases.
+static const char *scan_sse2_icase (const char *hay, size_t hlen,
+                                    const char *needle, size_t nlen)
+{
+   if (nlen < 2 || hlen < nlen)
+      return scan_portable_icase (hay, hlen, needle, nlen);
+
+   int f = (unsigned char)needle[0], l = (unsigned char)needle[nlen - 1];
+   const __m128i first_lo = _mm_set1_epi8 (scan_lower (f));
+   const __m128i first_up = _mm_set1_epi8 (scan_upper (f));
+   const __m128i last_lo = _mm_set1_epi8 (scan_lower (l));
+   const __m128i last_up = _mm_set1_epi8 (scan_upper (l));
+
+   size_t i = 0;
+   for (; i + 16 + nlen - 1 <= hlen; i += 16) {
+      __m128i bf = _mm_loadu_si128 ((const __m128i *)&hay[i]);
+      __m128i bl = _mm_loadu_si128 ((const __m128i *)&hay[i + nlen - 1]);
+      __m128i ef = _mm_or_si128 (_mm_cmpeq_epi8 (bf, first_lo),
+                                 _mm_cmpeq_epi8 (bf, first_up));
+      __m128i el = _mm_or_si128 (_mm_cmpeq_epi8 (bl, last_lo),
+                                 _mm_cmpeq_epi8 (bl, last_up));
+      uint32_t mask = _mm_movemask_epi8 (_mm_and_si128 (ef, el));
+      if (mask) {
+         const char *ret = scan_candidates_icase (&hay[i], mask, needle, nlen);
+         if (ret)
+            return ret;
+      }
+   }
+   return scan_portable_icase (&hay[i], hlen - i, needle, nlen);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *scan_avx2_icase (const char *hay, size_t hlen,
+                                    const char *needle, size_t nlen)
+{
+   if (nlen < 2 || hlen < nlen)
+      return scan_portable_icase (hay, hlen, needle, nlen);
+
+   int f = (unsigned char)needle[0], l = (unsigned char)needle[nlen - 1];
+   const __m256i first_lo = _mm256_set1_epi8 (scan_lower (f));
+   const __m256i first_up = _mm256_set1_epi8 (scan_upper (f));
+   const __m256i last_lo = _mm256_set1_epi8 (scan_lower (l));
+   const __m256i last_up = _mm256_set1_epi8 (scan_upper (l));
+
+   size_t i = 0;
+   for (; i + 32 + nlen - 1 <= hlen; i += 32) {
+      __m256i bf = _mm256_loadu_si256 ((const __m256i *)&hay[i]);
+      __m256i bl = _mm256_loadu_si256 ((const __m256i *)&hay[i + nlen - 1]);
+      __m256i ef = _mm256_or_si256 (_mm256_cmpeq_epi8 (bf, first_lo),
+                                    _mm256_cmpeq_epi8 (bf, first_up));
+      __m256i el = _mm256_or_si256 (_mm256_cmpeq_epi8 (bl, last_lo),
+                                    _mm256_cmpeq_epi8 (bl, last_up));
+      uint32_t mask = _mm256_movemask_epi8 (_mm256_and_si256 (ef, el));
+      if (mask) {
+         const char *ret = scan_candidates_icase (&hay[i], mask, needle, nlen);
+         if (ret)
+            return ret;
+      }
+   }
+   return scan_sse2_icase (&hay[i], hlen - i, needle, nlen);
+}
+
+#endif
+
+/* ********************************************************** */
+
+struct scan_kernel_t {
+   const char *name;
+   frm_scan_fn_t *find;
+   frm_scan_fn_t *find_icase;
+};
+
+// In order of preference.
+static const struct scan_kernel_t g_kernels[] = {
+#ifdef SCAN_X86
+   { "avx2", scan_avx2, scan_avx2_icase },
+   { "sse2", scan_sse2, scan_sse2_icase },
+#endif
+   { "portable", scan_portable, scan_portable_icase },
+};
+#define NKERNELS     (sizeof g_kernels / sizeof g_kernels[0])
+
+static const struct scan_kernel_t *g_kernel;
+
+static const struct scan_kernel_t *scan_kernel (const char *name)
+{
+   for (size_t i=0; name && i<NKERNELS; i++) {
+      if ((strcmp (name, g_kernels[i].name))!=0)
+         continue;
+#ifdef SCAN_X86
+      if (g_kernels[i].find == scan_avx2) {
+         __builtin_cpu_init ();
+         if (!(__builtin_cpu_supports ("avx2")))
+            return NULL;
+      }
+#endif
+      return &g_kernels[i];
+   }
+   return NULL;
+}
+
+static const struct scan_kernel_t *scan_select (void)
+{
+   const struct scan_kernel_t *ret = __atomic_load_n (&g_kernel, __ATOMIC_RELAXED);
+   if (!ret) {
+      // Every thread that gets here picks the same kernel.
+      for (size_t i=0; !ret; i++) {
+         ret = scan_kernel (g_kernels[i].name);
+      }
+      __atomic_store_n (&g_kernel, ret, __ATOMIC_RELAXED);
+   }
+   return ret;
+}
+
+frm_scan_fn_t *frm_scan_kernel (const char *name)
+{
+   const struct scan_kernel_t *kernel = scan_kernel (name);
+   return kernel ? kernel->find : NULL;
+}
+
+frm_scan_fn_t *frm_scan_kernel_icase (const char *name)
+{
+   const struct scan_kernel_t *kernel = scan_kernel (name);
+   return kernel ? kernel->find_icase : NULL;
+}
+
+const char *frm_scan_find (const char *hay, size_t hlen,
+                           const char *needle, size_t nlen)
+{
+   return scan_select ()->find (hay, hlen, needle, nlen);
+}
+
+const char *frm_scan_find_icase (const char *hay, size_t hlen,
+                                 const char *needle, size_t nlen)
+{
+   return scan_select ()->find_icase (hay, hlen, needle, nlen);
+}
+
+const char *frm_scan_kernel_name (void)
+{
+   return scan_select ()->name;
+}
+
+/* ********************************************************** */
+
+// Returns the lowercase form of the code point c, for the ranges of
+// Unicode that frm_scan_fold() handles. The lowercase form of each of
+// these is also encoded in two bytes.
+static uint32_t scan_fold_cp (uint32_t c)
+{
+   if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+      return c + 0x20;
+   if ((c >= 0x100 && c <= 0x12F) || (c >= 0x132 && c <= 0x137)
+         || (c >= 0x14A && c <= 0x177))
+      return c | 1;
+   if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+      return c + (c & 1);
+   if (c == 0x178)
+      return 0xFF;
+   if (c >= 0x391 && c <= 0x3AB && c != 0x3A2)
+      return c + 0x20;
+   if (c >= 0x400 && c <= 0x40F)
+      return c + 0x50;
+   if (c >= 0x410 && c <= 0x42F)
+      return c + 0x20;
+   return c;
+}
+
+bool frm_scan_ascii (const char *text, size_t len)
+{
+   for (size_t i=0; i<len; i++) {
+      if ((unsigned char)text[i] >= 0x80)
+         return false;
+   }
+   return true;
+}
+
+void frm_scan_fold (char *dst, const char *src, size_t len)
+{
+   for (size_t i=0; i<len; i++) {
+      unsigned char c = src[i];
+      if (c < 0x80) {
+         dst[i] = scan_lower (c);
+         continue;
+      }
+
+      unsigned char next = i + 1 < len ? src[i + 1] : 0;
+      if (c < 0xC2 || c > 0xDF || (next & 0xC0) != 0x80) {
+         dst[i] = c;
+         continue;
+      }
+
+      uint32_t cp = scan_fold_cp (((c & 0x1F) << 6) | (next & 0x3F));
+      dst[i] = 0xC0 | (cp >> 6);
+      dst[i + 1] = 0x80 | (cp & 0x3F);
+      i++;
+   }
+}
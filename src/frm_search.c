@@ -0,0 +1,1166 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "frm.h"
+#include "frm_stats.h"
+#include "frm_search.h"
+#include "frm_io.h"
+
+/* The snapshot is a header, the documents sorted by ID, the words sorted
+ * bytewise, the text of the words and the posting lists, which hold the
+ * documents that contain each word, and how often, in ascending order.
+ * Fields are stored in host byte order.
+ *
+ * The log is text with one document per line: the ID, the number of
+ * words in the document and then "word:count" for each distinct word,
+ * separated by spaces. A line that cannot be parsed, such as the last one
+ * after a crash, is skipped.
+ */
+
+#define SRCH_MAGIC         (0x48435253)
+#define SRCH_VERSION       (1)
+#define SRCH_FNAME         "search.index"
+#define SRCH_LOG_FNAME     "search.log"
+
+// Every search reads the whole log, so it is merged into the snapshot
+// once it is larger than this.
+#define SRCH_LOG_MAX       (256 * 1024)
+
+// Longer words are not indexed.
+#define SRCH_WORD_MAX      (64)
+
+#define SRCH_NONE          ((uint32_t)-1)
+#define SRCH_INITIAL_SLOTS (4096)
+
+// BM25 parameters.
+#define SRCH_K1            (1.2)
+#define SRCH_B             (0.75)
+
+struct srch_header_t {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t docs;             // Offset of the document table
+   uint64_t ndocs;
+   uint64_t total_len;        // The number of words in all documents
+   uint64_t words;            // Offset of the word table
+   uint64_t nwords;
+   uint64_t text;             // Offset of the text of the words
+   uint64_t text_len;
+   uint64_t postings;         // Offset of the posting lists
+   uint64_t npostings;
+};
+
+struct srch_doc_entry_t {
+   uint64_t id;
+   uint32_t len;
+   uint32_t reserved;
+};
+
+struct srch_word_entry_t {
+   uint64_t text;             // Offset of the word in the text
+   uint32_t len;
+   uint32_t count;            // The number of documents containing it
+   uint64_t start;            // Index of the first posting
+};
+
+struct srch_posting_t {
+   uint32_t doc;
+   uint32_t count;
+};
+
+struct srch_map_t {
+   int fd;
+   char *base;
+   size_t size;
+   const struct srch_header_t *hdr;
+   const struct srch_doc_entry_t *docs;
+   const struct srch_word_entry_t *words;
+   const char *text;
+   const struct srch_posting_t *postings;
+};
+
+struct frm_search_batch_t {
+   char *data;
+   size_t len;
+   size_t cap;
+};
+
+// A word in a document held in memory, pointing into the text of the
+// document or of its record.
+struct srch_word_t {
+   const char *str;
+   uint32_t len;
+   uint32_t count;
+};
+
+struct srch_doc_t {
+   uint64_t id;
+   uint32_t len;
+   uint32_t nwords;
+   size_t first;              // Index of the first word
+   size_t seq;
+};
+
+// Documents parsed from the log or a batch, sorted by ID.
+struct srch_docs_t {
+   struct srch_doc_t *docs;
+   size_t ndocs;
+   struct srch_word_t *words;
+   size_t nwords;
+};
+
+/* ********************************************************** */
+
+static uint64_t srch_align (uint64_t value)
+{
+   return (value + 7) & ~(uint64_t)7;
+}
+
+static bool srch_write_padded (int fd, const void *src, size_t len)
+{
+   static const char zeros[8];
+   return frm_io_write_full (fd, src, len)
+      && frm_io_write_full (fd, zeros, srch_align (len) - len);
+}
+
+// Makes room for n more elements of the given size in *array, which
+// holds len elements and has room for *cap.
+static bool srch_reserve (void *array, size_t *cap, size_t len, size_t n,
+                          size_t size)
+{
+   if (len + n <= *cap)
+      return true;
+
+   size_t newcap = *cap ? *cap : 16;
+   while (newcap < len + n) {
+      newcap *= 2;
+   }
+   void *tmp = realloc (*(void **)array, newcap * size);
+   if (!tmp) {
+      FRM_ERROR ("OOM error allocating search index\n");
+      return false;
+   }
+   *(void **)array = tmp;
+   *cap = newcap;
+   return true;
+}
+
+static int srch_wordcmp (const char *lhs, size_t llen,
+                         const char *rhs, size_t rlen)
+{
+   int cmp = memcmp (lhs, rhs, llen < rlen ? llen : rlen);
+   return cmp ? cmp : llen < rlen ? -1 : llen > rlen;
+}
+
+static int srch_word_cmp (const void *lhs, const void *rhs)
+{
+   const struct srch_word_t *l = lhs;
+   const struct srch_word_t *r = rhs;
+   return srch_wordcmp (l->str, l->len, r->str, r->len);
+}
+
+static bool srch_is_word (unsigned char c)
+{
+   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+      || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Splits text into words, sorted bytewise, which point into *lower, a
+// lowercase copy of text that the caller must free along with *words.
+static bool srch_words (const char *text, char **lower,
+                        struct srch_word_t **words, size_t *nwords)
+{
+   size_t len = strlen (text);
+   size_t cap = 0;
+
+   *words = NULL;
+   *nwords = 0;
+   if (!(*lower = malloc (len + 1))) {
+      FRM_ERROR ("OOM error allocating search words\n");
+      return false;
+   }
+   for (size_t i=0; i<=len; i++) {
+      char c = text[i];
+      (*lower)[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+   }
+
+   for (size_t i=0; i<len; ) {
+      if (!(srch_is_word (text[i]))) {
+         i++;
+         continue;
+      }
+      size_t start = i;
+      while (i < len && srch_is_word (text[i])) {
+         i++;
+      }
+      if (i - start > SRCH_WORD_MAX)
+         continue;
+      if (!(srch_reserve (words, &cap, *nwords, 1, sizeof **words))) {
+         free (*lower);
+         free (*words);
+         *lower = NULL;
+         *words = NULL;
+         return false;
+      }
+      (*words)[(*nwords)++] = (struct srch_word_t) {
+         &(*lower)[start], i - start, 1
+      };
+   }
+
+   if (*nwords) {
+      qsort (*words, *nwords, sizeof **words, srch_word_cmp);
+   }
+   return true;
+}
+
+/* ********************************************************** */
+
+frm_search_batch_t *frm_search_batch_new (void)
+{
+   frm_search_batch_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating search batch\n");
+   }
+   return ret;
+}
+
+void frm_search_batch_del (frm_search_batch_t *batch)
+{
+   if (batch) {
+      free (batch->data);
+      free (batch);
+   }
+}
+
+bool frm_search_batch_add (frm_search_batch_t *batch, uint64_t id,
+                           const char *text)
+{
+   char *lower = NULL;
+   struct srch_word_t *words = NULL;
+   size_t nwords = 0;
+
+   if (!(srch_words (text ? text : "", &lower, &words, &nwords)))
+      return false;
+
+   // At most one "word:count" for every word, and the ID and length.
+   size_t len = 2 * 21 + 2;
+   for (size_t i=0; i<nwords; i++) {
+      len += words[i].len + 22;
+   }
+
+   bool ret = srch_reserve (&batch->data, &batch->cap, batch->len, len + 1, 1);
+   if (ret) {
+      char *tmp = &batch->data[batch->len];
+      tmp += sprintf (tmp, "%" PRIu64 " %" PRIu32, id,
+                      nwords > UINT32_MAX ? UINT32_MAX : (uint32_t)nwords);
+      for (size_t i=0; i<nwords; ) {
+         size_t j = i + 1;
+         while (j < nwords && (srch_word_cmp (&words[i], &words[j]))==0) {
+            j++;
+         }
+         tmp += sprintf (tmp, " %.*s:%zu", (int)words[i].len, words[i].str, j - i);
+         i = j;
+      }
+      *tmp++ = '\n';
+      batch->len = tmp - batch->data;
+   }
+
+   free (lower);
+   free (words);
+   return ret;
+}
+
+/* ********************************************************** */
+
+static void srch_docs_free (struct srch_docs_t *docs)
+{
+   free (docs->docs);
+   free (docs->words);
+   memset (docs, 0, sizeof *docs);
+}
+
+static bool srch_number (const char **src, const char *end, uint64_t *dst)
+{
+   const char *tmp = *src;
+   *dst = 0;
+   while (tmp < end && *tmp >= '0' && *tmp <= '9') {
+      if (*dst > (UINT64_MAX - 9) / 10)
+         return false;
+      *dst = *dst * 10 + (*tmp++ - '0');
+   }
+   if (tmp == *src)
+      return false;
+   *src = tmp;
+   return true;
+}
+
+// Parses one record, ending at eol, into a document and its words.
+static bool srch_record_parse (struct srch_docs_t *docs, size_t *wcap,
+                               struct srch_doc_t *doc,
+                               const char *line, const char *eol)
+{
+   uint64_t len;
+   if (!(srch_number (&line, eol, &doc->id))
+         || line == eol || *line++ != ' '
+         || !(srch_number (&line, eol, &len)) || len > UINT32_MAX)
+      return false;
+
+   doc->len = len;
+   doc->nwords = 0;
+   doc->first = docs->nwords;
+   while (line < eol) {
+      if (*line++ != ' ')
+         return false;
+      const char *str = line;
+      while (line < eol && srch_is_word (*line)) {
+         line++;
+      }
+      uint64_t count;
+      size_t wlen = line - str;
+      if (wlen == 0 || wlen > SRCH_WORD_MAX
+            || line == eol || *line++ != ':'
+            || !(srch_number (&line, eol, &count))
+            || count == 0 || count > UINT32_MAX)
+         return false;
+      if (!(srch_reserve (&docs->words, wcap, docs->nwords, 1, sizeof *docs->words)))
+         return false;
+      docs->words[docs->nwords++] = (struct srch_word_t) { str, wlen, count };
+      doc->nwords++;
+   }
+   return true;
+}
+
+static int srch_doc_cmp (const void *lhs, const void *rhs)
+{
+   const struct srch_doc_t *l = lhs;
+   const struct srch_doc_t *r = rhs;
+   if (l->id != r->id)
+      return l->id < r->id ? -1 : 1;
+   return l->seq < r->seq ? -1 : l->seq > r->seq;
+}
+
+// Parses the records in data, which the documents point into. Of several
+// records for the same ID the last one wins.
+static bool srch_docs_parse (struct srch_docs_t *docs, const char *data,
+                             size_t len)
+{
+   size_t dcap = 0, wcap = 0;
+   const char *end = data + len;
+
+   memset (docs, 0, sizeof *docs);
+   for (const char *line = data; line < end; ) {
+      const char *eol = memchr (line, '\n', end - line);
+      if (!eol)
+         break;
+
+      struct srch_doc_t doc;
+      size_t nwords = docs->nwords;
+      if (!(srch_reserve (&docs->docs, &dcap, docs->ndocs, 1, sizeof *docs->docs))) {
+         srch_docs_free (docs);
+         return false;
+      }
+      if ((srch_record_parse (docs, &wcap, &doc, line, eol))) {
+         doc.seq = docs->ndocs;
+         docs->docs[docs->ndocs++] = doc;
+      } else {
+         docs->nwords = nwords;
+      }
+      line = eol + 1;
+   }
+
+   if (docs->ndocs) {
+      qsort (docs->docs, docs->ndocs, sizeof *docs->docs, srch_doc_cmp);
+   }
+   size_t ndocs = 0;
+   for (size_t i=0; i<docs->ndocs; i++) {
+      if (i + 1 < docs->ndocs && docs->docs[i + 1].id == docs->docs[i].id)
+         continue;
+      docs->docs[ndocs++] = docs->docs[i];
+   }
+   docs->ndocs = ndocs;
+   return true;
+}
+
+// Reads the log. A missing log is empty.
+static bool srch_log_read (int dirfd, char **data, size_t *len)
+{
+   *data = NULL;
+   *len = 0;
+
+   FRM_STATS_ADD (opens, 1);
+   int fd = openat (dirfd, SRCH_LOG_FNAME, O_RDONLY | O_BINARY | O_CLOEXEC);
+   if (fd < 0) {
+      if (errno == ENOENT)
+         return true;
+      FRM_ERROR ("Failed to open [%s]: %m\n", SRCH_LOG_FNAME);
+      return false;
+   }
+
+   struct stat sb;
+   bool ret = (fstat (fd, &sb))==0
+      && (*data = malloc (sb.st_size + 1))
+      && frm_io_read_full (fd, *data, sb.st_size, 0);
+   close (fd);
+   if (!ret) {
+      FRM_ERROR ("Failed to read [%s]: %m\n", SRCH_LOG_FNAME);
+      free (*data);
+      *data = NULL;
+      return false;
+   }
+   *len = sb.st_size;
+   return true;
+}
+
+/* ********************************************************** */
+
+static void srch_map_close (struct srch_map_t *sm)
+{
+   if (sm->base) {
+      munmap (sm->base, sm->size);
+   }
+   if (sm->fd >= 0) {
+      close (sm->fd);
+   }
+   memset (sm, 0, sizeof *sm);
+   sm->fd = -1;
+}
+
+// Maps the snapshot. A missing snapshot is not reported, and leaves errno
+// set to ENOENT.
+static bool srch_map_open (struct srch_map_t *sm, int dirfd)
+{
+   memset (sm, 0, sizeof *sm);
+   FRM_STATS_ADD (opens, 1);
+   if ((sm->fd = openat (dirfd, SRCH_FNAME, O_RDONLY | O_BINARY | O_CLOEXEC)) < 0) {
+      if (errno != ENOENT) {
+         FRM_ERROR ("Failed to open [%s]: %m\n", SRCH_FNAME);
+      }
+      return false;
+   }
+
+   struct stat sb;
+   if ((fstat (sm->fd, &sb))!=0 || (size_t)sb.st_size < sizeof *sm->hdr) {
+      FRM_ERROR ("Error: [%s] is not a search index\n", SRCH_FNAME);
+      srch_map_close (sm);
+      errno = EINVAL;
+      return false;
+   }
+
+   sm->size = sb.st_size;
+   sm->base = mmap (NULL, sm->size, PROT_READ, MAP_SHARED, sm->fd, 0);
+   if (sm->base == MAP_FAILED) {
+      FRM_ERROR ("Failed to map [%s]: %m\n", SRCH_FNAME);
+      sm->base = NULL;
+      srch_map_close (sm);
+      return false;
+   }
+
+   const struct srch_header_t *hdr = (const struct srch_header_t *)sm->base;
+   bool valid = hdr->magic == SRCH_MAGIC && hdr->version == SRCH_VERSION
+      && hdr->docs + hdr->ndocs * sizeof *sm->docs <= sm->size
+      && hdr->words + hdr->nwords * sizeof *sm->words <= sm->size
+      && hdr->text + hdr->text_len <= sm->size
+      && hdr->postings + hdr->npostings * sizeof *sm->postings <= sm->size
+      && hdr->ndocs < SRCH_NONE;
+
+   sm->hdr = hdr;
+   sm->docs = (const struct srch_doc_entry_t *)(sm->base + hdr->docs);
+   sm->words = (const struct srch_word_entry_t *)(sm->base + hdr->words);
+   sm->text = sm->base + hdr->text;
+   sm->postings = (const struct srch_posting_t *)(sm->base + hdr->postings);
+
+   for (size_t i=0; valid && i<hdr->nwords; i++) {
+      valid = sm->words[i].text + sm->words[i].len <= hdr->text_len
+         && sm->words[i].start + sm->words[i].count <= hdr->npostings;
+   }
+   if (!valid) {
+      FRM_ERROR ("Error: [%s] is not a search index\n", SRCH_FNAME);
+      srch_map_close (sm);
+      errno = EINVAL;
+      return false;
+   }
+   return true;
+}
+
+static const struct srch_word_entry_t *srch_map_find (const struct srch_map_t *sm,
+                                                      const char *str, size_t len)
+{
+   size_t lo = 0, hi = sm->hdr->nwords;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      const struct srch_word_entry_t *w = &sm->words[mid];
+      if ((srch_wordcmp (&sm->text[w->text], w->len, str, len)) < 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   const struct srch_word_entry_t *w = &sm->words[lo];
+   return lo < sm->hdr->nwords
+      && (srch_wordcmp (&sm->text[w->text], w->len, str, len))==0 ? w : NULL;
+}
+
+static size_t srch_map_doc (const struct srch_map_t *sm, uint64_t id)
+{
+   size_t lo = 0, hi = sm->hdr->ndocs;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (sm->docs[mid].id < id) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo < sm->hdr->ndocs && sm->docs[lo].id == id ? lo : SRCH_NONE;
+}
+
+/* ********************************************************** */
+
+/* Writing a snapshot merges the documents of the old snapshot, if any,
+ * with those in memory, which replace the old ones with the same ID. The
+ * words of the documents in memory are inverted with an open-addressed
+ * hash table and then merged with the words of the old snapshot, which
+ * are already sorted, so that the old snapshot is only read once.
+ */
+
+struct srch_slot_t {
+   const char *str;     // NULL for an empty slot
+   uint32_t len;
+   uint32_t count;
+   uint64_t start;
+   uint64_t fill;
+};
+
+struct srch_table_t {
+   struct srch_slot_t *slots;
+   size_t nslots;
+   size_t nused;
+};
+
+static uint32_t srch_hash (const char *str, size_t len)
+{
+   uint32_t ret = 2166136261u;
+   for (size_t i=0; i<len; i++) {
+      ret = (ret ^ (unsigned char)str[i]) * 16777619u;
+   }
+   return ret;
+}
+
+static struct srch_slot_t *srch_table_find (struct srch_table_t *table,
+                                            const char *str, size_t len)
+{
+   size_t mask = table->nslots - 1;
+   for (size_t i=srch_hash (str, len) & mask; ; i=(i + 1) & mask) {
+      struct srch_slot_t *slot = &table->slots[i];
+      if (!slot->str
+            || (slot->len == len && (memcmp (slot->str, str, len))==0))
+         return slot;
+   }
+}
+
+static bool srch_table_grow (struct srch_table_t *table)
+{
+   size_t nslots = table->nslots ? table->nslots * 2 : SRCH_INITIAL_SLOTS;
+   struct srch_slot_t *slots = calloc (nslots, sizeof *slots);
+   if (!slots) {
+      FRM_ERROR ("OOM error allocating search word table\n");
+      return false;
+   }
+
+   struct srch_table_t grown = { slots, nslots, table->nused };
+   for (size_t i=0; i<table->nslots; i++) {
+      struct srch_slot_t *slot = &table->slots[i];
+      if (slot->str) {
+         *srch_table_find (&grown, slot->str, slot->len) = *slot;
+      }
+   }
+   free (table->slots);
+   *table = grown;
+   return true;
+}
+
+static struct srch_slot_t *srch_table_add (struct srch_table_t *table,
+                                           const char *str, size_t len)
+{
+   if ((table->nused + 1) * 2 > table->nslots && !(srch_table_grow (table)))
+      return NULL;
+
+   struct srch_slot_t *ret = srch_table_find (table, str, len);
+   if (!ret->str) {
+      ret->str = str;
+      ret->len = len;
+      table->nused++;
+   }
+   return ret;
+}
+
+static int srch_slot_cmp (const void *lhs, const void *rhs)
+{
+   const struct srch_slot_t *l = *(const struct srch_slot_t * const *)lhs;
+   const struct srch_slot_t *r = *(const struct srch_slot_t * const *)rhs;
+   return srch_wordcmp (l->str, l->len, r->str, r->len);
+}
+
+// Writes a snapshot of the documents in sm, which may be NULL, and mem,
+// leaving out those for which live() returns false, and puts it in place
+// of the current snapshot and log.
+static bool srch_write (int dirfd, const struct srch_map_t *sm,
+                        const struct srch_docs_t *mem,
+                        frm_search_live_t *live, void *arg)
+{
+   bool error = true;
+   int outfd = -1;
+   uint32_t *remap = NULL;
+   uint32_t *memdoc = NULL;
+   struct srch_doc_entry_t *docs = NULL;
+   struct srch_table_t table = { NULL, 0, 0 };
+   struct srch_slot_t **memwords = NULL;
+   struct srch_posting_t *mempostings = NULL;
+   struct srch_word_entry_t *words = NULL;
+   char *text = NULL;
+   struct srch_posting_t *postings = NULL;
+   struct srch_header_t hdr;
+   char tmpname[64];
+   static unsigned int counter = 0;
+
+   snprintf (tmpname, sizeof tmpname, "%s-%li-%u.tmp", SRCH_FNAME,
+             (long)getpid (), __sync_fetch_and_add (&counter, 1));
+
+   size_t snapdocs = sm ? sm->hdr->ndocs : 0;
+   size_t snapwords = sm ? sm->hdr->nwords : 0;
+   if (!(remap = malloc ((snapdocs + 1) * sizeof *remap))
+         || !(memdoc = malloc ((mem->ndocs + 1) * sizeof *memdoc))
+         || !(docs = malloc ((snapdocs + mem->ndocs + 1) * sizeof *docs))) {
+      FRM_ERROR ("OOM error allocating search index documents\n");
+      goto cleanup;
+   }
+
+   // Number the documents that are kept in order of ID.
+   uint64_t ndocs = 0, total_len = 0;
+   for (size_t i=0, j=0; i<snapdocs || j<mem->ndocs; ) {
+      uint64_t id;
+      uint32_t len;
+      uint32_t *number;
+      if (j == mem->ndocs || (i < snapdocs && sm->docs[i].id < mem->docs[j].id)) {
+         id = sm->docs[i].id;
+         len = sm->docs[i].len;
+         number = &remap[i++];
+      } else {
+         if (i < snapdocs && sm->docs[i].id == mem->docs[j].id) {
+            remap[i++] = SRCH_NONE;
+         }
+         id = mem->docs[j].id;
+         len = mem->docs[j].len;
+         number = &memdoc[j++];
+      }
+      *number = SRCH_NONE;
+      if (ndocs < SRCH_NONE - 1 && (!live || live (arg, id))) {
+         *number = ndocs;
+         docs[ndocs++] = (struct srch_doc_entry_t) { id, len, 0 };
+         total_len += len;
+      }
+   }
+
+   // Count the documents in memory that contain each word, then fill in
+   // the posting lists in order of document.
+   uint64_t nmempostings = 0;
+   for (size_t i=0; i<mem->ndocs; i++) {
+      if (memdoc[i] == SRCH_NONE)
+         continue;
+      const struct srch_word_t *w = &mem->words[mem->docs[i].first];
+      for (size_t j=0; j<mem->docs[i].nwords; j++) {
+         struct srch_slot_t *slot = srch_table_add (&table, w[j].str, w[j].len);
+         if (!slot)
+            goto cleanup;
+         slot->count++;
+         nmempostings++;
+      }
+   }
+
+   size_t nmemwords = 0;
+   if (!(memwords = malloc ((table.nused + 1) * sizeof *memwords))
+         || !(mempostings = malloc ((nmempostings + 1) * sizeof *mempostings))) {
+      FRM_ERROR ("OOM error allocating search index words\n");
+      goto cleanup;
+   }
+   uint64_t memtext_len = 0;
+   for (size_t i=0; i<table.nslots; i++) {
+      if (table.slots[i].str) {
+         memwords[nmemwords++] = &table.slots[i];
+         memtext_len += table.slots[i].len;
+      }
+   }
+   qsort (memwords, nmemwords, sizeof *memwords, srch_slot_cmp);
+
+   nmempostings = 0;
+   for (size_t i=0; i<nmemwords; i++) {
+      memwords[i]->start = nmempostings;
+      nmempostings += memwords[i]->count;
+   }
+   for (size_t i=0; i<mem->ndocs; i++) {
+      if (memdoc[i] == SRCH_NONE)
+         continue;
+      const struct srch_word_t *w = &mem->words[mem->docs[i].first];
+      for (size_t j=0; j<mem->docs[i].nwords; j++) {
+         struct srch_slot_t *slot = srch_table_find (&table, w[j].str, w[j].len);
+         mempostings[slot->start + slot->fill++] =
+            (struct srch_posting_t) { memdoc[i], w[j].count };
+      }
+   }
+
+   uint64_t maxpostings = (sm ? sm->hdr->npostings : 0) + nmempostings;
+   uint64_t maxtext = (sm ? sm->hdr->text_len : 0) + memtext_len;
+   if (!(words = malloc ((snapwords + nmemwords + 1) * sizeof *words))
+         || !(text = malloc (maxtext + 1))
+         || !(postings = malloc ((maxpostings + 1) * sizeof *postings))) {
+      FRM_ERROR ("OOM error allocating search index\n");
+      goto cleanup;
+   }
+
+   // Merge the sorted words and, for each word, the posting lists, which
+   // are both in order of the new document numbers.
+   uint64_t nwords = 0, text_len = 0, npostings = 0;
+   for (size_t i=0, j=0; i<snapwords || j<nmemwords; ) {
+      const struct srch_word_entry_t *sw = i < snapwords ? &sm->words[i] : NULL;
+      const struct srch_slot_t *mw = j < nmemwords ? memwords[j] : NULL;
+      int cmp = !sw ? 1 : !mw ? -1
+              : srch_wordcmp (&sm->text[sw->text], sw->len, mw->str, mw->len);
+
+      const char *str = NULL;
+      uint32_t len = 0;
+      const struct srch_posting_t *sp = NULL, *mp = NULL;
+      size_t sn = 0, mn = 0;
+      if (cmp <= 0) {
+         str = &sm->text[sw->text];
+         len = sw->len;
+         sp = &sm->postings[sw->start];
+         sn = sw->count;
+         i++;
+      }
+      if (cmp >= 0) {
+         str = mw->str;
+         len = mw->len;
+         mp = &mempostings[mw->start];
+         mn = mw->count;
+         j++;
+      }
+
+      uint64_t start = npostings;
+      for (size_t x=0, y=0; x<sn || y<mn; ) {
+         uint32_t doc = SRCH_NONE;
+         if (x < sn) {
+            if (sp[x].doc >= snapdocs || remap[sp[x].doc] == SRCH_NONE) {
+               x++;
+               continue;
+            }
+            doc = remap[sp[x].doc];
+         }
+         if (y < mn && (doc == SRCH_NONE || mp[y].doc < doc)) {
+            postings[npostings++] = mp[y++];
+         } else {
+            postings[npostings++] = (struct srch_posting_t) { doc, sp[x++].count };
+         }
+      }
+      if (npostings == start)
+         continue;
+
+      words[nwords++] = (struct srch_word_entry_t) {
+         text_len, len, npostings - start, start
+      };
+      memcpy (&text[text_len], str, len);
+      text_len += len;
+   }
+
+   memset (&hdr, 0, sizeof hdr);
+   hdr.magic = SRCH_MAGIC;
+   hdr.version = SRCH_VERSION;
+   hdr.docs = srch_align (sizeof hdr);
+   hdr.ndocs = ndocs;
+   hdr.total_len = total_len;
+   hdr.words = hdr.docs + ndocs * sizeof *docs;
+   hdr.nwords = nwords;
+   hdr.text = hdr.words + nwords * sizeof *words;
+   hdr.text_len = text_len;
+   hdr.postings = hdr.text + srch_align (text_len);
+   hdr.npostings = npostings;
+
+   FRM_STATS_ADD (opens, 1);
+   outfd = openat (dirfd, tmpname,
+                   O_WRONLY | O_CREAT | O_EXCL | O_BINARY | O_CLOEXEC, 0644);
+   if (outfd < 0
+         || !(srch_write_padded (outfd, &hdr, sizeof hdr))
+         || !(frm_io_write_full (outfd, docs, ndocs * sizeof *docs))
+         || !(frm_io_write_full (outfd, words, nwords * sizeof *words))
+         || !(srch_write_padded (outfd, text, text_len))
+         || !(frm_io_write_full (outfd, postings, npostings * sizeof *postings))) {
+      FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   if ((close (outfd))!=0) {
+      outfd = -1;
+      FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+   outfd = -1;
+
+   // Replaying the log over the new snapshot changes nothing, so a crash
+   // between these two is harmless.
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (dirfd, tmpname, dirfd, SRCH_FNAME))!=0) {
+      FRM_ERROR ("Failed to rename [%s] to [%s]: %m\n", tmpname, SRCH_FNAME);
+      goto cleanup;
+   }
+   if ((unlinkat (dirfd, SRCH_LOG_FNAME, 0))!=0 && errno != ENOENT) {
+      FRM_ERROR ("Failed to remove [%s]: %m\n", SRCH_LOG_FNAME);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   if (outfd >= 0) {
+      close (outfd);
+   }
+   if (error) {
+      unlinkat (dirfd, tmpname, 0);
+   }
+   free (remap);
+   free (memdoc);
+   free (docs);
+   free (table.slots);
+   free (memwords);
+   free (mempostings);
+   free (words);
+   free (text);
+   free (postings);
+   return !error;
+}
+
+// Merges the log into a new snapshot.
+static bool srch_compact (int dirfd, frm_search_live_t *live, void *arg)
+{
+   struct srch_map_t sm;
+   struct srch_docs_t mem;
+   char *data = NULL;
+   size_t len = 0;
+
+   if (!(srch_map_open (&sm, dirfd)))
+      return errno == ENOENT;
+
+   bool ret = srch_log_read (dirfd, &data, &len)
+      && srch_docs_parse (&mem, data, len);
+   if (ret) {
+      ret = srch_write (dirfd, &sm, &mem, live, arg);
+      srch_docs_free (&mem);
+   }
+
+   srch_map_close (&sm);
+   free (data);
+   return ret;
+}
+
+// Removes the snapshot and the log, so that the next search recreates
+// them from the payloads.
+static bool srch_discard (int dirfd)
+{
+   bool ret = true;
+   if ((unlinkat (dirfd, SRCH_FNAME, 0))!=0 && errno != ENOENT) {
+      FRM_ERROR ("Failed to remove [%s]: %m\n", SRCH_FNAME);
+      ret = false;
+   }
+   if ((unlinkat (dirfd, SRCH_LOG_FNAME, 0))!=0 && errno != ENOENT) {
+      FRM_ERROR ("Failed to remove [%s]: %m\n", SRCH_LOG_FNAME);
+      ret = false;
+   }
+   return ret;
+}
+
+/* ********************************************************** */
+
+bool frm_search_exists (int dirfd)
+{
+   struct stat sb;
+   return (fstatat (dirfd, SRCH_FNAME, &sb, 0))==0;
+}
+
+bool frm_search_create (int dirfd, const frm_search_batch_t *batch)
+{
+   struct srch_docs_t mem;
+   if (!(srch_docs_parse (&mem, batch->data, batch->len)))
+      return false;
+
+   bool ret = srch_write (dirfd, NULL, &mem, NULL, NULL);
+   srch_docs_free (&mem);
+   return ret;
+}
+
+bool frm_search_append (int dirfd, const frm_search_batch_t *batch,
+                        frm_search_live_t *live, void *arg)
+{
+   // Without a snapshot the next search indexes every payload anyway.
+   if (!batch || !batch->len || !(frm_search_exists (dirfd)))
+      return true;
+
+   FRM_STATS_ADD (opens, 1);
+   int fd = openat (dirfd, SRCH_LOG_FNAME,
+                    O_RDWR | O_APPEND | O_CREAT | O_BINARY | O_CLOEXEC, 0644);
+   struct stat sb;
+   if (fd < 0 || (fstat (fd, &sb))!=0) {
+      FRM_ERROR ("Failed to open [%s]: %m\n", SRCH_LOG_FNAME);
+      if (fd >= 0) {
+         close (fd);
+      }
+      return srch_discard (dirfd);
+   }
+
+   // Finish off a record that was cut short, so that it is skipped rather
+   // than joined to the first new one.
+   char last = '\n';
+   bool ret = sb.st_size == 0
+      || frm_io_read_full (fd, &last, 1, sb.st_size - 1);
+   if (ret && last != '\n') {
+      ret = frm_io_write_full (fd, "\n", 1);
+   }
+   ret = ret && frm_io_write_full (fd, batch->data, batch->len);
+   if ((close (fd))!=0) {
+      ret = false;
+   }
+
+   if (!ret) {
+      FRM_ERROR ("Failed to write [%s]: %m\n", SRCH_LOG_FNAME);
+      return srch_discard (dirfd);
+   }
+
+   if ((uint64_t)sb.st_size + batch->len > SRCH_LOG_MAX
+         && !(srch_compact (dirfd, live, arg))) {
+      return srch_discard (dirfd);
+   }
+
+   return true;
+}
+
+/* ********************************************************** */
+
+// The hits are kept in a heap with the worst one at the top.
+static bool srch_hit_worse (const struct frm_search_hit_t *lhs,
+                            const struct frm_search_hit_t *rhs)
+{
+   return lhs->score < rhs->score
+      || (lhs->score == rhs->score && lhs->id > rhs->id);
+}
+
+static int srch_hit_cmp (const void *lhs, const void *rhs)
+{
+   return srch_hit_worse (rhs, lhs) ? -1 : srch_hit_worse (lhs, rhs);
+}
+
+static void srch_heap_push (struct frm_search_hit_t *heap, size_t *nheap,
+                            size_t limit, struct frm_search_hit_t hit)
+{
+   size_t i;
+   if (*nheap < limit) {
+      // Sift up from the new leaf.
+      for (i=(*nheap)++; i > 0 && srch_hit_worse (&hit, &heap[(i - 1) / 2]);
+           i=(i - 1) / 2) {
+         heap[i] = heap[(i - 1) / 2];
+      }
+   } else {
+      // Replace the top and sift down.
+      for (i=0; 2 * i + 1 < *nheap; ) {
+         size_t child = 2 * i + 1;
+         if (child + 1 < *nheap && srch_hit_worse (&heap[child + 1], &heap[child]))
+            child++;
+         if (!(srch_hit_worse (&heap[child], &hit)))
+            break;
+         heap[i] = heap[child];
+         i = child;
+      }
+   }
+   heap[i] = hit;
+}
+
+// Adds a document to the hits if it is among the best so far and live.
+static void srch_offer (struct frm_search_hit_t *heap, size_t *nheap,
+                        size_t limit, uint64_t id, double score,
+                        frm_search_live_t *live, void *arg)
+{
+   struct frm_search_hit_t hit = { id, score };
+   if (*nheap == limit && !(srch_hit_worse (&heap[0], &hit)))
+      return;
+   if (live && !(live (arg, id)))
+      return;
+   srch_heap_push (heap, nheap, limit, hit);
+}
+
+static double srch_bm25 (double idf, uint32_t count, uint32_t len, double avglen)
+{
+   double tf = count;
+   return idf * tf * (SRCH_K1 + 1)
+      / (tf + SRCH_K1 * (1 - SRCH_B + SRCH_B * len / avglen));
+}
+
+struct frm_search_hit_t *frm_search_query (int dirfd, const char *query,
+                                           size_t limit,
+                                           frm_search_live_t *live,
+                                           void *arg, size_t *nhits)
+{
+   bool error = true;
+   struct srch_map_t sm;
+   char *lower = NULL;
+   struct srch_word_t *qwords = NULL;
+   size_t nqwords = 0;
+   char *data = NULL;
+   size_t len = 0;
+   struct srch_docs_t mem = { NULL, 0, NULL, 0 };
+   bool *replaced = NULL;
+   double *scores = NULL;
+   uint32_t *touched = NULL;
+   double *memscores = NULL;
+   uint32_t *memcounts = NULL;
+   struct frm_search_hit_t *ret = NULL;
+   size_t nret = 0;
+
+   *nhits = 0;
+   if (!(srch_map_open (&sm, dirfd)))
+      return NULL;
+
+   if (!(srch_words (query ? query : "", &lower, &qwords, &nqwords))
+         || !(srch_log_read (dirfd, &data, &len))
+         || !(srch_docs_parse (&mem, data, len)))
+      goto cleanup;
+
+   size_t ndocs = sm.hdr->ndocs;
+   if (!(replaced = calloc (ndocs + 1, sizeof *replaced))
+         || !(scores = calloc (ndocs + 1, sizeof *scores))
+         || !(touched = malloc ((ndocs + 1) * sizeof *touched))
+         || !(memscores = calloc (mem.ndocs + 1, sizeof *memscores))
+         || !(memcounts = malloc ((mem.ndocs + 1) * sizeof *memcounts))) {
+      FRM_ERROR ("OOM error allocating search scores\n");
+      goto cleanup;
+   }
+
+   // Documents in the log replace those in the snapshot.
+   uint64_t total_len = sm.hdr->total_len;
+   size_t nreplaced = 0;
+   for (size_t i=0; i<mem.ndocs; i++) {
+      size_t doc = srch_map_doc (&sm, mem.docs[i].id);
+      if (doc != SRCH_NONE) {
+         replaced[doc] = true;
+         total_len -= sm.docs[doc].len;
+         nreplaced++;
+      }
+      total_len += mem.docs[i].len;
+   }
+   double n = ndocs - nreplaced + mem.ndocs;
+   double avglen = n > 0 && total_len > 0 ? total_len / n : 1;
+
+   size_t ntouched = 0;
+   for (size_t i=0; i<nqwords; i++) {
+      if (i > 0 && (srch_word_cmp (&qwords[i - 1], &qwords[i]))==0)
+         continue;
+
+      const struct srch_word_entry_t *w = srch_map_find (&sm, qwords[i].str,
+                                                         qwords[i].len);
+      const struct srch_posting_t *postings = w ? &sm.postings[w->start] : NULL;
+      size_t npostings = w ? w->count : 0;
+
+      size_t count = 0;
+      for (size_t j=0; j<npostings; j++) {
+         count += postings[j].doc < ndocs && !replaced[postings[j].doc];
+      }
+      for (size_t j=0; j<mem.ndocs; j++) {
+         const struct srch_word_t *mw = &mem.words[mem.docs[j].first];
+         memcounts[j] = 0;
+         for (size_t k=0; k<mem.docs[j].nwords; k++) {
+            if ((srch_word_cmp (&mw[k], &qwords[i]))==0) {
+               memcounts[j] = mw[k].count;
+               count++;
+               break;
+            }
+         }
+      }
+      if (!count)
+         continue;
+
+      double idf = log (1 + (n - count + 0.5) / (count + 0.5));
+      for (size_t j=0; j<npostings; j++) {
+         uint32_t doc = postings[j].doc;
+         if (doc >= ndocs || replaced[doc])
+            continue;
+         if (scores[doc] == 0) {
+            touched[ntouched++] = doc;
+         }
+         scores[doc] += srch_bm25 (idf, postings[j].count, sm.docs[doc].len, avglen);
+      }
+      for (size_t j=0; j<mem.ndocs; j++) {
+         if (memcounts[j]) {
+            memscores[j] += srch_bm25 (idf, memcounts[j], mem.docs[j].len, avglen);
+         }
+      }
+   }
+
+   size_t nmatches = ntouched;
+   for (size_t i=0; i<mem.ndocs; i++) {
+      nmatches += memscores[i] > 0;
+   }
+   if (!limit || limit > nmatches) {
+      limit = nmatches;
+   }
+   if (!(ret = malloc ((limit + 1) * sizeof *ret))) {
+      FRM_ERROR ("OOM error allocating search hits\n");
+      goto cleanup;
+   }
+
+   for (size_t i=0; limit && i<ntouched; i++) {
+      srch_offer (ret, &nret, limit, sm.docs[touched[i]].id, scores[touched[i]],
+                  live, arg);
+   }
+   for (size_t i=0; limit && i<mem.ndocs; i++) {
+      if (memscores[i] > 0) {
+         srch_offer (ret, &nret, limit, mem.docs[i].id, memscores[i], live, arg);
+      }
+   }
+   qsort (ret, nret, sizeof *ret, srch_hit_cmp);
+
+   *nhits = nret;
+   error = false;
+
+cleanup:
+   if (error) {
+      free (ret);
+      ret = NULL;
+   }
+   srch_map_close (&sm);
+   srch_docs_free (&mem);
+   free (lower);
+   free (qwords);
+   free (data);
+   free (replaced);
+   free (scores);
+   free (touched);
+   free (memscores);
+   free (memcounts);
+   return ret;
+}
+
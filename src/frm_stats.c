@@ -0,0 +1,193 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "frm.h"
+#include "frm_stats.h"
+
+struct frm_stats_table_t {
+   pthread_mutex_t lock;
+   bool enabled;
+
+   // In the order in which the functions were first called.
+   frm_stats_t *entries;
+   size_t nentries;
+   size_t cap;
+};
+
+// The call being counted in this thread.
+struct stats_call_t {
+   frm_stats_table_t *table;
+   size_t depth;
+   uint64_t start;
+   int64_t heap;
+   frm_stats_t counts;
+};
+
+__thread frm_stats_t *frm_stats_active = NULL;
+static __thread struct stats_call_t g_call;
+
+/* ********************************************************** */
+
+static uint64_t stats_now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The number of heap bytes in use by the process. mallinfo2() walks every
+// arena, so this is only called at the start and end of the outermost
+// counted call, and only while counting is enabled.
+static int64_t stats_heap (void)
+{
+#if defined (__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+   struct mallinfo2 mi = mallinfo2 ();
+   return (int64_t)(mi.uordblks + mi.hblkhd);
+#else
+   return 0;
+#endif
+}
+
+static frm_stats_t *stats_find (frm_stats_table_t *table, const char *fname)
+{
+   for (size_t i=0; i<table->nentries; i++) {
+      if (table->entries[i].fname == fname
+            || (strcmp (table->entries[i].fname, fname))==0)
+         return &table->entries[i];
+   }
+
+   if (table->nentries == table->cap) {
+      size_t newcap = table->cap ? table->cap * 2 : 32;
+      frm_stats_t *tmp = realloc (table->entries, newcap * sizeof *tmp);
+      if (!tmp) {
+         FRM_ERROR ("OOM error allocating stats for [%s]\n", fname);
+         return NULL;
+      }
+      table->entries = tmp;
+      table->cap = newcap;
+   }
+
+   frm_stats_t *ret = &table->entries[table->nentries++];
+   memset (ret, 0, sizeof *ret);
+   ret->fname = fname;
+   return ret;
+}
+
+/* ********************************************************** */
+
+frm_stats_table_t *frm_stats_table_new (void)
+{
+   frm_stats_table_t *ret = calloc (1, sizeof *ret);
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating stats\n");
+      return NULL;
+   }
+   pthread_mutex_init (&ret->lock, NULL);
+   return ret;
+}
+
+void frm_stats_table_del (frm_stats_table_t *table)
+{
+   if (!table)
+      return;
+
+   pthread_mutex_destroy (&table->lock);
+   free (table->entries);
+   free (table);
+}
+
+void frm_stats_table_enable (frm_stats_table_t *table, bool enable)
+{
+   if (table) {
+      __atomic_store_n (&table->enabled, enable, __ATOMIC_RELAXED);
+   }
+}
+
+frm_stats_t *frm_stats_table_get (frm_stats_table_t *table)
+{
+   if (!table)
+      return calloc (1, sizeof (frm_stats_t));
+
+   pthread_mutex_lock (&table->lock);
+   frm_stats_t *ret = calloc (table->nentries + 1, sizeof *ret);
+   if (ret && table->nentries) {
+      memcpy (ret, table->entries, table->nentries * sizeof *ret);
+   }
+   pthread_mutex_unlock (&table->lock);
+
+   if (!ret) {
+      FRM_ERROR ("OOM error allocating stats\n");
+   }
+   return ret;
+}
+
+void frm_stats_table_reset (frm_stats_table_t *table)
+{
+   if (!table)
+      return;
+
+   pthread_mutex_lock (&table->lock);
+   table->nentries = 0;
+   pthread_mutex_unlock (&table->lock);
+}
+
+void frm_stats_begin (frm_stats_table_t *table, const char *fname)
+{
+   if (g_call.depth) {
+      g_call.depth++;
+      return;
+   }
+   if (!table || !(__atomic_load_n (&table->enabled, __ATOMIC_RELAXED)))
+      return;
+
+   memset (&g_call, 0, sizeof g_call);
+   g_call.table = table;
+   g_call.depth = 1;
+   g_call.counts.fname = fname;
+   g_call.heap = stats_heap ();
+   g_call.start = stats_now ();
+   frm_stats_active = &g_call.counts;
+}
+
+void frm_stats_end (void)
+{
+   if (!g_call.depth || --g_call.depth > 0)
+      return;
+
+   frm_stats_active = NULL;
+   g_call.counts.nsecs = stats_now () - g_call.start;
+   g_call.counts.heap_bytes = stats_heap () - g_call.heap;
+
+   const frm_stats_t *src = &g_call.counts;
+   pthread_mutex_lock (&g_call.table->lock);
+   frm_stats_t *dst = stats_find (g_call.table, src->fname);
+   if (dst) {
+      dst->calls++;
+      dst->nsecs += src->nsecs;
+      dst->opens += src->opens;
+      dst->readdirs += src->readdirs;
+      dst->renames += src->renames;
+      dst->bytes_read += src->bytes_read;
+      dst->bytes_written += src->bytes_written;
+      dst->heap_bytes += src->heap_bytes;
+   }
+   pthread_mutex_unlock (&g_call.table->lock);
+}
@@ -0,0 +1,81 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_STATS
+#define H_FRM_STATS
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Counters of the work done by the public functions on a framedb handle
+ * (see frm_stats_enable() in frm.h), one entry per function. The counts
+ * are of the work done by the thread that made the call; frm_grep()
+ * reads the payloads in other threads, which are not counted.
+ */
+typedef struct frm_stats_t {
+   const char *fname;         // The function, NULL in the last entry
+   uint64_t calls;
+   uint64_t nsecs;            // Wall time, including waiting for locks
+
+   uint64_t opens;            // Files and directories opened
+   uint64_t readdirs;         // Directory entries read
+   uint64_t renames;
+   uint64_t bytes_read;       // By read() and stdio, not through mmap()
+   uint64_t bytes_written;
+
+   // The change in the number of heap bytes in use by the whole process
+   // over the call, from mallinfo2(): what the function allocated and did
+   // not free, including what it returns, plus whatever other threads
+   // allocated or freed meanwhile. It is not a count of allocations; the
+   // library allocates with the C library directly, so there is nowhere
+   // to count them. Always 0 where the C library cannot report it.
+   int64_t heap_bytes;
+} frm_stats_t;
+
+/* The table of counters kept by each handle, and the functions that the
+ * library uses to fill it in. While a call is counted frm_stats_active
+ * points to its counters, and is NULL otherwise, so a counter costs a
+ * single test when counting is off.
+ */
+typedef struct frm_stats_table_t frm_stats_table_t;
+
+extern __thread frm_stats_t *frm_stats_active;
+
+#define FRM_STATS_ADD(field,n)      do {\
+   if (frm_stats_active)\
+      frm_stats_active->field += (n);\
+} while (0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   frm_stats_table_t *frm_stats_table_new (void);
+   void frm_stats_table_del (frm_stats_table_t *table);
+   void frm_stats_table_enable (frm_stats_table_t *table, bool enable);
+
+   // Returns a copy of the counters, ending with an entry whose fname is
+   // NULL, or NULL if there is not enough memory.
+   frm_stats_t *frm_stats_table_get (frm_stats_table_t *table);
+   void frm_stats_table_reset (frm_stats_table_t *table);
+
+   // Start and end counting a call to the function fname, which must
+   // outlive the table. Calls made while another is counted in the same
+   // thread are counted as part of it. table may be NULL. Each call to
+   // frm_stats_begin() must be matched by one to frm_stats_end().
+   void frm_stats_begin (frm_stats_table_t *table, const char *fname);
+   void frm_stats_end (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,225 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "frm.h"
+#include "frm_trace.h"
+
+#define TRACE_BUFSZ        (64 * 1024)
+#define TRACE_EVENTSZ      (256)
+#define TRACE_DEPTH        (16)
+
+struct trace_t {
+   pthread_mutex_t lock;
+   int fd;                    // -1 when tracing is off
+   uint64_t epoch;            // Timestamps are written relative to this
+   size_t nevents;
+   size_t len;
+   char buf[TRACE_BUFSZ];
+};
+
+static struct trace_t g_trace = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .fd = -1,
+};
+static bool g_trace_on = false;
+static bool g_trace_atexit = false;
+
+static __thread struct frm_trace_span_t g_stack[TRACE_DEPTH];
+static __thread size_t g_depth = 0;
+static __thread pid_t g_tid = 0;
+
+/* ********************************************************** */
+
+static uint64_t trace_now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called with trace->lock held.
+static bool trace_flush (struct trace_t *trace)
+{
+   size_t off = 0;
+   while (off < trace->len) {
+      ssize_t n = write (trace->fd, &trace->buf[off], trace->len - off);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0) {
+         FRM_ERROR ("Failed to write trace: %m\n");
+         trace->len = 0;
+         return false;
+      }
+      off += n;
+   }
+   trace->len = 0;
+   return true;
+}
+
+// Called with trace->lock held.
+static void trace_append (struct trace_t *trace, const char *s, size_t len)
+{
+   if (trace->len + len > sizeof trace->buf) {
+      trace_flush (trace);
+   }
+   memcpy (&trace->buf[trace->len], s, len);
+   trace->len += len;
+}
+
+static void trace_event (const char *name, uint64_t start, uint64_t end)
+{
+   struct trace_t *trace = &g_trace;
+
+   if (!g_tid) {
+      g_tid = syscall (SYS_gettid);
+   }
+
+   char event[TRACE_EVENTSZ];
+   uint64_t ts = start > trace->epoch ? start - trace->epoch : 0;
+   uint64_t dur = end - start;
+   int len = snprintf (event, sizeof event,
+         ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+         "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+         "\"pid\":%i,\"tid\":%i}",
+         name, strncmp (name, "frm_", 4) == 0 ? "api" : "internal",
+         ts / 1000, (unsigned)(ts % 1000),
+         dur / 1000, (unsigned)(dur % 1000),
+         (int)getpid (), (int)g_tid);
+   if (len < 0 || (size_t)len >= sizeof event)
+      return;
+
+   pthread_mutex_lock (&trace->lock);
+   // Tracing may have stopped since the span ended.
+   if (trace->fd >= 0) {
+      // The first event has no separator before it.
+      size_t skip = trace->nevents++ ? 0 : 1;
+      trace_append (trace, &event[skip], len - skip);
+   }
+   pthread_mutex_unlock (&trace->lock);
+}
+
+static void trace_atexit (void)
+{
+   frm_trace_stop ();
+}
+
+static void trace_from_env (void)
+{
+   const char *fname = getenv ("FRM_TRACE");
+   if (fname && fname[0]) {
+      frm_trace_start (fname);
+   }
+}
+
+/* ********************************************************** */
+
+uint64_t frm_trace_begin (void)
+{
+   if (!(__atomic_load_n (&g_trace_on, __ATOMIC_RELAXED)))
+      return 0;
+
+   return trace_now ();
+}
+
+void frm_trace_span_end (struct frm_trace_span_t *span)
+{
+   if (!span->start || !(__atomic_load_n (&g_trace_on, __ATOMIC_RELAXED)))
+      return;
+
+   trace_event (span->name, span->start, trace_now ());
+}
+
+void frm_trace_push (const char *name)
+{
+   if (g_depth < TRACE_DEPTH) {
+      g_stack[g_depth].name = name;
+      g_stack[g_depth].start = frm_trace_begin ();
+   }
+   g_depth++;
+}
+
+void frm_trace_pop (void)
+{
+   if (!g_depth)
+      return;
+
+   if (--g_depth < TRACE_DEPTH) {
+      frm_trace_span_end (&g_stack[g_depth]);
+   }
+}
+
+void frm_trace_from_env (void)
+{
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   pthread_once (&once, trace_from_env);
+}
+
+bool frm_trace_start (const char *fname)
+{
+   bool error = true;
+   struct trace_t *trace = &g_trace;
+
+   pthread_mutex_lock (&trace->lock);
+
+   if (trace->fd >= 0) {
+      FRM_ERROR ("Tracing already started\n");
+      goto cleanup;
+   }
+
+   trace->fd = open (fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (trace->fd < 0) {
+      FRM_ERROR ("Failed to create trace file [%s]: %m\n", fname);
+      goto cleanup;
+   }
+   trace->epoch = trace_now ();
+   trace->nevents = 0;
+   trace->len = 0;
+   trace_append (trace, "[", 1);
+
+   if (!g_trace_atexit) {
+      atexit (trace_atexit);
+      g_trace_atexit = true;
+   }
+
+   __atomic_store_n (&g_trace_on, true, __ATOMIC_RELAXED);
+   error = false;
+
+cleanup:
+   pthread_mutex_unlock (&trace->lock);
+   return !error;
+}
+
+void frm_trace_stop (void)
+{
+   struct trace_t *trace = &g_trace;
+
+   pthread_mutex_lock (&trace->lock);
+   if (trace->fd >= 0) {
+      // Spans that are still open when tracing stops are dropped.
+      __atomic_store_n (&g_trace_on, false, __ATOMIC_RELAXED);
+      trace_append (trace, "\n]\n", 3);
+      trace_flush (trace);
+      close (trace->fd);
+      trace->fd = -1;
+   }
+   pthread_mutex_unlock (&trace->lock);
+}
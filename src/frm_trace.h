@@ -0,0 +1,63 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+
+#ifndef H_FRM_TRACE
+#define H_FRM_TRACE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Tracing of the library calls, written as trace events that can be
+ * loaded into chrome://tracing or https://ui.perfetto.dev (see
+ * frm_trace_start() in frm.h). Each span is written as one complete
+ * event when it ends, with the time it started and how long it took.
+ * The events are gathered in a buffer that is written out when it is
+ * full and when tracing stops.
+ *
+ * Spans are made in two ways. A span that covers a whole function is
+ * declared at the top of the function with FRM_TRACE_SPAN(), and ends
+ * when the function returns. A span that starts and ends in different
+ * functions, such as a lock and unlock, uses frm_trace_push() and
+ * frm_trace_pop(), which keep the spans in a per-thread stack.
+ *
+ * When tracing is off each span costs a test of a global flag.
+ */
+
+struct frm_trace_span_t {
+   const char *name;
+   uint64_t start;         // 0 if tracing was off when the span began
+};
+
+#define FRM_TRACE_SPAN(name)\
+   struct frm_trace_span_t frm_trace_span\
+      __attribute__ ((cleanup (frm_trace_span_end))) = { name, frm_trace_begin () }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns the start of a span, or 0 if tracing is off.
+   uint64_t frm_trace_begin (void);
+   void frm_trace_span_end (struct frm_trace_span_t *span);
+
+   // name must be a string literal.
+   void frm_trace_push (const char *name);
+   void frm_trace_pop (void);
+
+   // Starts tracing to the file named by $FRM_TRACE, if it is set, the
+   // first time it is called.
+   void frm_trace_from_env (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
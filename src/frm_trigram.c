@@ -0,0 +1,941 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "frm.h"
+#include "frm_stats.h"
+#include "frm_trigram.h"
+#include "frm_io.h"
+#include "frm_scan.h"
+#include "ds_str.h"
+
+/* The snapshot is a header, a copy of the text of the sorted index, the
+ * offset of each line in that text, the table of trigrams sorted by key
+ * and the posting lists, which hold the line numbers of the paths that
+ * contain each trigram in ascending order. Fields are stored in host
+ * byte order.
+ *
+ * The log is text with one change per line: "+path" for an added path,
+ * "-path" for a path that was removed with everything below it, and
+ * "=ino size sec nsec" after each change, which identifies the sorted
+ * index that the change produced. A log that does not end with an
+ * identity line was interrupted, and is discarded.
+ */
+
+#define TRI_MAGIC          (0x49525446)
+#define TRI_VERSION        (1)
+#define TRI_FNAME          "index.trigram"
+#define TRI_LOG_FNAME      "index.trigram.log"
+
+// The log is discarded, so that the next search rebuilds the snapshot,
+// once it is larger than this plus a quarter of the size of the index.
+#define TRI_LOG_MIN        (64 * 1024)
+
+#define TRI_NONE           ((uint32_t)-1)
+#define TRI_INITIAL_SLOTS  (4096)
+
+struct tri_ident_t {
+   uint64_t ino;
+   uint64_t size;
+   uint64_t sec;
+   uint64_t nsec;
+};
+
+struct tri_header_t {
+   uint32_t magic;
+   uint32_t version;
+   struct tri_ident_t ident;  // The sorted index this is a snapshot of
+   uint64_t text;             // Offset of the copy of the sorted index
+   uint64_t text_len;
+   uint64_t lines;            // Offset of nlines + 1 line offsets
+   uint64_t nlines;
+   uint64_t trigrams;         // Offset of the trigram table
+   uint64_t ntrigrams;
+   uint64_t postings;         // Offset of the posting lists
+   uint64_t npostings;
+};
+
+struct tri_entry_t {
+   uint32_t key;
+   uint32_t count;
+   uint64_t start;            // Index of the first posting
+};
+
+struct tri_map_t {
+   int fd;
+   char *base;
+   size_t size;
+   const struct tri_header_t *hdr;
+   const char *text;
+   const uint32_t *lines;
+   const struct tri_entry_t *trigrams;
+   const uint32_t *postings;
+};
+
+struct tri_log_t {
+   char *data;
+   char **added;
+   size_t nadded;
+   char **removed;
+   size_t nremoved;
+   bool have_ident;
+   struct tri_ident_t ident;
+};
+
+/* ********************************************************** */
+
+static uint64_t tri_align (uint64_t value)
+{
+   return (value + 7) & ~(uint64_t)7;
+}
+
+static uint32_t tri_key (const char *s)
+{
+   return ((uint32_t)(unsigned char)s[0] << 16)
+        | ((uint32_t)(unsigned char)s[1] << 8)
+        | (uint32_t)(unsigned char)s[2];
+}
+
+static void tri_ident (struct tri_ident_t *dst, const struct stat *sb)
+{
+   dst->ino = sb->st_ino;
+   dst->size = sb->st_size;
+   dst->sec = sb->st_mtim.tv_sec;
+   dst->nsec = sb->st_mtim.tv_nsec;
+}
+
+static bool tri_ident_eq (const struct tri_ident_t *lhs,
+                          const struct tri_ident_t *rhs)
+{
+   return lhs->ino == rhs->ino && lhs->size == rhs->size
+      && lhs->sec == rhs->sec && lhs->nsec == rhs->nsec;
+}
+
+static bool tri_ident_parse (struct tri_ident_t *dst, const char *line)
+{
+   return line[0] == '='
+      && (sscanf (&line[1], "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+                  &dst->ino, &dst->size, &dst->sec, &dst->nsec))==4;
+}
+
+// Returns true if path, of length plen, is removed or below removed.
+static bool tri_covers (const char *removed, const char *path, size_t plen)
+{
+   size_t rlen = strlen (removed);
+   return plen >= rlen && (memcmp (path, removed, rlen))==0
+      && (plen == rlen || path[rlen] == '/');
+}
+
+// Removes the snapshot and the log. The next search rebuilds them.
+static bool tri_discard (int dirfd)
+{
+   bool ret = true;
+   if ((unlinkat (dirfd, TRI_FNAME, 0))!=0 && errno != ENOENT) {
+      FRM_ERROR ("Failed to remove [%s]: %m\n", TRI_FNAME);
+      ret = false;
+   }
+   if ((unlinkat (dirfd, TRI_LOG_FNAME, 0))!=0 && errno != ENOENT) {
+      FRM_ERROR ("Failed to remove [%s]: %m\n", TRI_LOG_FNAME);
+      ret = false;
+   }
+   return ret;
+}
+
+/* ********************************************************** */
+
+/* Building a snapshot counts the lines containing each trigram in one
+ * pass over the index, and fills in the posting lists in a second. The
+ * trigrams are kept in an open-addressed hash table while building.
+ */
+
+struct tri_slot_t {
+   uint32_t key;        // TRI_NONE for an empty slot
+   uint32_t count;
+   uint32_t last;       // The last line counted or filled in
+   uint32_t fill;
+   uint64_t start;
+};
+
+struct tri_table_t {
+   struct tri_slot_t *slots;
+   size_t nslots;
+   size_t nused;
+};
+
+static struct tri_slot_t *tri_table_find (struct tri_table_t *table,
+                                          uint32_t key)
+{
+   size_t mask = table->nslots - 1;
+   for (size_t i=(key * 0x9e3779b1u) & mask; ; i=(i + 1) & mask) {
+      if (table->slots[i].key == key || table->slots[i].key == TRI_NONE)
+         return &table->slots[i];
+   }
+}
+
+static bool tri_table_grow (struct tri_table_t *table)
+{
+   size_t nslots = table->nslots ? table->nslots * 2 : TRI_INITIAL_SLOTS;
+   struct tri_slot_t *slots = malloc (nslots * sizeof *slots);
+   if (!slots) {
+      FRM_ERROR ("OOM error allocating trigram table\n");
+      return false;
+   }
+   for (size_t i=0; i<nslots; i++) {
+      slots[i].key = TRI_NONE;
+   }
+
+   struct tri_table_t grown = { slots, nslots, table->nused };
+   for (size_t i=0; i<table->nslots; i++) {
+      if (table->slots[i].key != TRI_NONE) {
+         *tri_table_find (&grown, table->slots[i].key) = table->slots[i];
+      }
+   }
+   free (table->slots);
+   *table = grown;
+   return true;
+}
+
+static struct tri_slot_t *tri_table_add (struct tri_table_t *table,
+                                         uint32_t key)
+{
+   if ((table->nused + 1) * 2 > table->nslots && !(tri_table_grow (table)))
+      return NULL;
+
+   struct tri_slot_t *ret = tri_table_find (table, key);
+   if (ret->key == TRI_NONE) {
+      ret->key = key;
+      ret->count = 0;
+      ret->last = TRI_NONE;
+      ret->fill = 0;
+      ret->start = 0;
+      table->nused++;
+   }
+   return ret;
+}
+
+static int tri_entry_cmp (const void *lhs, const void *rhs)
+{
+   const struct tri_entry_t *l = lhs;
+   const struct tri_entry_t *r = rhs;
+   return l->key < r->key ? -1 : l->key > r->key;
+}
+
+static size_t tri_line_len (const char *text, const uint32_t *lines, size_t i)
+{
+   size_t len = lines[i + 1] - lines[i];
+   return len && text[lines[i] + len - 1] == '\n' ? len - 1 : len;
+}
+
+static bool tri_write_padded (int fd, const void *src, size_t len)
+{
+   static const char zeros[8];
+   return frm_io_write_full (fd, src, len)
+      && frm_io_write_full (fd, zeros, tri_align (len) - len);
+}
+
+// Builds a snapshot of the sorted index and puts it in place of the
+// current one, which is discarded along with the log.
+static bool tri_build (int dirfd, const char *index_fname)
+{
+   bool error = true;
+   int fd = -1;
+   int outfd = -1;
+   char *text = MAP_FAILED;
+   size_t text_len = 0;
+   uint32_t *lines = NULL;
+   struct tri_table_t table = { NULL, 0, 0 };
+   struct tri_entry_t *entries = NULL;
+   uint32_t *postings = NULL;
+   struct tri_header_t hdr;
+   char tmpname[64];
+   static unsigned int counter = 0;
+
+   snprintf (tmpname, sizeof tmpname, "%s-%li-%u.tmp", TRI_FNAME,
+             (long)getpid (), __sync_fetch_and_add (&counter, 1));
+
+   struct stat sb;
+   FRM_STATS_ADD (opens, 1);
+   if ((fd = openat (dirfd, index_fname, O_RDONLY | O_BINARY | O_CLOEXEC)) < 0
+         || (fstat (fd, &sb))!=0) {
+      FRM_ERROR ("Error: failed to read index [%s]: %m\n", index_fname);
+      goto cleanup;
+   }
+
+   if ((uint64_t)sb.st_size >= TRI_NONE) {
+      FRM_ERROR ("Error: index [%s] is too large for a trigram index\n",
+                 index_fname);
+      errno = EFBIG;
+      goto cleanup;
+   }
+
+   text_len = sb.st_size;
+   if (text_len && (text = mmap (NULL, text_len, PROT_READ, MAP_SHARED, fd, 0))
+                     == MAP_FAILED) {
+      FRM_ERROR ("Error: failed to map index [%s]: %m\n", index_fname);
+      goto cleanup;
+   }
+
+   size_t nlines = 0;
+   for (size_t i=0; i<text_len; nlines++) {
+      const char *eol = memchr (&text[i], '\n', text_len - i);
+      i = eol ? (size_t)(eol - text) + 1 : text_len;
+   }
+
+   if (!(lines = malloc ((nlines + 1) * sizeof *lines))) {
+      FRM_ERROR ("OOM error allocating trigram index lines\n");
+      goto cleanup;
+   }
+   nlines = 0;
+   for (size_t i=0; i<text_len; nlines++) {
+      lines[nlines] = i;
+      const char *eol = memchr (&text[i], '\n', text_len - i);
+      i = eol ? (size_t)(eol - text) + 1 : text_len;
+   }
+   lines[nlines] = text_len;
+
+   // Count the lines each trigram appears in, once per line.
+   for (size_t i=0; i<nlines; i++) {
+      const char *line = &text[lines[i]];
+      size_t len = tri_line_len (text, lines, i);
+      for (size_t j=0; j + FRM_TRIGRAM_MIN <= len; j++) {
+         struct tri_slot_t *slot = tri_table_add (&table, tri_key (&line[j]));
+         if (!slot)
+            goto cleanup;
+         if (slot->last != i) {
+            slot->last = i;
+            slot->count++;
+         }
+      }
+   }
+
+   size_t ntrigrams = 0;
+   if (!(entries = malloc ((table.nused + 1) * sizeof *entries))) {
+      FRM_ERROR ("OOM error allocating trigram table\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<table.nslots; i++) {
+      if (table.slots[i].key != TRI_NONE) {
+         entries[ntrigrams].key = table.slots[i].key;
+         entries[ntrigrams].count = table.slots[i].count;
+         ntrigrams++;
+      }
+   }
+   qsort (entries, ntrigrams, sizeof *entries, tri_entry_cmp);
+
+   uint64_t npostings = 0;
+   for (size_t i=0; i<ntrigrams; i++) {
+      struct tri_slot_t *slot = tri_table_find (&table, entries[i].key);
+      entries[i].start = slot->start = npostings;
+      slot->last = TRI_NONE;
+      npostings += entries[i].count;
+   }
+
+   if (!(postings = malloc ((npostings + 1) * sizeof *postings))) {
+      FRM_ERROR ("OOM error allocating trigram posting lists\n");
+      goto cleanup;
+   }
+
+   // Lines are visited in order, so each posting list comes out sorted.
+   for (size_t i=0; i<nlines; i++) {
+      const char *line = &text[lines[i]];
+      size_t len = tri_line_len (text, lines, i);
+      for (size_t j=0; j + FRM_TRIGRAM_MIN <= len; j++) {
+         struct tri_slot_t *slot = tri_table_find (&table, tri_key (&line[j]));
+         if (slot->last != i) {
+            slot->last = i;
+            postings[slot->start + slot->fill++] = i;
+         }
+      }
+   }
+
+   memset (&hdr, 0, sizeof hdr);
+   hdr.magic = TRI_MAGIC;
+   hdr.version = TRI_VERSION;
+   tri_ident (&hdr.ident, &sb);
+   hdr.text = tri_align (sizeof hdr);
+   hdr.text_len = text_len;
+   hdr.lines = hdr.text + tri_align (text_len);
+   hdr.nlines = nlines;
+   hdr.trigrams = hdr.lines + tri_align ((nlines + 1) * sizeof *lines);
+   hdr.ntrigrams = ntrigrams;
+   hdr.postings = hdr.trigrams + ntrigrams * sizeof *entries;
+   hdr.npostings = npostings;
+
+   FRM_STATS_ADD (opens, 1);
+   outfd = openat (dirfd, tmpname,
+                   O_WRONLY | O_CREAT | O_EXCL | O_BINARY | O_CLOEXEC, 0644);
+   if (outfd < 0
+         || !(tri_write_padded (outfd, &hdr, sizeof hdr))
+         || !(tri_write_padded (outfd, text_len ? text : "", text_len))
+         || !(tri_write_padded (outfd, lines, (nlines + 1) * sizeof *lines))
+         || !(frm_io_write_full (outfd, entries, ntrigrams * sizeof *entries))
+         || !(frm_io_write_full (outfd, postings, npostings * sizeof *postings))) {
+      FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+
+   if ((close (outfd))!=0) {
+      outfd = -1;
+      FRM_ERROR ("Failed to write [%s]: %m\n", tmpname);
+      goto cleanup;
+   }
+   outfd = -1;
+
+   // Without the log an old snapshot does not match the index, so a crash
+   // between these two leaves nothing that can be mistaken for current.
+   if ((unlinkat (dirfd, TRI_LOG_FNAME, 0))!=0 && errno != ENOENT) {
+      FRM_ERROR ("Failed to remove [%s]: %m\n", TRI_LOG_FNAME);
+      goto cleanup;
+   }
+
+   FRM_STATS_ADD (renames, 1);
+   if ((renameat (dirfd, tmpname, dirfd, TRI_FNAME))!=0) {
+      FRM_ERROR ("Failed to rename [%s] to [%s]: %m\n", tmpname, TRI_FNAME);
+      goto cleanup;
+   }
+
+   error = false;
+
+cleanup:
+   if (outfd >= 0) {
+      close (outfd);
+   }
+   if (error) {
+      unlinkat (dirfd, tmpname, 0);
+   }
+   if (text != MAP_FAILED) {
+      munmap (text, text_len);
+   }
+   if (fd >= 0) {
+      close (fd);
+   }
+   free (lines);
+   free (table.slots);
+   free (entries);
+   free (postings);
+   return !error;
+}
+
+/* ********************************************************** */
+
+static void tri_map_close (struct tri_map_t *tm)
+{
+   if (tm->base) {
+      munmap (tm->base, tm->size);
+   }
+   if (tm->fd >= 0) {
+      close (tm->fd);
+   }
+   memset (tm, 0, sizeof *tm);
+   tm->fd = -1;
+}
+
+// Maps the snapshot. A missing snapshot is not reported, as the caller
+// builds one.
+static bool tri_map_open (struct tri_map_t *tm, int dirfd)
+{
+   memset (tm, 0, sizeof *tm);
+   FRM_STATS_ADD (opens, 1);
+   if ((tm->fd = openat (dirfd, TRI_FNAME, O_RDONLY | O_BINARY | O_CLOEXEC)) < 0) {
+      if (errno != ENOENT) {
+         FRM_ERROR ("Failed to open [%s]: %m\n", TRI_FNAME);
+      }
+      return false;
+   }
+
+   struct stat sb;
+   if ((fstat (tm->fd, &sb))!=0 || (size_t)sb.st_size < sizeof *tm->hdr) {
+      FRM_ERROR ("Error: [%s] is not a trigram index\n", TRI_FNAME);
+      tri_map_close (tm);
+      return false;
+   }
+
+   tm->size = sb.st_size;
+   tm->base = mmap (NULL, tm->size, PROT_READ, MAP_SHARED, tm->fd, 0);
+   if (tm->base == MAP_FAILED) {
+      FRM_ERROR ("Failed to map [%s]: %m\n", TRI_FNAME);
+      tm->base = NULL;
+      tri_map_close (tm);
+      return false;
+   }
+
+   const struct tri_header_t *hdr = (const struct tri_header_t *)tm->base;
+   if (hdr->magic != TRI_MAGIC || hdr->version != TRI_VERSION
+         || hdr->text + hdr->text_len > tm->size
+         || hdr->lines + (hdr->nlines + 1) * sizeof *tm->lines > tm->size
+         || hdr->trigrams + hdr->ntrigrams * sizeof *tm->trigrams > tm->size
+         || hdr->postings + hdr->npostings * sizeof *tm->postings > tm->size) {
+      FRM_ERROR ("Error: [%s] is not a trigram index\n", TRI_FNAME);
+      tri_map_close (tm);
+      return false;
+   }
+
+   tm->hdr = hdr;
+   tm->text = tm->base + hdr->text;
+   tm->lines = (const uint32_t *)(tm->base + hdr->lines);
+   tm->trigrams = (const struct tri_entry_t *)(tm->base + hdr->trigrams);
+   tm->postings = (const uint32_t *)(tm->base + hdr->postings);
+   return true;
+}
+
+static const struct tri_entry_t *tri_map_find (const struct tri_map_t *tm,
+                                               uint32_t key)
+{
+   size_t lo = 0, hi = tm->hdr->ntrigrams;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (tm->trigrams[mid].key < key) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo < tm->hdr->ntrigrams && tm->trigrams[lo].key == key
+      ? &tm->trigrams[lo]
+      : NULL;
+}
+
+// Compares the start of line i with prefix: negative if the line sorts
+// before every path starting with prefix, zero if it starts with prefix
+// and positive if it sorts after them.
+static int tri_map_prefixcmp (const struct tri_map_t *tm, size_t i,
+                              const char *prefix, size_t plen)
+{
+   size_t len = tri_line_len (tm->text, tm->lines, i);
+   int cmp = memcmp (&tm->text[tm->lines[i]], prefix, len < plen ? len : plen);
+   return cmp ? cmp : len < plen ? -1 : 0;
+}
+
+// Returns the first line at which cmp is at least 'at'.
+static size_t tri_map_bound (const struct tri_map_t *tm, const char *prefix,
+                             size_t plen, int at)
+{
+   size_t lo = 0, hi = tm->hdr->nlines;
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      int cmp = tri_map_prefixcmp (tm, mid, prefix, plen);
+      if ((cmp < 0 ? -1 : cmp > 0) < at) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+// Returns the first posting in [from, to) that is not less than line.
+static size_t tri_postings_bound (const uint32_t *postings, size_t from,
+                                  size_t to, uint32_t line)
+{
+   while (from < to) {
+      size_t mid = from + (to - from) / 2;
+      if (postings[mid] < line) {
+         from = mid + 1;
+      } else {
+         to = mid;
+      }
+   }
+   return from;
+}
+
+/* ********************************************************** */
+
+static void tri_log_free (struct tri_log_t *log)
+{
+   free (log->data);
+   free (log->added);
+   free (log->removed);
+   memset (log, 0, sizeof *log);
+}
+
+static bool tri_log_push (char ***array, size_t *len, char *s)
+{
+   // Grow in powers of two.
+   if ((*len & (*len - 1))==0) {
+      char **tmp = realloc (*array, (*len ? *len * 2 : 1) * sizeof *tmp);
+      if (!tmp) {
+         FRM_ERROR ("OOM error reading trigram log\n");
+         return false;
+      }
+      *array = tmp;
+   }
+   (*array)[(*len)++] = s;
+   return true;
+}
+
+// Reads and replays the log: paths that were added, and not removed
+// later, end up in log->added, and every removed path in log->removed.
+// A missing log is empty. Returns false if the log cannot be used.
+static bool tri_log_read (struct tri_log_t *log, int dirfd)
+{
+   memset (log, 0, sizeof *log);
+
+   FRM_STATS_ADD (opens, 1);
+   int fd = openat (dirfd, TRI_LOG_FNAME, O_RDONLY | O_BINARY | O_CLOEXEC);
+   if (fd < 0) {
+      return errno == ENOENT;
+   }
+
+   struct stat sb;
+   bool ret = (fstat (fd, &sb))==0
+      && (log->data = malloc (sb.st_size + 1))
+      && frm_io_read_full (fd, log->data, sb.st_size, 0);
+   close (fd);
+   if (!ret) {
+      FRM_ERROR ("Failed to read [%s]: %m\n", TRI_LOG_FNAME);
+      tri_log_free (log);
+      return false;
+   }
+   log->data[sb.st_size] = 0;
+
+   char *line = log->data;
+   while (ret && *line) {
+      char *eol = strchr (line, '\n');
+      if (!eol) {
+         ret = false;
+         break;
+      }
+      *eol = 0;
+
+      switch (line[0]) {
+         case '+':
+            ret = tri_log_push (&log->added, &log->nadded, &line[1]);
+            log->have_ident = false;
+            break;
+
+         case '-': {
+            size_t nadded = 0;
+            for (size_t i=0; i<log->nadded; i++) {
+               if (!(tri_covers (&line[1], log->added[i], strlen (log->added[i]))))
+                  log->added[nadded++] = log->added[i];
+            }
+            log->nadded = nadded;
+            ret = tri_log_push (&log->removed, &log->nremoved, &line[1]);
+            log->have_ident = false;
+            break;
+         }
+
+         default:
+            ret = log->have_ident = tri_ident_parse (&log->ident, line);
+            break;
+      }
+      line = &eol[1];
+   }
+
+   // Every change must be followed by the identity of the index it made.
+   if (!ret || (line != log->data && !log->have_ident)) {
+      FRM_ERROR ("Warning: discarding incomplete [%s]\n", TRI_LOG_FNAME);
+      tri_log_free (log);
+      return false;
+   }
+
+   return true;
+}
+
+/* ********************************************************** */
+
+bool frm_trigram_update (int dirfd, int oldfd, const char *index_fname,
+                         const char *removed, char **added, size_t nadded)
+{
+   struct tri_header_t hdr;
+   FRM_STATS_ADD (opens, 1);
+   int fd = openat (dirfd, TRI_FNAME, O_RDONLY | O_BINARY | O_CLOEXEC);
+   if (fd < 0) {
+      // Nothing to keep up to date: the next search builds a snapshot.
+      return tri_discard (dirfd);
+   }
+
+   bool valid = frm_io_read_full (fd, &hdr, sizeof hdr, 0)
+      && hdr.magic == TRI_MAGIC && hdr.version == TRI_VERSION;
+   close (fd);
+   if (!valid)
+      return tri_discard (dirfd);
+
+   FRM_STATS_ADD (opens, 1);
+   int logfd = openat (dirfd, TRI_LOG_FNAME,
+                       O_RDWR | O_APPEND | O_CREAT | O_BINARY | O_CLOEXEC, 0644);
+   struct stat sb;
+   if (logfd < 0 || (fstat (logfd, &sb))!=0) {
+      FRM_ERROR ("Failed to open [%s]: %m\n", TRI_LOG_FNAME);
+      if (logfd >= 0) {
+         close (logfd);
+      }
+      return tri_discard (dirfd);
+   }
+
+   // The index before this change must be the one that the snapshot and
+   // the log describe, otherwise a change was missed.
+   struct tri_ident_t expected = hdr.ident;
+   off_t logsize = sb.st_size;
+   if (logsize > 0) {
+      char tail[256];
+      size_t taillen = logsize < (off_t)sizeof tail ? (size_t)logsize : sizeof tail - 1;
+      valid = frm_io_read_full (logfd, tail, taillen, logsize - taillen)
+         && tail[taillen - 1] == '\n';
+      if (valid) {
+         tail[taillen - 1] = 0;
+         char *last = strrchr (tail, '\n');
+         valid = (last || taillen == (size_t)logsize)
+            && tri_ident_parse (&expected, last ? &last[1] : tail);
+      }
+   }
+
+   struct tri_ident_t old, now;
+   valid = valid && (fstat (oldfd, &sb))==0;
+   if (valid) {
+      tri_ident (&old, &sb);
+      valid = tri_ident_eq (&old, &expected)
+         && (fstatat (dirfd, index_fname, &sb, 0))==0;
+   }
+   if (!valid) {
+      close (logfd);
+      return tri_discard (dirfd);
+   }
+   tri_ident (&now, &sb);
+
+   size_t len = removed ? strlen (removed) + 2 : 0;
+   for (size_t i=0; i<nadded; i++) {
+      len += strlen (added[i]) + 2;
+   }
+   len += 4 * 21 + 2;
+
+   char *buf = malloc (len + 1);
+   if (!buf) {
+      FRM_ERROR ("OOM error allocating trigram log entry\n");
+      close (logfd);
+      return tri_discard (dirfd);
+   }
+
+   char *tmp = buf;
+   if (removed) {
+      tmp += sprintf (tmp, "-%s\n", removed);
+   }
+   for (size_t i=0; i<nadded; i++) {
+      tmp += sprintf (tmp, "+%s\n", added[i]);
+   }
+   tmp += sprintf (tmp, "=%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                   now.ino, now.size, now.sec, now.nsec);
+
+   len = tmp - buf;
+   bool ret = frm_io_write_full (logfd, buf, len);
+   if ((close (logfd))!=0) {
+      ret = false;
+   }
+   free (buf);
+
+   if (!ret) {
+      FRM_ERROR ("Failed to write [%s]: %m\n", TRI_LOG_FNAME);
+      return tri_discard (dirfd);
+   }
+
+   if ((uint64_t)logsize + len > TRI_LOG_MIN + hdr.text_len / 4) {
+      return tri_discard (dirfd);
+   }
+
+   return true;
+}
+
+static int tri_strcmp (const void *lhs, const void *rhs)
+{
+   return strcmp (*(char * const *)lhs, *(char * const *)rhs);
+}
+
+static int tri_entry_countcmp (const void *lhs, const void *rhs)
+{
+   const struct tri_entry_t *l = *(const struct tri_entry_t * const *)lhs;
+   const struct tri_entry_t *r = *(const struct tri_entry_t * const *)rhs;
+   return l->count < r->count ? -1 : l->count > r->count;
+}
+
+char **frm_trigram_match (int dirfd, const char *index_fname,
+                          const char *prefix, const char *sterm)
+{
+   size_t slen = sterm ? strlen (sterm) : 0;
+   if (slen < FRM_TRIGRAM_MIN) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   if (!prefix) {
+      prefix = "";
+   }
+   size_t plen = strlen (prefix);
+
+   bool error = true;
+   struct tri_map_t tm = { -1, NULL, 0, NULL, NULL, NULL, NULL, NULL };
+   struct tri_log_t log = { NULL, NULL, 0, NULL, 0, false, { 0, 0, 0, 0 } };
+   const struct tri_entry_t **lists = NULL;
+   uint32_t *candidates = NULL;
+   char **added = NULL;
+   char **ret = NULL;
+
+   struct stat sb;
+   struct tri_ident_t current;
+   if ((fstatat (dirfd, index_fname, &sb, 0))!=0) {
+      FRM_ERROR ("Error: failed to stat index [%s]: %m\n", index_fname);
+      goto cleanup;
+   }
+   tri_ident (&current, &sb);
+
+   // Use the snapshot if it is up to date, otherwise build a new one.
+   bool ready = false;
+   for (int attempt=0; attempt<2 && !ready; attempt++) {
+      if (attempt > 0) {
+         tri_map_close (&tm);
+         tri_log_free (&log);
+         if (!(tri_build (dirfd, index_fname)))
+            goto cleanup;
+      }
+      if ((tri_map_open (&tm, dirfd)) && (tri_log_read (&log, dirfd))) {
+         ready = tri_ident_eq (log.have_ident ? &log.ident : &tm.hdr->ident,
+                               &current);
+      }
+   }
+   if (!ready) {
+      FRM_ERROR ("Error: failed to build [%s]\n", TRI_FNAME);
+      goto cleanup;
+   }
+
+   // The posting list of every trigram in sterm, shortest first. A
+   // trigram that does not appear anywhere rules out the whole snapshot.
+   size_t nlists = 0;
+   if (!(lists = malloc ((slen - 2) * sizeof *lists))) {
+      FRM_ERROR ("OOM error allocating trigram lists\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i + FRM_TRIGRAM_MIN <= slen; i++) {
+      const struct tri_entry_t *entry = tri_map_find (&tm, tri_key (&sterm[i]));
+      if (!entry) {
+         nlists = 0;
+         break;
+      }
+      lists[nlists++] = entry;
+   }
+   qsort (lists, nlists, sizeof *lists, tri_entry_countcmp);
+
+   // Only the lines in [lo, hi) start with prefix.
+   size_t ncandidates = 0;
+   uint32_t lo = tri_map_bound (&tm, prefix, plen, 0);
+   uint32_t hi = tri_map_bound (&tm, prefix, plen, 1);
+   if (nlists) {
+      const uint32_t *postings = &tm.postings[lists[0]->start];
+      size_t from = tri_postings_bound (postings, 0, lists[0]->count, lo);
+      size_t to = tri_postings_bound (postings, from, lists[0]->count, hi);
+      if (!(candidates = malloc ((to - from + 1) * sizeof *candidates))) {
+         FRM_ERROR ("OOM error allocating trigram candidates\n");
+         goto cleanup;
+      }
+      memcpy (candidates, &postings[from], (to - from) * sizeof *candidates);
+      ncandidates = to - from;
+   }
+
+   for (size_t i=1; i<nlists && ncandidates; i++) {
+      if (lists[i] == lists[i - 1])
+         continue;
+      const uint32_t *postings = &tm.postings[lists[i]->start];
+      size_t pos = 0, kept = 0;
+      for (size_t j=0; j<ncandidates; j++) {
+         pos = tri_postings_bound (postings, pos, lists[i]->count, candidates[j]);
+         if (pos == lists[i]->count)
+            break;
+         if (postings[pos] == candidates[j])
+            candidates[kept++] = candidates[j];
+      }
+      ncandidates = kept;
+   }
+
+   // Only the candidates that really contain sterm, and that have not
+   // been removed since the snapshot, are matches.
+   size_t nmatches = 0;
+   for (size_t i=0; i<ncandidates; i++) {
+      const char *line = &tm.text[tm.lines[candidates[i]]];
+      size_t len = tri_line_len (tm.text, tm.lines, candidates[i]);
+      bool found = frm_scan_find (line, len, sterm, slen) != NULL;
+      for (size_t j=0; found && j<log.nremoved; j++) {
+         found = !(tri_covers (log.removed[j], line, len));
+      }
+      if (found) {
+         candidates[nmatches++] = candidates[i];
+      }
+   }
+
+   size_t nadded = 0;
+   if (!(added = malloc ((log.nadded + 1) * sizeof *added))) {
+      FRM_ERROR ("OOM error allocating trigram matches\n");
+      goto cleanup;
+   }
+   for (size_t i=0; i<log.nadded; i++) {
+      if ((strncmp (log.added[i], prefix, plen))==0
+            && strstr (log.added[i], sterm)) {
+         added[nadded++] = log.added[i];
+      }
+   }
+   qsort (added, nadded, sizeof *added, tri_strcmp);
+
+   // Merge the two sorted lists.
+   if (!(ret = calloc (nmatches + nadded + 1, sizeof *ret))) {
+      FRM_ERROR ("OOM error allocating trigram matches\n");
+      goto cleanup;
+   }
+   size_t i = 0, j = 0, nret = 0;
+   while (i < nmatches || j < nadded) {
+      const char *line = i < nmatches ? &tm.text[tm.lines[candidates[i]]] : NULL;
+      size_t len = i < nmatches ? tri_line_len (tm.text, tm.lines, candidates[i]) : 0;
+      int cmp = !line ? 1 : j == nadded ? -1 : 0;
+      if (cmp == 0) {
+         size_t alen = strlen (added[j]);
+         cmp = memcmp (line, added[j], len < alen ? len : alen);
+         if (cmp == 0)
+            cmp = len < alen ? -1 : len > alen;
+      }
+
+      if (cmp <= 0) {
+         ret[nret] = malloc (len + 1);
+         if (ret[nret]) {
+            memcpy (ret[nret], line, len);
+            ret[nret][len] = 0;
+         }
+         i++;
+         j += cmp == 0;
+      } else {
+         ret[nret] = ds_str_dup (added[j++]);
+      }
+      if (!ret[nret++]) {
+         FRM_ERROR ("OOM error allocating trigram match\n");
+         goto cleanup;
+      }
+   }
+
+   error = false;
+
+cleanup:
+   if (error) {
+      frm_strarray_free (ret);
+      ret = NULL;
+   }
+   tri_map_close (&tm);
+   tri_log_free (&log);
+   free (lists);
+   free (candidates);
+   free (added);
+   return ret;
+}
+
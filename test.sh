@@ -194,4 +194,187 @@ execute $PROG match --from-root "one/ei" || die failed match
 
 execute $PROG tree || die failed tree
 
+# Batch runs each line as a command on the one open framedb, and stops
+# at the first command that fails.
+cat > t << EOF
+# Comments and blank lines are skipped
+
+push batch-one --message="from a batch"
+push batch-two --message="from a batch"
+up
+up
+EOF
+execute $PROG batch t || die failed batch
+execute $PROG status || die failed status
+execute $PROG match --from-root "batch" || die failed match
+cat > t << EOF
+push batch-three --message="from a batch"
+down no-such-frame
+push batch-four --message="from a batch"
+EOF
+execute $PROG batch t 2> /dev/null && die batch did not stop at a failed command
+execute $PROG match --from-root "batch" || die failed match
+execute $PROG up || die failed up
+
+# Import-tree creates a frame for each path under the current frame,
+# with the contents after the tab, if any, as its notes.
+printf 'imported\nimported/a\tNotes of a\nimported/a/b\nimported/c\tNotes of c\n' > t
+execute $PROG import-tree t --message="Imported" || die failed import-tree
+execute $PROG match --from-root "imported" || die failed match
+execute $PROG switch root/one/FIVE/imported/c || die failed switch
+execute $PROG switch root/one/FIVE/imported/a/b || die failed switch
+execute $PROG up || die failed up
+execute $PROG up || die failed up
+execute $PROG up || die failed up
+
+# A popped frame stays in the trash until gc removes it, and undo-pop
+# restores it until then.
+execute $PROG push popped --message="Popped" || die failed push
+execute $PROG pop || die failed pop
+execute $PROG match --from-root "popped" || die failed match
+execute $PROG gc 3600 || die failed gc
+execute $PROG gc 20000000000 || die failed gc
+execute $PROG undo-pop || die failed undo-pop
+execute $PROG match --from-root "popped" || die failed match
+execute $PROG pop || die failed pop
+execute $PROG gc 0 || die failed gc
+execute $PROG undo-pop 2> /dev/null && die undo-pop restored a collected frame
+execute $PROG match --from-root "popped" || die failed match
+
+# A frame keeps its ID when it is renamed, and switch --id finds it by
+# that ID alone.
+execute $PROG id root/one/FIVE/imported/c > t || die failed id
+cat t
+ID=`cat t | tail -n 1`
+execute $PROG switch --id=$ID || die failed switch
+execute $PROG rename 'C' || die failed rename
+execute $PROG switch --id=1 || die failed switch
+execute $PROG switch --id=$ID || die failed switch
+execute $PROG id > t || die failed id
+if [ `tail -n 1 t` -ne $ID ]; then
+   die renamed frame changed its ID
+fi
+execute $PROG switch --id=99999 2> /dev/null && die switched to a frame that does not exist
+execute $PROG up || die failed up
+execute $PROG up || die failed up
+
+# Move takes the frames under the moved frame with it; relative and
+# absolute paths both work and the moved frame keeps its ID.
+execute $PROG id imported/a > t || die failed id
+ID=`cat t | tail -n 1`
+execute $PROG move imported/a root/one/FIVE/batch-one || die failed move
+execute $PROG match --from-root "FIVE/" || die failed match
+execute $PROG id batch-one/a > t || die failed id
+if [ `tail -n 1 t` -ne $ID ]; then
+   die moved frame changed its ID
+fi
+execute $PROG move batch-one batch-one/a 2> /dev/null && die moved a frame under itself
+execute $PROG move batch-one/a/b imported || die failed move
+execute $PROG tree || die failed tree
+
+# Search looks up words in the contents, and sees contents as soon as
+# they are replaced.
+execute $PROG search batch || die failed search
+execute $PROG search NOTES --limit=1 || die failed search
+execute $PROG down batch-three || die failed down
+execute $PROG replace --message="Searchable" || die failed replace
+execute $PROG up || die failed up
+execute $PROG search batch || die failed search
+execute $PROG search searchable || die failed search
+execute $PROG search nowhere || die failed search
+
+# Grep matches an extended regular expression against the contents of
+# the frames under the current frame, or under --from.
+execute $PROG grep 'of.(a|c)$' || die failed grep
+execute $PROG grep '^from.a.batch$' --from=batch-one || die failed grep
+execute $PROG grep '^from.a.batch$' --from=root/one/FIVE/imported || die failed grep
+execute $PROG grep 'Search' --from=root || die failed grep
+execute $PROG grep '(' 2> /dev/null && die grep accepted a bad regex
+
+# Jump switches to the best fuzzy match of the words, in order, in the
+# path. Uppercase letters in a word are matched exactly.
+execute $PROG jump batch --list || die failed jump
+execute $PROG jump bat two --list --limit=1 || die failed jump
+execute $PROG jump five imp C || die failed jump
+execute $PROG jump five imp Z 2> /dev/null && die jump found a frame that does not match
+execute $PROG jump one FIVE || die failed jump
+
+# Match can ignore case, and can match the whole path with a glob.
+execute $PROG match --from-root "five/i" --icase || die failed match
+execute $PROG match --from-root "five/i" || die failed match
+execute $PROG match --from-root 'root/**/b' --glob || die failed match
+execute $PROG match --from-root 'root/*/FIVE/*' --glob || die failed match
+execute $PROG match --from-root 'root/one/????/batch-[a-o]*' --glob || die failed match
+execute $PROG match --from-root 'ROOT/*/five' --glob --icase || die failed match
+execute $PROG match 'root/one/FIVE/*' --glob --invert || die failed match
+
+# The same matches on a mapped framedb.
+rm -f /tmp/frame.map
+$PROG create --mapped --dbpath=/tmp/frame.map 2> /dev/null || die failed to create mapped
+printf 'one\none/FIVE\none/FIVE/imported\none/FIVE/imported/b\none/FIVE/batch-one\n' > t
+$PROG import-tree t --message=x --dbpath=/tmp/frame.map || die failed mapped import-tree
+$PROG match --from-root "five/i" --icase --dbpath=/tmp/frame.map || die failed mapped match
+$PROG match --from-root 'root/**/b' --glob --dbpath=/tmp/frame.map || die failed mapped match
+$PROG match --from-root 'ROOT/*/five' --glob --icase --dbpath=/tmp/frame.map || die failed mapped match
+
+# Perf-report summarises the runs recorded with --perflog or with
+# $FRAME_PERFLOG set. Only the counts are compared, not the timings.
+execute $PROG status --perflog || die failed status
+execute $PROG status --perflog || die failed status
+execute $PROG down no-such-frame --perflog 2> /dev/null && die down found a frame that does not exist
+FRAME_PERFLOG=1 execute $PROG list || die failed list
+execute $PROG perf-report --since=1d > t || die failed perf-report
+awk '/^Executing/ { print; next } { print $1, $2, $3 }' t
+execute $PROG perf-report --since=bogus 2> /dev/null && die perf-report accepted a bad age
+
+# --stats prints a line of counters to stderr for each library function
+# that the command called. Only the calls are compared, not the costs.
+execute $PROG list --stats 2> t || die failed list --stats
+awk '{ print $1, $2 }' t
+if [ `grep -c '^frm_list  *1 ' t` -ne 1 ]; then
+   die --stats did not count the call to frm_list
+fi
+
+# $FRM_TRACE names a file to write a trace of the library calls to, as
+# a JSON array of complete events with one event per line.
+rm -f t
+FRM_TRACE=t execute $PROG list || die failed traced list
+if [ "`head -n 1 t`" != "[" ] || [ "`tail -n 1 t`" != "]" ]; then
+   die trace is not a JSON array
+fi
+EVENT='^{"name":"[a-z_]+","cat":"(api|internal)","ph":"X","ts":[0-9.]+,"dur":[0-9.]+,"pid":[0-9]+,"tid":[0-9]+},?$'
+if [ `sed '1d;$d' t | grep -cvE "$EVENT"` -ne 0 ]; then
+   die trace has malformed events
+fi
+grep -o '"name":"[a-z_]*","cat":"api"' t | sort -u
+
+# A mapped framedb reclaims the space of deleted frames and replaced
+# payloads, so growing and shrinking it over and over must not keep
+# growing the file.
+export MAPDB=/tmp/frame.map
+rm -f $MAPDB $MAPDB.batch
+$PROG create --mapped --dbpath=$MAPDB 2> /dev/null || die failed to create mapped
+PAYLOAD=`printf '%3000s' | tr ' ' x`
+for round in `seq 10`; do
+   for i in `seq 100`; do
+      echo "push f$i --message=$PAYLOAD"
+      echo "append --message=$PAYLOAD"
+      echo "rename g$i"
+      echo "up"
+   done > $MAPDB.batch
+   for i in `seq 100`; do
+      echo "delete root/g$i"
+   done >> $MAPDB.batch
+   $PROG batch $MAPDB.batch --dbpath=$MAPDB > /dev/null || die failed mapped batch
+   SIZE=`stat -c %s $MAPDB`
+   if [ $SIZE -gt 4194304 ]; then
+      die mapped framedb grew to $SIZE bytes in round $round
+   fi
+done
+echo "Mapped framedb stayed under 4194304 bytes"
+$PROG gc --dbpath=$MAPDB || die failed mapped gc
+if [ `stat -c %s $MAPDB` -gt $SIZE ]; then
+   die mapped framedb grew from $SIZE bytes in gc
+fi
+
 echo 'Use [sed "s:(.\+)::g"] to strip the dates'
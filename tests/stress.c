@@ -0,0 +1,197 @@
+/* ************************************************************************** *
+ * Frame  (©2023 Lelanthran Manickum)                                         *
+ *                                                                            *
+ * This program comes with ABSOLUTELY NO WARRANTY. This is free software      *
+ * and you are welcome to redistribute it under certain conditions;  see      *
+ * the LICENSE file for details.                                              *
+ * ****************************************************************************/
+
+/* Multithreaded stress test of the library. A number of threads work on
+ * the same framedb at the same time, half of them sharing a single handle
+ * and the other half using a handle each. Each thread creates frames,
+ * writes and reads their payloads, navigates and searches, and checks
+ * that it sees everything that it wrote.
+ *
+ * Usage: stress.elf <dbpath> [--mapped]
+ *
+ * The framedb at dbpath must not exist. Exits with 0 if all the checks
+ * passed and 1 otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "frm.h"
+
+#define NTHREADS     (8)
+#define NITERATIONS  (50)
+
+struct worker_t {
+   pthread_t tid;
+   size_t index;
+   const char *dbpath;
+   bool mapped;
+   frm_t *shared;
+   size_t nfailures;
+};
+
+#define CHECK(w,cond,...)     do {\
+   if (!(cond)) {\
+      fprintf (stderr, "[%s:%i] thread %zu: ", __FILE__, __LINE__, (w)->index);\
+      fprintf (stderr, __VA_ARGS__);\
+      fprintf (stderr, "\n");\
+      (w)->nfailures++;\
+   }\
+} while (0)
+
+static size_t count_matches (frm_t *frm, const char *sterm)
+{
+   char **results = frm_match_from_root (frm, sterm, 0);
+   size_t ret = 0;
+   while (results && results[ret])
+      ret++;
+   frm_strarray_free (results);
+   return ret;
+}
+
+static void *worker (void *arg)
+{
+   struct worker_t *w = arg;
+   bool own = w->index % 2 == 0;
+   frm_t *frm = own ? frm_init (w->dbpath) : w->shared;
+   if (!frm) {
+      CHECK (w, false, "failed to open [%s]", w->dbpath);
+      return NULL;
+   }
+
+   char prefix[32];
+   snprintf (prefix, sizeof prefix, "t%zu-", w->index);
+
+   for (size_t i=0; i<NITERATIONS; i++) {
+      char name[64], path[80], line[64];
+      snprintf (name, sizeof name, "%s%zu", prefix, i);
+      snprintf (path, sizeof path, "root/%s", name);
+      snprintf (line, sizeof line, "line %zu of thread %zu", i, w->index);
+
+      CHECK (w, frm_new_at (frm, "root", name, "created"),
+               "failed to create [%s]: %s", path, frm_lastmsg (frm));
+      CHECK (w, frm_payload_append_at (frm, path, line),
+               "failed to append to [%s]: %s", path, frm_lastmsg (frm));
+
+      char *payload = frm_payload_at (frm, path);
+      CHECK (w, strstr (payload, "created") && strstr (payload, line),
+               "wrong payload in [%s]: [%s]", path, payload);
+      frm_mem_free (payload);
+
+      // Only a thread with its own handle may move the current frame.
+      if (own) {
+         CHECK (w, frm_switch_direct (frm, path), "failed to switch to [%s]", path);
+         CHECK (w, frm_push (frm, "child", line), "failed to push under [%s]", path);
+         CHECK (w, frm_up (frm), "failed to go up from [%s/child]", path);
+         char *current = frm_current (frm);
+         CHECK (w, strcmp (current, path) == 0,
+                  "current frame is [%s], expected [%s]", current, path);
+         frm_mem_free (current);
+
+         char **children = frm_list (frm, NULL);
+         CHECK (w, children && children[0] && !children[1],
+                  "expected a single child of [%s]", path);
+         frm_strarray_free (children);
+         CHECK (w, frm_top (frm), "failed to switch to root");
+
+         // A handle sees the frames of its own open batch.
+         char batched[80];
+         snprintf (batched, sizeof batched, "%s-batch", name);
+         CHECK (w, frm_batch_begin (frm), "failed to begin a batch");
+         CHECK (w, frm_new_at (frm, "root", batched, "batched"),
+                  "failed to create [root/%s]: %s", batched, frm_lastmsg (frm));
+         CHECK (w, count_matches (frm, batched) == 1,
+                  "did not find [root/%s] before the batch ended", batched);
+         CHECK (w, frm_batch_end (frm), "failed to end a batch");
+      }
+
+      size_t expected = (i + 1) * (own ? 3 : 1);
+      size_t nmatches = count_matches (frm, prefix);
+      CHECK (w, nmatches == expected,
+               "found %zu frames matching [%s], expected %zu",
+               nmatches, prefix, expected);
+
+      // Whichever thread searches first builds the search index.
+      if (!w->mapped) {
+         char **hits = frm_search (frm, "created", 1);
+         CHECK (w, hits && hits[0], "failed to search for [created]: %s",
+                  frm_lastmsg (frm));
+         frm_strarray_free (hits);
+      }
+   }
+
+   if (own) {
+      frm_close (frm);
+   }
+   return NULL;
+}
+
+int main (int argc, char **argv)
+{
+   if (argc < 2) {
+      fprintf (stderr, "Usage: %s <dbpath> [--mapped]\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   const char *dbpath = argv[1];
+   bool mapped = argc > 2 && (strcmp (argv[2], "--mapped"))==0;
+   if (mapped) {
+      int fd = open (dbpath, O_CREAT | O_EXCL | O_RDWR, 0600);
+      if (fd < 0) {
+         fprintf (stderr, "Failed to create [%s]: %m\n", dbpath);
+         return EXIT_FAILURE;
+      }
+      close (fd);
+   }
+
+   frm_t *shared = frm_create (dbpath);
+   if (!shared) {
+      fprintf (stderr, "Failed to create framedb [%s]\n", dbpath);
+      return EXIT_FAILURE;
+   }
+
+   struct worker_t workers[NTHREADS];
+   memset (workers, 0, sizeof workers);
+   for (size_t i=0; i<NTHREADS; i++) {
+      workers[i].index = i;
+      workers[i].dbpath = dbpath;
+      workers[i].mapped = mapped;
+      workers[i].shared = shared;
+      if ((pthread_create (&workers[i].tid, NULL, worker, &workers[i]))!=0) {
+         fprintf (stderr, "Failed to start thread %zu\n", i);
+         return EXIT_FAILURE;
+      }
+   }
+
+   size_t nfailures = 0;
+   for (size_t i=0; i<NTHREADS; i++) {
+      pthread_join (workers[i].tid, NULL);
+      nfailures += workers[i].nfailures;
+   }
+
+   size_t expected = NTHREADS * NITERATIONS + (NTHREADS / 2) * NITERATIONS * 2;
+   size_t nframes = count_matches (shared, "");
+   if (nframes != expected) {
+      fprintf (stderr, "Found %zu frames in total, expected %zu\n",
+               nframes, expected);
+      nfailures++;
+   }
+
+   frm_close (shared);
+
+   printf ("%s: %zu threads, %zu failures\n", dbpath, (size_t)NTHREADS, nfailures);
+   return nfailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}